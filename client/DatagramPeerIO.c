@@ -142,6 +142,8 @@ int DatagramPeerIO_Init (
     PacketPassInterface *recv_userif,
     int otp_warning_count,
     BThreadWorkDispatcher *twd,
+    int spproto_window,
+    int spproto_batch,
     void *user,
     BLog_logfunc logfunc,
     DatagramPeerIO_handler_error handler_error,
@@ -153,6 +155,9 @@ int DatagramPeerIO_Init (
     ASSERT(socket_mtu >= 0)
     spproto_assert_security_params(sp_params);
     ASSERT(num_frames > 0)
+    ASSERT(spproto_window > 0)
+    ASSERT(spproto_batch > 0)
+    ASSERT(spproto_batch <= spproto_window)
     ASSERT(PacketPassInterface_GetMTU(recv_userif) >= payload_mtu)
     if (SPPROTO_HAVE_OTP(sp_params)) {
         ASSERT(otp_warning_count > 0)
@@ -205,7 +210,7 @@ int DatagramPeerIO_Init (
     PacketPassNotifier_Init(&o->recv_notifier, FragmentProtoAssembler_GetInput(&o->recv_assembler), BReactor_PendingGroup(o->reactor));
     
     // init decoder
-    if (!SPProtoDecoder_Init(&o->recv_decoder, PacketPassNotifier_GetInput(&o->recv_notifier), o->sp_params, 2, BReactor_PendingGroup(o->reactor), twd, o->user, o->logfunc)) {
+    if (!SPProtoDecoder_Init(&o->recv_decoder, PacketPassNotifier_GetInput(&o->recv_notifier), o->sp_params, 2, BReactor_PendingGroup(o->reactor), twd, spproto_window, spproto_batch, o->user, o->logfunc)) {
         PeerLog(o, BLOG_ERROR, "SPProtoDecoder_Init failed");
         goto fail1;
     }
@@ -226,7 +231,7 @@ int DatagramPeerIO_Init (
     FragmentProtoDisassembler_Init(&o->send_disassembler, o->reactor, o->payload_mtu, o->spproto_payload_mtu, -1, latency);
     
     // init encoder
-    if (!SPProtoEncoder_Init(&o->send_encoder, FragmentProtoDisassembler_GetOutput(&o->send_disassembler), o->sp_params, otp_warning_count, BReactor_PendingGroup(o->reactor), twd)) {
+    if (!SPProtoEncoder_Init(&o->send_encoder, FragmentProtoDisassembler_GetOutput(&o->send_disassembler), o->sp_params, otp_warning_count, BReactor_PendingGroup(o->reactor), twd, spproto_window, spproto_batch)) {
         PeerLog(o, BLOG_ERROR, "SPProtoEncoder_Init failed");
         goto fail3;
     }
@@ -367,8 +372,23 @@ fail0:
 void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(!SPPROTO_HAVE_DIRECTION_KEYS(o->sp_params) || o->mode == DATAGRAMPEERIO_MODE_CONNECT || o->mode == DATAGRAMPEERIO_MODE_BIND)
     DebugObject_Access(&o->d_obj);
     
+    if (SPPROTO_HAVE_DIRECTION_KEYS(o->sp_params)) {
+        // derive a key for each direction
+        int binder = (o->mode == DATAGRAMPEERIO_MODE_BIND);
+        uint8_t send_key[BENCRYPTION_MAX_KEY_SIZE];
+        uint8_t recv_key[BENCRYPTION_MAX_KEY_SIZE];
+        spproto_derive_direction_key(o->sp_params, encryption_key, binder, send_key);
+        spproto_derive_direction_key(o->sp_params, encryption_key, !binder, recv_key);
+        
+        // set keys
+        SPProtoEncoder_SetEncryptionKey(&o->send_encoder, send_key);
+        SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, recv_key);
+        return;
+    }
+    
     // set sending key
     SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key);
     
@@ -95,6 +95,11 @@ typedef void (*DatagramPeerIO_handler_otp_ready) (void *user);
  *                 Datagrams are being received on the socket. Datagrams are not being
  *                 sent initially. When a datagram is received, its source address is
  *                 used as a destination address for sending datagrams.
+ *
+ * With an SPProto window of 1, a frame being sent is written once, by the
+ * fragmenter, into the datagram buffer after the room reserved for the
+ * SPProto header and IV, and is then encrypted in place. Received datagrams
+ * are likewise decrypted in place in the receive buffer.
  */
 typedef struct {
     DebugObject d_obj;
@@ -148,6 +153,10 @@ typedef struct {
  * @param otp_warning_count If using OTPs, after how many encoded packets to call the handler.
  *                          In this case, must be >0 and <=sp_params.otp_num.
  * @param twd thread work dispatcher
+ * @param spproto_window window parameter to {@link SPProtoEncoder_Init} and {@link SPProtoDecoder_Init}.
+ *                       Must be >0.
+ * @param spproto_batch batch parameter to {@link SPProtoEncoder_Init} and {@link SPProtoDecoder_Init}.
+ *                      Must be >0 and <=spproto_window.
  * @param user value to pass to handlers
  * @param logfunc function which prepends the log prefix using {@link BLog_Append}
  * @param handler_error error handler
@@ -166,6 +175,8 @@ int DatagramPeerIO_Init (
     PacketPassInterface *recv_userif,
     int otp_warning_count,
     BThreadWorkDispatcher *twd,
+    int spproto_window,
+    int spproto_batch,
     void *user,
     BLog_logfunc logfunc,
     DatagramPeerIO_handler_error handler_error,
@@ -216,6 +227,9 @@ int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
 /**
  * Sets the encryption key to use for sending and receiving.
  * Encryption must be enabled.
+ * If the security parameters use direction keys, the interface must be in
+ * connecting or connected mode, and the keys for sending and receiving are
+ * derived from the given key depending on whether it was bound or connected.
  *
  * @param o the object
  * @param encryption_key key to use
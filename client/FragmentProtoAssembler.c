@@ -33,6 +33,7 @@
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <misc/balloc.h>
+#include <misc/balign.h>
 
 #include "FragmentProtoAssembler.h"
 
@@ -40,15 +41,76 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_impl.h>
+#define BITMAP_WORD_BITS 64
+
+#include "FragmentProtoAssembler_hash.h"
+#include <structure/CHash_impl.h>
+
+static uint64_t word_mask (int from, int to)
+{
+    ASSERT(from >= 0)
+    ASSERT(from < to)
+    ASSERT(to <= BITMAP_WORD_BITS)
+    
+    uint64_t upto = (to == BITMAP_WORD_BITS ? UINT64_MAX : (((uint64_t)1 << to) - 1));
+    return upto & ~(((uint64_t)1 << from) - 1);
+}
+
+static int range_is_clear (uint64_t *bitmap, int start, int end)
+{
+    ASSERT(start >= 0)
+    ASSERT(end > start)
+    
+    int first = start / BITMAP_WORD_BITS;
+    int last = (end - 1) / BITMAP_WORD_BITS;
+    
+    if (first == last) {
+        return !(bitmap[first] & word_mask(start % BITMAP_WORD_BITS, (end - 1) % BITMAP_WORD_BITS + 1));
+    }
+    
+    if ((bitmap[first] & word_mask(start % BITMAP_WORD_BITS, BITMAP_WORD_BITS)) ||
+        (bitmap[last] & word_mask(0, (end - 1) % BITMAP_WORD_BITS + 1))
+    ) {
+        return 0;
+    }
+    for (int i = first + 1; i < last; i++) {
+        if (bitmap[i]) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static void set_range (uint64_t *bitmap, int start, int end)
+{
+    ASSERT(start >= 0)
+    ASSERT(end > start)
+    
+    int first = start / BITMAP_WORD_BITS;
+    int last = (end - 1) / BITMAP_WORD_BITS;
+    
+    if (first == last) {
+        bitmap[first] |= word_mask(start % BITMAP_WORD_BITS, (end - 1) % BITMAP_WORD_BITS + 1);
+        return;
+    }
+    
+    bitmap[first] |= word_mask(start % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+    for (int i = first + 1; i < last; i++) {
+        bitmap[i] = UINT64_MAX;
+    }
+    bitmap[last] |= word_mask(0, (end - 1) % BITMAP_WORD_BITS + 1);
+}
 
 static void free_frame (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
+    // clear the part of the bitmap that was used
+    memset(frame->bitmap, 0, bdivide_up(frame->bitmap_end, BITMAP_WORD_BITS) * sizeof(frame->bitmap[0]));
+    
     // remove from used list
     LinkedList1_Remove(&o->frames_used, &frame->list_node);
-    // remove from used tree
-    FPAFramesTree_Remove(&o->frames_used_tree, 0, frame);
+    // remove from used hash table
+    FPAFramesHash_Remove(&o->frames_used_hash, 0, FPAFramesHashDerefNonNull(0, frame));
     
     // append to free list
     LinkedList1_Append(&o->frames_free, &frame->list_node);
@@ -69,7 +131,7 @@ static void free_oldest_frame (FragmentProtoAssembler *o)
 
 static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
 {
-    ASSERT(!FPAFramesTree_LookupExact(&o->frames_used_tree, 0, id))
+    ASSERT(FPAFramesHashIsNullRef(FPAFramesHash_Lookup(&o->frames_used_hash, 0, id)))
     
     // if there are no free entries, free the oldest used one
     if (LinkedList1_IsEmpty(&o->frames_free)) {
@@ -92,63 +154,36 @@ static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAs
     frame->sum = 0;
     frame->length = -1;
     frame->length_so_far = 0;
+    frame->prefix_end = 0;
+    frame->bitmap_end = 0;
     
     // append to used list
     LinkedList1_Append(&o->frames_used, &frame->list_node);
-    // insert to used tree
-    int res = FPAFramesTree_Insert(&o->frames_used_tree, 0, frame, NULL);
+    // insert to used hash table
+    int res = FPAFramesHash_Insert(&o->frames_used_hash, 0, FPAFramesHashDerefNonNull(0, frame), NULL);
     ASSERT_EXECUTE(res)
     
     return frame;
 }
 
-static int chunks_overlap (int c1_start, int c1_len, int c2_start, int c2_len)
-{
-    return (c1_start + c1_len > c2_start && c2_start + c2_len > c1_start);
-}
-
 static int frame_is_timed_out (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
-    ASSERT(frame->time <= o->time)
-    
-    return (o->time - frame->time > o->time_tolerance);
+    // times wrap around, but used frames are never older than time_tolerance
+    return ((uint32_t)(o->time - frame->time) > (uint32_t)o->time_tolerance);
 }
 
-static void reduce_times (FragmentProtoAssembler *o)
+static void free_timed_out_frames (FragmentProtoAssembler *o)
 {
-    // find the frame with minimal time, removing timed out frames
-    struct FragmentProtoAssembler_frame *minframe = NULL;
-    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_used);
-    while (list_node) {
-        LinkedList1Node *next = LinkedList1Node_Next(list_node);
+    // used frames are ordered by time, so timed out ones are at the front
+    LinkedList1Node *list_node;
+    while (list_node = LinkedList1_GetFirst(&o->frames_used)) {
         struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
-        if (frame_is_timed_out(o, frame)) {
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while reducing times)");
-            free_frame(o, frame);
-        } else {
-            if (!minframe || frame->time < minframe->time) {
-                minframe = frame;
-            }
+        if (!frame_is_timed_out(o, frame)) {
+            break;
         }
-        list_node = next;
+        PeerLog(o, BLOG_INFO, "freeing timed out frame");
+        free_frame(o, frame);
     }
-    
-    if (!minframe) {
-        // have no frames, set packet time to zero
-        o->time = 0;
-        return;
-    }
-    
-    uint32_t min_time = minframe->time;
-    
-    // subtract minimal time from all frames
-    for (list_node = LinkedList1_GetFirst(&o->frames_used); list_node; list_node = LinkedList1Node_Next(list_node)) {
-        struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
-        frame->time -= min_time;
-    }
-    
-    // subtract minimal time from packet time
-    o->time -= min_time;
 }
 
 static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame_id, int chunk_start, int chunk_len, int is_last, uint8_t *payload)
@@ -177,32 +212,22 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     ASSERT(chunk_end <= o->output_mtu)
     
     // lookup frame
-    struct FragmentProtoAssembler_frame *frame = FPAFramesTree_LookupExact(&o->frames_used_tree, 0, frame_id);
+    struct FragmentProtoAssembler_frame *frame = FPAFramesHash_Lookup(&o->frames_used_hash, 0, frame_id).ptr;
     if (!frame) {
+        if (chunk_start == 0 && is_last) {
+            // the chunk is the whole frame, send it directly from the input packet
+            PeerLog(o, BLOG_DEBUG, "frame complete");
+            PacketPassInterface_Sender_Send(o->output, payload, chunk_len);
+            return 1;
+        }
+        
         // frame not found, add a new one
         frame = allocate_new_frame(o, frame_id);
-    } else {
-        // have existing frame with that ID
-        // check frame time
-        if (frame_is_timed_out(o, frame)) {
-            // frame is timed out, remove it and use a new one
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while processing chunk)");
-            free_frame(o, frame);
-            frame = allocate_new_frame(o, frame_id);
-        }
     }
     
+    ASSERT(!frame_is_timed_out(o, frame))
     ASSERT(frame->num_chunks < o->num_chunks)
     
-    // check if the chunk overlaps with any existing chunks
-    for (int i = 0; i < frame->num_chunks; i++) {
-        struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[i];
-        if (chunks_overlap(chunk->start, chunk->len, chunk_start, chunk_len)) {
-            PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
-            goto fail_frame;
-        }
-    }
-    
     if (is_last) {
         // this chunk is marked as last
         if (frame->length >= 0) {
@@ -225,15 +250,35 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
         }
     }
     
+    // mark the chunk's data as received, checking that it does not
+    // overlap with existing chunks
+    if (chunk_start == frame->prefix_end && chunk_start >= frame->bitmap_end) {
+        // chunk continues the received prefix and is before any other chunks
+        frame->prefix_end = chunk_end;
+    } else {
+        if (chunk_len > 0) {
+            // nothing is marked at or after bitmap_end, so only check below it
+            if (chunk_start < frame->prefix_end ||
+                (chunk_start < frame->bitmap_end && !range_is_clear(frame->bitmap, chunk_start, chunk_end))
+            ) {
+                PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
+                goto fail_frame;
+            }
+            set_range(frame->bitmap, chunk_start, chunk_end);
+            if (frame->bitmap_end < chunk_end) {
+                frame->bitmap_end = chunk_end;
+            }
+        }
+    }
+    
     // chunk is good, add it
     
-    // update frame time
+    // update frame time, moving the frame to the end of the used list
     frame->time = o->time;
+    LinkedList1_Remove(&o->frames_used, &frame->list_node);
+    LinkedList1_Append(&o->frames_used, &frame->list_node);
     
-    // add chunk entry
-    struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[frame->num_chunks];
-    chunk->start = chunk_start;
-    chunk->len = chunk_len;
+    // count chunk
     frame->num_chunks++;
     
     // update sum
@@ -324,19 +369,10 @@ static void process_input (FragmentProtoAssembler *o)
     }
     
     // increment packet time
-    if (o->time == FPA_MAX_TIME) {
-        reduce_times(o);
-        if (!LinkedList1_IsEmpty(&o->frames_used)) {
-            ASSERT(o->time < FPA_MAX_TIME) // If there was a frame with zero time, it was removed because
-                                           // time_tolerance < FPA_MAX_TIME. So something >0 was subtracted.
-            o->time++;
-        } else {
-            // it was set to zero by reduce_times
-            ASSERT(o->time == 0)
-        }
-    } else {
-        o->time++;
-    }
+    o->time++;
+    
+    // free frames which have now timed out
+    free_timed_out_frames(o);
     
     // set no input packet
     o->in_len = -1;
@@ -371,7 +407,7 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
 {
     ASSERT(input_mtu >= 0)
     ASSERT(num_frames > 0)
-    ASSERT(num_frames < FPA_MAX_TIME) // needed so we can always subtract times when packet time is maximum
+    ASSERT(num_frames < FPA_MAX_TIME) // needed so that frame ages can be computed with wrapping times
     ASSERT(num_chunks > 0)
     
     // init arguments
@@ -400,10 +436,12 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
         goto fail1;
     }
     
-    // allocate chunks
-    if (!(o->frames_chunks = (struct FragmentProtoAssembler_chunk *)BAllocArray2(num_frames, o->num_chunks, sizeof(o->frames_chunks[0])))) {
+    // allocate bitmaps
+    o->bitmap_words = bdivide_up(o->output_mtu, BITMAP_WORD_BITS);
+    if (!(o->frames_bitmaps = (uint64_t *)BAllocArray2(num_frames, o->bitmap_words, sizeof(o->frames_bitmaps[0])))) {
         goto fail2;
     }
+    memset(o->frames_bitmaps, 0, (size_t)num_frames * o->bitmap_words * sizeof(o->frames_bitmaps[0]));
     
     // allocate buffers
     if (!(o->frames_buffer = (uint8_t *)BAllocArray(num_frames, o->output_mtu))) {
@@ -417,16 +455,18 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     // initialize frame entries
     for (int i = 0; i < num_frames; i++) {
         struct FragmentProtoAssembler_frame *frame = &o->frames_entries[i];
-        // set chunks array pointer
-        frame->chunks = o->frames_chunks + (size_t)i * o->num_chunks;
+        // set bitmap pointer
+        frame->bitmap = o->frames_bitmaps + (size_t)i * o->bitmap_words;
         // set buffer pointer
         frame->buffer = o->frames_buffer + (size_t)i * o->output_mtu;
         // add to free list
         LinkedList1_Append(&o->frames_free, &frame->list_node);
     }
     
-    // init tree
-    FPAFramesTree_Init(&o->frames_used_tree);
+    // init hash table
+    if (!FPAFramesHash_Init(&o->frames_used_hash, num_frames)) {
+        goto fail4;
+    }
     
     // have no input packet
     o->in_len = -1;
@@ -435,8 +475,10 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     
     return 1;
     
+fail4:
+    BFree(o->frames_buffer);
 fail3:
-    BFree(o->frames_chunks);
+    BFree(o->frames_bitmaps);
 fail2:
     BFree(o->frames_entries);
 fail1:
@@ -447,12 +489,15 @@ fail1:
 void FragmentProtoAssembler_Free (FragmentProtoAssembler *o)
 {
     DebugObject_Free(&o->d_obj);
-
+    
+    // free hash table
+    FPAFramesHash_Free(&o->frames_used_hash);
+    
     // free buffers
     BFree(o->frames_buffer);
     
-    // free chunks
-    BFree(o->frames_chunks);
+    // free bitmaps
+    BFree(o->frames_bitmaps);
     
     // free frames
     BFree(o->frames_entries);
@@ -38,37 +38,33 @@
 
 #include <protocol/fragmentproto.h>
 #include <misc/debug.h>
-#include <misc/compare.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
 #include <structure/LinkedList1.h>
-#include <structure/SAvl.h>
+#include <structure/CHash.h>
 #include <flow/PacketPassInterface.h>
 
 #define FPA_MAX_TIME UINT32_MAX
 
 struct FragmentProtoAssembler_frame;
 
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_decl.h>
-
-struct FragmentProtoAssembler_chunk {
-    int start;
-    int len;
-};
+#include "FragmentProtoAssembler_hash.h"
+#include <structure/CHash_decl.h>
 
 struct FragmentProtoAssembler_frame {
-    LinkedList1Node list_node; // node in free or used list
-    struct FragmentProtoAssembler_chunk *chunks; // array of chunks, up to num_chunks
+    LinkedList1Node list_node; // node in free list, or in used list ordered by time
+    uint64_t *bitmap; // bitmap of received bytes outside the prefix, bitmap_words words; all clear when free
     uint8_t *buffer; // buffer with frame data, size output_mtu
     // everything below only defined when frame entry is used
     fragmentproto_frameid id; // frame identifier
     uint32_t time; // packet time when the last chunk was received
-    FPAFramesTreeNode tree_node; // node fields in tree for searching frames by id
-    int num_chunks; // number of valid chunks
+    struct FragmentProtoAssembler_frame *hash_next; // next in frames_used_hash bucket, indexed by id
+    int num_chunks; // number of chunks received
     int sum; // sum of all chunks' lengths
     int length; // length of the frame, or -1 if not yet known
     int length_so_far; // if length=-1, current data set's upper bound
+    int prefix_end; // end of the data received in order from the start, not marked in the bitmap
+    int bitmap_end; // upper bound of data marked in the bitmap
 };
 
 /**
@@ -76,6 +72,14 @@ struct FragmentProtoAssembler_frame {
  *
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ *
+ * Frames being assembled are found by ID through a hash table. For each frame,
+ * chunks received in order from the start only extend a prefix, and the bytes
+ * of any other chunks are tracked in a bitmap, so overlapping chunks are detected
+ * without looking at previous chunks. Used frames are kept in order of the last
+ * received chunk, and timed out frames are freed from the front of that list as
+ * packets arrive. A frame which arrives as a single chunk is passed to the output
+ * directly from the input packet, without being copied.
  */
 typedef struct {
     void *user;
@@ -84,14 +88,15 @@ typedef struct {
     PacketPassInterface *output;
     int output_mtu;
     int num_chunks;
+    int bitmap_words;
     uint32_t time;
     int time_tolerance;
     struct FragmentProtoAssembler_frame *frames_entries;
-    struct FragmentProtoAssembler_chunk *frames_chunks;
+    uint64_t *frames_bitmaps;
     uint8_t *frames_buffer;
     LinkedList1 frames_free;
     LinkedList1 frames_used;
-    FPAFramesTree frames_used_tree;
+    FPAFramesHash frames_used_hash;
     int in_len;
     uint8_t *in;
     int in_pos;
@@ -106,6 +111,8 @@ typedef struct {
  * @param input_mtu maximum input packet size. Must be >=0.
  * @param output output interface
  * @param num_frames number of frames we can hold. Must be >0 and < FPA_MAX_TIME.
+ *  A frame which has not received a chunk in the last num_frames input packets
+ *  is dropped.
  *  To make the assembler tolerate out-of-order input of degree D, set to D+2.
  *  Here, D is the minimum size of a hypothetical buffer needed to order the input.
  * @param num_chunks maximum number of chunks a frame can come in. Must be >0.
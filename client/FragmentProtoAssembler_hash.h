@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME FPAFramesHash
+#define CHASH_PARAM_ENTRY struct FragmentProtoAssembler_frame
+#define CHASH_PARAM_LINK struct FragmentProtoAssembler_frame *
+#define CHASH_PARAM_KEY fragmentproto_frameid
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct FragmentProtoAssembler_frame *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((size_t)(entry).ptr->id)
+#define CHASH_PARAM_KEYHASH(arg, key) ((size_t)(key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 0
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) ((entry1).ptr->id == (entry2).ptr->id)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) ((key1) == (entry2).ptr->id)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
@@ -37,7 +37,7 @@
 #include <misc/ipv4_proto.h>
 #include <misc/igmp_proto.h>
 #include <misc/byteorder.h>
-#include <misc/compare.h>
+#include <misc/minmax.h>
 #include <misc/print_macros.h>
 
 #include <client/FrameDecider.h>
@@ -49,29 +49,77 @@
 #define DECIDE_STATE_FLOOD 3
 #define DECIDE_STATE_MULTICAST 4
 
+#define DECIDE_BATCH_CHUNK 16
+
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static int compare_macs (const uint8_t *mac1, const uint8_t *mac2)
+static uint64_t mac_to_key (const uint8_t *mac)
 {
-    int c = memcmp(mac1, mac2, 6);
-    return B_COMPARE(c, 0);
+    uint64_t key = 0;
+    memcpy(&key, mac, 6);
+    return key;
 }
 
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_impl.h>
+static size_t hash_mac_key (uint64_t key)
+{
+    // the low bits of the key are the vendor part of the MAC, so mix it up
+    uint64_t h = key * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h ^ (h >> 32));
+}
 
-#include "FrameDecider_groups_tree.h"
-#include <structure/SAvl_impl.h>
+static size_t hash_u32 (uint32_t x)
+{
+    uint64_t h = x * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h ^ (h >> 32));
+}
 
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_impl.h>
+static void prefetch (const void *addr)
+{
+#ifdef __GNUC__
+    __builtin_prefetch(addr);
+#endif
+}
+
+#include "FrameDecider_macs_hash.h"
+#include <structure/CHash_impl.h>
+
+#include "FrameDecider_groups_hash.h"
+#include <structure/CHash_impl.h>
+
+#include "FrameDecider_multicast_hash.h"
+#include <structure/CHash_impl.h>
+
+static int grow_hashes (FrameDecider *d, int num_peers)
+{
+    ASSERT(num_peers > 0)
+    
+    // make sure every used entry of num_peers peers can have its own bucket
+    
+    size_t want_macs = (size_t)num_peers * d->max_peer_macs;
+    while (d->macs_hash.num_buckets < want_macs) {
+        if (!FDMacsHash_MultiplyBuckets(&d->macs_hash, 0, 1)) {
+            return 0;
+        }
+    }
+    
+    size_t want_groups = (size_t)num_peers * d->max_peer_groups;
+    while (d->multicast_hash.num_buckets < want_groups) {
+        if (!FDMulticastHash_MultiplyBuckets(&d->multicast_hash, 0, 1)) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
 
 static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
 {
     FrameDecider *d = o->d;
     
-    // locate entry in tree
-    struct _FrameDecider_mac_entry *e_entry = FDMacsTree_LookupExact(&d->macs_tree, 0, mac);
+    uint64_t key = mac_to_key(mac);
+    
+    // locate entry in hash table
+    struct _FrameDecider_mac_entry *e_entry = FDMacsHash_Lookup(&d->macs_hash, 0, key).ptr;
     if (e_entry) {
         if (e_entry->peer == o) {
             // this is our MAC; only move it to the end of the used list
@@ -81,7 +129,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         }
         
         // some other peer has that MAC; disassociate it
-        FDMacsTree_Remove(&d->macs_tree, 0, e_entry);
+        FDMacsHash_Remove(&d->macs_hash, 0, FDMacsHashDerefNonNull(0, e_entry));
         LinkedList1_Remove(&e_entry->peer->mac_entries_used, &e_entry->list_node);
         LinkedList1_Append(&e_entry->peer->mac_entries_free, &e_entry->list_node);
     }
@@ -102,18 +150,18 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         ASSERT(entry->peer == o)
         
         // remove from used
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        FDMacsHash_Remove(&d->macs_hash, 0, FDMacsHashDerefNonNull(0, entry));
         LinkedList1_Remove(&o->mac_entries_used, &entry->list_node);
     }
     
     PeerLog(o, BLOG_INFO, "adding MAC %02"PRIx8":%02"PRIx8":%02"PRIx8":%02"PRIx8":%02"PRIx8":%02"PRIx8"", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
     
     // set MAC in entry
-    memcpy(entry->mac, mac, sizeof(entry->mac));
+    entry->mac_key = key;
     
     // add to used
     LinkedList1_Append(&o->mac_entries_used, &entry->list_node);
-    int res = FDMacsTree_Insert(&d->macs_tree, 0, entry, NULL);
+    int res = FDMacsHash_Insert(&d->macs_hash, 0, FDMacsHashDerefNonNull(0, entry), NULL);
     ASSERT_EXECUTE(res)
 }
 
@@ -135,7 +183,7 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
     // compute sig
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    struct _FrameDecider_group_entry *master = FDMulticastHash_Lookup(&d->multicast_hash, 0, sig).ptr;
     if (master) {
         // use existing master
         ASSERT(master->is_master)
@@ -154,8 +202,8 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
         // set sig
         group_entry->master.sig = sig;
         
-        // insert to multicast tree
-        int res = FDMulticastTree_Insert(&d->multicast_tree, 0, group_entry, NULL);
+        // insert to multicast hash table
+        int res = FDMulticastHash_Insert(&d->multicast_hash, 0, FDMulticastHashDerefNonNull(0, group_entry), NULL);
         ASSERT_EXECUTE(res)
         
         // init list node
@@ -169,8 +217,8 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
     if (group_entry->is_master) {
-        // remove master from multicast tree
-        FDMulticastTree_Remove(&d->multicast_tree, 0, group_entry);
+        // remove master from multicast hash table
+        FDMulticastHash_Remove(&d->multicast_hash, 0, FDMulticastHashDerefNonNull(0, group_entry));
         
         if (!LinkedList3Node_IsLonely(&group_entry->sig_list_node)) {
             // at least one more group entry for this sig; make another entry the master
@@ -186,8 +234,8 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
             // set sig
             newmaster->master.sig = sig;
             
-            // insert to multicast tree
-            int res = FDMulticastTree_Insert(&d->multicast_tree, 0, newmaster, NULL);
+            // insert to multicast hash table
+            int res = FDMulticastHash_Insert(&d->multicast_hash, 0, FDMulticastHashDerefNonNull(0, newmaster), NULL);
             ASSERT_EXECUTE(res)
         }
     }
@@ -200,7 +248,7 @@ static void add_group_to_peer (FrameDeciderPeer *o, uint32_t group)
 {
     FrameDecider *d = o->d;
     
-    struct _FrameDecider_group_entry *group_entry = FDGroupsTree_LookupExact(&o->groups_tree, 0, group);
+    struct _FrameDecider_group_entry *group_entry = FDGroupsHash_Lookup(&o->groups_hash, 0, group).ptr;
     if (group_entry) {
         // move to end of used list
         LinkedList1_Remove(&o->group_entries_used, &group_entry->list_node);
@@ -225,8 +273,8 @@ static void add_group_to_peer (FrameDeciderPeer *o, uint32_t group)
             // remove from multicast
             remove_from_multicast(d, group_entry);
             
-            // remove from peer's groups tree
-            FDGroupsTree_Remove(&o->groups_tree, 0, group_entry);
+            // remove from peer's groups hash table
+            FDGroupsHash_Remove(&o->groups_hash, 0, FDGroupsHashDerefNonNull(0, group_entry));
             
             // remove from used list
             LinkedList1_Remove(&o->group_entries_used, &group_entry->list_node);
@@ -238,8 +286,8 @@ static void add_group_to_peer (FrameDeciderPeer *o, uint32_t group)
         // set group address
         group_entry->group = group;
         
-        // insert to peer's groups tree
-        int res = FDGroupsTree_Insert(&o->groups_tree, 0, group_entry, NULL);
+        // insert to peer's groups hash table
+        int res = FDGroupsHash_Insert(&o->groups_hash, 0, FDGroupsHashDerefNonNull(0, group_entry), NULL);
         ASSERT_EXECUTE(res)
         
         // add to multicast
@@ -265,8 +313,8 @@ static void remove_group_entry (struct _FrameDecider_group_entry *group_entry)
     // remove from multicast
     remove_from_multicast(d, group_entry);
     
-    // remove from peer's groups tree
-    FDGroupsTree_Remove(&peer->groups_tree, 0, group_entry);
+    // remove from peer's groups hash table
+    FDGroupsHash_Remove(&peer->groups_hash, 0, FDGroupsHashDerefNonNull(0, group_entry));
     
     // remove from used list
     LinkedList1_Remove(&peer->group_entries_used, &group_entry->list_node);
@@ -285,8 +333,8 @@ static void lower_group_timers_to_lmqt (FrameDecider *d, uint32_t group)
     // compute sig
     uint32_t sig = compute_sig_for_group(group);
     
-    // look up the sig in multicast tree
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    // look up the sig in multicast hash table
+    struct _FrameDecider_group_entry *master = FDMulticastHash_Lookup(&d->multicast_hash, 0, sig).ptr;
     if (!master) {
         return;
     }
@@ -320,50 +368,8 @@ static void group_entry_timer_handler (struct _FrameDecider_group_entry *group_e
     remove_group_entry(group_entry);
 }
 
-void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups, btime_t igmp_group_membership_interval, btime_t igmp_last_member_query_time, BReactor *reactor)
+static void reset_decide (FrameDecider *o)
 {
-    ASSERT(max_peer_macs > 0)
-    ASSERT(max_peer_groups > 0)
-    
-    // init arguments
-    o->max_peer_macs = max_peer_macs;
-    o->max_peer_groups = max_peer_groups;
-    o->igmp_group_membership_interval = igmp_group_membership_interval;
-    o->igmp_last_member_query_time = igmp_last_member_query_time;
-    o->reactor = reactor;
-    
-    // init peers list
-    LinkedList1_Init(&o->peers_list);
-    
-    // init MAC tree
-    FDMacsTree_Init(&o->macs_tree);
-    
-    // init multicast tree
-    FDMulticastTree_Init(&o->multicast_tree);
-    
-    // init decide state
-    o->decide_state = DECIDE_STATE_NONE;
-    
-    // set no current flood peer
-    o->decide_flood_current = NULL;
-    
-    DebugObject_Init(&o->d_obj);
-}
-
-void FrameDecider_Free (FrameDecider *o)
-{
-    ASSERT(FDMulticastTree_IsEmpty(&o->multicast_tree))
-    ASSERT(FDMacsTree_IsEmpty(&o->macs_tree))
-    ASSERT(LinkedList1_IsEmpty(&o->peers_list))
-    DebugObject_Free(&o->d_obj);
-}
-
-void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int frame_len)
-{
-    ASSERT(frame_len >= 0)
-    DebugObject_Access(&o->d_obj);
-    
-    // reset decide state
     switch (o->decide_state) {
         case DECIDE_STATE_NONE:
             break;
@@ -373,27 +379,29 @@ void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int f
             break;
         case DECIDE_STATE_MULTICAST:
             LinkedList3Iterator_Free(&o->decide_multicast_it);
-            return;
+            break;
         default:
             ASSERT(0);
     }
     o->decide_state = DECIDE_STATE_NONE;
     o->decide_flood_current = NULL;
-    
-    // analyze frame
-    
+}
+
+static int analyze_frame (FrameDecider *o, const uint8_t *frame, int frame_len, uint8_t *out_dest, int *out_is_igmp)
+{
     const uint8_t *pos = frame;
     int len = frame_len;
     
     if (len < sizeof(struct ethernet_header)) {
-        return;
+        return 0;
     }
     struct ethernet_header eh;
     memcpy(&eh, pos, sizeof(eh));
     pos += sizeof(struct ethernet_header);
     len -= sizeof(struct ethernet_header);
     
-    int is_igmp = 0;
+    memcpy(out_dest, eh.dest, sizeof(eh.dest));
+    *out_is_igmp = 0;
     
     switch (ntoh16(eh.type)) {
         case ETHERTYPE_IPV4: {
@@ -410,7 +418,7 @@ void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int f
             }
             
             // remember that it's IGMP; we have to flood IGMP frames
-            is_igmp = 1;
+            *out_is_igmp = 1;
             
             // check IGMP header
             if (len < sizeof(struct igmp_base)) {
@@ -466,47 +474,230 @@ void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int f
         } break;
     }
     
-out:;
-    
+out:
+    return 1;
+}
+
+static int classify_dest (const uint8_t *dest, int is_igmp)
+{
     const uint8_t broadcast_mac[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     const uint8_t multicast_mac_header[] = {0x01, 0x00, 0x5e};
     
     // if it's broadcast or IGMP, flood it
-    if (is_igmp || !memcmp(eh.dest, broadcast_mac, sizeof(broadcast_mac))) {
-        o->decide_state = DECIDE_STATE_FLOOD;
-        o->decide_flood_current = LinkedList1_GetFirst(&o->peers_list);
-        return;
+    if (is_igmp || !memcmp(dest, broadcast_mac, sizeof(broadcast_mac))) {
+        return DECIDE_STATE_FLOOD;
     }
     
     // if it's multicast, forward to all peers with the given sig
-    if (!memcmp(eh.dest, multicast_mac_header, sizeof(multicast_mac_header))) {
-        // extract group's sig from destination MAC
-        uint32_t sig = compute_sig_for_mac(eh.dest);
-        
-        // look up the sig in multicast tree
-        struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&o->multicast_tree, 0, sig);
-        if (master) {
-            ASSERT(master->is_master)
-            
-            o->decide_state = DECIDE_STATE_MULTICAST;
-            LinkedList3Iterator_Init(&o->decide_multicast_it, LinkedList3Node_First(&master->sig_list_node), 1);
-        }
-        
+    if (!memcmp(dest, multicast_mac_header, sizeof(multicast_mac_header))) {
+        return DECIDE_STATE_MULTICAST;
+    }
+    
+    // otherwise look for the MAC entry
+    return DECIDE_STATE_UNICAST;
+}
+
+static void lookup_multicast (FrameDecider *o, uint32_t sig, FrameDeciderDecision *out)
+{
+    // look up the sig in multicast hash table
+    struct _FrameDecider_group_entry *master = FDMulticastHash_Lookup(&o->multicast_hash, 0, sig).ptr;
+    if (!master) {
+        out->state = DECIDE_STATE_NONE;
         return;
     }
+    ASSERT(master->is_master)
     
+    out->state = DECIDE_STATE_MULTICAST;
+    out->u.multicast_master = master;
+}
+
+static void lookup_unicast (FrameDecider *o, uint64_t key, FrameDeciderDecision *out)
+{
     // look for MAC entry
-    struct _FrameDecider_mac_entry *entry = FDMacsTree_LookupExact(&o->macs_tree, 0, eh.dest);
-    if (entry) {
-        o->decide_state = DECIDE_STATE_UNICAST;
-        o->decide_unicast_peer = entry->peer;
+    struct _FrameDecider_mac_entry *entry = FDMacsHash_Lookup(&o->macs_hash, 0, key).ptr;
+    if (!entry) {
+        // unknown destination MAC, flood
+        out->state = DECIDE_STATE_FLOOD;
+        return;
+    }
+    
+    out->state = DECIDE_STATE_UNICAST;
+    out->u.unicast_peer = entry->peer;
+}
+
+static void start_decision (FrameDecider *o, const FrameDeciderDecision *decision)
+{
+    ASSERT(o->decide_state == DECIDE_STATE_NONE)
+    
+    switch (decision->state) {
+        case DECIDE_STATE_NONE:
+            break;
+        
+        case DECIDE_STATE_UNICAST:
+            o->decide_state = DECIDE_STATE_UNICAST;
+            o->decide_unicast_peer = decision->u.unicast_peer;
+            break;
+        
+        case DECIDE_STATE_FLOOD:
+            o->decide_state = DECIDE_STATE_FLOOD;
+            o->decide_flood_current = LinkedList1_GetFirst(&o->peers_list);
+            break;
+        
+        case DECIDE_STATE_MULTICAST:
+            ASSERT(decision->u.multicast_master->is_master)
+            o->decide_state = DECIDE_STATE_MULTICAST;
+            LinkedList3Iterator_Init(&o->decide_multicast_it, LinkedList3Node_First(&decision->u.multicast_master->sig_list_node), 1);
+            break;
+        
+        default:
+            ASSERT(0);
+    }
+}
+
+int FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups, btime_t igmp_group_membership_interval, btime_t igmp_last_member_query_time, BReactor *reactor)
+{
+    ASSERT(max_peer_macs > 0)
+    ASSERT(max_peer_groups > 0)
+    
+    // init arguments
+    o->max_peer_macs = max_peer_macs;
+    o->max_peer_groups = max_peer_groups;
+    o->igmp_group_membership_interval = igmp_group_membership_interval;
+    o->igmp_last_member_query_time = igmp_last_member_query_time;
+    o->reactor = reactor;
+    
+    // init peers list
+    LinkedList1_Init(&o->peers_list);
+    o->num_peers = 0;
+    
+    // init MAC hash table; it is grown as peers are added
+    if (!FDMacsHash_Init(&o->macs_hash, max_peer_macs)) {
+        BLog(BLOG_ERROR, "FDMacsHash_Init failed");
+        goto fail0;
+    }
+    
+    // init multicast hash table; it is grown as peers are added
+    if (!FDMulticastHash_Init(&o->multicast_hash, max_peer_groups)) {
+        BLog(BLOG_ERROR, "FDMulticastHash_Init failed");
+        goto fail1;
+    }
+    
+    // init decide state
+    o->decide_state = DECIDE_STATE_NONE;
+    
+    // set no current flood peer
+    o->decide_flood_current = NULL;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    FDMacsHash_Free(&o->macs_hash);
+fail0:
+    return 0;
+}
+
+void FrameDecider_Free (FrameDecider *o)
+{
+    ASSERT(LinkedList1_IsEmpty(&o->peers_list))
+    ASSERT(o->num_peers == 0)
+    DebugObject_Free(&o->d_obj);
+    
+    // free multicast hash table
+    FDMulticastHash_Free(&o->multicast_hash);
+    
+    // free MAC hash table
+    FDMacsHash_Free(&o->macs_hash);
+}
+
+void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int frame_len)
+{
+    ASSERT(frame_len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // reset decide state
+    reset_decide(o);
+    
+    // analyze frame
+    uint8_t dest[6];
+    int is_igmp;
+    if (!analyze_frame(o, frame, frame_len, dest, &is_igmp)) {
         return;
     }
     
-    // unknown destination MAC, flood
-    o->decide_state = DECIDE_STATE_FLOOD;
-    o->decide_flood_current = LinkedList1_GetFirst(&o->peers_list);
-    return;
+    // decide
+    FrameDeciderDecision decision;
+    switch (decision.state = classify_dest(dest, is_igmp)) {
+        case DECIDE_STATE_MULTICAST:
+            lookup_multicast(o, compute_sig_for_mac(dest), &decision);
+            break;
+        case DECIDE_STATE_UNICAST:
+            lookup_unicast(o, mac_to_key(dest), &decision);
+            break;
+    }
+    
+    start_decision(o, &decision);
+}
+
+void FrameDecider_DecideBatch (FrameDecider *o, const uint8_t *const *frames, const int *frame_lens, int num_frames, FrameDeciderDecision *out_decisions)
+{
+    ASSERT(num_frames >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    uint32_t keys[DECIDE_BATCH_CHUNK];
+    uint64_t mac_keys[DECIDE_BATCH_CHUNK];
+    
+    for (int start = 0; start < num_frames; start += DECIDE_BATCH_CHUNK) {
+        int count = bmin_int(DECIDE_BATCH_CHUNK, num_frames - start);
+        FrameDeciderDecision *decs = out_decisions + start;
+        
+        // analyze frames and start fetching the hash buckets they will need
+        for (int i = 0; i < count; i++) {
+            ASSERT(frame_lens[start + i] >= 0)
+            
+            uint8_t dest[6];
+            int is_igmp;
+            if (!analyze_frame(o, frames[start + i], frame_lens[start + i], dest, &is_igmp)) {
+                decs[i].state = DECIDE_STATE_NONE;
+                continue;
+            }
+            
+            switch (decs[i].state = classify_dest(dest, is_igmp)) {
+                case DECIDE_STATE_MULTICAST: {
+                    keys[i] = compute_sig_for_mac(dest);
+                    size_t index = hash_u32(keys[i]) % o->multicast_hash.num_buckets;
+                    prefetch(&o->multicast_hash.buckets[index]);
+                } break;
+                case DECIDE_STATE_UNICAST: {
+                    mac_keys[i] = mac_to_key(dest);
+                    size_t index = hash_mac_key(mac_keys[i]) % o->macs_hash.num_buckets;
+                    prefetch(&o->macs_hash.buckets[index]);
+                } break;
+            }
+        }
+        
+        // do the lookups
+        for (int i = 0; i < count; i++) {
+            switch (decs[i].state) {
+                case DECIDE_STATE_MULTICAST:
+                    lookup_multicast(o, keys[i], &decs[i]);
+                    break;
+                case DECIDE_STATE_UNICAST:
+                    lookup_unicast(o, mac_keys[i], &decs[i]);
+                    break;
+            }
+        }
+    }
+}
+
+void FrameDecider_StartDecision (FrameDecider *o, const FrameDeciderDecision *decision)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // reset decide state
+    reset_decide(o);
+    
+    start_decision(o, decision);
 }
 
 FrameDeciderPeer * FrameDecider_NextDestination (FrameDecider *o)
@@ -574,8 +765,21 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
         goto fail1;
     }
     
+    // init groups hash table
+    if (!FDGroupsHash_Init(&o->groups_hash, d->max_peer_groups)) {
+        PeerLog(o, BLOG_ERROR, "FDGroupsHash_Init failed");
+        goto fail2;
+    }
+    
+    // make room in decider's hash tables
+    if (!grow_hashes(d, d->num_peers + 1)) {
+        PeerLog(o, BLOG_ERROR, "failed to grow hash tables");
+        goto fail3;
+    }
+    
     // insert to peers list
     LinkedList1_Append(&d->peers_list, &o->list_node);
+    d->num_peers++;
     
     // init MAC entry lists
     LinkedList1_Init(&o->mac_entries_free);
@@ -610,13 +814,14 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
         BTimer_Init(&entry->timer, 0, (BTimer_handler)group_entry_timer_handler, entry);
     }
     
-    // initialize groups tree
-    FDGroupsTree_Init(&o->groups_tree);
-    
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail3:
+    FDGroupsHash_Free(&o->groups_hash);
+fail2:
+    BFree(o->group_entries);
 fail1:
     BFree(o->mac_entries);
 fail0:
@@ -647,12 +852,12 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         BReactor_RemoveTimer(d->reactor, &entry->timer);
     }
     
-    // remove used MAC entries from tree
+    // remove used MAC entries from hash table
     for (node = LinkedList1_GetFirst(&o->mac_entries_used); node; node = LinkedList1Node_Next(node)) {
         struct _FrameDecider_mac_entry *entry = UPPER_OBJECT(node, struct _FrameDecider_mac_entry, list_node);
         
-        // remove from tree
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        // remove from hash table
+        FDMacsHash_Remove(&d->macs_hash, 0, FDMacsHashDerefNonNull(0, entry));
     }
     
     // remove from peers list
@@ -660,6 +865,10 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         d->decide_flood_current = LinkedList1Node_Next(d->decide_flood_current);
     }
     LinkedList1_Remove(&d->peers_list, &o->list_node);
+    d->num_peers--;
+    
+    // free groups hash table
+    FDGroupsHash_Free(&o->groups_hash);
     
     // free group entries
     BFree(o->group_entries);
@@ -39,7 +39,7 @@
 
 #include <structure/LinkedList1.h>
 #include <structure/LinkedList3.h>
-#include <structure/SAvl.h>
+#include <structure/CHash.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
 #include <system/BReactor.h>
@@ -48,23 +48,21 @@ struct _FrameDeciderPeer;
 struct _FrameDecider_mac_entry;
 struct _FrameDecider_group_entry;
 
-typedef const uint8_t *FDMacsTree_key;
+#include "FrameDecider_macs_hash.h"
+#include <structure/CHash_decl.h>
 
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_decl.h>
+#include "FrameDecider_groups_hash.h"
+#include <structure/CHash_decl.h>
 
-#include "FrameDecider_groups_tree.h"
-#include <structure/SAvl_decl.h>
-
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_decl.h>
+#include "FrameDecider_multicast_hash.h"
+#include <structure/CHash_decl.h>
 
 struct _FrameDecider_mac_entry {
     struct _FrameDeciderPeer *peer;
     LinkedList1Node list_node; // node in FrameDeciderPeer.mac_entries_free or FrameDeciderPeer.mac_entries_used
     // defined when used:
-    uint8_t mac[6];
-    FDMacsTreeNode tree_node; // node in FrameDecider.macs_tree, indexed by mac
+    uint64_t mac_key; // MAC address packed into an integer, as by mac_to_key() in FrameDecider.c
+    struct _FrameDecider_mac_entry *macs_hash_next; // next in FrameDecider.macs_hash bucket, indexed by mac_key
 };
 
 struct _FrameDecider_group_entry {
@@ -74,7 +72,7 @@ struct _FrameDecider_group_entry {
     // defined when used:
     // basic group data
     uint32_t group; // group address
-    FDGroupsTreeNode tree_node; // node in FrameDeciderPeer.groups_tree, indexed by group
+    struct _FrameDecider_group_entry *groups_hash_next; // next in FrameDeciderPeer.groups_hash bucket, indexed by group
     // all that folows is managed by add_to_multicast() and remove_from_multicast()
     LinkedList3Node sig_list_node; // node in list of group entries with the same sig
     btime_t timer_endtime;
@@ -82,7 +80,7 @@ struct _FrameDecider_group_entry {
     // defined when used and we are master:
     struct {
         uint32_t sig; // last 23 bits of group address
-        FDMulticastTreeNode tree_node; // node in FrameDecider.multicast_tree, indexed by sig
+        struct _FrameDecider_group_entry *multicast_hash_next; // next in FrameDecider.multicast_hash bucket, indexed by sig
     } master;
 };
 
@@ -96,8 +94,9 @@ typedef struct {
     btime_t igmp_last_member_query_time;
     BReactor *reactor;
     LinkedList1 peers_list;
-    FDMacsTree macs_tree;
-    FDMulticastTree multicast_tree;
+    int num_peers;
+    FDMacsHash macs_hash;
+    FDMulticastHash multicast_hash;
     int decide_state;
     LinkedList1Node *decide_flood_current;
     struct _FrameDeciderPeer *decide_unicast_peer;
@@ -119,10 +118,23 @@ typedef struct _FrameDeciderPeer {
     LinkedList1 mac_entries_used;
     LinkedList1 group_entries_free;
     LinkedList1 group_entries_used;
-    FDGroupsTree groups_tree;
+    FDGroupsHash groups_hash;
     DebugObject d_obj;
 } FrameDeciderPeer;
 
+/**
+ * Result of classifying a frame with {@link FrameDecider_DecideBatch}.
+ * Contents are private; see {@link FrameDecider_DecideBatch} for how long
+ * it stays valid.
+ */
+typedef struct {
+    int state;
+    union {
+        struct _FrameDeciderPeer *unicast_peer;
+        struct _FrameDecider_group_entry *multicast_master;
+    } u;
+} FrameDeciderDecision;
+
 /**
  * Initializes the object.
  * 
@@ -136,8 +148,10 @@ typedef struct _FrameDeciderPeer {
  * @param igmp_last_member_query_time IGMP Last Member Query Time value. When a Group-Specific
  *        Query is detected in {@link FrameDecider_AnalyzeAndDecide}, this is how long we wait for a peer
  *        belonging to the group to send a join before we remove the group from it.
+ * @param reactor reactor we live in
+ * @return 1 on success, 0 on failure
  */
-void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups, btime_t igmp_group_membership_interval, btime_t igmp_last_member_query_time, BReactor *reactor);
+int FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups, btime_t igmp_group_membership_interval, btime_t igmp_last_member_query_time, BReactor *reactor) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -158,8 +172,42 @@ void FrameDecider_Free (FrameDecider *o);
 void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int frame_len);
 
 /**
- * Returns the next peer that the frame submitted to {@link FrameDecider_AnalyzeAndDecide} should be
- * forwarded to.
+ * Analyzes a burst of frames read from the local device, and classifies each of
+ * them without starting to decide. The frames are processed in chunks; all
+ * frames of a chunk are analyzed before any destination is looked up, so that
+ * the lookups' memory accesses overlap. Any effect of analyzing a later frame
+ * of a chunk (e.g. an IGMP query lowering group timers) is therefore already in
+ * place when an earlier frame is looked up, and the decisions are not
+ * guaranteed to be the same as from calling {@link FrameDecider_AnalyzeAndDecide}
+ * on each frame in turn.
+ * 
+ * The decisions point to peers and their MAC and group entries. They become
+ * invalid after any {@link FrameDeciderPeer_Free}, any change to the MAC or
+ * group tables (a peer analyzing a frame, or a group entry timing out), and
+ * the next call of {@link FrameDecider_AnalyzeAndDecide} or this function.
+ * In practice, they have to be used from the same job context as this call.
+ * 
+ * @param o the object
+ * @param frames array of pointers to frame data
+ * @param frame_lens array of frame lengths. Each must be >=0.
+ * @param num_frames number of frames. Must be >=0.
+ * @param out_decisions array receiving a decision for each frame
+ */
+void FrameDecider_DecideBatch (FrameDecider *o, const uint8_t *const *frames, const int *frame_lens, int num_frames, FrameDeciderDecision *out_decisions);
+
+/**
+ * Starts deciding according to a decision obtained from {@link FrameDecider_DecideBatch}.
+ * Afterwards, destinations are retrieved with {@link FrameDecider_NextDestination},
+ * as with {@link FrameDecider_AnalyzeAndDecide}.
+ * 
+ * @param o the object
+ * @param decision decision for the frame, which must still be valid
+ */
+void FrameDecider_StartDecision (FrameDecider *o, const FrameDeciderDecision *decision);
+
+/**
+ * Returns the next peer that the frame submitted to {@link FrameDecider_AnalyzeAndDecide}
+ * or {@link FrameDecider_StartDecision} should be forwarded to.
  * 
  * @param o the object
  * @return peer to forward the frame to, or NULL if no more
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME FDMulticastHash
+#define CHASH_PARAM_ENTRY struct _FrameDecider_group_entry
+#define CHASH_PARAM_LINK struct _FrameDecider_group_entry *
+#define CHASH_PARAM_KEY uint32_t
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct _FrameDecider_group_entry *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) (hash_u32((entry).ptr->master.sig))
+#define CHASH_PARAM_KEYHASH(arg, key) (hash_u32((key)))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 0
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) ((entry1).ptr->master.sig == (entry2).ptr->master.sig)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) ((key1) == (entry2).ptr->master.sig)
+#define CHASH_PARAM_ENTRY_NEXT master.multicast_hash_next
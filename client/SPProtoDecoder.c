@@ -29,7 +29,7 @@
 
 #include <string.h>
 
-#include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/byteorder.h>
 #include <security/BHash.h>
 
@@ -39,51 +39,106 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static void decode_work_func (SPProtoDecoder *o)
+#define SLOT_STATE_INPUT 1
+#define SLOT_STATE_WORKING 2
+#define SLOT_STATE_DONE 3
+#define SLOT_STATE_SENDING 4
+
+static void decode_work_handler (struct SPProtoDecoder_slot *leader);
+
+static struct SPProtoDecoder_slot * get_slot (SPProtoDecoder *o, int i)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->in_len <= o->input_mtu)
+    ASSERT(i >= 0)
+    ASSERT(i < o->slots_used)
     
-    uint8_t *in = o->in;
-    int in_len = o->in_len;
+    return &o->slots[(o->slots_start + i) % o->window];
+}
+
+static struct SPProtoDecoder_slot * group_slot (SPProtoDecoder *o, struct SPProtoDecoder_slot *leader, int k)
+{
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(k >= 0)
+    ASSERT(k < leader->tw_group_len)
     
-    o->tw_out_len = -1;
+    return &o->slots[((leader - o->slots) + k) % o->window];
+}
+
+static void free_encryptors (SPProtoDecoder *o)
+{
+    ASSERT(o->have_encryption_key)
     
-    uint8_t *plaintext;
-    int plaintext_len;
+    for (int i = 0; i < o->window; i++) {
+        BEncryption_Free(&o->slots[i].encryptor);
+    }
+}
+
+static int decode_start (SPProtoDecoder *o, struct SPProtoDecoder_slot *slot, struct BEncryption_op *op, uint8_t *iv)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(slot->in_len >= 0)
+    ASSERT(slot->in_len <= o->input_mtu)
     
-    // decrypt if needed
-    if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        plaintext = in;
-        plaintext_len = in_len;
-    } else {
-        // input must be a multiple of blocks size
-        if (in_len % o->enc_block_size != 0) {
-            PeerLog(o, BLOG_WARNING, "packet size not a multiple of block size");
-            return;
-        }
-        
-        // input must have an IV block
-        if (in_len < o->enc_block_size) {
-            PeerLog(o, BLOG_WARNING, "packet does not have an IV");
-            return;
+    uint8_t *in = slot->in;
+    int in_len = slot->in_len;
+    
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // input must have a nonce and a tag
+        if (in_len < BENCRYPTION_AEAD_NONCE_SIZE + BENCRYPTION_AEAD_TAG_SIZE) {
+            PeerLog(o, BLOG_WARNING, "packet does not have a nonce and a tag");
+            return 0;
         }
         
         // check if we have encryption key
         if (!o->have_encryption_key) {
             PeerLog(o, BLOG_WARNING, "have no encryption key");
-            return;
+            return 0;
         }
         
-        // copy IV as BEncryption_Decrypt changes the IV
-        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, in, o->enc_block_size);
-        
-        // decrypt
-        uint8_t *ciphertext = in + o->enc_block_size;
-        int ciphertext_len = in_len - o->enc_block_size;
-        plaintext = o->buf;
-        BEncryption_Decrypt(&o->encryptor, ciphertext, plaintext, ciphertext_len, iv);
+        // queue in-place decryption and verification
+        uint8_t *ciphertext = in + BENCRYPTION_AEAD_NONCE_SIZE;
+        int ciphertext_len = in_len - BENCRYPTION_AEAD_NONCE_SIZE - BENCRYPTION_AEAD_TAG_SIZE;
+        op->in = ciphertext;
+        op->out = ciphertext;
+        op->len = ciphertext_len;
+        op->iv = in;
+        op->tag = ciphertext + ciphertext_len;
+        return 1;
+    }
+    
+    // input must be a multiple of blocks size
+    if (in_len % o->enc_block_size != 0) {
+        PeerLog(o, BLOG_WARNING, "packet size not a multiple of block size");
+        return 0;
+    }
+    
+    // input must have an IV block
+    if (in_len < o->enc_block_size) {
+        PeerLog(o, BLOG_WARNING, "packet does not have an IV");
+        return 0;
+    }
+    
+    // check if we have encryption key
+    if (!o->have_encryption_key) {
+        PeerLog(o, BLOG_WARNING, "have no encryption key");
+        return 0;
+    }
+    
+    // copy IV as decryption changes the IV
+    memcpy(iv, in, o->enc_block_size);
+    
+    // queue in-place decryption
+    op->in = in + o->enc_block_size;
+    op->out = in + o->enc_block_size;
+    op->len = in_len - o->enc_block_size;
+    op->iv = iv;
+    return 1;
+}
+
+static void decode_finish (SPProtoDecoder *o, struct SPProtoDecoder_slot *slot, uint8_t *plaintext, int plaintext_len)
+{
+    // remove padding
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !SPPROTO_HAVE_AEAD(o->sp_params)) {
+        int ciphertext_len = plaintext_len;
         
         // read padding
         if (ciphertext_len < o->enc_block_size) {
@@ -125,8 +180,15 @@ static void decode_work_func (SPProtoDecoder *o)
         // remember seed and OTP (can't check from here)
         struct spproto_otpdata header_otpd;
         memcpy(&header_otpd, header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), sizeof(header_otpd));
-        o->tw_out_seed_id = ltoh16(header_otpd.seed_id);
-        o->tw_out_otp = header_otpd.otp;
+        slot->tw_out_seed_id = ltoh16(header_otpd.seed_id);
+        slot->tw_out_otp = header_otpd.otp;
+    }
+    
+    // remember sequence number (can't check from here)
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        uint64_t seqnum;
+        memcpy(&seqnum, header + SPPROTO_HEADER_SEQNUM_OFF(o->sp_params), sizeof(seqnum));
+        slot->tw_out_seqnum = ltoh64(seqnum);
     }
     
     // check hash
@@ -150,94 +212,256 @@ static void decode_work_func (SPProtoDecoder *o)
     }
     
     // return packet
-    o->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
-    o->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+    slot->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
+    slot->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
 }
 
-static void decode_work_handler (SPProtoDecoder *o)
+static void decode_work_func (struct SPProtoDecoder_slot *leader)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->tw_have)
-    DebugObject_Access(&o->d_obj);
+    SPProtoDecoder *o = leader->o;
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(leader->tw_group_len <= o->batch)
+    
+    struct BEncryption_op ops[BENCRYPTION_MAX_BATCH];
+    struct SPProtoDecoder_slot *op_slots[BENCRYPTION_MAX_BATCH];
+    uint8_t ivs[BENCRYPTION_MAX_BATCH][BENCRYPTION_MAX_BLOCK_SIZE];
+    int num_ops = 0;
+    
+    for (int k = 0; k < leader->tw_group_len; k++) {
+        struct SPProtoDecoder_slot *slot = group_slot(o, leader, k);
+        slot->tw_out_len = -1;
+        
+        // without encryption, the input is the plaintext
+        if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+            decode_finish(o, slot, slot->in, slot->in_len);
+            continue;
+        }
+        
+        // check packet and queue decryption
+        if (decode_start(o, slot, &ops[num_ops], ivs[num_ops])) {
+            op_slots[num_ops++] = slot;
+        }
+    }
     
-    // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    if (num_ops == 0) {
+        return;
+    }
     
-    // check OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params) && o->tw_out_len >= 0) {
-        if (!OTPChecker_CheckOTP(&o->otpchecker, o->tw_out_seed_id, o->tw_out_otp)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
-            o->tw_out_len = -1;
+    // decrypt packets together, using the leader's encryptor
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        BEncryption_OpenBatch(&leader->encryptor, ops, num_ops);
+    } else {
+        BEncryption_DecryptBatch(&leader->encryptor, ops, num_ops);
+    }
+    
+    for (int j = 0; j < num_ops; j++) {
+        if (SPPROTO_HAVE_AEAD(o->sp_params) && !ops[j].authentic) {
+            PeerLog(o, BLOG_WARNING, "packet has wrong tag");
+            continue;
         }
+        decode_finish(o, op_slots[j], ops[j].out, ops[j].len);
     }
+}
+
+static void release_slot (SPProtoDecoder *o)
+{
+    ASSERT(o->slots_used > 0)
+    
+    // release first slot
+    o->slots_start = (o->slots_start + 1) % o->window;
+    o->slots_used--;
     
-    if (o->tw_out_len < 0) {
-        // cannot decode, finish input packet
+    // accept next input packet
+    if (o->in_blocked) {
+        o->in_blocked = 0;
         PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
-    } else {
+    }
+}
+
+static void maybe_output (SPProtoDecoder *o)
+{
+    while (!o->out_busy && o->slots_used > 0) {
+        struct SPProtoDecoder_slot *slot = get_slot(o, 0);
+        if (slot->state != SLOT_STATE_DONE) {
+            return;
+        }
+        
+        // check OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params) && slot->tw_out_len >= 0) {
+            if (!OTPChecker_CheckOTP(&o->otpchecker, slot->tw_out_seed_id, slot->tw_out_otp)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
+                slot->tw_out_len = -1;
+            }
+        }
+        
+        if (slot->tw_out_len < 0) {
+            // cannot decode, drop packet
+            release_slot(o);
+            continue;
+        }
+        
         // submit decoded packet to output
-        PacketPassInterface_Sender_Send(o->output, o->tw_out, o->tw_out_len);
+        slot->state = SLOT_STATE_SENDING;
+        o->out_busy = 1;
+        PacketPassInterface_Sender_Send(o->output, slot->tw_out, slot->tw_out_len);
     }
 }
 
+static void maybe_decode (SPProtoDecoder *o)
+{
+    // skip packets already being decoded
+    int i = 0;
+    while (i < o->slots_used && get_slot(o, i)->state != SLOT_STATE_INPUT) {
+        i++;
+    }
+    
+    // start decoding received packets, grouping up to batch packets
+    // into a single work
+    while (i < o->slots_used && o->num_works < o->max_works) {
+        struct SPProtoDecoder_slot *leader = get_slot(o, i);
+        int n = 0;
+        
+        while (n < o->batch && i < o->slots_used) {
+            struct SPProtoDecoder_slot *slot = get_slot(o, i);
+            ASSERT(slot->state == SLOT_STATE_INPUT)
+            slot->tw_group_len = 0;
+            slot->state = SLOT_STATE_WORKING;
+            n++;
+            i++;
+        }
+        
+        // start work
+        leader->tw_group_len = n;
+        BThreadWork_Init(&leader->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, leader, (BThreadWork_work_func)decode_work_func, leader);
+        o->num_works++;
+    }
+}
+
+static void decode_work_handler (struct SPProtoDecoder_slot *leader)
+{
+    SPProtoDecoder *o = leader->o;
+    ASSERT(leader->state == SLOT_STATE_WORKING)
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(o->num_works > 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // free work
+    BThreadWork_Free(&leader->tw);
+    o->num_works--;
+    
+    // mark packets in group done
+    for (int k = 0; k < leader->tw_group_len; k++) {
+        struct SPProtoDecoder_slot *slot = group_slot(o, leader, k);
+        ASSERT(slot->state == SLOT_STATE_WORKING)
+        slot->state = SLOT_STATE_DONE;
+        
+        // Check sequence number. This is done here rather than when outputting
+        // so that the packet is checked against the window of the key it was
+        // decoded with.
+        if (SPPROTO_HAVE_SEQNUM(o->sp_params) && slot->tw_out_len >= 0) {
+            if (!ReplayWindow_Check(&o->replay, slot->tw_out_seqnum)) {
+                PeerLog(o, BLOG_WARNING, "packet has a replayed sequence number");
+                slot->tw_out_len = -1;
+            }
+        }
+    }
+    
+    // output packet if it's next
+    maybe_output(o);
+    
+    // decode packets which were waiting for a free work
+    maybe_decode(o);
+}
+
 static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(!o->tw_have)
+    ASSERT(!o->in_blocked)
+    ASSERT(o->slots_used < o->window)
     DebugObject_Access(&o->d_obj);
     
-    // remember input
-    o->in = data;
-    o->in_len = data_len;
+    // take a slot
+    o->slots_used++;
+    struct SPProtoDecoder_slot *slot = get_slot(o, o->slots_used - 1);
+    
+    // remember input; with a single slot, decode from the input buffer directly
+    if (o->window == 1) {
+        slot->in = data;
+    } else {
+        memcpy(slot->in, data, data_len);
+    }
+    slot->in_len = data_len;
+    slot->state = SLOT_STATE_INPUT;
     
     // start decoding
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, o, (BThreadWork_work_func)decode_work_func, o);
-    o->tw_have = 1;
+    maybe_decode(o);
+    
+    // accept next input packet if we have a free slot
+    if (o->slots_used < o->window) {
+        PacketPassInterface_Done(&o->input);
+    } else {
+        o->in_blocked = 1;
+    }
 }
 
 static void output_handler_done (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(!o->tw_have)
+    ASSERT(o->out_busy)
+    ASSERT(get_slot(o, 0)->state == SLOT_STATE_SENDING)
     DebugObject_Access(&o->d_obj);
     
-    // finish input packet
-    PacketPassInterface_Done(&o->input);
-    o->in_len = -1;
+    // finish packet
+    o->out_busy = 0;
+    release_slot(o);
+    
+    // output next packet
+    maybe_output(o);
 }
 
-static void maybe_stop_work_and_ignore (SPProtoDecoder *o)
+static void stop_work_and_ignore (SPProtoDecoder *o)
 {
-    ASSERT(!(o->tw_have) || o->in_len >= 0)
-    
-    if (o->tw_have) {
-        // free work
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
-        
-        // ignore packet, receive next one
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
+    // stop existing work, ignoring packets being or waiting to be decoded
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *slot = get_slot(o, i);
+        if (slot->state == SLOT_STATE_WORKING && slot->tw_group_len > 0) {
+            BThreadWork_Free(&slot->tw);
+            o->num_works--;
+        }
+        if (slot->state == SLOT_STATE_INPUT || slot->state == SLOT_STATE_WORKING) {
+            slot->state = SLOT_STATE_DONE;
+            slot->tw_out_len = -1;
+        }
     }
+    
+    ASSERT(o->num_works == 0)
+    
+    // release ignored packets
+    maybe_output(o);
 }
 
-int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc)
+int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, int window, int batch, void *user, BLog_logfunc logfunc)
 {
     spproto_assert_security_params(sp_params);
     ASSERT(spproto_carrier_mtu_for_payload_mtu(sp_params, PacketPassInterface_GetMTU(output)) >= 0)
     ASSERT(!SPPROTO_HAVE_OTP(sp_params) || num_otp_seeds >= 2)
+    ASSERT(window > 0)
+    ASSERT(batch > 0)
+    ASSERT(batch <= window)
+    ASSERT(batch <= BENCRYPTION_MAX_BATCH)
     
     // init arguments
     o->output = output;
     o->sp_params = sp_params;
     o->twd = twd;
+    o->window = window;
+    o->batch = batch;
     o->user = user;
     o->logfunc = logfunc;
     
+    // allow enough works to cover the window
+    o->max_works = (o->window + o->batch - 1) / o->batch;
+    
     // init output
     PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
     
@@ -258,11 +482,24 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // calculate input MTU
     o->input_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->output_mtu);
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail0;
+    // allocate slots
+    if (!(o->slots = (struct SPProtoDecoder_slot *)BAllocArray(o->window, sizeof(o->slots[0])))) {
+        goto fail0;
+    }
+    
+    // allocate input buffers; with a single slot, the input buffer is used
+    if (o->window > 1) {
+        if (!(o->in_bufs = (uint8_t *)BAllocArray(o->window, o->input_mtu))) {
+            goto fail1;
+        }
+    }
+    
+    // init slots
+    for (int i = 0; i < o->window; i++) {
+        struct SPProtoDecoder_slot *slot = &o->slots[i];
+        slot->o = o;
+        if (o->window > 1) {
+            slot->in = o->in_bufs + (size_t)i * o->input_mtu;
         }
     }
     
@@ -272,7 +509,14 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // init OTP checker
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         if (!OTPChecker_Init(&o->otpchecker, o->sp_params.otp_num, o->sp_params.otp_mode, num_otp_seeds, o->twd)) {
-            goto fail1;
+            goto fail2;
+        }
+    }
+    
+    // init replay window
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        if (!ReplayWindow_Init(&o->replay, o->sp_params.replay_window)) {
+            goto fail3;
         }
     }
     
@@ -281,21 +525,34 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
         o->have_encryption_key = 0;
     }
     
-    // have no input packet
-    o->in_len = -1;
+    // have no packets
+    o->slots_start = 0;
+    o->slots_used = 0;
     
     // have no work
-    o->tw_have = 0;
+    o->num_works = 0;
+    
+    // input not blocked
+    o->in_blocked = 0;
+    
+    // output not busy
+    o->out_busy = 0;
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
-fail1:
+fail3:
+    if (SPPROTO_HAVE_OTP(o->sp_params)) {
+        OTPChecker_Free(&o->otpchecker);
+    }
+fail2:
     PacketPassInterface_Free(&o->input);
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    if (o->window > 1) {
+        BFree(o->in_bufs);
     }
+fail1:
+    BFree(o->slots);
 fail0:
     return 0;
 }
@@ -305,13 +562,21 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     DebugObject_Free(&o->d_obj);
     
     // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoDecoder_slot *slot = get_slot(o, i);
+        if (slot->state == SLOT_STATE_WORKING && slot->tw_group_len > 0) {
+            BThreadWork_Free(&slot->tw);
+        }
     }
     
-    // free encryptor
+    // free encryptors
     if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
+    }
+    
+    // free replay window
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        ReplayWindow_Free(&o->replay);
     }
     
     // free OTP checker
@@ -322,10 +587,13 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     // free input
     PacketPassInterface_Free(&o->input);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free input buffers
+    if (o->window > 1) {
+        BFree(o->in_bufs);
     }
+    
+    // free slots
+    BFree(o->slots);
 }
 
 PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
@@ -341,15 +609,22 @@ void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
-    maybe_stop_work_and_ignore(o);
+    stop_work_and_ignore(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
+    }
+    
+    // init encryptors, one per slot since AEAD contexts cannot be shared between threads
+    for (int i = 0; i < o->window; i++) {
+        BEncryption_Init(&o->slots[i].encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
+    // the sender starts a new sequence with the key
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        ReplayWindow_Reset(&o->replay);
+    }
     
     // have encryption key
     o->have_encryption_key = 1;
@@ -361,11 +636,11 @@ void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
-    maybe_stop_work_and_ignore(o);
+    stop_work_and_ignore(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free encryptors
+        free_encryptors(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -42,6 +42,7 @@
 #include <protocol/spproto.h>
 #include <security/BEncryption.h>
 #include <security/OTPChecker.h>
+#include <security/ReplayWindow.h>
 #include <flow/PacketPassInterface.h>
 
 /**
@@ -51,15 +52,28 @@
  */
 typedef void (*SPProtoDecoder_otp_handler) (void *user);
 
+struct SPProtoDecoder_slot;
+
 /**
  * Object which decodes packets according to SPProto.
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ * 
+ * Packets are decrypted in place, and the output packets point into
+ * the input packets, so the input buffers may be modified.
+ * 
+ * Up to window packets are accepted from the input and decoded
+ * concurrently; they are output in the order they were received.
+ * When packets are queued, up to batch of them are decoded by a single
+ * thread work, with their decryption done in one batch.
  */
 typedef struct {
     PacketPassInterface *output;
     struct spproto_security_params sp_params;
     BThreadWorkDispatcher *twd;
+    int window;
+    int batch;
+    int max_works;
     void *user;
     BLog_logfunc logfunc;
     int output_mtu;
@@ -67,21 +81,34 @@ typedef struct {
     int enc_block_size;
     int enc_key_size;
     int input_mtu;
-    uint8_t *buf;
+    uint8_t *in_bufs;
     PacketPassInterface input;
     OTPChecker otpchecker;
+    ReplayWindow replay;
     int have_encryption_key;
-    BEncryption encryptor;
+    struct SPProtoDecoder_slot *slots;
+    int slots_start;
+    int slots_used;
+    int num_works;
+    int in_blocked;
+    int out_busy;
+    DebugObject d_obj;
+} SPProtoDecoder;
+
+struct SPProtoDecoder_slot {
+    SPProtoDecoder *o;
+    int state;
     uint8_t *in;
     int in_len;
-    int tw_have;
+    BEncryption encryptor;
     BThreadWork tw;
+    int tw_group_len;
     uint16_t tw_out_seed_id;
     otp_t tw_out_otp;
+    uint64_t tw_out_seqnum;
     uint8_t *tw_out;
     int tw_out_len;
-    DebugObject d_obj;
-} SPProtoDecoder;
+};
 
 /**
  * Initializes the object.
@@ -97,11 +124,19 @@ typedef struct {
  *                      receiving packets. Must be >=2 if using OTPs.
  * @param pg pending group
  * @param twd thread work dispatcher
+ * @param window maximum number of packets being decoded at the same time. Must be >0.
+ *               With window=1, packets are decoded from the input buffer directly.
+ *               With window>1, input packets are copied into internal buffers, which
+ *               only pays off if twd is using threads.
+ * @param batch maximum number of packets decoded by a single thread work.
+ *              Must be >0, <=window and <=BENCRYPTION_MAX_BATCH. At most
+ *              ceil(window/batch) works are started at the same time, and packets
+ *              received while they are busy are decoded together.
  * @param user argument to handlers
  * @param logfunc function which prepends the log prefix using {@link BLog_Append}
  * @return 1 on success, 0 on failure
  */
-int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc) WARN_UNUSED;
+int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, int window, int batch, void *user, BLog_logfunc logfunc) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <security/BRandom.h>
@@ -38,45 +39,93 @@
 
 #include "SPProtoEncoder.h"
 
+#define SLOT_STATE_RECEIVING 1
+#define SLOT_STATE_INPUT 2
+#define SLOT_STATE_WORKING 3
+#define SLOT_STATE_DONE 4
+
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i);
+static struct SPProtoEncoder_slot * group_slot (SPProtoEncoder *o, struct SPProtoEncoder_slot *leader, int k);
+static uint8_t * slot_plaintext (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot);
 static int can_encode (SPProtoEncoder *o);
-static void encode_packet (SPProtoEncoder *o);
-static void encode_work_func (SPProtoEncoder *o);
-static void encode_work_handler (SPProtoEncoder *o);
+static void prepare_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot);
+static void encode_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot, BRandomStream *rng, struct BEncryption_op *op, uint8_t *iv);
+static void encode_work_func (struct SPProtoEncoder_slot *leader);
+static void encode_work_handler (struct SPProtoEncoder_slot *leader);
 static void maybe_encode (SPProtoEncoder *o);
+static void maybe_receive (SPProtoEncoder *o);
+static void maybe_output (SPProtoEncoder *o);
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data);
 static void input_handler_done (SPProtoEncoder *o, int data_len);
 static void handler_job_hander (SPProtoEncoder *o);
 static void otpgenerator_handler (SPProtoEncoder *o);
-static void maybe_stop_work (SPProtoEncoder *o);
+static void stop_work_and_drop (SPProtoEncoder *o);
+static void free_encryptors (SPProtoEncoder *o);
 
-static int can_encode (SPProtoEncoder *o)
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->slots_used)
+    
+    return &o->slots[(o->slots_start + i) % o->window];
+}
+
+static struct SPProtoEncoder_slot * group_slot (SPProtoEncoder *o, struct SPProtoEncoder_slot *leader, int k)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(k >= 0)
+    ASSERT(k < leader->tw_group_len)
     
+    return &o->slots[((leader - o->slots) + k) % o->window];
+}
+
+static uint8_t * slot_plaintext (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot)
+{
+    // plaintext is placed in the output buffer after the nonce or IV,
+    // so that it can be encrypted in place
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        return slot->out + BENCRYPTION_AEAD_NONCE_SIZE;
+    }
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        return slot->out + o->enc_block_size;
+    }
+    return slot->out;
+}
+
+static int can_encode (SPProtoEncoder *o)
+{
     return (
         (!SPPROTO_HAVE_OTP(o->sp_params) || OTPGenerator_GetPosition(&o->otpgen) < o->sp_params.otp_num) &&
         (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
     );
 }
 
-static void encode_packet (SPProtoEncoder *o)
+static void prepare_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(slot->state == SLOT_STATE_INPUT)
     ASSERT(can_encode(o))
     
     // generate OTP, remember seed ID
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        o->tw_seed_id = o->otpgen_seed_id;
-        o->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+        slot->tw_seed_id = o->otpgen_seed_id;
+        slot->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
     }
     
-    // start work
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, o, (BThreadWork_work_func)encode_work_func, o);
-    o->tw_have = 1;
+    // assign sequence number
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        slot->tw_seqnum = o->seqnum++;
+    }
+    
+    // assign nonce
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        memcpy(slot->tw_nonce, o->aead_nonce_prefix, SPPROTO_AEAD_NONCE_PREFIX_LEN);
+        uint64_t counter = hton64(o->aead_counter++);
+        memcpy(slot->tw_nonce + SPPROTO_AEAD_NONCE_COUNTER_OFF, &counter, sizeof(counter));
+    }
+    
+    // not a group leader unless set later
+    slot->tw_group_len = 0;
+    slot->state = SLOT_STATE_WORKING;
     
     // schedule OTP warning handler
     if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
@@ -84,31 +133,35 @@ static void encode_packet (SPProtoEncoder *o)
     }
 }
 
-static void encode_work_func (SPProtoEncoder *o)
+static void encode_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *slot, BRandomStream *rng, struct BEncryption_op *op, uint8_t *iv)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
+    ASSERT(slot->in_len >= 0)
+    ASSERT(slot->in_len <= o->input_mtu)
     ASSERT(!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
     
-    ASSERT(o->in_len <= o->input_mtu)
-    
     // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    uint8_t *plaintext = slot_plaintext(o, slot);
     
     // plaintext begins with header
     uint8_t *header = plaintext;
     
     // plaintext is header + payload
-    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + o->in_len;
+    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + slot->in_len;
     
     // write OTP
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         struct spproto_otpdata header_otpd;
-        header_otpd.seed_id = htol16(o->tw_seed_id);
-        header_otpd.otp = o->tw_otp;
+        header_otpd.seed_id = htol16(slot->tw_seed_id);
+        header_otpd.otp = slot->tw_otp;
         memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
     }
     
+    // write sequence number
+    if (SPPROTO_HAVE_SEQNUM(o->sp_params)) {
+        uint64_t seqnum = htol64(slot->tw_seqnum);
+        memcpy(header + SPPROTO_HEADER_SEQNUM_OFF(o->sp_params), &seqnum, sizeof(seqnum));
+    }
+    
     // write hash
     if (SPPROTO_HAVE_HASH(o->sp_params)) {
         uint8_t *header_hash = header + SPPROTO_HEADER_HASH_OFF(o->sp_params);
@@ -123,7 +176,19 @@ static void encode_work_func (SPProtoEncoder *o)
     
     int out_len;
     
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // write nonce
+        memcpy(slot->out, slot->tw_nonce, BENCRYPTION_AEAD_NONCE_SIZE);
+        
+        // queue in-place encryption, with the tag following the ciphertext
+        op->in = plaintext;
+        op->out = plaintext;
+        op->len = plaintext_len;
+        op->iv = slot->tw_nonce;
+        op->tag = plaintext + plaintext_len;
+        out_len = BENCRYPTION_AEAD_NONCE_SIZE + plaintext_len + BENCRYPTION_AEAD_TAG_SIZE;
+    }
+    else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         // encrypting pad(header + payload)
         int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
         
@@ -134,80 +199,198 @@ static void encode_work_func (SPProtoEncoder *o)
         }
         
         // generate IV
-        BRandom_randomize(o->out, o->enc_block_size);
+        BRandomStream_GenBytes(rng, slot->out, o->enc_block_size);
         
-        // copy IV because BEncryption_Encrypt changes the IV
-        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, o->out, o->enc_block_size);
+        // copy IV because encryption changes the IV
+        memcpy(iv, slot->out, o->enc_block_size);
         
-        // encrypt
-        BEncryption_Encrypt(&o->encryptor, plaintext, o->out + o->enc_block_size, cyphertext_len, iv);
+        // queue in-place encryption
+        op->in = plaintext;
+        op->out = plaintext;
+        op->len = cyphertext_len;
+        op->iv = iv;
         out_len = o->enc_block_size + cyphertext_len;
-    } else {
+    }
+    else {
         out_len = plaintext_len;
     }
     
     // remember length
-    o->tw_out_len = out_len;
+    slot->tw_out_len = out_len;
+}
+
+static void encode_work_func (struct SPProtoEncoder_slot *leader)
+{
+    SPProtoEncoder *o = leader->o;
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(leader->tw_group_len <= o->batch)
+    
+    struct BEncryption_op ops[BENCRYPTION_MAX_BATCH];
+    uint8_t ivs[BENCRYPTION_MAX_BATCH][BENCRYPTION_MAX_BLOCK_SIZE];
+    
+    // build packets, taking IVs from the leader's generator
+    for (int k = 0; k < leader->tw_group_len; k++) {
+        encode_packet(o, group_slot(o, leader, k), &leader->rng, &ops[k], ivs[k]);
+    }
+    
+    // encrypt them together, using the leader's encryptor
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        BEncryption_SealBatch(&leader->encryptor, ops, leader->tw_group_len);
+    }
+    else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        BEncryption_EncryptBatch(&leader->encryptor, ops, leader->tw_group_len);
+    }
 }
 
-static void encode_work_handler (SPProtoEncoder *o)
+static void encode_work_handler (struct SPProtoEncoder_slot *leader)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(o->tw_have)
+    SPProtoEncoder *o = leader->o;
+    ASSERT(leader->state == SLOT_STATE_WORKING)
+    ASSERT(leader->tw_group_len > 0)
+    ASSERT(o->num_works > 0)
+    DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&leader->tw);
+    o->num_works--;
+    
+    // mark packets in group done
+    for (int k = 0; k < leader->tw_group_len; k++) {
+        struct SPProtoEncoder_slot *slot = group_slot(o, leader, k);
+        ASSERT(slot->state == SLOT_STATE_WORKING)
+        slot->state = SLOT_STATE_DONE;
+    }
     
-    // finish packet
-    o->in_len = -1;
-    o->out_have = 0;
-    PacketRecvInterface_Done(&o->output, o->tw_out_len);
+    // output packet if it's next
+    maybe_output(o);
+    
+    // encode packets which were waiting for a free work
+    maybe_encode(o);
 }
 
 static void maybe_encode (SPProtoEncoder *o)
 {
-    if (o->in_len >= 0 && o->out_have && !o->tw_have && can_encode(o)) {
-        encode_packet(o);
+    // skip packets already being encoded
+    int i = 0;
+    while (i < o->slots_used && (get_slot(o, i)->state == SLOT_STATE_WORKING || get_slot(o, i)->state == SLOT_STATE_DONE)) {
+        i++;
+    }
+    
+    // start encoding received packets in order, grouping up to batch
+    // packets into a single work
+    while (i < o->slots_used && o->num_works < o->max_works) {
+        struct SPProtoEncoder_slot *leader = get_slot(o, i);
+        int n = 0;
+        
+        while (n < o->batch && i < o->slots_used) {
+            struct SPProtoEncoder_slot *slot = get_slot(o, i);
+            if (slot->state != SLOT_STATE_INPUT || !can_encode(o)) {
+                break;
+            }
+            prepare_packet(o, slot);
+            n++;
+            i++;
+        }
+        
+        if (n == 0) {
+            break;
+        }
+        
+        // start work
+        leader->tw_group_len = n;
+        BThreadWork_Init(&leader->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, leader, (BThreadWork_work_func)encode_work_func, leader);
+        o->num_works++;
     }
 }
 
+static void maybe_receive (SPProtoEncoder *o)
+{
+    if (o->in_receiving || o->slots_used == o->window) {
+        return;
+    }
+    
+    // with a single slot, we encode directly into the output buffer
+    if (o->window == 1 && !o->out_have) {
+        return;
+    }
+    
+    // take a slot
+    o->slots_used++;
+    struct SPProtoEncoder_slot *slot = get_slot(o, o->slots_used - 1);
+    if (o->window == 1) {
+        slot->out = o->out;
+    }
+    slot->state = SLOT_STATE_RECEIVING;
+    
+    // schedule receive
+    o->in_receiving = 1;
+    PacketRecvInterface_Receiver_Recv(o->input, slot_plaintext(o, slot) + SPPROTO_HEADER_LEN(o->sp_params));
+}
+
+static void maybe_output (SPProtoEncoder *o)
+{
+    if (!o->out_have || o->slots_used == 0) {
+        return;
+    }
+    
+    struct SPProtoEncoder_slot *slot = get_slot(o, 0);
+    if (slot->state != SLOT_STATE_DONE) {
+        return;
+    }
+    
+    // copy packet unless it was encoded in place
+    if (slot->out != o->out) {
+        memcpy(o->out, slot->out, slot->tw_out_len);
+    }
+    
+    // release slot
+    o->slots_start = (o->slots_start + 1) % o->window;
+    o->slots_used--;
+    
+    // finish packet
+    o->out_have = 0;
+    PacketRecvInterface_Done(&o->output, slot->tw_out_len);
+    
+    // read ahead into the released slot
+    maybe_receive(o);
+}
+
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data)
 {
-    ASSERT(o->in_len == -1)
     ASSERT(!o->out_have)
-    ASSERT(!o->tw_have)
     DebugObject_Access(&o->d_obj);
     
     // remember output packet
     o->out_have = 1;
     o->out = data;
     
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    // output packet if we have one ready
+    maybe_output(o);
     
-    // schedule receive
-    PacketRecvInterface_Receiver_Recv(o->input, plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+    // continue receiving input
+    maybe_receive(o);
 }
 
 static void input_handler_done (SPProtoEncoder *o, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->in_receiving)
     DebugObject_Access(&o->d_obj);
     
+    struct SPProtoEncoder_slot *slot = get_slot(o, o->slots_used - 1);
+    ASSERT(slot->state == SLOT_STATE_RECEIVING)
+    
     // remember input packet
-    o->in_len = data_len;
+    slot->in_len = data_len;
+    slot->state = SLOT_STATE_INPUT;
+    o->in_receiving = 0;
     
     // encode if possible
-    if (can_encode(o)) {
-        encode_packet(o);
-    }
+    maybe_encode(o);
+    
+    // read ahead
+    maybe_receive(o);
 }
 
 static void handler_job_hander (SPProtoEncoder *o)
@@ -233,16 +416,44 @@ static void otpgenerator_handler (SPProtoEncoder *o)
     maybe_encode(o);
 }
 
-static void maybe_stop_work (SPProtoEncoder *o)
+static void free_encryptors (SPProtoEncoder *o)
 {
-    // stop existing work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->window; i++) {
+        BEncryption_Free(&o->slots[i].encryptor);
     }
 }
 
-int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd)
+static void stop_work_and_drop (SPProtoEncoder *o)
+{
+    // stop existing work and drop packets being or already encoded; they are
+    // encrypted in place, so their plaintext is gone and they cannot be
+    // encoded again with a different key
+    int num_drop = 0;
+    while (num_drop < o->slots_used) {
+        struct SPProtoEncoder_slot *slot = get_slot(o, num_drop);
+        if (slot->state != SLOT_STATE_WORKING && slot->state != SLOT_STATE_DONE) {
+            break;
+        }
+        if (slot->state == SLOT_STATE_WORKING && slot->tw_group_len > 0) {
+            BThreadWork_Free(&slot->tw);
+            o->num_works--;
+        }
+        num_drop++;
+    }
+    
+    ASSERT(o->num_works == 0)
+    
+    // packets are encoded in order, so the dropped ones are at the front
+    o->slots_start = (o->slots_start + num_drop) % o->window;
+    o->slots_used -= num_drop;
+    
+    // read ahead into the released slots
+    maybe_receive(o);
+}
+
+int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd, int window, int batch)
 {
     spproto_assert_security_params(sp_params);
     ASSERT(spproto_carrier_mtu_for_payload_mtu(sp_params, PacketRecvInterface_GetMTU(input)) >= 0)
@@ -250,12 +461,21 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
         ASSERT(otp_warning_count > 0)
         ASSERT(otp_warning_count <= sp_params.otp_num)
     }
+    ASSERT(window > 0)
+    ASSERT(batch > 0)
+    ASSERT(batch <= window)
+    ASSERT(batch <= BENCRYPTION_MAX_BATCH)
     
     // init arguments
     o->input = input;
     o->sp_params = sp_params;
     o->otp_warning_count = otp_warning_count;
     o->twd = twd;
+    o->window = window;
+    o->batch = batch;
+    
+    // allow enough works to cover the window
+    o->max_works = (o->window + o->batch - 1) / o->batch;
     
     // set no handlers
     o->handler = NULL;
@@ -283,6 +503,9 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
         o->have_encryption_key = 0;
     }
     
+    // start sequence numbers
+    o->seqnum = 0;
+    
     // remember input MTU
     o->input_mtu = PacketRecvInterface_GetMTU(o->input);
     
@@ -292,8 +515,8 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // init input
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
     
-    // have no input in buffer
-    o->in_len = -1;
+    // not receiving input
+    o->in_receiving = 0;
     
     // init output
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, pg);
@@ -301,24 +524,46 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // have no output available
     o->out_have = 0;
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail1;
+    // allocate slots
+    if (!(o->slots = (struct SPProtoEncoder_slot *)BAllocArray(o->window, sizeof(o->slots[0])))) {
+        goto fail1;
+    }
+    
+    // allocate output buffers; with a single slot, the output buffer is used
+    if (o->window > 1) {
+        if (!(o->out_bufs = (uint8_t *)BAllocArray(o->window, o->output_mtu))) {
+            goto fail2;
         }
     }
     
-    // init handler job
-    BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
+    // init slots
+    for (int i = 0; i < o->window; i++) {
+        struct SPProtoEncoder_slot *slot = &o->slots[i];
+        slot->o = o;
+        if (o->window > 1) {
+            slot->out = o->out_bufs + (size_t)i * o->output_mtu;
+        }
+        if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BRandomStream_Init(&slot->rng);
+        }
+    }
+    
+    // have no packets
+    o->slots_start = 0;
+    o->slots_used = 0;
     
     // have no work
-    o->tw_have = 0;
+    o->num_works = 0;
+    
+    // init handler job
+    BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail2:
+    BFree(o->slots);
 fail1:
     PacketRecvInterface_Free(&o->output);
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
@@ -333,26 +578,39 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
     DebugObject_Free(&o->d_obj);
     
     // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    for (int i = 0; i < o->slots_used; i++) {
+        struct SPProtoEncoder_slot *slot = get_slot(o, i);
+        if (slot->state == SLOT_STATE_WORKING && slot->tw_group_len > 0) {
+            BThreadWork_Free(&slot->tw);
+        }
+    }
+    
+    // free encryptors
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
+        free_encryptors(o);
+    }
+    
+    // free IV generators
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && !SPPROTO_HAVE_AEAD(o->sp_params)) {
+        for (int i = 0; i < o->window; i++) {
+            BRandomStream_Free(&o->slots[i].rng);
+        }
     }
     
     // free handler job
     BPending_Free(&o->handler_job);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free output buffers
+    if (o->window > 1) {
+        BFree(o->out_bufs);
     }
     
+    // free slots
+    BFree(o->slots);
+    
     // free output
     PacketRecvInterface_Free(&o->output);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
-    }
-    
     // free otp generator
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         OTPGenerator_Free(&o->otpgen);
@@ -372,15 +630,26 @@ void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
-    maybe_stop_work(o);
+    stop_work_and_drop(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
+    }
+    
+    // init encryptors, one per slot since AEAD contexts cannot be shared between threads
+    for (int i = 0; i < o->window; i++) {
+        BEncryption_Init(&o->slots[i].encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    }
+    
+    // start a new nonce sequence
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        BRandom_randomize(o->aead_nonce_prefix, SPPROTO_AEAD_NONCE_PREFIX_LEN);
+        o->aead_counter = 0;
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    // start a new sequence, which the receiver expects with the new key
+    o->seqnum = 0;
     
     // have encryption key
     o->have_encryption_key = 1;
@@ -395,11 +664,11 @@ void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
-    maybe_stop_work(o);
+    stop_work_and_drop(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free encryptors
+        free_encryptors(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -40,6 +40,7 @@
 #include <protocol/spproto.h>
 #include <base/DebugObject.h>
 #include <security/BEncryption.h>
+#include <security/BRandomStream.h>
 #include <security/OTPGenerator.h>
 #include <flow/PacketRecvInterface.h>
 #include <threadwork/BThreadWork.h>
@@ -52,11 +53,22 @@
  */
 typedef void (*SPProtoEncoder_handler) (void *user);
 
+struct SPProtoEncoder_slot;
+
 /**
  * Object which encodes packets according to SPProto.
  *
  * Input is with {@link PacketRecvInterface}.
  * Output is with {@link PacketRecvInterface}.
+ * 
+ * Input packets are received directly into the output buffer, after
+ * the space reserved for the SPProto header and the IV or nonce, and
+ * are encrypted in place.
+ *
+ * Up to window packets are read ahead from the input and encoded
+ * concurrently; they are output in the order they were received.
+ * When packets are queued, up to batch of them are encoded by a single
+ * thread work, with their encryption done in one batch.
  */
 typedef struct {
     PacketRecvInterface *input;
@@ -64,6 +76,9 @@ typedef struct {
     int otp_warning_count;
     SPProtoEncoder_handler handler;
     BThreadWorkDispatcher *twd;
+    int window;
+    int batch;
+    int max_works;
     void *user;
     int hash_size;
     int enc_block_size;
@@ -72,22 +87,39 @@ typedef struct {
     uint16_t otpgen_seed_id;
     uint16_t otpgen_pending_seed_id;
     int have_encryption_key;
-    BEncryption encryptor;
+    uint8_t aead_nonce_prefix[SPPROTO_AEAD_NONCE_PREFIX_LEN];
+    uint64_t aead_counter;
+    uint64_t seqnum;
     int input_mtu;
     int output_mtu;
-    int in_len;
     PacketRecvInterface output;
     int out_have;
     uint8_t *out;
-    uint8_t *buf;
+    uint8_t *out_bufs;
+    struct SPProtoEncoder_slot *slots;
+    int slots_start;
+    int slots_used;
+    int num_works;
+    int in_receiving;
     BPending handler_job;
-    int tw_have;
+    DebugObject d_obj;
+} SPProtoEncoder;
+
+struct SPProtoEncoder_slot {
+    SPProtoEncoder *o;
+    int state;
+    uint8_t *out;
+    int in_len;
+    BEncryption encryptor;
+    BRandomStream rng;
     BThreadWork tw;
+    int tw_group_len;
+    uint8_t tw_nonce[BENCRYPTION_AEAD_NONCE_SIZE];
     uint16_t tw_seed_id;
     otp_t tw_otp;
+    uint64_t tw_seqnum;
     int tw_out_len;
-    DebugObject d_obj;
-} SPProtoEncoder;
+};
 
 /**
  * Initializes the object.
@@ -103,9 +135,18 @@ typedef struct {
  *                          In this case, must be >0 and <=sp_params.otp_num.
  * @param pg pending group
  * @param twd thread work dispatcher
+ * @param window maximum number of packets being encoded at the same time. Must be >0.
+ *               With window=1, packets are received and encoded directly in the output
+ *               buffer, so they are written just once.
+ *               With window>1, packets are encoded in internal buffers and copied
+ *               to the output, which only pays off if twd is using threads.
+ * @param batch maximum number of packets encoded by a single thread work.
+ *              Must be >0, <=window and <=BENCRYPTION_MAX_BATCH. At most
+ *              ceil(window/batch) works are started at the same time, and packets
+ *              queued while they are busy are encoded together.
  * @return 1 on success, 0 on failure
  */
-int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd) WARN_UNUSED;
+int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd, int window, int batch) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -127,6 +168,8 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o);
 /**
  * Sets an encryption key to use.
  * Encryption must be enabled.
+ * Packets which were encoded with the previous key but not yet
+ * output are dropped.
  *
  * @param o the object
  * @param encryption_key key to use
@@ -136,6 +179,8 @@ void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key
 /**
  * Removes an encryption key if one is configured.
  * Encryption must be enabled.
+ * Packets which were encoded with the previous key but not yet
+ * output are dropped.
  *
  * @param o the object
  */
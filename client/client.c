@@ -94,6 +94,7 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int threads_cpu_affinity;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
     int ssl;
@@ -112,7 +113,10 @@ struct {
     int otp_mode;
     int otp_num;
     int otp_num_warn;
+    int replay_window;
     int fragmentation_latency;
+    int spproto_window;
+    int spproto_batch;
     int peer_ssl;
     int peer_tcp_socket_sndbuf;
     int send_buffer_size;
@@ -488,8 +492,9 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
-        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+    int twd_flags = (options.threads_cpu_affinity ? BTHREADWORK_INIT_CPU_AFFINITY : 0);
+    if (!BThreadWorkDispatcher_Init2(&twd, &ss, options.threads, twd_flags)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init2 failed");
         goto fail3;
     }
     
@@ -549,7 +554,10 @@ int main (int argc, char *argv[])
     num_peers = 0;
     
     // init frame decider
-    FrameDecider_Init(&frame_decider, options.max_macs, options.max_groups, options.igmp_group_membership_interval, options.igmp_last_member_query_time, &ss);
+    if (!FrameDecider_Init(&frame_decider, options.max_macs, options.max_groups, options.igmp_group_membership_interval, options.igmp_last_member_query_time, &ss)) {
+        BLog(BLOG_ERROR, "FrameDecider_Init failed");
+        goto fail11;
+    }
     
     // init relays list
     LinkedList1_Init(&relays);
@@ -562,7 +570,7 @@ int main (int argc, char *argv[])
                                server_handler_error, server_handler_ready, server_handler_newclient, server_handler_endclient, server_handler_message
     )) {
         BLog(BLOG_ERROR, "ServerConnection_Init failed");
-        goto fail11;
+        goto fail12;
     }
     
     // set server not ready
@@ -599,8 +607,9 @@ int main (int argc, char *argv[])
         PacketPassFairQueue_Free(&server_queue);
     }
     ServerConnection_Free(&server);
-fail11:
+fail12:
     FrameDecider_Free(&frame_decider);
+fail11:
     DPReceiveDevice_Free(&device_output_dprd);
 fail10:
     DataProtoSource_Free(&device_dpsource);
@@ -668,6 +677,7 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--threads-cpu-affinity]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
         "        [--ssl --nssdb <string> --client-cert-name <string>]\n"
@@ -682,10 +692,13 @@ void print_help (const char *name)
         "        ] ...\n"
         "        --transport-mode <udp/tcp>\n"
         "        (transport-mode=udp?\n"
-        "            --encryption-mode <blowfish/aes/none>\n"
+        "            --encryption-mode <blowfish/aes/aes-gcm/chacha20-poly1305/none>\n"
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
+        "            [--replay-window <num-packets>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
+        "            [--spproto-window <num-packets>]\n"
+        "            [--spproto-batch <num-packets>]\n"
         "        )\n"
         "        (transport-mode=tcp?\n"
         "            (ssl? [--peer-ssl])\n"
@@ -727,6 +740,7 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.threads_cpu_affinity = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
     options.ssl = 0;
@@ -741,7 +755,10 @@ int parse_arguments (int argc, char *argv[])
     options.encryption_mode = -1;
     options.hash_mode = -1;
     options.otp_mode = SPPROTO_OTP_MODE_NONE;
+    options.replay_window = SPPROTO_REPLAY_WINDOW_NONE;
     options.fragmentation_latency = PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY;
+    options.spproto_window = PEER_DEFAULT_UDP_SPPROTO_WINDOW;
+    options.spproto_batch = PEER_DEFAULT_UDP_SPPROTO_BATCH;
     options.peer_ssl = 0;
     options.peer_tcp_socket_sndbuf = -1;
     options.send_buffer_size = PEER_DEFAULT_SEND_BUFFER_SIZE;
@@ -754,6 +771,8 @@ int parse_arguments (int argc, char *argv[])
     options.max_peers = DEFAULT_MAX_PEERS;
     
     int have_fragmentation_latency = 0;
+    int have_spproto_window = 0;
+    int have_spproto_batch = 0;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -839,6 +858,9 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--threads-cpu-affinity")) {
+            options.threads_cpu_affinity = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
@@ -986,6 +1008,12 @@ int parse_arguments (int argc, char *argv[])
             else if (!strcmp(arg2, "aes")) {
                 options.encryption_mode = BENCRYPTION_CIPHER_AES;
             }
+            else if (!strcmp(arg2, "aes-gcm")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_AES_GCM;
+            }
+            else if (!strcmp(arg2, "chacha20-poly1305")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -1042,6 +1070,17 @@ int parse_arguments (int argc, char *argv[])
             }
             i += 3;
         }
+        else if (!strcmp(arg, "--replay-window")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.replay_window = atoi(argv[i + 1])) <= 0 || options.replay_window > REPLAYWINDOW_MAX_SIZE) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else if (!strcmp(arg, "--fragmentation-latency")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -1051,6 +1090,30 @@ int parse_arguments (int argc, char *argv[])
             have_fragmentation_latency = 1;
             i++;
         }
+        else if (!strcmp(arg, "--spproto-window")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.spproto_window = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            have_spproto_window = 1;
+            i++;
+        }
+        else if (!strcmp(arg, "--spproto-batch")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.spproto_batch = atoi(argv[i + 1])) <= 0 || options.spproto_batch > BENCRYPTION_MAX_BATCH) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            have_spproto_batch = 1;
+            i++;
+        }
         else if (!strcmp(arg, "--peer-ssl")) {
             options.peer_ssl = 1;
         }
@@ -1185,16 +1248,46 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!(options.encryption_mode > 0 && BEncryption_cipher_is_aead(options.encryption_mode)) || options.hash_mode == SPPROTO_HASH_MODE_NONE)) {
+        fprintf(stderr, "False: --encryption-mode <aes-gcm/chacha20-poly1305> => --hash-mode none\n");
+        return 0;
+    }
+    
     if (!(!(options.otp_mode != SPPROTO_OTP_MODE_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --otp => UDP\n");
         return 0;
     }
     
+    if (!(!(options.replay_window != SPPROTO_REPLAY_WINDOW_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --replay-window => UDP\n");
+        return 0;
+    }
+    
+    if (!(!(options.replay_window != SPPROTO_REPLAY_WINDOW_NONE) || (options.encryption_mode > 0 && (BEncryption_cipher_is_aead(options.encryption_mode) || options.hash_mode > 0)))) {
+        fprintf(stderr, "False: --replay-window => (--encryption-mode <aes-gcm/chacha20-poly1305> || (--encryption-mode && --hash-mode))\n");
+        return 0;
+    }
+    
     if (!(!have_fragmentation_latency || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --fragmentation-latency => UDP\n");
         return 0;
     }
     
+    if (!(!have_spproto_window || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --spproto-window => UDP\n");
+        return 0;
+    }
+    
+    if (!(!have_spproto_batch || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --spproto-batch => UDP\n");
+        return 0;
+    }
+    
+    if (!(options.spproto_batch <= options.spproto_window)) {
+        fprintf(stderr, "False: --spproto-batch <= --spproto-window\n");
+        return 0;
+    }
+    
     if (!(!options.peer_ssl || (options.ssl && options.transport_mode == TRANSPORT_MODE_TCP))) {
         fprintf(stderr, "False: --peer-ssl => (--ssl && TCP)\n");
         return 0;
@@ -1297,6 +1390,7 @@ int process_arguments (void)
         if (options.otp_mode > 0) {
             sp_params.otp_num = options.otp_num;
         }
+        sp_params.replay_window = options.replay_window;
     }
     
     return 1;
@@ -1622,7 +1716,7 @@ int peer_init_link (struct peer_data *peer)
         if (!DatagramPeerIO_Init(
             &peer->pio.udp.pio, &ss, data_mtu, CLIENT_UDP_MTU, sp_params,
             options.fragmentation_latency, PEER_UDP_ASSEMBLER_NUM_FRAMES, recv_if,
-            options.otp_num_warn, &twd, peer,
+            options.otp_num_warn, &twd, options.spproto_window, options.spproto_batch, peer,
             (BLog_logfunc)peer_logfunc,
             (DatagramPeerIO_handler_error)peer_udp_pio_handler_error,
             (DatagramPeerIO_handler_otp_warning)peer_udp_pio_handler_seed_warning,
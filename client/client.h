@@ -65,6 +65,10 @@
 #define PEER_DEFAULT_MAX_GROUPS 16
 // how long we wait for a packet to reach full size before sending it (see FragmentProtoDisassembler latency argument)
 #define PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY 0
+// how many packets per peer to encrypt/decrypt at the same time (see SPProtoEncoder window argument)
+#define PEER_DEFAULT_UDP_SPPROTO_WINDOW 1
+// how many queued packets to encrypt/decrypt in one batch (see SPProtoEncoder batch argument)
+#define PEER_DEFAULT_UDP_SPPROTO_BATCH 1
 // value related to how much out-of-order input we tolerate (see FragmentProtoAssembler num_frames argument)
 #define PEER_UDP_ASSEMBLER_NUM_FRAMES 4
 // socket send buffer (SO_SNDBUF) for peer TCP connections, <=0 to not set
@@ -0,0 +1,290 @@
+/**
+ * @file FragmentProtoStream.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Generates FragmentProto packet streams for testing and benchmarking
+ * {@link FragmentProtoAssembler}, and reorders, drops and duplicates their
+ * packets. Frames are numbered with sequence numbers, and their length and
+ * contents are a function of the sequence number, so a receiver can check
+ * any frame it gets with {@link FragmentProtoStream_CheckFrame}.
+ */
+
+#ifndef _FRAGMENTPROTOSTREAM_H
+#define _FRAGMENTPROTOSTREAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <protocol/fragmentproto.h>
+
+#define FRAGMENTPROTOSTREAM_MIN_FRAME_LEN 4
+
+typedef struct {
+    int min_frame_len;
+    int max_frame_len;
+    int carrier_mtu;
+    int num_frames;
+    uint8_t *data;
+    int *packet_offsets;
+    int num_packets;
+    int *schedule;
+    int schedule_len;
+} FragmentProtoStream;
+
+static uint32_t _FragmentProtoStream_hash (uint32_t x)
+{
+    x ^= x >> 16;
+    x *= UINT32_C(0x7feb352d);
+    x ^= x >> 15;
+    x *= UINT32_C(0x846ca68b);
+    x ^= x >> 16;
+    return x;
+}
+
+static int FragmentProtoStream_FrameLen (FragmentProtoStream *o, uint32_t seq)
+{
+    return o->min_frame_len + _FragmentProtoStream_hash(seq) % (uint32_t)(o->max_frame_len - o->min_frame_len + 1);
+}
+
+static void _FragmentProtoStream_frame_data (uint32_t seq, int len, uint8_t *out)
+{
+    ASSERT(len >= FRAGMENTPROTOSTREAM_MIN_FRAME_LEN)
+    
+    uint32_t seq_le = htol32(seq);
+    memcpy(out, &seq_le, sizeof(seq_le));
+    
+    uint32_t x = _FragmentProtoStream_hash(seq ^ UINT32_C(0xa5a5a5a5));
+    for (int i = sizeof(seq_le); i < len; i++) {
+        out[i] = x >> 24;
+        x = x * 1103515245 + 12345;
+    }
+}
+
+/**
+ * Checks that a frame is one generated by the stream.
+ * 
+ * @return the frame's sequence number, or -1 if the frame is wrong
+ */
+static int FragmentProtoStream_CheckFrame (FragmentProtoStream *o, const uint8_t *data, int len)
+{
+    if (len < FRAGMENTPROTOSTREAM_MIN_FRAME_LEN) {
+        return -1;
+    }
+    
+    uint32_t seq_le;
+    memcpy(&seq_le, data, sizeof(seq_le));
+    uint32_t seq = ltoh32(seq_le);
+    
+    if (seq >= (uint32_t)o->num_frames || len != FragmentProtoStream_FrameLen(o, seq)) {
+        return -1;
+    }
+    
+    uint8_t expected[UINT16_MAX];
+    _FragmentProtoStream_frame_data(seq, len, expected);
+    if (memcmp(data, expected, len)) {
+        return -1;
+    }
+    
+    return seq;
+}
+
+/**
+ * Generates a stream as {@link FragmentProtoDisassembler} would, packing chunks
+ * of consecutive frames into packets. Packets are sometimes sent before they are
+ * full, at frame boundaries, as the disassembler does when its latency expires.
+ * The schedule is initialized to send every packet once, in order.
+ * 
+ * @param min_frame_len minimum frame length. Must be >=FRAGMENTPROTOSTREAM_MIN_FRAME_LEN.
+ * @param max_frame_len maximum frame length. Must be >=min_frame_len and <=UINT16_MAX.
+ * @param carrier_mtu maximum packet length. Must be >sizeof(struct fragmentproto_chunk_header).
+ * @return 1 on success, 0 on failure
+ */
+static int FragmentProtoStream_Init (FragmentProtoStream *o, int num_frames, int min_frame_len, int max_frame_len, int carrier_mtu)
+{
+    ASSERT(num_frames >= 0)
+    ASSERT(min_frame_len >= FRAGMENTPROTOSTREAM_MIN_FRAME_LEN)
+    ASSERT(max_frame_len >= min_frame_len)
+    ASSERT(max_frame_len <= UINT16_MAX)
+    ASSERT(carrier_mtu > (int)sizeof(struct fragmentproto_chunk_header))
+    
+    o->min_frame_len = min_frame_len;
+    o->max_frame_len = max_frame_len;
+    o->carrier_mtu = carrier_mtu;
+    o->num_frames = num_frames;
+    
+    // compute an upper bound on the number of packets
+    size_t max_packets = 1;
+    for (int i = 0; i < num_frames; i++) {
+        max_packets += fragmentproto_max_chunks_for_frame(carrier_mtu, FragmentProtoStream_FrameLen(o, i));
+    }
+    
+    if (!(o->data = (uint8_t *)BAllocArray(max_packets, carrier_mtu))) {
+        goto fail0;
+    }
+    if (!(o->packet_offsets = (int *)BAllocArray(max_packets + 1, sizeof(o->packet_offsets[0])))) {
+        goto fail1;
+    }
+    if (!(o->schedule = (int *)BAllocArray(max_packets, sizeof(o->schedule[0])))) {
+        goto fail2;
+    }
+    
+    uint8_t frame[UINT16_MAX];
+    int pos = 0;
+    int packet_start = 0;
+    o->num_packets = 0;
+    
+    for (int i = 0; i < num_frames; i++) {
+        int frame_len = FragmentProtoStream_FrameLen(o, i);
+        _FragmentProtoStream_frame_data(i, frame_len, frame);
+        
+        int frame_pos = 0;
+        while (frame_pos < frame_len) {
+            // start a new packet if there is no room for a chunk with data
+            if (carrier_mtu - (pos - packet_start) <= (int)sizeof(struct fragmentproto_chunk_header)) {
+                o->packet_offsets[o->num_packets++] = packet_start;
+                packet_start = pos;
+            }
+            
+            int chunk_len = bmin_int(frame_len - frame_pos, carrier_mtu - (pos - packet_start) - sizeof(struct fragmentproto_chunk_header));
+            
+            struct fragmentproto_chunk_header header;
+            header.frame_id = htol16((fragmentproto_frameid)i);
+            header.chunk_start = htol16(frame_pos);
+            header.chunk_len = htol16(chunk_len);
+            header.is_last = htol8(frame_pos + chunk_len == frame_len);
+            memcpy(o->data + pos, &header, sizeof(header));
+            pos += sizeof(header);
+            
+            memcpy(o->data + pos, frame + frame_pos, chunk_len);
+            pos += chunk_len;
+            frame_pos += chunk_len;
+        }
+        
+        // sometimes send the packet early
+        if (pos > packet_start && rand() % 4 == 0) {
+            o->packet_offsets[o->num_packets++] = packet_start;
+            packet_start = pos;
+        }
+    }
+    
+    if (pos > packet_start) {
+        o->packet_offsets[o->num_packets++] = packet_start;
+    }
+    o->packet_offsets[o->num_packets] = pos;
+    ASSERT(o->num_packets <= max_packets)
+    
+    // schedule all packets in order
+    for (int i = 0; i < o->num_packets; i++) {
+        o->schedule[i] = i;
+    }
+    o->schedule_len = o->num_packets;
+    
+    return 1;
+    
+fail2:
+    BFree(o->packet_offsets);
+fail1:
+    BFree(o->data);
+fail0:
+    return 0;
+}
+
+static void FragmentProtoStream_Free (FragmentProtoStream *o)
+{
+    BFree(o->schedule);
+    BFree(o->packet_offsets);
+    BFree(o->data);
+}
+
+/**
+ * Shuffles the schedule within consecutive blocks of reorder+1 packets,
+ * so that it can be put back in order with a buffer of reorder packets.
+ * 
+ * @param reorder degree of reordering. Must be >=0.
+ */
+static void FragmentProtoStream_Reorder (FragmentProtoStream *o, int reorder)
+{
+    ASSERT(reorder >= 0)
+    
+    for (int start = 0; start < o->schedule_len; start += reorder + 1) {
+        int count = bmin_int(reorder + 1, o->schedule_len - start);
+        for (int i = count - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            int tmp = o->schedule[start + i];
+            o->schedule[start + i] = o->schedule[start + j];
+            o->schedule[start + j] = tmp;
+        }
+    }
+}
+
+/**
+ * Drops packets from the schedule, and duplicates some into the place
+ * of dropped ones.
+ * 
+ * @param loss_permille how many of 1000 packets to drop
+ * @param dup_permille how many of 1000 dropped packets to replace with a
+ *                     copy of a nearby earlier packet instead
+ */
+static void FragmentProtoStream_Lose (FragmentProtoStream *o, int loss_permille, int dup_permille)
+{
+    int out = 0;
+    for (int i = 0; i < o->schedule_len; i++) {
+        if (rand() % 1000 >= loss_permille) {
+            o->schedule[out++] = o->schedule[i];
+        }
+        else if (out > 0 && rand() % 1000 < dup_permille) {
+            o->schedule[out] = o->schedule[out - 1 - rand() % bmin_int(out, 8)];
+            out++;
+        }
+    }
+    o->schedule_len = out;
+}
+
+static uint8_t * FragmentProtoStream_PacketData (FragmentProtoStream *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_packets)
+    
+    return o->data + o->packet_offsets[i];
+}
+
+static int FragmentProtoStream_PacketLen (FragmentProtoStream *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_packets)
+    
+    return o->packet_offsets[i + 1] - o->packet_offsets[i];
+}
+
+#endif
@@ -32,17 +32,23 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <time.h>
 
 #include <misc/balloc.h>
+#include <misc/balign.h>
 #include <security/BRandom.h>
 #include <security/BEncryption.h>
+#include <security/BHash.h>
 #include <base/DebugObject.h>
 
 static void usage (char *name)
 {
     printf(
-        "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops>\n"
-        "    <cipher> is one of (blowfish, aes).\n",
+        "Usage: %s <enc/dec> <ciper> <unit_size> <num_ops> [<hash>]\n"
+        "    <cipher> is one of (blowfish, aes, aes-gcm, chacha20-poly1305).\n"
+        "    <unit_size> is rounded down to the cipher block size.\n"
+        "    <hash> is one of (none, md5, sha1), for blowfish and aes only.\n"
+        "    With a hash, each operation also hashes the unit, like SPProto does.\n",
         name
     );
     
@@ -55,16 +61,18 @@ int main (int argc, char **argv)
         return 1;
     }
     
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         usage(argv[0]);
     }
     
     char *mode_str = argv[1];
     char *cipher_str = argv[2];
+    char *hash_str = (argc > 5 ? argv[5] : "none");
     
     int mode;
     int cipher = 0; // silence warning
-    int num_blocks = atoi(argv[3]);
+    int hash = 0;
+    int unit_size = atoi(argv[3]);
     int num_ops = atoi(argv[4]);
     
     if (!strcmp(mode_str, "enc")) {
@@ -83,11 +91,27 @@ int main (int argc, char **argv)
     else if (!strcmp(cipher_str, "aes")) {
         cipher = BENCRYPTION_CIPHER_AES;
     }
+    else if (!strcmp(cipher_str, "aes-gcm")) {
+        cipher = BENCRYPTION_CIPHER_AES_GCM;
+    }
+    else if (!strcmp(cipher_str, "chacha20-poly1305")) {
+        cipher = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+    }
     else {
         usage(argv[0]);
     }
     
-    if (num_blocks < 0 || num_ops < 0) {
+    if (!strcmp(hash_str, "md5")) {
+        hash = BHASH_TYPE_MD5;
+    }
+    else if (!strcmp(hash_str, "sha1")) {
+        hash = BHASH_TYPE_SHA1;
+    }
+    else if (strcmp(hash_str, "none")) {
+        usage(argv[0]);
+    }
+    
+    if (unit_size < 0 || num_ops < 0 || (hash && BEncryption_cipher_is_aead(cipher))) {
         usage(argv[0]);
     }
     
@@ -100,11 +124,12 @@ int main (int argc, char **argv)
     uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
     BRandom_randomize(iv, block_size);
     
-    if (num_blocks > INT_MAX / block_size) {
-        printf("too much");
-        goto fail0;
-    }
-    int unit_size = num_blocks * block_size;
+    uint8_t nonce[BENCRYPTION_AEAD_NONCE_SIZE];
+    BRandom_randomize(nonce, sizeof(nonce));
+    
+    uint8_t tag[BENCRYPTION_AEAD_TAG_SIZE];
+    
+    unit_size = balign_down(unit_size, block_size);
     
     printf("unit size %d\n", unit_size);
     
@@ -121,20 +146,55 @@ int main (int argc, char **argv)
     }
     
     BEncryption enc;
-    BEncryption_Init(&enc, mode, cipher, key);
+    BEncryption_Init(&enc, mode | BENCRYPTION_MODE_ENCRYPT, cipher, key);
     
     uint8_t *in = buf1;
     uint8_t *out = buf2;
     BRandom_randomize(in, unit_size);
     
+    // for AEAD decryption, we need a valid tag
+    if (BEncryption_cipher_is_aead(cipher) && mode == BENCRYPTION_MODE_DECRYPT) {
+        BEncryption_Seal(&enc, nonce, in, in, unit_size, tag);
+    }
+    
+    clock_t start = clock();
+    
     for (int i = 0; i < num_ops; i++) {
-        BEncryption_Encrypt(&enc, in, out, unit_size, iv);
+        if (BEncryption_cipher_is_aead(cipher)) {
+            if (mode == BENCRYPTION_MODE_ENCRYPT) {
+                BEncryption_Seal(&enc, nonce, in, out, unit_size, tag);
+            } else {
+                if (!BEncryption_Open(&enc, nonce, in, out, unit_size, tag)) {
+                    printf("verification failed\n");
+                    goto fail2;
+                }
+            }
+            continue;
+        }
+        
+        uint8_t hash_out[BHASH_MAX_SIZE];
+        
+        if (mode == BENCRYPTION_MODE_ENCRYPT) {
+            if (hash) {
+                BHash_calculate(hash, in, unit_size, hash_out);
+            }
+            BEncryption_Encrypt(&enc, in, out, unit_size, iv);
+        } else {
+            BEncryption_Decrypt(&enc, in, out, unit_size, iv);
+            if (hash) {
+                BHash_calculate(hash, out, unit_size, hash_out);
+            }
+        }
         
         uint8_t *t = in;
         in = out;
         out = t;
     }
     
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%d ops in %.3f s, %.1f MB/s\n", num_ops, secs, (secs > 0 ? (double)unit_size * num_ops / secs / 1000000 : 0.0));
+    
+fail2:
     BEncryption_Free(&enc);
     BFree(buf2);
 fail1:
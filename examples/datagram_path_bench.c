@@ -0,0 +1,371 @@
+/**
+ * @file datagram_path_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Benchmark for the datagram path of the VPN client. Frames are passed
+ * through the same chain of objects as in DatagramPeerIO, with the socket
+ * replaced by a SinglePacketBuffer feeding the encoded packets straight
+ * into the decoding side:
+ * 
+ * FragmentProtoDisassembler -> SPProtoEncoder -> SinglePacketBuffer ->
+ * SPProtoDecoder -> FragmentProtoAssembler -> sink
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <protocol/spproto.h>
+#include <protocol/fragmentproto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <security/BSecurity.h>
+#include <security/BRandom.h>
+#include <security/BEncryption.h>
+#include <security/BHash.h>
+#include <threadwork/BThreadWork.h>
+#include <flow/SinglePacketBuffer.h>
+#include <client/FragmentProtoDisassembler.h>
+#include <client/FragmentProtoAssembler.h>
+#include <client/SPProtoEncoder.h>
+#include <client/SPProtoDecoder.h>
+
+#define SOCKET_MTU 1472
+#define ASSEMBLER_NUM_FRAMES 4
+#define OTP_CIPHER BENCRYPTION_CIPHER_AES
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+struct spproto_security_params sp_params;
+FragmentProtoDisassembler disassembler;
+SPProtoEncoder encoder;
+SinglePacketBuffer buffer;
+SPProtoDecoder decoder;
+FragmentProtoAssembler assembler;
+PacketPassInterface sink;
+uint8_t *frame;
+int frame_size;
+int num_frames;
+int num_sent;
+int num_received;
+int started;
+btime_t start_time;
+uint16_t otp_seed_id;
+uint8_t otp_key[BENCRYPTION_MAX_KEY_SIZE];
+uint8_t otp_iv[BENCRYPTION_MAX_BLOCK_SIZE];
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <cipher> <hash> <replay> <frame_size> <num_frames> [<window> <batch> <threads>]\n"
+        "    <cipher> is one of (none, blowfish, aes, aes-gcm, chacha20-poly1305).\n"
+        "    <hash> is one of (none, md5, sha1), and must be none with AEAD ciphers.\n"
+        "    <replay> is one of (none, otp:<num>, window:<size>), for OTPs with num\n"
+        "    OTPs per seed, or sequence numbers with a replay window of size. A replay\n"
+        "    window needs an AEAD cipher, or a block cipher with a hash.\n"
+        "    <window> and <batch> are the SPProto window and batch (default 1).\n"
+        "    <threads> is the number of worker threads (default 0).\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void logfunc (void *user)
+{
+    BLog_Append("bench: ");
+}
+
+static void send_frame (void)
+{
+    ASSERT(num_sent < num_frames)
+    
+    // number the frame so the sink can check ordering
+    uint32_t seq = hton32(num_sent);
+    memcpy(frame, &seq, sizeof(seq));
+    num_sent++;
+    
+    PacketPassInterface_Sender_Send(FragmentProtoDisassembler_GetInput(&disassembler), frame, frame_size);
+}
+
+static void source_handler_done (void *user)
+{
+    if (num_sent < num_frames) {
+        send_frame();
+    }
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    // check frame
+    uint32_t seq = hton32(num_received);
+    if (data_len != frame_size || memcmp(data, &seq, sizeof(seq)) || memcmp(data + sizeof(seq), frame + sizeof(seq), frame_size - sizeof(seq))) {
+        printf("frame %d is wrong\n", num_received);
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    PacketPassInterface_Done(&sink);
+    
+    if (++num_received == num_frames) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void add_otp_seed (void)
+{
+    // give a new seed to the decoder; the encoder gets it once the
+    // decoder is ready to check its OTPs, like with peers
+    otp_seed_id++;
+    BRandom_randomize(otp_key, BEncryption_cipher_key_size(OTP_CIPHER));
+    BRandom_randomize(otp_iv, BEncryption_cipher_block_size(OTP_CIPHER));
+    SPProtoDecoder_AddOTPSeed(&decoder, otp_seed_id, otp_key, otp_iv);
+}
+
+static void encoder_handler_otp_warning (void *user)
+{
+    add_otp_seed();
+}
+
+static void decoder_handler_otp_ready (void *user)
+{
+    if (SPPROTO_HAVE_OTP(sp_params)) {
+        SPProtoEncoder_SetOTPSeed(&encoder, otp_seed_id, otp_key, otp_iv);
+    }
+    
+    if (!started) {
+        started = 1;
+        start_time = btime_gettime();
+        send_frame();
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 6 && argc != 9) {
+        usage(argv[0]);
+    }
+    
+    char *cipher_str = argv[1];
+    char *hash_str = argv[2];
+    char *replay_str = argv[3];
+    frame_size = atoi(argv[4]);
+    num_frames = atoi(argv[5]);
+    int window = (argc > 6 ? atoi(argv[6]) : 1);
+    int batch = (argc > 6 ? atoi(argv[7]) : 1);
+    int threads = (argc > 6 ? atoi(argv[8]) : 0);
+    
+    sp_params.hash_mode = SPPROTO_HASH_MODE_NONE;
+    sp_params.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+    sp_params.otp_mode = SPPROTO_OTP_MODE_NONE;
+    sp_params.otp_num = 0;
+    
+    if (!strcmp(cipher_str, "blowfish")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_BLOWFISH;
+    }
+    else if (!strcmp(cipher_str, "aes")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_AES;
+    }
+    else if (!strcmp(cipher_str, "aes-gcm")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_AES_GCM;
+    }
+    else if (!strcmp(cipher_str, "chacha20-poly1305")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+    }
+    else if (strcmp(cipher_str, "none")) {
+        usage(argv[0]);
+    }
+    
+    if (!strcmp(hash_str, "md5")) {
+        sp_params.hash_mode = BHASH_TYPE_MD5;
+    }
+    else if (!strcmp(hash_str, "sha1")) {
+        sp_params.hash_mode = BHASH_TYPE_SHA1;
+    }
+    else if (strcmp(hash_str, "none")) {
+        usage(argv[0]);
+    }
+    
+    sp_params.replay_window = SPPROTO_REPLAY_WINDOW_NONE;
+    
+    int otps = 0;
+    int replay_window = 0;
+    if (sscanf(replay_str, "otp:%d", &otps) == 1) {
+        if (otps <= 0) {
+            usage(argv[0]);
+        }
+        sp_params.otp_mode = OTP_CIPHER;
+        sp_params.otp_num = otps;
+    }
+    else if (sscanf(replay_str, "window:%d", &replay_window) == 1) {
+        if (replay_window <= 0 || replay_window > REPLAYWINDOW_MAX_SIZE) {
+            usage(argv[0]);
+        }
+        sp_params.replay_window = replay_window;
+    }
+    else if (strcmp(replay_str, "none")) {
+        usage(argv[0]);
+    }
+    
+    if (frame_size < (int)sizeof(uint32_t) || frame_size > UINT16_MAX || num_frames <= 0 ||
+        window <= 0 || batch <= 0 || batch > window || batch > BENCRYPTION_MAX_BATCH ||
+        (SPPROTO_HAVE_AEAD(sp_params) && SPPROTO_HAVE_HASH(sp_params)) ||
+        (SPPROTO_HAVE_SEQNUM(sp_params) && !SPPROTO_HAVE_AUTHENTICATION(sp_params))
+    ) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (threads > 0 && !BSecurity_GlobalInitThreadSafe()) {
+        DEBUG("BSecurity_GlobalInitThreadSafe failed");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail1;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, threads)) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail2;
+    }
+    
+    int spproto_payload_mtu = spproto_payload_mtu_for_carrier_mtu(sp_params, SOCKET_MTU);
+    if (spproto_payload_mtu <= (int)sizeof(struct fragmentproto_chunk_header)) {
+        DEBUG("socket MTU is too small");
+        goto fail3;
+    }
+    
+    if (!(frame = (uint8_t *)BAlloc(frame_size))) {
+        DEBUG("BAlloc failed");
+        goto fail3;
+    }
+    BRandom_randomize(frame, frame_size);
+    
+    // init receiving side
+    PacketPassInterface_Init(&sink, frame_size, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    if (!FragmentProtoAssembler_Init(&assembler, spproto_payload_mtu, &sink, ASSEMBLER_NUM_FRAMES, fragmentproto_max_chunks_for_frame(spproto_payload_mtu, frame_size),
+                                     BReactor_PendingGroup(&reactor), NULL, logfunc
+    )) {
+        DEBUG("FragmentProtoAssembler_Init failed");
+        goto fail4;
+    }
+    
+    if (!SPProtoDecoder_Init(&decoder, FragmentProtoAssembler_GetInput(&assembler), sp_params, 2, BReactor_PendingGroup(&reactor), &twd, window, batch, NULL, logfunc)) {
+        DEBUG("SPProtoDecoder_Init failed");
+        goto fail5;
+    }
+    SPProtoDecoder_SetHandlers(&decoder, decoder_handler_otp_ready, NULL);
+    
+    // init sending side
+    FragmentProtoDisassembler_Init(&disassembler, &reactor, frame_size, spproto_payload_mtu, -1, -1);
+    PacketPassInterface_Sender_Init(FragmentProtoDisassembler_GetInput(&disassembler), source_handler_done, NULL);
+    
+    if (!SPProtoEncoder_Init(&encoder, FragmentProtoDisassembler_GetOutput(&disassembler), sp_params, (otps + 1) / 2, BReactor_PendingGroup(&reactor), &twd, window, batch)) {
+        DEBUG("SPProtoEncoder_Init failed");
+        goto fail6;
+    }
+    SPProtoEncoder_SetHandlers(&encoder, encoder_handler_otp_warning, NULL);
+    
+    // connect the sides
+    if (!SinglePacketBuffer_Init(&buffer, SPProtoEncoder_GetOutput(&encoder), SPProtoDecoder_GetInput(&decoder), BReactor_PendingGroup(&reactor))) {
+        DEBUG("SinglePacketBuffer_Init failed");
+        goto fail7;
+    }
+    
+    // set keys
+    if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+        BRandom_randomize(key, BEncryption_cipher_key_size(sp_params.encryption_mode));
+        SPProtoEncoder_SetEncryptionKey(&encoder, key);
+        SPProtoDecoder_SetEncryptionKey(&decoder, key);
+    }
+    
+    // start sending, once OTPs are ready if used
+    otp_seed_id = 0;
+    num_sent = 0;
+    num_received = 0;
+    started = 0;
+    if (SPPROTO_HAVE_OTP(sp_params)) {
+        add_otp_seed();
+    } else {
+        decoder_handler_otp_ready(NULL);
+    }
+    
+    if (BReactor_Exec(&reactor)) {
+        goto fail8;
+    }
+    
+    btime_t time = btime_gettime() - start_time;
+    printf("%d frames of %d bytes in %d ms, %.1f Mbit/s\n", num_frames, frame_size, (int)time,
+           (time > 0 ? (double)num_frames * frame_size * 8 / time / 1000 : 0.0));
+    
+    ret = 0;
+
+fail8:
+    SinglePacketBuffer_Free(&buffer);
+fail7:
+    SPProtoEncoder_Free(&encoder);
+fail6:
+    FragmentProtoDisassembler_Free(&disassembler);
+    SPProtoDecoder_Free(&decoder);
+fail5:
+    FragmentProtoAssembler_Free(&assembler);
+fail4:
+    PacketPassInterface_Free(&sink);
+    BFree(frame);
+fail3:
+    BThreadWorkDispatcher_Free(&twd);
+fail2:
+    BReactor_Free(&reactor);
+fail1:
+    if (threads > 0) {
+        BSecurity_GlobalFreeThreadSafe();
+    }
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file fragmentproto_assembler_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures the cost of reassembling frames in {@link FragmentProtoAssembler}.
+ * A FragmentProto stream is generated in advance, its packets are reordered
+ * and some are lost, and it is then fed to the assembler a number of times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <client/FragmentProtoAssembler.h>
+
+#include "FragmentProtoStream.h"
+
+static PacketPassInterface sink;
+static uint64_t num_frames_out;
+static uint64_t num_bytes_out;
+static int input_done;
+
+static void logfunc (void *user)
+{
+    BLog_Append("bench: ");
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    num_frames_out++;
+    num_bytes_out += data_len;
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void input_handler_done (void *user)
+{
+    input_done = 1;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 8) {
+        fprintf(stderr, "Usage: %s <carrier_mtu> <min_frame_len> <max_frame_len> <num_frames> <reorder> <loss_permille> <rounds>\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    int carrier_mtu = atoi(argv[1]);
+    int min_frame_len = atoi(argv[2]);
+    int max_frame_len = atoi(argv[3]);
+    int num_frames = atoi(argv[4]);
+    int reorder = atoi(argv[5]);
+    int loss_permille = atoi(argv[6]);
+    int rounds = atoi(argv[7]);
+    
+    if (carrier_mtu <= (int)sizeof(struct fragmentproto_chunk_header) || min_frame_len < FRAGMENTPROTOSTREAM_MIN_FRAME_LEN ||
+        max_frame_len < min_frame_len || max_frame_len > UINT16_MAX || num_frames < 0 || reorder < 0 || loss_permille < 0 || rounds < 0
+    ) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FragmentProtoAssembler, BLOG_NOTICE);
+    
+    BTime_Init();
+    
+    BPendingGroup pg;
+    BPendingGroup_Init(&pg);
+    
+    srand(1);
+    
+    FragmentProtoStream stream;
+    if (!FragmentProtoStream_Init(&stream, num_frames, min_frame_len, max_frame_len, carrier_mtu)) {
+        DEBUG("FragmentProtoStream_Init failed");
+        goto fail0;
+    }
+    FragmentProtoStream_Reorder(&stream, reorder);
+    FragmentProtoStream_Lose(&stream, loss_permille, 0);
+    
+    PacketPassInterface_Init(&sink, max_frame_len, sink_handler_send, NULL, &pg);
+    
+    // frames time out after this many packets; see fragmentproto_assembler_test
+    int num_assembler_frames = 2 * reorder + 3;
+    
+    FragmentProtoAssembler assembler;
+    if (!FragmentProtoAssembler_Init(&assembler, carrier_mtu, &sink, num_assembler_frames, fragmentproto_max_chunks_for_frame(carrier_mtu, max_frame_len), &pg, NULL, logfunc)) {
+        DEBUG("FragmentProtoAssembler_Init failed");
+        goto fail1;
+    }
+    PacketPassInterface *input = FragmentProtoAssembler_GetInput(&assembler);
+    PacketPassInterface_Sender_Init(input, input_handler_done, NULL);
+    
+    btime_t start_time = btime_gettime();
+    
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < stream.schedule_len; i++) {
+            int p = stream.schedule[i];
+            
+            input_done = 0;
+            PacketPassInterface_Sender_Send(input, FragmentProtoStream_PacketData(&stream, p), FragmentProtoStream_PacketLen(&stream, p));
+            while (!input_done) {
+                BPendingGroup_ExecuteJob(&pg);
+            }
+        }
+    }
+    
+    btime_t time = btime_gettime() - start_time;
+    uint64_t num_packets = (uint64_t)rounds * stream.schedule_len;
+    printf("%llu packets in %d ms, %.1f ns/packet, %llu of %llu frames out, %.1f Mbit/s\n",
+           (unsigned long long)num_packets, (int)time, (num_packets > 0 ? (double)time * 1000000 / num_packets : 0.0),
+           (unsigned long long)num_frames_out, (unsigned long long)rounds * num_frames,
+           (time > 0 ? (double)num_bytes_out * 8 / time / 1000 : 0.0));
+    
+    ret = 0;
+    
+    FragmentProtoAssembler_Free(&assembler);
+fail1:
+    PacketPassInterface_Free(&sink);
+    FragmentProtoStream_Free(&stream);
+fail0:
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file fragmentproto_assembler_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Randomized test of {@link FragmentProtoAssembler}. Each round generates a
+ * FragmentProto stream with random frame sizes and MTUs, and feeds it to an
+ * assembler with one of these kinds of damage:
+ *   - packets reordered within the assembler's tolerance; all frames must
+ *     come out exactly once,
+ *   - packets also lost and duplicated; frames which come out must be intact,
+ *   - packet bytes also corrupted; frames which come out must fit the MTU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <flow/PacketPassInterface.h>
+#include <client/FragmentProtoAssembler.h>
+
+#include "FragmentProtoStream.h"
+
+#define DAMAGE_REORDER 0
+#define DAMAGE_LOSS 1
+#define DAMAGE_CORRUPT 2
+
+static FragmentProtoStream stream;
+static int damage;
+static int frame_mtu;
+static PacketPassInterface sink;
+static int *delivered;
+static int input_done;
+
+static void logfunc (void *user)
+{
+    BLog_Append("test: ");
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    ASSERT_FORCE(data_len >= 0)
+    ASSERT_FORCE(data_len <= frame_mtu)
+    
+    if (damage != DAMAGE_CORRUPT) {
+        int seq = FragmentProtoStream_CheckFrame(&stream, data, data_len);
+        ASSERT_FORCE(seq >= 0)
+        delivered[seq]++;
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void input_handler_done (void *user)
+{
+    input_done = 1;
+}
+
+static void run_round (BPendingGroup *pg)
+{
+    damage = rand() % 3;
+    int carrier_mtu = sizeof(struct fragmentproto_chunk_header) + 1 + rand() % 1500;
+    int min_frame_len = FRAGMENTPROTOSTREAM_MIN_FRAME_LEN + rand() % 100;
+    int max_frame_len_range = (rand() % 4 ? 1500 : UINT16_MAX - min_frame_len + 1);
+    int max_frame_len = min_frame_len + rand() % max_frame_len_range;
+    int num_frames = 1 + rand() % (max_frame_len > 4000 ? 200 : 5000);
+    int reorder_range = (rand() % 2 ? 4 : 64);
+    int reorder = rand() % reorder_range;
+    
+    frame_mtu = max_frame_len;
+    int num_chunks = fragmentproto_max_chunks_for_frame(carrier_mtu, frame_mtu);
+    
+    ASSERT_FORCE(FragmentProtoStream_Init(&stream, num_frames, min_frame_len, max_frame_len, carrier_mtu))
+    
+    FragmentProtoStream_Reorder(&stream, reorder);
+    if (damage != DAMAGE_REORDER) {
+        int loss_permille = rand() % 300;
+        int dup_permille = rand() % 1000;
+        FragmentProtoStream_Lose(&stream, loss_permille, dup_permille);
+    }
+    
+    delivered = (int *)BAllocArray(num_frames, sizeof(delivered[0]));
+    ASSERT_FORCE(delivered)
+    memset(delivered, 0, num_frames * sizeof(delivered[0]));
+    
+    uint8_t *packet = (uint8_t *)BAlloc(carrier_mtu);
+    ASSERT_FORCE(packet)
+    
+    PacketPassInterface_Init(&sink, frame_mtu, sink_handler_send, NULL, pg);
+    
+    // Frames time out after num_frames packets without a chunk. Shuffling in
+    // blocks of R+1 packets can put consecutive packets up to 2R+1 apart.
+    int num_assembler_frames = 2 * reorder + 3;
+    
+    FragmentProtoAssembler assembler;
+    ASSERT_FORCE(FragmentProtoAssembler_Init(&assembler, carrier_mtu, &sink, num_assembler_frames, num_chunks, pg, NULL, logfunc))
+    PacketPassInterface *input = FragmentProtoAssembler_GetInput(&assembler);
+    PacketPassInterface_Sender_Init(input, input_handler_done, NULL);
+    
+    for (int i = 0; i < stream.schedule_len; i++) {
+        int len = FragmentProtoStream_PacketLen(&stream, stream.schedule[i]);
+        memcpy(packet, FragmentProtoStream_PacketData(&stream, stream.schedule[i]), len);
+        
+        if (damage == DAMAGE_CORRUPT) {
+            int num_flips = rand() % 4;
+            for (int j = 0; j < num_flips && len > 0; j++) {
+                packet[rand() % len] ^= 1 << (rand() % 8);
+            }
+            if (len > 0 && rand() % 8 == 0) {
+                len = rand() % len;
+            }
+        }
+        
+        input_done = 0;
+        PacketPassInterface_Sender_Send(input, packet, len);
+        while (!input_done) {
+            ASSERT_FORCE(BPendingGroup_HasJobs(pg))
+            BPendingGroup_ExecuteJob(pg);
+        }
+    }
+    
+    int num_delivered = 0;
+    for (int i = 0; i < num_frames; i++) {
+        if (damage == DAMAGE_REORDER) {
+            ASSERT_FORCE(delivered[i] == 1)
+        }
+        num_delivered += delivered[i];
+    }
+    
+    printf("damage=%d carrier_mtu=%d frame_len=%d..%d frames=%d reorder=%d packets=%d delivered=%d\n",
+           damage, carrier_mtu, min_frame_len, max_frame_len, num_frames, reorder, stream.schedule_len, num_delivered);
+    
+    FragmentProtoAssembler_Free(&assembler);
+    PacketPassInterface_Free(&sink);
+    BFree(packet);
+    BFree(delivered);
+    FragmentProtoStream_Free(&stream);
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <seed> <rounds>\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    srand(atoi(argv[1]));
+    int rounds = atoi(argv[2]);
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FragmentProtoAssembler, BLOG_NOTICE);
+    
+    BPendingGroup pg;
+    BPendingGroup_Init(&pg);
+    
+    for (int i = 0; i < rounds; i++) {
+        run_round(&pg);
+    }
+    
+    BPendingGroup_Free(&pg);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
@@ -0,0 +1,206 @@
+/**
+ * @file frame_decider_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures the cost of deciding where frames from the device go in
+ * {@link FrameDecider}, for a given number of peers each owning a number
+ * of MAC addresses. Frames are sent to random known MACs, which is the
+ * common case in a large L2 mesh, and are decided either one at a time
+ * with FrameDecider_AnalyzeAndDecide or in bursts with FrameDecider_DecideBatch.
+ * The frames are generated in advance, so that mostly the decider is timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <misc/ethernet_proto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <client/FrameDecider.h>
+
+#define FRAME_LEN 64
+#define NUM_POOL_FRAMES 4096
+
+static void logfunc (void *user)
+{
+    BLog_Append("peer %d: ", (int)(intptr_t)user);
+}
+
+static void make_frame (uint8_t *frame, uint32_t dest_id, uint32_t src_id)
+{
+    memset(frame, 0, FRAME_LEN);
+    
+    struct ethernet_header eh;
+    eh.dest[0] = 0x02;
+    eh.dest[1] = 0x00;
+    memcpy(eh.dest + 2, &dest_id, 4);
+    eh.source[0] = 0x02;
+    eh.source[1] = 0x00;
+    memcpy(eh.source + 2, &src_id, 4);
+    eh.type = hton16(0x86dd);
+    memcpy(frame, &eh, sizeof(eh));
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s <num_peers> <macs_per_peer> <num_frames> <batch>\n", (argc > 0 ? argv[0] : ""));
+        fprintf(stderr, "    <batch> of 0 decides frames one at a time.\n");
+        return 1;
+    }
+    
+    int num_peers = atoi(argv[1]);
+    int macs_per_peer = atoi(argv[2]);
+    int num_frames = atoi(argv[3]);
+    int batch = atoi(argv[4]);
+    
+    if (num_peers <= 0 || macs_per_peer <= 0 || num_frames <= 0 || batch < 0) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FrameDecider, BLOG_NOTICE);
+    
+    BTime_Init();
+    
+    BReactor reactor;
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    FrameDecider decider;
+    if (!FrameDecider_Init(&decider, macs_per_peer, 1, 1000, 1000, &reactor)) {
+        DEBUG("FrameDecider_Init failed");
+        goto fail1;
+    }
+    
+    FrameDeciderPeer *peers = (FrameDeciderPeer *)BAllocArray(num_peers, sizeof(peers[0]));
+    if (!peers) {
+        DEBUG("BAllocArray failed");
+        goto fail2;
+    }
+    
+    int num_macs = num_peers * macs_per_peer;
+    if (batch > NUM_POOL_FRAMES) {
+        batch = NUM_POOL_FRAMES;
+    }
+    
+    uint8_t *frames_data = (uint8_t *)BAllocArray(NUM_POOL_FRAMES, FRAME_LEN);
+    const uint8_t **frames = (const uint8_t **)BAllocArray(NUM_POOL_FRAMES, sizeof(frames[0]));
+    int *frame_lens = (int *)BAllocArray(NUM_POOL_FRAMES, sizeof(frame_lens[0]));
+    FrameDeciderDecision *decisions = (FrameDeciderDecision *)BAllocArray(NUM_POOL_FRAMES, sizeof(decisions[0]));
+    if (!frames_data || !frames || !frame_lens || !decisions) {
+        DEBUG("BAllocArray failed");
+        goto fail3;
+    }
+    
+    // add peers, and have them announce their MACs
+    int num_inited = 0;
+    for (; num_inited < num_peers; num_inited++) {
+        if (!FrameDeciderPeer_Init(&peers[num_inited], &decider, (void *)(intptr_t)num_inited, logfunc)) {
+            DEBUG("FrameDeciderPeer_Init failed");
+            goto fail4;
+        }
+    }
+    for (int i = 0; i < num_macs; i++) {
+        make_frame(frames_data, 0, i);
+        FrameDeciderPeer_Analyze(&peers[i / macs_per_peer], frames_data, FRAME_LEN);
+    }
+    
+    // generate frames to random known MACs
+    srand(1);
+    for (int i = 0; i < NUM_POOL_FRAMES; i++) {
+        make_frame(frames_data + (size_t)i * FRAME_LEN, rand() % num_macs, num_macs);
+        frames[i] = frames_data + (size_t)i * FRAME_LEN;
+        frame_lens[i] = FRAME_LEN;
+    }
+    
+    btime_t start_time = btime_gettime();
+    uint64_t checksum = 0;
+    
+    for (int done = 0; done < num_frames;) {
+        int pos = done % NUM_POOL_FRAMES;
+        int count = (batch > 0 ? bmin_int(batch, bmin_int(num_frames - done, NUM_POOL_FRAMES - pos)) : 1);
+        
+        if (batch > 0) {
+            FrameDecider_DecideBatch(&decider, frames + pos, frame_lens + pos, count, decisions + pos);
+        }
+        
+        for (int i = pos; i < pos + count; i++) {
+            if (batch > 0) {
+                FrameDecider_StartDecision(&decider, &decisions[i]);
+            } else {
+                FrameDecider_AnalyzeAndDecide(&decider, frames[i], frame_lens[i]);
+            }
+            
+            FrameDeciderPeer *peer;
+            while (peer = FrameDecider_NextDestination(&decider)) {
+                checksum += peer - peers;
+            }
+        }
+        
+        done += count;
+    }
+    
+    btime_t time = btime_gettime() - start_time;
+    printf("%d peers, %d MACs: %d frames in %d ms, %.1f ns/frame (checksum %llu)\n", num_peers, num_macs, num_frames, (int)time,
+           (double)time * 1000000 / num_frames, (unsigned long long)checksum);
+    
+    ret = 0;
+    
+fail4:
+    while (num_inited > 0) {
+        FrameDeciderPeer_Free(&peers[--num_inited]);
+    }
+fail3:
+    BFree(decisions);
+    BFree(frame_lens);
+    BFree(frames);
+    BFree(frames_data);
+    BFree(peers);
+fail2:
+    FrameDecider_Free(&decider);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
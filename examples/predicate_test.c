@@ -28,7 +28,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <predicate/BPredicate.h>
 #include <base/BLog.h>
@@ -68,8 +70,15 @@ static int func_error (void *user, void **args)
 
 int main (int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <predicate>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <predicate> [<iterations>]\n", argv[0]);
+        fprintf(stderr, "    With <iterations>, also measures how fast the predicate evaluates.\n");
+        return 1;
+    }
+    
+    int iterations = 0;
+    if (argc == 3 && (iterations = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "bad iterations\n");
         return 1;
     }
     
@@ -102,6 +111,19 @@ int main (int argc, char **argv)
     int result = BPredicate_Eval(&pr);
     printf("%d\n", result);
     
+    // benchmark
+    if (iterations > 0) {
+        clock_t start = clock();
+        for (int i = 0; i < iterations; i++) {
+            if (BPredicate_Eval(&pr) != result) {
+                fprintf(stderr, "result changed\n");
+                return 1;
+            }
+        }
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%d evaluations in %.3f s, %.0f per second\n", iterations, secs, (secs > 0 ? iterations / secs : 0.0));
+    }
+    
     // free functions
     BPredicateFunction_Free(&f_hello);
     BPredicateFunction_Free(&f_neg);
@@ -0,0 +1,313 @@
+/**
+ * @file replay_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Compares the memory and CPU cost of the two SPProto replay protection
+ * modes, one-time passwords and sequence numbers with a replay window,
+ * for a given number of peers. For OTPs, each peer has an OTPGenerator
+ * for sending and an OTPChecker keeping two seeds for receiving, as in the
+ * client. For sequence numbers, each peer has a ReplayWindow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <security/BRandom.h>
+#include <security/BEncryption.h>
+#include <security/OTPGenerator.h>
+#include <security/OTPChecker.h>
+#include <security/ReplayWindow.h>
+#include <threadwork/BThreadWork.h>
+
+#define OTP_CIPHER BENCRYPTION_CIPHER_AES
+#define OTP_NUM_SEEDS 2
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+int num_peers;
+OTPGenerator *gens;
+OTPChecker *checkers;
+int seed_round;
+int num_generating;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <num_peers> <otp_num> <replay_window> <packets_per_peer>\n"
+        "    <packets_per_peer> must be <=otp_num.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static long long get_heap_used (void)
+{
+#ifdef HAVE_MALLINFO2
+    return mallinfo2().uordblks;
+#else
+    return -1;
+#endif
+}
+
+static double get_secs (clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void start_seed_round (void)
+{
+    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    
+    // Give every peer's checker a seed. A checker forgets a seed still being
+    // generated when given another one, so seeds are given one round at a
+    // time. The generator uses the last seed.
+    for (int i = 0; i < num_peers; i++) {
+        BRandom_randomize(key, BEncryption_cipher_key_size(OTP_CIPHER));
+        BRandom_randomize(iv, BEncryption_cipher_block_size(OTP_CIPHER));
+        OTPChecker_AddSeed(&checkers[i], seed_round, key, iv);
+        num_generating++;
+        if (seed_round == OTP_NUM_SEEDS - 1) {
+            OTPGenerator_SetSeed(&gens[i], key, iv);
+            num_generating++;
+        }
+    }
+}
+
+static void generated_handler (void *user)
+{
+    ASSERT(num_generating > 0)
+    
+    if (--num_generating > 0) {
+        return;
+    }
+    
+    if (++seed_round < OTP_NUM_SEEDS) {
+        start_seed_round();
+        return;
+    }
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+static void print_result (const char *name, long long mem, double setup_secs, double check_secs, long long num_packets, long long num_accepted)
+{
+    printf("%s: memory %lld bytes (%lld per peer), setup %.1f ms, %.1f ns per packet, %lld of %lld accepted\n",
+           name, mem, (mem >= 0 ? mem / num_peers : -1), setup_secs * 1000,
+           (num_packets > 0 ? check_secs * 1000000000 / num_packets : 0.0), num_accepted, num_packets);
+}
+
+static int bench_otp (int otp_num, int packets_per_peer)
+{
+    int ret = 0;
+    
+    gens = (OTPGenerator *)BAllocArray(num_peers, sizeof(gens[0]));
+    checkers = (OTPChecker *)BAllocArray(num_peers, sizeof(checkers[0]));
+    if (!gens || !checkers) {
+        DEBUG("BAllocArray failed");
+        goto fail0;
+    }
+    
+    long long mem_start = get_heap_used();
+    
+    int num_inited = 0;
+    for (num_inited = 0; num_inited < num_peers; num_inited++) {
+        if (!OTPGenerator_Init(&gens[num_inited], otp_num, OTP_CIPHER, &twd, generated_handler, NULL)) {
+            DEBUG("OTPGenerator_Init failed");
+            goto fail1;
+        }
+        if (!OTPChecker_Init(&checkers[num_inited], otp_num, OTP_CIPHER, OTP_NUM_SEEDS, &twd)) {
+            DEBUG("OTPChecker_Init failed");
+            OTPGenerator_Free(&gens[num_inited]);
+            goto fail1;
+        }
+        OTPChecker_SetHandlers(&checkers[num_inited], generated_handler, NULL);
+    }
+    
+    clock_t start = clock();
+    
+    // give seeds and wait for generation
+    seed_round = 0;
+    num_generating = 0;
+    start_seed_round();
+    BReactor_Exec(&reactor);
+    
+    double setup_secs = get_secs(start);
+    long long mem = get_heap_used() - mem_start;
+    
+    // send packets round robin over peers
+    long long num_accepted = 0;
+    start = clock();
+    for (int j = 0; j < packets_per_peer; j++) {
+        for (int i = 0; i < num_peers; i++) {
+            otp_t otp = OTPGenerator_GetOTP(&gens[i]);
+            num_accepted += OTPChecker_CheckOTP(&checkers[i], OTP_NUM_SEEDS - 1, otp);
+        }
+    }
+    double check_secs = get_secs(start);
+    
+    print_result("otp", (mem_start >= 0 ? mem : -1), setup_secs, check_secs, (long long)num_peers * packets_per_peer, num_accepted);
+    
+    ret = 1;
+    
+fail1:
+    while (num_inited-- > 0) {
+        OTPChecker_Free(&checkers[num_inited]);
+        OTPGenerator_Free(&gens[num_inited]);
+    }
+fail0:
+    BFree(checkers);
+    BFree(gens);
+    return ret;
+}
+
+static int bench_replay (int replay_window, int packets_per_peer)
+{
+    int ret = 0;
+    
+    ReplayWindow *windows = (ReplayWindow *)BAllocArray(num_peers, sizeof(windows[0]));
+    uint64_t *seqnums = (uint64_t *)BAllocArray(num_peers, sizeof(seqnums[0]));
+    if (!windows || !seqnums) {
+        DEBUG("BAllocArray failed");
+        goto fail0;
+    }
+    
+    long long mem_start = get_heap_used();
+    
+    clock_t start = clock();
+    
+    int num_inited;
+    for (num_inited = 0; num_inited < num_peers; num_inited++) {
+        if (!ReplayWindow_Init(&windows[num_inited], replay_window)) {
+            DEBUG("ReplayWindow_Init failed");
+            goto fail1;
+        }
+        seqnums[num_inited] = 0;
+    }
+    
+    double setup_secs = get_secs(start);
+    long long mem = get_heap_used() - mem_start;
+    
+    // send packets round robin over peers, swapping every other pair of
+    // packets to exercise reordering within the window
+    long long num_accepted = 0;
+    start = clock();
+    for (int j = 0; j < packets_per_peer; j++) {
+        for (int i = 0; i < num_peers; i++) {
+            uint64_t seq = seqnums[i]++;
+            if (seq % 4 == 2 && j + 1 < packets_per_peer) {
+                seq++;
+            } else if (seq % 4 == 3) {
+                seq--;
+            }
+            num_accepted += ReplayWindow_Check(&windows[i], seq);
+        }
+    }
+    double check_secs = get_secs(start);
+    
+    print_result("replay window", (mem_start >= 0 ? mem : -1), setup_secs, check_secs, (long long)num_peers * packets_per_peer, num_accepted);
+    
+    ret = 1;
+    
+fail1:
+    while (num_inited-- > 0) {
+        ReplayWindow_Free(&windows[num_inited]);
+    }
+fail0:
+    BFree(seqnums);
+    BFree(windows);
+    return ret;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 5) {
+        usage(argv[0]);
+    }
+    
+    num_peers = atoi(argv[1]);
+    int otp_num = atoi(argv[2]);
+    int replay_window = atoi(argv[3]);
+    int packets_per_peer = atoi(argv[4]);
+    
+    if (num_peers <= 0 || otp_num <= 0 || replay_window <= 0 || replay_window > REPLAYWINDOW_MAX_SIZE ||
+        packets_per_peer < 0 || packets_per_peer > otp_num
+    ) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 0)) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    if (!bench_otp(otp_num, packets_per_peer)) {
+        goto fail2;
+    }
+    
+    if (!bench_replay(replay_window, packets_per_peer)) {
+        goto fail2;
+    }
+    
+    ret = 0;
+    
+fail2:
+    BThreadWorkDispatcher_Free(&twd);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
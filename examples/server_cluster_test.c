@@ -0,0 +1,449 @@
+/**
+ * @file server_cluster_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Test of a cluster of VPN servers. One client is connected to each given
+ * server address, which may be servers of the same cluster. The test checks
+ * that:
+ *   - every client is told about every other client with newclient,
+ *   - a message from every client reaches every other client, and
+ *   - when the first client disconnects, the others get endclient for it.
+ * 
+ * See server_cluster_test.sh for starting a cluster on localhost and
+ * running this against it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <prinit.h>
+#include <nss/nss.h>
+#include <nss/ssl.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/nsskey.h>
+#include <protocol/scproto.h>
+#include <protocol/packetproto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <nspr_support/DummyPRFileDesc.h>
+#include <nspr_support/BSSLConnection.h>
+#include <threadwork/BThreadWork.h>
+#include <server_connection/ServerConnection.h>
+
+#define MAX_CLIENTS 16
+#define TEST_TIMEOUT 20000
+#define RESEND_INTERVAL 200
+#define KEEPALIVE_INTERVAL 10000
+#define BUFFER_PACKETS 16
+
+#define PHASE_CONNECT 1
+#define PHASE_MESSAGES 2
+#define PHASE_END 3
+
+struct test_msg {
+    peerid_t from;
+    peerid_t to;
+};
+
+struct test_client {
+    int index;
+    ServerConnection sc;
+    int have_sc;
+    int ready;
+    peerid_t id;
+    int num_known;
+    peerid_t known[MAX_CLIENTS];
+    int sending;
+    int next_peer;
+    int ended;
+    uint8_t packet[sizeof(struct packetproto_header) + sizeof(struct sc_header) + sizeof(struct sc_client_outmsg) + sizeof(struct test_msg)];
+};
+
+static BReactor reactor;
+static BThreadWorkDispatcher twd;
+static int have_ssl;
+static CERTCertificate *client_cert;
+static SECKEYPrivateKey *client_key;
+static char *server_name;
+static struct test_client clients[MAX_CLIENTS];
+static int num_clients;
+static int phase;
+static int received[MAX_CLIENTS][MAX_CLIENTS];
+static int num_received;
+static BTimer timeout_timer;
+static BTimer resend_timer;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s [--nssdb <string> --client-cert-name <string> --server-name <string>] <server-addr> ...\n"
+        "    One client is connected to each server address, at most %d.\n"
+        "    The options enable SSL, like with badvpn-client.\n",
+        name, MAX_CLIENTS
+    );
+    
+    exit(1);
+}
+
+static void fail (const char *msg)
+{
+    printf("FAIL: %s\n", msg);
+    BReactor_Quit(&reactor, 1);
+}
+
+static int find_client_by_id (peerid_t id)
+{
+    for (int i = 0; i < num_clients; i++) {
+        if (clients[i].have_sc && clients[i].ready && clients[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int knows (struct test_client *c, peerid_t id)
+{
+    for (int i = 0; i < c->num_known; i++) {
+        if (c->known[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void send_next (struct test_client *c)
+{
+    ASSERT(phase == PHASE_MESSAGES)
+    ASSERT(!c->sending)
+    
+    // find a peer which has not received our message yet
+    while (c->next_peer < num_clients && (c->next_peer == c->index || received[c->index][c->next_peer])) {
+        c->next_peer++;
+    }
+    if (c->next_peer == num_clients) {
+        return;
+    }
+    struct test_client *peer = &clients[c->next_peer++];
+    
+    // build outmsg
+    struct packetproto_header *pp = (struct packetproto_header *)c->packet;
+    struct sc_header *header = (struct sc_header *)(pp + 1);
+    struct sc_client_outmsg *outmsg = (struct sc_client_outmsg *)(header + 1);
+    struct test_msg *msg = (struct test_msg *)(outmsg + 1);
+    pp->len = htol16(sizeof(*header) + sizeof(*outmsg) + sizeof(*msg));
+    header->type = SCID_OUTMSG;
+    outmsg->clientid = htol16(peer->id);
+    msg->from = htol16(c->id);
+    msg->to = htol16(peer->id);
+    
+    c->sending = 1;
+    PacketPassInterface_Sender_Send(ServerConnection_GetSendInterface(&c->sc), c->packet, sizeof(c->packet));
+}
+
+static void send_handler_done (struct test_client *c)
+{
+    ASSERT(c->sending)
+    
+    c->sending = 0;
+    
+    if (phase == PHASE_MESSAGES) {
+        send_next(c);
+    }
+}
+
+static void check_progress (void)
+{
+    if (phase == PHASE_CONNECT) {
+        // wait for every client to know every other client
+        for (int i = 0; i < num_clients; i++) {
+            if (!clients[i].ready) {
+                return;
+            }
+        }
+        for (int i = 0; i < num_clients; i++) {
+            for (int j = 0; j < num_clients; j++) {
+                if (j != i && !knows(&clients[i], clients[j].id)) {
+                    return;
+                }
+            }
+        }
+        
+        printf("all clients know each other\n");
+        
+        // start sending messages; they are sent again until received,
+        // since the other server may not have seen the accept yet
+        phase = PHASE_MESSAGES;
+        for (int i = 0; i < num_clients; i++) {
+            PacketPassInterface_Sender_Init(ServerConnection_GetSendInterface(&clients[i].sc), (PacketPassInterface_handler_done)send_handler_done, &clients[i]);
+            clients[i].next_peer = 0;
+            send_next(&clients[i]);
+        }
+        BReactor_SetTimer(&reactor, &resend_timer);
+        return;
+    }
+    
+    if (phase == PHASE_MESSAGES) {
+        if (num_received < num_clients * (num_clients - 1)) {
+            return;
+        }
+        
+        printf("all messages received\n");
+        
+        // disconnect the first client
+        phase = PHASE_END;
+        BReactor_RemoveTimer(&reactor, &resend_timer);
+        ServerConnection_ReleaseBuffers(&clients[0].sc);
+        ServerConnection_Free(&clients[0].sc);
+        clients[0].have_sc = 0;
+    }
+    
+    if (phase == PHASE_END) {
+        for (int i = 1; i < num_clients; i++) {
+            if (!clients[i].ended) {
+                return;
+            }
+        }
+        
+        printf("all clients got endclient\n");
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void resend_timer_handler (void *unused)
+{
+    ASSERT(phase == PHASE_MESSAGES)
+    
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].next_peer = 0;
+        if (!clients[i].sending) {
+            send_next(&clients[i]);
+        }
+    }
+    
+    BReactor_SetTimer(&reactor, &resend_timer);
+}
+
+static void timeout_timer_handler (void *unused)
+{
+    fail("timed out");
+}
+
+static void server_handler_error (struct test_client *c)
+{
+    fail("server connection error");
+}
+
+static void server_handler_ready (struct test_client *c, peerid_t my_id, uint32_t ext_ip)
+{
+    printf("client %d: ready, ID %d\n", c->index, (int)my_id);
+    
+    c->ready = 1;
+    c->id = my_id;
+    
+    check_progress();
+}
+
+static void server_handler_newclient (struct test_client *c, peerid_t peer_id, int flags, const uint8_t *cert, int cert_len)
+{
+    if (knows(c, peer_id) || c->num_known == MAX_CLIENTS) {
+        fail("duplicate newclient");
+        return;
+    }
+    
+    c->known[c->num_known++] = peer_id;
+    
+    check_progress();
+}
+
+static void server_handler_endclient (struct test_client *c, peerid_t peer_id)
+{
+    if (!knows(c, peer_id)) {
+        fail("endclient for unknown client");
+        return;
+    }
+    
+    if (phase != PHASE_END || peer_id != clients[0].id || c->ended) {
+        fail("unexpected endclient");
+        return;
+    }
+    
+    c->ended = 1;
+    
+    check_progress();
+}
+
+static void server_handler_message (struct test_client *c, peerid_t peer_id, uint8_t *data, int data_len)
+{
+    struct test_msg msg;
+    if (data_len != sizeof(msg)) {
+        fail("message has wrong length");
+        return;
+    }
+    memcpy(&msg, data, sizeof(msg));
+    
+    int from = find_client_by_id(peer_id);
+    if (from < 0 || ltoh16(msg.from) != peer_id || ltoh16(msg.to) != c->id) {
+        fail("message has wrong content");
+        return;
+    }
+    
+    if (phase != PHASE_MESSAGES || received[from][c->index]) {
+        return;
+    }
+    
+    received[from][c->index] = 1;
+    num_received++;
+    
+    check_progress();
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    char *nssdb = NULL;
+    char *client_cert_name = NULL;
+    server_name = NULL;
+    
+    int i = 1;
+    while (i < argc && !strncmp(argv[i], "--", 2)) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (!strcmp(argv[i], "--nssdb")) {
+            nssdb = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "--client-cert-name")) {
+            client_cert_name = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "--server-name")) {
+            server_name = argv[i + 1];
+        }
+        else {
+            usage(argv[0]);
+        }
+        i += 2;
+    }
+    
+    have_ssl = !!nssdb;
+    num_clients = argc - i;
+    
+    if (num_clients < 2 || num_clients > MAX_CLIENTS || !!client_cert_name != have_ssl || !!server_name != have_ssl) {
+        usage(argv[0]);
+    }
+    
+    BAddr addrs[MAX_CLIENTS];
+    for (int j = 0; j < num_clients; j++) {
+        if (!BAddr_Parse(&addrs[j], argv[i + j], NULL, 0)) {
+            usage(argv[0]);
+        }
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (have_ssl) {
+        PR_Init(PR_USER_THREAD, PR_PRIORITY_NORMAL, 0);
+        ASSERT_FORCE(DummyPRFileDesc_GlobalInit())
+        ASSERT_FORCE(BSSLConnection_GlobalInit())
+        ASSERT_FORCE(NSS_Init(nssdb) == SECSuccess)
+        ASSERT_FORCE(NSS_SetDomesticPolicy() == SECSuccess)
+        ASSERT_FORCE(open_nss_cert_and_key(client_cert_name, &client_cert, &client_key))
+    }
+    
+    ASSERT_FORCE(BNetwork_GlobalInit())
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, 0))
+    
+    BTimer_Init(&timeout_timer, TEST_TIMEOUT, timeout_timer_handler, NULL);
+    BReactor_SetTimer(&reactor, &timeout_timer);
+    BTimer_Init(&resend_timer, RESEND_INTERVAL, resend_timer_handler, NULL);
+    
+    phase = PHASE_CONNECT;
+    num_received = 0;
+    memset(received, 0, sizeof(received));
+    
+    for (int j = 0; j < num_clients; j++) {
+        struct test_client *c = &clients[j];
+        c->index = j;
+        c->ready = 0;
+        c->num_known = 0;
+        c->sending = 0;
+        c->ended = 0;
+        ASSERT_FORCE(ServerConnection_Init(&c->sc, &reactor, &twd, addrs[j], KEEPALIVE_INTERVAL, BUFFER_PACKETS, have_ssl, 0, client_cert, client_key, server_name, c,
+            (ServerConnection_handler_error)server_handler_error,
+            (ServerConnection_handler_ready)server_handler_ready,
+            (ServerConnection_handler_newclient)server_handler_newclient,
+            (ServerConnection_handler_endclient)server_handler_endclient,
+            (ServerConnection_handler_message)server_handler_message
+        ))
+        c->have_sc = 1;
+    }
+    
+    int ret = BReactor_Exec(&reactor);
+    
+    for (int j = 0; j < num_clients; j++) {
+        if (clients[j].have_sc) {
+            if (phase != PHASE_CONNECT) {
+                ServerConnection_ReleaseBuffers(&clients[j].sc);
+            }
+            ServerConnection_Free(&clients[j].sc);
+        }
+    }
+    
+    BReactor_RemoveTimer(&reactor, &resend_timer);
+    BReactor_RemoveTimer(&reactor, &timeout_timer);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    
+    if (have_ssl) {
+        CERT_DestroyCertificate(client_cert);
+        SECKEY_DestroyPrivateKey(client_key);
+        SSL_ClearSessionCache();
+        ASSERT_FORCE(NSS_Shutdown() == SECSuccess)
+        ASSERT_FORCE(PR_Cleanup() == PR_SUCCESS)
+        PL_ArenaFinish();
+    }
+    
+    printf("%s\n", (ret ? "FAILED" : "PASSED"));
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return ret;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Starts a cluster of VPN servers on localhost and runs server_cluster_test
+# against it, with one client on each server and a second client on the
+# first server.
+#
+# Usage: server_cluster_test.sh <build-dir> [<num-servers>] [-- <extra server args>]
+#
+# For SSL, pass e.g. "-- --ssl --nssdb sql:/path/to/nssdb --server-cert-name <name>"
+# and set TEST_ARGS to the SSL options for server_cluster_test. The servers
+# then share the NSS database, as all servers of a cluster need certificates
+# with the same subject.
+#
+
+set -e
+
+if [ "$#" -lt 1 ]; then
+    echo "Usage: $0 <build-dir> [<num-servers>] [-- <extra server args>]" >&2
+    exit 1
+fi
+
+BUILD_DIR=$1
+shift
+NUM_SERVERS=3
+if [ "$#" -gt 0 ] && [ "$1" != "--" ]; then
+    NUM_SERVERS=$1
+    shift
+fi
+if [ "$#" -gt 0 ] && [ "$1" = "--" ]; then
+    shift
+fi
+
+SERVER=${BUILD_DIR}/server/badvpn-server
+TEST=${BUILD_DIR}/examples/server_cluster_test
+CLIENT_PORT_BASE=${CLIENT_PORT_BASE:-17000}
+CLUSTER_PORT_BASE=${CLUSTER_PORT_BASE:-17100}
+
+PIDS=""
+cleanup () {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+ADDRS=""
+i=0
+while [ "$i" -lt "$NUM_SERVERS" ]; do
+    PEERS=""
+    j=0
+    while [ "$j" -lt "$NUM_SERVERS" ]; do
+        if [ "$j" -ne "$i" ]; then
+            PEERS="$PEERS --cluster-peer $j 127.0.0.1:$((CLUSTER_PORT_BASE + j))"
+        fi
+        j=$((j + 1))
+    done
+
+    "$SERVER" --loglevel warning --listen-addr "127.0.0.1:$((CLIENT_PORT_BASE + i))" \
+        --cluster-id "$i" --cluster-listen-addr "127.0.0.1:$((CLUSTER_PORT_BASE + i))" $PEERS "$@" &
+    PIDS="$PIDS $!"
+
+    ADDRS="$ADDRS 127.0.0.1:$((CLIENT_PORT_BASE + i))"
+    i=$((i + 1))
+done
+
+# give the servers time to listen and link up
+sleep 2
+
+"$TEST" $TEST_ARGS $ADDRS "127.0.0.1:$CLIENT_PORT_BASE"
@@ -0,0 +1,255 @@
+/**
+ * @file spproto_rekey_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Test of encryption key changes in {@link SPProtoEncoder} and
+ * {@link SPProtoDecoder}. Numbered packets are passed from an encoder to a
+ * decoder, and both are given a new key every few packets, while the encoder
+ * still has packets being encoded or waiting to be output. Packets may be
+ * lost around a key change, but those which come out must be intact and in
+ * order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <protocol/spproto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <security/BSecurity.h>
+#include <security/BRandom.h>
+#include <security/BEncryption.h>
+#include <security/BHash.h>
+#include <threadwork/BThreadWork.h>
+#include <flow/SinglePacketBuffer.h>
+#include <client/SPProtoEncoder.h>
+#include <client/SPProtoDecoder.h>
+
+#define PACKET_SIZE 1000
+#define NUM_PACKETS 20000
+#define REKEY_INTERVAL 37
+
+static BReactor reactor;
+static BThreadWorkDispatcher twd;
+static struct spproto_security_params sp_params;
+static PacketRecvInterface source;
+static SPProtoEncoder encoder;
+static SinglePacketBuffer buffer;
+static SPProtoDecoder decoder;
+static PacketPassInterface sink;
+static uint32_t num_sent;
+static int num_received;
+static int64_t last_seq;
+static int num_rekeys;
+static int num_rekeys_in_flight;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <cipher> <hash> <window> <batch> <threads>\n"
+        "    <cipher> is one of (blowfish, aes, aes-gcm, chacha20-poly1305).\n"
+        "    <hash> is one of (none, md5, sha1), and must be none with AEAD ciphers.\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void logfunc (void *user)
+{
+    BLog_Append("test: ");
+}
+
+static uint8_t packet_byte (uint32_t seq, int i)
+{
+    return (uint8_t)(seq * 31 + i);
+}
+
+static void set_key (void)
+{
+    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+    BRandom_randomize(key, BEncryption_cipher_key_size(sp_params.encryption_mode));
+    SPProtoEncoder_SetEncryptionKey(&encoder, key);
+    SPProtoDecoder_SetEncryptionKey(&decoder, key);
+}
+
+static void source_handler_recv (void *user, uint8_t *data)
+{
+    uint32_t seq = hton32(num_sent);
+    memcpy(data, &seq, sizeof(seq));
+    for (int i = sizeof(seq); i < PACKET_SIZE; i++) {
+        data[i] = packet_byte(num_sent, i);
+    }
+    num_sent++;
+    
+    PacketRecvInterface_Done(&source, PACKET_SIZE);
+}
+
+static void sink_handler_send (void *user, uint8_t *data, int data_len)
+{
+    ASSERT_FORCE(data_len == PACKET_SIZE)
+    
+    // check packet
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    seq = ntoh32(seq);
+    ASSERT_FORCE((int64_t)seq > last_seq)
+    ASSERT_FORCE(seq < num_sent)
+    for (int i = sizeof(seq); i < PACKET_SIZE; i++) {
+        ASSERT_FORCE(data[i] == packet_byte(seq, i))
+    }
+    last_seq = seq;
+    
+    PacketPassInterface_Done(&sink);
+    
+    if (++num_received == NUM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // change keys, noting whether the encoder is busy with packets
+    if (num_received % REKEY_INTERVAL == 0) {
+        if (encoder.num_works > 0 || encoder.slots_used > 1) {
+            num_rekeys_in_flight++;
+        }
+        num_rekeys++;
+        set_key();
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 6) {
+        usage(argv[0]);
+    }
+    
+    char *cipher_str = argv[1];
+    char *hash_str = argv[2];
+    int window = atoi(argv[3]);
+    int batch = atoi(argv[4]);
+    int threads = atoi(argv[5]);
+    
+    sp_params.hash_mode = SPPROTO_HASH_MODE_NONE;
+    sp_params.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+    sp_params.otp_mode = SPPROTO_OTP_MODE_NONE;
+    sp_params.otp_num = 0;
+    sp_params.replay_window = SPPROTO_REPLAY_WINDOW_NONE;
+    
+    if (!strcmp(cipher_str, "blowfish")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_BLOWFISH;
+    }
+    else if (!strcmp(cipher_str, "aes")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_AES;
+    }
+    else if (!strcmp(cipher_str, "aes-gcm")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_AES_GCM;
+    }
+    else if (!strcmp(cipher_str, "chacha20-poly1305")) {
+        sp_params.encryption_mode = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+    }
+    else {
+        usage(argv[0]);
+    }
+    
+    if (!strcmp(hash_str, "md5")) {
+        sp_params.hash_mode = BHASH_TYPE_MD5;
+    }
+    else if (!strcmp(hash_str, "sha1")) {
+        sp_params.hash_mode = BHASH_TYPE_SHA1;
+    }
+    else if (strcmp(hash_str, "none")) {
+        usage(argv[0]);
+    }
+    
+    if (window <= 0 || batch <= 0 || batch > window || batch > BENCRYPTION_MAX_BATCH || threads < 0 ||
+        (SPPROTO_HAVE_AEAD(sp_params) && SPPROTO_HAVE_HASH(sp_params))
+    ) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (threads > 0) {
+        ASSERT_FORCE(BSecurity_GlobalInitThreadSafe())
+    }
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    ASSERT_FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, threads))
+    
+    BPendingGroup *pg = BReactor_PendingGroup(&reactor);
+    
+    // init receiving side
+    PacketPassInterface_Init(&sink, PACKET_SIZE, sink_handler_send, NULL, pg);
+    ASSERT_FORCE(SPProtoDecoder_Init(&decoder, &sink, sp_params, 2, pg, &twd, window, batch, NULL, logfunc))
+    
+    // init sending side
+    PacketRecvInterface_Init(&source, PACKET_SIZE, source_handler_recv, NULL, pg);
+    ASSERT_FORCE(SPProtoEncoder_Init(&encoder, &source, sp_params, 1, pg, &twd, window, batch))
+    
+    // connect the sides
+    ASSERT_FORCE(SinglePacketBuffer_Init(&buffer, SPProtoEncoder_GetOutput(&encoder), SPProtoDecoder_GetInput(&decoder), pg))
+    
+    num_sent = 0;
+    num_received = 0;
+    last_seq = -1;
+    num_rekeys = 0;
+    num_rekeys_in_flight = 0;
+    
+    set_key();
+    
+    int ret = BReactor_Exec(&reactor);
+    
+    printf("%d packets of %d sent, %d keys, %d with packets in flight\n", num_received, (int)num_sent, num_rekeys, num_rekeys_in_flight);
+    
+    SinglePacketBuffer_Free(&buffer);
+    SPProtoEncoder_Free(&encoder);
+    PacketRecvInterface_Free(&source);
+    SPProtoDecoder_Free(&decoder);
+    PacketPassInterface_Free(&sink);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    if (threads > 0) {
+        BSecurity_GlobalFreeThreadSafe();
+    }
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return ret;
+}
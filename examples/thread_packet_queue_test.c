@@ -0,0 +1,209 @@
+/**
+ * @file thread_packet_queue_test.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Passes packets from one thread to another through a {@link BThreadPacketQueue},
+ * checking that they all arrive intact and in order, and reports the rate.
+ * The producer writes bursts of random size, and the consumer occasionally
+ * stalls, so that both the empty and the full queue are exercised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+#include <system/BThreadSignal.h>
+#include <system/BThreadPacketQueue.h>
+
+static int num_total;
+static int mtu;
+static BReactor producer_reactor;
+static BReactor consumer_reactor;
+static BThreadPacketQueue queue;
+static BThreadSignal quit_signal;
+static BPending produce_job;
+static int num_produced;
+static int num_consumed;
+static int num_blocked;
+static unsigned int producer_rand;
+static unsigned int consumer_rand;
+
+static unsigned int next_rand (unsigned int *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16);
+}
+
+static int packet_len (int seq)
+{
+    return (int)(((unsigned int)seq * 2654435761u) % (unsigned int)(mtu + 1));
+}
+
+static uint8_t packet_byte (int seq, int i)
+{
+    return (uint8_t)(seq * 31 + i);
+}
+
+static void produce_job_handler (void *user)
+{
+    // write a burst of packets
+    int burst = 1 + next_rand(&producer_rand) % 100;
+    
+    for (int i = 0; i < burst && num_produced < num_total; i++) {
+        uint8_t *data;
+        if (!BThreadPacketQueue_Producer_StartPacket(&queue, &data)) {
+            // continue when there is space
+            num_blocked++;
+            return;
+        }
+        
+        int len = packet_len(num_produced);
+        for (int j = 0; j < len; j++) {
+            data[j] = packet_byte(num_produced, j);
+        }
+        
+        BThreadPacketQueue_Producer_EndPacket(&queue, len);
+        num_produced++;
+    }
+    
+    if (num_produced < num_total) {
+        BPending_Set(&produce_job);
+    }
+}
+
+static void queue_handler_space (void *user)
+{
+    BPending_Set(&produce_job);
+}
+
+static void queue_handler_recv (void *user, uint8_t *data, int data_len)
+{
+    ASSERT_FORCE(num_consumed < num_total)
+    ASSERT_FORCE(data_len == packet_len(num_consumed))
+    
+    for (int j = 0; j < data_len; j++) {
+        ASSERT_FORCE(data[j] == packet_byte(num_consumed, j))
+    }
+    
+    num_consumed++;
+    
+    // stall sometimes, so the producer fills the queue
+    if (next_rand(&consumer_rand) % 1000 == 0) {
+        volatile int x = 0;
+        for (int i = 0; i < 100000; i++) {
+            x++;
+        }
+    }
+    
+    if (num_consumed == num_total) {
+        BReactor_Quit(&consumer_reactor, 0);
+    }
+}
+
+static void quit_signal_handler (BThreadSignal *thread_signal)
+{
+    BReactor_Quit(&producer_reactor, 0);
+}
+
+static void * producer_thread (void *unused)
+{
+    BReactor_Exec(&producer_reactor);
+    
+    return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <num_packets> <queue_packets> <mtu>\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    num_total = atoi(argv[1]);
+    int queue_packets = atoi(argv[2]);
+    mtu = atoi(argv[3]);
+    
+    if (num_total < 0 || queue_packets <= 0 || mtu < 0) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    ASSERT_FORCE(BReactor_Init(&producer_reactor))
+    ASSERT_FORCE(BReactor_Init(&consumer_reactor))
+    ASSERT_FORCE(BThreadPacketQueue_Init(&queue, mtu, queue_packets, &producer_reactor, &consumer_reactor, NULL, queue_handler_space, queue_handler_recv))
+    ASSERT_FORCE(BThreadSignal_Init(&quit_signal, &producer_reactor, quit_signal_handler))
+    
+    BPending_Init(&produce_job, BReactor_PendingGroup(&producer_reactor), produce_job_handler, NULL);
+    BPending_Set(&produce_job);
+    
+    num_produced = 0;
+    num_consumed = 0;
+    num_blocked = 0;
+    producer_rand = 1;
+    consumer_rand = 2;
+    
+    btime_t start = btime_gettime();
+    
+    pthread_t thread;
+    ASSERT_FORCE(pthread_create(&thread, NULL, producer_thread, NULL) == 0)
+    
+    if (num_total > 0) {
+        BReactor_Exec(&consumer_reactor);
+    }
+    
+    btime_t elapsed = btime_gettime() - start;
+    
+    ASSERT_FORCE(BThreadSignal_Thread_Signal(&quit_signal))
+    ASSERT_FORCE(pthread_join(thread, NULL) == 0)
+    
+    ASSERT_FORCE(num_produced == num_total)
+    ASSERT_FORCE(num_consumed == num_total)
+    
+    printf("packets=%d blocked=%d time=%dms rate=%.0f packets/s\n", num_total, num_blocked, (int)elapsed,
+           (elapsed > 0 ? 1000.0 * num_total / elapsed : 0.0));
+    
+    BPending_Free(&produce_job);
+    BThreadSignal_Free(&quit_signal);
+    BThreadPacketQueue_Free(&queue);
+    BReactor_Free(&consumer_reactor);
+    BReactor_Free(&producer_reactor);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
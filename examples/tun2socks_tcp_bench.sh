@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# Measures the throughput of one TCP download through tun2socks on localhost.
+# A TUN device is created, and a minimal SOCKS5 server redirects every
+# connection to a local HTTP server, which serves a file of the given size.
+# Extra arguments are passed to tun2socks, so that e.g. --tcp-mss, --tcp-wnd
+# and --tcp-snd-buf can be compared by running the script once for each.
+#
+# Usage: tun2socks_tcp_bench.sh <build-dir> [<size-MB>] [-- <extra tun2socks args>]
+#
+# Set TUN_MTU to try an MSS above 1460, e.g. TUN_MTU=9000 with --tcp-mss 8960.
+#
+# Needs root (to create the TUN device), python3 and curl.
+#
+
+set -e
+
+if [ "$#" -lt 1 ]; then
+    echo "Usage: $0 <build-dir> [<size-MB>] [-- <extra tun2socks args>]" >&2
+    exit 1
+fi
+
+BUILD_DIR=$1
+shift
+SIZE_MB=100
+if [ "$#" -gt 0 ] && [ "$1" != "--" ]; then
+    SIZE_MB=$1
+    shift
+fi
+if [ "$#" -gt 0 ] && [ "$1" = "--" ]; then
+    shift
+fi
+
+TUN2SOCKS=${BUILD_DIR}/tun2socks/badvpn-tun2socks
+TUNDEV=${TUNDEV:-t2sbench0}
+SOCKS_PORT=${SOCKS_PORT:-17200}
+HTTP_PORT=${HTTP_PORT:-17201}
+TUN_MTU=${TUN_MTU:-1500}
+
+WORKDIR=$(mktemp -d)
+PIDS=""
+cleanup () {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    ip tuntap del dev "$TUNDEV" mode tun 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+ip tuntap add dev "$TUNDEV" mode tun
+ip addr add 10.200.0.1/24 dev "$TUNDEV"
+ip link set "$TUNDEV" mtu "$TUN_MTU" up
+
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/zero > "$WORKDIR/blob"
+python3 -m http.server --bind 127.0.0.1 --directory "$WORKDIR" "$HTTP_PORT" >/dev/null 2>&1 &
+PIDS="$PIDS $!"
+
+cat > "$WORKDIR/socks.py" <<EOF
+import socket, threading
+
+def pipe (a, b):
+    try:
+        while True:
+            d = a.recv(65536)
+            if not d:
+                break
+            b.sendall(d)
+    except OSError:
+        pass
+    try:
+        b.shutdown(socket.SHUT_WR)
+    except OSError:
+        pass
+
+def recv_exact (c, n):
+    d = b''
+    while len(d) < n:
+        d += c.recv(n - len(d))
+    return d
+
+def handle (c):
+    nmethods = recv_exact(c, 2)[1]
+    recv_exact(c, nmethods)
+    c.sendall(b'\x05\x00')
+    atyp = recv_exact(c, 4)[3]
+    alen = {1: 4, 4: 16}.get(atyp) or recv_exact(c, 1)[0]
+    recv_exact(c, alen + 2)
+    r = socket.create_connection(('127.0.0.1', $HTTP_PORT))
+    c.sendall(b'\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00')
+    threading.Thread(target=pipe, args=(c, r), daemon=True).start()
+    pipe(r, c)
+
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', $SOCKS_PORT))
+s.listen(16)
+while True:
+    c, _ = s.accept()
+    threading.Thread(target=handle, args=(c,), daemon=True).start()
+EOF
+python3 "$WORKDIR/socks.py" &
+PIDS="$PIDS $!"
+
+"$TUN2SOCKS" --loglevel warning --tundev "$TUNDEV" --netif-ipaddr 10.200.0.2 \
+    --netif-netmask 255.255.255.0 --socks-server-addr "127.0.0.1:$SOCKS_PORT" "$@" &
+PIDS="$PIDS $!"
+
+# give the servers time to listen
+sleep 1
+
+# any address behind the virtual router works, the SOCKS server redirects it
+curl -s -o /dev/null -w "%{size_download} bytes in %{time_total} s, %{speed_download} bytes/s\n" \
+    "http://10.200.0.3/blob"
@@ -0,0 +1,141 @@
+/**
+ * @file udpgw_lookup_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/offset.h>
+#include <structure/BAVL.h>
+#include <udpgw_client/UdpGwClient.h>
+
+#include <udpgw_client/UdpGwClient_hash.h>
+#include <structure/CHash_impl.h>
+
+struct entry {
+    struct UdpGwClient_connection con;
+    BAVLNode tree_node;
+};
+
+static int conaddr_comparator (void *unused, void *v1, void *v2)
+{
+    struct UdpGwClient_conaddr *a1 = v1;
+    struct UdpGwClient_conaddr *a2 = v2;
+    
+    int r = BAddr_CompareOrder(&a1->remote_addr, &a2->remote_addr);
+    if (r) {
+        return r;
+    }
+    return BAddr_CompareOrder(&a1->local_addr, &a2->local_addr);
+}
+
+static struct UdpGwClient_conaddr random_conaddr (void)
+{
+    struct UdpGwClient_conaddr conaddr;
+    BAddr_InitIPv4(&conaddr.local_addr, hton32(0x0a000000 | (rand() & 0xffff)), hton16(1024 + rand() % 60000));
+    BAddr_InitIPv4(&conaddr.remote_addr, hton32(((uint32_t)rand() << 8) ^ rand()), hton16(53));
+    return conaddr;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <num_connections> <num_lookups>\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    int num_connections = atoi(argv[1]);
+    int num_lookups = atoi(argv[2]);
+    
+    if (num_connections <= 0 || num_lookups < 0) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    struct entry *entries = (struct entry *)BAllocArray(num_connections, sizeof(entries[0]));
+    ASSERT_FORCE(entries)
+    
+    int *order = (int *)BAllocArray(num_lookups, sizeof(order[0]));
+    ASSERT_FORCE(order)
+    
+    BAVL tree;
+    BAVL_Init(&tree, OFFSET_DIFF(struct entry, con.conaddr, tree_node), conaddr_comparator, NULL);
+    
+    UdpGwClient__ConaddrHash hash;
+    ASSERT_FORCE(UdpGwClient__ConaddrHash_Init(&hash, num_connections))
+    
+    for (int i = 0; i < num_connections; i++) {
+        struct entry *e = &entries[i];
+        do {
+            e->con.conaddr = random_conaddr();
+        } while (!BAVL_Insert(&tree, &e->tree_node, NULL));
+        e->con.conaddr_hash = UdpGwClient__conaddr_hash(e->con.conaddr);
+        e->con.conid = i;
+        
+        UdpGwClient__ConaddrHashRef ref = {&e->con, &e->con};
+        ASSERT_FORCE(UdpGwClient__ConaddrHash_Insert(&hash, 0, ref, NULL))
+    }
+    
+    for (int i = 0; i < num_lookups; i++) {
+        order[i] = rand() % num_connections;
+    }
+    
+    unsigned int sum;
+    clock_t start;
+    
+    sum = 0;
+    start = clock();
+    for (int i = 0; i < num_lookups; i++) {
+        BAVLNode *node = BAVL_LookupExact(&tree, &entries[order[i]].con.conaddr);
+        ASSERT_FORCE(node)
+        sum += UPPER_OBJECT(node, struct entry, tree_node)->con.conid;
+    }
+    printf("BAVL:  %.3f s (sum %u)\n", (double)(clock() - start) / CLOCKS_PER_SEC, sum);
+    
+    sum = 0;
+    start = clock();
+    for (int i = 0; i < num_lookups; i++) {
+        UdpGwClient__ConaddrHashRef ref = UdpGwClient__ConaddrHash_Lookup(&hash, 0, entries[order[i]].con.conaddr);
+        ASSERT_FORCE(ref.link)
+        sum += ref.ptr->conid;
+    }
+    printf("CHash: %.3f s (sum %u)\n", (double)(clock() - start) / CLOCKS_PER_SEC, sum);
+    
+    UdpGwClient__ConaddrHash_Free(&hash);
+    BFree(order);
+    BFree(entries);
+    
+    return 0;
+}
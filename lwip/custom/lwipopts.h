@@ -30,6 +30,8 @@
 #ifndef LWIP_CUSTOM_LWIPOPTS_H
 #define LWIP_CUSTOM_LWIPOPTS_H
 
+#include <stdint.h>
+
 #define NO_SYS 1
 #define LWIP_TIMERS 0
 #define MEM_ALIGNMENT 4
@@ -60,11 +62,42 @@
 #define LWIP_IPV6_AUTOCONFIG 0
 
 #define MEMP_NUM_TCP_PCB_LISTEN 16
+// with MEMP_MEM_MALLOC this is not a limit, the application has to
+// restrict the number of connections itself
 #define MEMP_NUM_TCP_PCB 1024
-#define TCP_MSS 1460
-#define TCP_SND_BUF 16384
+
+// The MSS, receive window and send buffer are runtime variables (see
+// custom/sys.c), so that applications can size them for the device MTU and
+// the bandwidth-delay product they expect; zero selects the default. They must
+// be set before lwip_init() and not changed afterwards, and the application
+// must check them like lwIP's sanity checks would.
+// In preprocessor conditions the variables read as zero, so lwIP's checks
+// there see the defaults.
+// The MSS is limited so that 4 * TCP_MSS fits in 16 bits, as lwIP expects;
+// this is still enough for jumbo frames.
+#define TCP_MSS (lwip_custom_tcp_mss ? lwip_custom_tcp_mss : TCP_MSS_DEFAULT)
+#define TCP_MSS_MIN 536
+#define TCP_MSS_LIMIT 8960
+#define TCP_MSS_DEFAULT 1460
+// Window scaling allows receive windows up to TCP_WND_LIMIT.
+#define LWIP_WND_SCALE 1
+#define TCP_RCV_SCALE 5
+#define TCP_WND (lwip_custom_tcp_wnd ? lwip_custom_tcp_wnd : TCP_WND_DEFAULT)
+#define TCP_WND_LIMIT (0xFFFFU << TCP_RCV_SCALE)
+#define TCP_WND_DEFAULT (4 * TCP_MSS)
+#define TCP_SND_BUF (lwip_custom_tcp_snd_buf ? lwip_custom_tcp_snd_buf : TCP_SND_BUF_DEFAULT)
+#define TCP_SND_BUF_LIMIT (1024 * 1024)
+#define TCP_SND_BUF_DEFAULT (2 * TCP_MSS > 16384 ? 2 * TCP_MSS : 16384)
 #define TCP_SND_QUEUELEN (4 * (TCP_SND_BUF)/(TCP_MSS))
 
+// pool buffers are chained, so they need not hold a whole segment; keep
+// their size constant as lwIP sizes the pool statically
+#define PBUF_POOL_BUFSIZE LWIP_MEM_ALIGN_SIZE(TCP_MSS_DEFAULT + 40 + PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN)
+
+extern uint32_t lwip_custom_tcp_mss;
+extern uint32_t lwip_custom_tcp_wnd;
+extern uint32_t lwip_custom_tcp_snd_buf;
+
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
 
@@ -31,6 +31,10 @@
 
 #include <lwip/sys.h>
 
+uint32_t lwip_custom_tcp_mss = 0;
+uint32_t lwip_custom_tcp_wnd = 0;
+uint32_t lwip_custom_tcp_snd_buf = 0;
+
 u32_t sys_now (void)
 {
     return btime_gettime();
@@ -197,6 +197,7 @@ static int add_expr_recurser (NCDEvaluator *o, NCDValue *value, NCDValMem *mem,
         
         case NCDVALUE_VAR: {
             struct NCDEvaluator__Var var;
+            var.slot = -1;
             
             if (!ncd_make_name_indices(o->string_index, NCDValue_VarName(value), &var.varnames, &var.num_names)) {
                 BLog(BLOG_ERROR, "ncd_make_name_indices failed");
@@ -319,7 +320,7 @@ static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, N
         case 0: {
             struct NCDEvaluator__Var *var = NCDEvaluator__VarVec_Get(&o->vars, index);
             
-            res = context->funcs->func_eval_var(context->funcs->user, var->varnames, var->num_names, mem, out);
+            res = context->funcs->func_eval_var(context->funcs->user, var->varnames, var->num_names, var->slot, mem, out);
         } break;
         
         case 1: {
@@ -384,7 +385,17 @@ void NCDEvaluator_Free (NCDEvaluator *o)
 
 int NCDEvaluatorExpr_Init (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDValue *value)
 {
-    return expr_init(&o->expr, eval, value);
+    // variables of this expression, including those in call arguments,
+    // are pushed to the var vector contiguously
+    o->vars_start = eval->vars.count;
+    
+    if (!expr_init(&o->expr, eval, value)) {
+        return 0;
+    }
+    
+    o->vars_end = eval->vars.count;
+    
+    return 1;
 }
 
 void NCDEvaluatorExpr_Free (NCDEvaluatorExpr *o)
@@ -392,6 +403,21 @@ void NCDEvaluatorExpr_Free (NCDEvaluatorExpr *o)
     expr_free(&o->expr);
 }
 
+void NCDEvaluatorExpr_ResolveSlots (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDEvaluator_resolve_slot_func func_resolve, void *user)
+{
+    ASSERT(o->vars_start <= o->vars_end)
+    ASSERT(o->vars_end <= eval->vars.count)
+    ASSERT(func_resolve)
+    
+    for (size_t i = o->vars_start; i < o->vars_end; i++) {
+        struct NCDEvaluator__Var *var = NCDEvaluator__VarVec_Get(&eval->vars, i);
+        ASSERT(var->num_names > 0)
+        
+        var->slot = func_resolve(user, var->varnames[0]);
+        ASSERT(var->slot >= -1)
+    }
+}
+
 int NCDEvaluatorExpr_Eval (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDEvaluator_EvalFuncs const *funcs, NCDValMem *out_newmem, NCDValRef *out_val)
 {
     ASSERT(funcs)
@@ -47,6 +47,7 @@ struct NCDEvaluator__Expr {
 struct NCDEvaluator__Var {
     NCD_string_id_t *varnames;
     size_t num_names;
+    int slot;
 };
 
 #include "NCDEvaluator_var_vec.h"
@@ -71,6 +72,8 @@ typedef struct {
 
 typedef struct {
     struct NCDEvaluator__Expr expr;
+    size_t vars_start;
+    size_t vars_end;
 } NCDEvaluatorExpr;
 
 typedef struct {
@@ -80,14 +83,22 @@ typedef struct {
 
 typedef struct {
     void *user;
-    int (*func_eval_var) (void *user, NCD_string_id_t const *varnames, size_t num_names, NCDValMem *mem, NCDValRef *out);
+    int (*func_eval_var) (void *user, NCD_string_id_t const *varnames, size_t num_names, int slot, NCDValMem *mem, NCDValRef *out);
     int (*func_eval_call) (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out);
 } NCDEvaluator_EvalFuncs;
 
+/**
+ * Resolves the first name of a variable reference to a slot, at load time.
+ * The returned slot is passed to func_eval_var
+ * each time the variable is evaluated; -1 means the name has no slot.
+ */
+typedef int (*NCDEvaluator_resolve_slot_func) (void *user, NCD_string_id_t name);
+
 int NCDEvaluator_Init (NCDEvaluator *o, NCDStringIndex *string_index) WARN_UNUSED;
 void NCDEvaluator_Free (NCDEvaluator *o);
 int NCDEvaluatorExpr_Init (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDValue *value) WARN_UNUSED;
 void NCDEvaluatorExpr_Free (NCDEvaluatorExpr *o);
+void NCDEvaluatorExpr_ResolveSlots (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDEvaluator_resolve_slot_func func_resolve, void *user);
 int NCDEvaluatorExpr_Eval (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDEvaluator_EvalFuncs const *funcs, NCDValMem *out_newmem, NCDValRef *out_val) WARN_UNUSED;
 size_t NCDEvaluatorArgs_Count (NCDEvaluatorArgs *o);
 int NCDEvaluatorArgs_EvalArg (NCDEvaluatorArgs *o, size_t index, NCDValMem *mem, NCDValRef *out_ref) WARN_UNUSED;
@@ -47,6 +47,7 @@ struct NCDInterpProcess__stmt {
     NCD_string_id_t cmdname;
     NCD_string_id_t *objnames;
     size_t num_objnames;
+    int objnames_slot;
     union {
         const struct NCDInterpModule *simple_module;
         int method_name_id;
@@ -57,6 +58,56 @@ struct NCDInterpProcess__stmt {
     int hash_next;
 };
 
+struct resolve_slot_context {
+    NCDInterpProcess *o;
+    int from_index;
+};
+
+static int find_statement (NCDInterpProcess *o, int from_index, NCD_string_id_t name)
+{
+    ASSERT(from_index >= 0)
+    ASSERT(from_index <= o->num_stmts)
+    
+    size_t bucket_idx = name % o->num_hash_buckets;
+    int stmt_idx = o->hash_buckets[bucket_idx];
+    ASSERT(stmt_idx >= -1)
+    ASSERT(stmt_idx < o->num_stmts)
+    
+    while (stmt_idx >= 0) {
+        if (stmt_idx < from_index && o->stmts[stmt_idx].name == name) {
+            return stmt_idx;
+        }
+        
+        stmt_idx = o->stmts[stmt_idx].hash_next;
+        ASSERT(stmt_idx >= -1)
+        ASSERT(stmt_idx < o->num_stmts)
+    }
+    
+    return -1;
+}
+
+static int resolve_slot_func (void *user, NCD_string_id_t name)
+{
+    struct resolve_slot_context *ctx = user;
+    
+    return find_statement(ctx->o, ctx->from_index, name);
+}
+
+static void resolve_slots (NCDInterpProcess *o, NCDEvaluator *eval)
+{
+    // Names visible to a statement are fixed by the program text, so
+    // bind them to statement indices now instead of searching each time
+    // the statement is (re)initialized.
+    for (int i = 0; i < o->num_stmts; i++) {
+        struct NCDInterpProcess__stmt *e = &o->stmts[i];
+        
+        e->objnames_slot = (e->objnames ? find_statement(o, i, e->objnames[0]) : -1);
+        
+        struct resolve_slot_context ctx = {o, i};
+        NCDEvaluatorExpr_ResolveSlots(&e->arg_expr, eval, resolve_slot_func, &ctx);
+    }
+}
+
 static int compute_prealloc (NCDInterpProcess *o)
 {
     int size = 0;
@@ -183,6 +234,8 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
     
     ASSERT(o->num_stmts == num_stmts)
     
+    resolve_slots(o, eval);
+    
     DebugObject_Init(&o->d_obj);
     return 1;
     
@@ -222,22 +275,7 @@ int NCDInterpProcess_FindStatement (NCDInterpProcess *o, int from_index, NCD_str
     ASSERT(from_index >= 0)
     ASSERT(from_index <= o->num_stmts)
     
-    size_t bucket_idx = name % o->num_hash_buckets;
-    int stmt_idx = o->hash_buckets[bucket_idx];
-    ASSERT(stmt_idx >= -1)
-    ASSERT(stmt_idx < o->num_stmts)
-    
-    while (stmt_idx >= 0) {
-        if (stmt_idx < from_index && o->stmts[stmt_idx].name == name) {
-            return stmt_idx;
-        }
-        
-        stmt_idx = o->stmts[stmt_idx].hash_next;
-        ASSERT(stmt_idx >= -1)
-        ASSERT(stmt_idx < o->num_stmts)
-    }
-    
-    return -1;
+    return find_statement(o, from_index, name);
 }
 
 const char * NCDInterpProcess_StatementCmdName (NCDInterpProcess *o, int i, NCDStringIndex *string_index)
@@ -262,6 +300,16 @@ void NCDInterpProcess_StatementObjNames (NCDInterpProcess *o, int i, const NCD_s
     *out_num_objnames = o->stmts[i].num_objnames;
 }
 
+int NCDInterpProcess_StatementObjSlot (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(o->stmts[i].objnames)
+    
+    return o->stmts[i].objnames_slot;
+}
+
 const struct NCDInterpModule * NCDInterpProcess_StatementGetSimpleModule (NCDInterpProcess *o, int i, NCDStringIndex *string_index, NCDModuleIndex *module_index)
 {
     DebugObject_Access(&o->d_obj);
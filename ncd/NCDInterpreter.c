@@ -103,13 +103,14 @@ static void process_work_job_handler_working (struct process *p);
 static void process_work_job_handler_up (struct process *p);
 static void process_work_job_handler_waiting (struct process *p);
 static void process_work_job_handler_terminating (struct process *p);
-static int eval_func_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, NCDValMem *mem, NCDValRef *out);
+static int eval_func_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, int slot, NCDValMem *mem, NCDValRef *out);
 static int eval_func_eval_call (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out);
 static void process_advance (struct process *p);
 static void process_wait_timer_handler (BSmallTimer *timer);
 static int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDObject *out_object);
-static int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object);
-static int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value);
+static int process_slot_object (struct process *p, int slot, NCD_string_id_t name, NCDObject *out_object);
+static int process_resolve_object_expr (struct process *p, int slot, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object);
+static int process_resolve_variable_expr (struct process *p, int slot, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value);
 static void statement_logfunc (struct statement *ps);
 static void statement_log (struct statement *ps, int level, const char *fmt, ...);
 static struct process * statement_process (struct statement *ps);
@@ -823,15 +824,17 @@ again:
     return;
 }
 
-int eval_func_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, NCDValMem *mem, NCDValRef *out)
+int eval_func_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, int slot, NCDValMem *mem, NCDValRef *out)
 {
     struct process *p = user;
     ASSERT(varnames)
     ASSERT(num_names > 0)
+    ASSERT(slot >= -1)
+    ASSERT(slot < p->ap)
     ASSERT(mem)
     ASSERT(out)
     
-    return process_resolve_variable_expr(p, p->ap, varnames, num_names, mem, out);
+    return process_resolve_variable_expr(p, slot, varnames, num_names, mem, out);
 }
 
 static int eval_func_eval_call (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out)
@@ -889,7 +892,8 @@ void process_advance (struct process *p)
     } else {
         // get object
         NCDObject object;
-        if (!process_resolve_object_expr(p, p->ap, objnames, num_objnames, &object)) {
+        int slot = NCDInterpProcess_StatementObjSlot(p->iprocess, p->ap);
+        if (!process_resolve_object_expr(p, slot, objnames, num_objnames, &object)) {
             goto fail0;
         }
         
@@ -980,13 +984,22 @@ int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDOb
     ASSERT(pos <= p->num_statements)
     ASSERT(out_object)
     
-    int i = NCDInterpProcess_FindStatement(p->iprocess, pos, name);
-    if (i >= 0) {
-        struct statement *ps = &p->statements[i];
-        ASSERT(i < p->num_statements)
+    int slot = NCDInterpProcess_FindStatement(p->iprocess, pos, name);
+    
+    return process_slot_object(p, slot, name, out_object);
+}
+
+int process_slot_object (struct process *p, int slot, NCD_string_id_t name, NCDObject *out_object)
+{
+    ASSERT(slot >= -1)
+    ASSERT(slot < p->num_statements)
+    ASSERT(out_object)
+    
+    if (slot >= 0) {
+        struct statement *ps = &p->statements[slot];
         
         if (ps->inst.istate == SSTATE_FORGOTTEN) {
-            process_log(p, BLOG_ERROR, "statement (%d) is uninitialized", i);
+            process_log(p, BLOG_ERROR, "statement (%d) is uninitialized", slot);
             return 0;
         }
         
@@ -1001,16 +1014,16 @@ int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDOb
     return 0;
 }
 
-int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object)
+int process_resolve_object_expr (struct process *p, int slot, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object)
 {
-    ASSERT(pos >= 0)
-    ASSERT(pos <= p->num_statements)
+    ASSERT(slot >= -1)
+    ASSERT(slot < p->ap)
     ASSERT(names)
     ASSERT(num_names > 0)
     ASSERT(out_object)
     
     NCDObject object;
-    if (!process_find_object(p, pos, names[0], &object)) {
+    if (!process_slot_object(p, slot, names[0], &object)) {
         goto fail;
     }
     
@@ -1022,22 +1035,22 @@ int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id
     
 fail:;
     char *name = implode_id_strings(p->interp, names, num_names, '.');
-    process_log(p, BLOG_ERROR, "failed to resolve object (%s) from position %zu", (name ? name : ""), pos);
+    process_log(p, BLOG_ERROR, "failed to resolve object (%s) from position %d", (name ? name : ""), p->ap);
     free(name);
     return 0;
 }
 
-int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value)
+int process_resolve_variable_expr (struct process *p, int slot, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value)
 {
-    ASSERT(pos >= 0)
-    ASSERT(pos <= p->num_statements)
+    ASSERT(slot >= -1)
+    ASSERT(slot < p->ap)
     ASSERT(names)
     ASSERT(num_names > 0)
     ASSERT(mem)
     ASSERT(out_value)
     
     NCDObject object;
-    if (!process_find_object(p, pos, names[0], &object)) {
+    if (!process_slot_object(p, slot, names[0], &object)) {
         goto fail;
     }
     
@@ -1049,7 +1062,7 @@ int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_
     
 fail:;
     char *name = implode_id_strings(p->interp, names, num_names, '.');
-    process_log(p, BLOG_ERROR, "failed to resolve variable (%s) from position %zu", (name ? name : ""), pos);
+    process_log(p, BLOG_ERROR, "failed to resolve variable (%s) from position %d", (name ? name : ""), p->ap);
     free(name);
     return 0;
 }
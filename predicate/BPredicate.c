@@ -44,7 +44,59 @@
 
 #include <generated/blog_channel_BPredicate.h>
 
-static int eval_predicate_node (BPredicate *p, struct predicate_node *root);
+#define PROG_CONST 1
+#define PROG_NOT 2
+#define PROG_JUMP_IF_FALSE 3
+#define PROG_JUMP_IF_TRUE 4
+#define PROG_PUSH 5
+#define PROG_CALL 6
+#define PROG_ERROR 7
+
+#define PROG_ERROR_UNKNOWN_FUNCTION 0
+#define PROG_ERROR_NOT_ENOUGH_ARGS 1
+#define PROG_ERROR_EXPECTING_PREDICATE 2
+#define PROG_ERROR_EXPECTING_STRING 3
+#define PROG_ERROR_TOO_MANY_ARGS 4
+
+static const char *program_error_messages[] = {
+    "unknown function",
+    "not enough arguments",
+    "expecting predicate argument",
+    "expecting string argument",
+    "too many arguments"
+};
+
+struct program_instr {
+    int op;
+    int arg;
+};
+
+struct program_call {
+    BPredicateFunction *func;
+    // arguments, with the strings filled in
+    void *args[PREDICATE_MAX_ARGS];
+    // which arguments are logical; their values are on the stack
+    int bool_args[PREDICATE_MAX_ARGS];
+    int num_bool_args;
+    // slot for remembering the result within an evaluation, or -1
+    int memo_slot;
+};
+
+struct program {
+    struct program_instr *code;
+    int code_len;
+    int code_size;
+    struct program_call *calls;
+    int num_calls;
+    int calls_size;
+    int num_memo;
+    int *memo;
+    int stack_depth;
+    int stack_max;
+    int *stack;
+};
+
+static int compile_node (BPredicate *p, struct program *prog, struct predicate_node *root);
 
 void yyerror (YYLTYPE *yylloc, yyscan_t scanner, struct predicate_node **result, char *str)
 {
@@ -56,7 +108,85 @@ static int string_comparator (void *user, char *s1, char *s2)
     return B_COMPARE(cmp, 0);
 }
 
-static int eval_function (BPredicate *p, struct predicate_node *root)
+static void free_program (struct program *prog)
+{
+    BFree(prog->stack);
+    BFree(prog->memo);
+    BFree(prog->calls);
+    BFree(prog->code);
+    free(prog);
+}
+
+static int emit (struct program *prog, int op, int arg)
+{
+    if (prog->code_len == prog->code_size) {
+        int new_size = (prog->code_size > 0 ? 2 * prog->code_size : 16);
+        struct program_instr *new_code = (struct program_instr *)BReallocArray(prog->code, new_size, sizeof(new_code[0]));
+        if (!new_code) {
+            return 0;
+        }
+        prog->code = new_code;
+        prog->code_size = new_size;
+    }
+    
+    prog->code[prog->code_len].op = op;
+    prog->code[prog->code_len].arg = arg;
+    prog->code_len++;
+    
+    return 1;
+}
+
+static int find_memo_call (struct program *prog, struct program_call *c)
+{
+    for (int i = 0; i < prog->num_calls; i++) {
+        struct program_call *oc = &prog->calls[i];
+        if (oc->memo_slot < 0 || oc->func != c->func) {
+            continue;
+        }
+        
+        int j;
+        for (j = 0; j < c->func->num_args; j++) {
+            if (strcmp((char *)oc->args[j], (char *)c->args[j])) {
+                break;
+            }
+        }
+        if (j == c->func->num_args) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static int add_call (struct program *prog, struct program_call *c)
+{
+    // with only string arguments, the call is the same as any other like it
+    if (c->num_bool_args == 0) {
+        int i = find_memo_call(prog, c);
+        if (i >= 0) {
+            return i;
+        }
+        c->memo_slot = prog->num_memo++;
+    } else {
+        c->memo_slot = -1;
+    }
+    
+    if (prog->num_calls == prog->calls_size) {
+        int new_size = (prog->calls_size > 0 ? 2 * prog->calls_size : 4);
+        struct program_call *new_calls = (struct program_call *)BReallocArray(prog->calls, new_size, sizeof(new_calls[0]));
+        if (!new_calls) {
+            return -1;
+        }
+        prog->calls = new_calls;
+        prog->calls_size = new_size;
+    }
+    
+    prog->calls[prog->num_calls] = *c;
+    
+    return prog->num_calls++;
+}
+
+static int compile_function (BPredicate *p, struct program *prog, struct predicate_node *root)
 {
     ASSERT(root->type == NODE_FUNCTION)
     
@@ -64,121 +194,234 @@ static int eval_function (BPredicate *p, struct predicate_node *root)
     ASSERT(root->function.name)
     BAVLNode *tree_node;
     if (!(tree_node = BAVL_LookupExact(&p->functions_tree, root->function.name))) {
-        BLog(BLOG_WARNING, "unknown function");
-        return 0;
+        return emit(prog, PROG_ERROR, PROG_ERROR_UNKNOWN_FUNCTION);
     }
     BPredicateFunction *func = UPPER_OBJECT(tree_node, BPredicateFunction, tree_node);
     
-    // evaluate arguments
+    struct program_call c;
+    c.func = func;
+    c.num_bool_args = 0;
+    
+    // compile arguments; logical ones leave their values on the stack
     struct arguments_node *arg = root->function.args;
-    void *args[PREDICATE_MAX_ARGS];
+    int error = -1;
     for (int i = 0; i < func->num_args; i++) {
         if (!arg) {
-            BLog(BLOG_WARNING, "not enough arguments");
-            return 0;
+            error = PROG_ERROR_NOT_ENOUGH_ARGS;
+            break;
         }
         switch (func->args[i]) {
             case PREDICATE_TYPE_BOOL:
                 if (arg->arg.type != ARGUMENT_PREDICATE) {
-                    BLog(BLOG_WARNING, "expecting predicate argument");
-                    return 0;
+                    error = PROG_ERROR_EXPECTING_PREDICATE;
+                    break;
                 }
-                if (!eval_predicate_node(p, arg->arg.predicate)) {
+                if (!compile_node(p, prog, arg->arg.predicate) || !emit(prog, PROG_PUSH, 0)) {
                     return 0;
                 }
-                args[i] = &arg->arg.predicate->eval_value;
+                if (++prog->stack_depth > prog->stack_max) {
+                    prog->stack_max = prog->stack_depth;
+                }
+                c.args[i] = NULL;
+                c.bool_args[c.num_bool_args++] = i;
                 break;
             case PREDICATE_TYPE_STRING:
                 if (arg->arg.type != ARGUMENT_STRING) {
-                    BLog(BLOG_WARNING, "expecting string argument");
-                    return 0;
+                    error = PROG_ERROR_EXPECTING_STRING;
+                    break;
                 }
-                args[i] = arg->arg.string;
+                c.args[i] = arg->arg.string;
                 break;
             default:
                 ASSERT(0);
         }
+        if (error >= 0) {
+            break;
+        }
         arg = arg->next;
     }
     
-    if (arg) {
-        BLog(BLOG_WARNING, "too many arguments");
-        return 0;
+    if (error < 0 && arg) {
+        error = PROG_ERROR_TOO_MANY_ARGS;
     }
     
-    // call callback
-    #ifndef NDEBUG
-    p->in_function = 1;
-    #endif
-    int res = func->callback(func->user, args);
-    #ifndef NDEBUG
-    p->in_function = 0;
-    #endif
-    if (res != 0 && res != 1) {
-        BLog(BLOG_WARNING, "callback returned non-boolean");
+    // the arguments are popped by the call, or abandoned by the error
+    prog->stack_depth -= c.num_bool_args;
+    
+    if (error >= 0) {
+        return emit(prog, PROG_ERROR, error);
+    }
+    
+    int call_index = add_call(prog, &c);
+    if (call_index < 0) {
         return 0;
     }
     
-    root->eval_value = res;
-    return 1;
+    return emit(prog, PROG_CALL, call_index);
 }
 
-int eval_predicate_node (BPredicate *p, struct predicate_node *root)
+int compile_node (BPredicate *p, struct program *prog, struct predicate_node *root)
 {
     ASSERT(root)
     
+    int jump_pos;
+    
     switch (root->type) {
         case NODE_CONSTANT:
-            root->eval_value = root->constant.val;
-            return 1;
+            return emit(prog, PROG_CONST, root->constant.val);
         case NODE_NEG:
-            if (!eval_predicate_node(p, root->neg.op)) {
-                return 0;
-            }
-            root->eval_value = !root->neg.op->eval_value;
-            return 1;
+            return compile_node(p, prog, root->neg.op) && emit(prog, PROG_NOT, 0);
         case NODE_CONJUNCT:
-            if (!eval_predicate_node(p, root->conjunct.op1)) {
+            if (!compile_node(p, prog, root->conjunct.op1)) {
                 return 0;
             }
-            if (!root->conjunct.op1->eval_value) {
-                root->eval_value = 0;
-                return 1;
-            }
-            if (!eval_predicate_node(p, root->conjunct.op2)) {
+            jump_pos = prog->code_len;
+            if (!emit(prog, PROG_JUMP_IF_FALSE, -1) || !compile_node(p, prog, root->conjunct.op2)) {
                 return 0;
             }
-            if (!root->conjunct.op2->eval_value) {
-                root->eval_value = 0;
-                return 1;
-            }
-            root->eval_value = 1;
+            prog->code[jump_pos].arg = prog->code_len;
             return 1;
         case NODE_DISJUNCT:
-            if (!eval_predicate_node(p, root->disjunct.op1)) {
+            if (!compile_node(p, prog, root->disjunct.op1)) {
                 return 0;
             }
-            if (root->disjunct.op1->eval_value) {
-                root->eval_value = 1;
-                return 1;
-            }
-            if (!eval_predicate_node(p, root->disjunct.op2)) {
+            jump_pos = prog->code_len;
+            if (!emit(prog, PROG_JUMP_IF_TRUE, -1) || !compile_node(p, prog, root->disjunct.op2)) {
                 return 0;
             }
-            if (root->disjunct.op2->eval_value) {
-                root->eval_value = 1;
-                return 1;
-            }
-            root->eval_value = 0;
+            prog->code[jump_pos].arg = prog->code_len;
             return 1;
         case NODE_FUNCTION:
-            return eval_function(p, root);
+            return compile_function(p, prog, root);
         default:
             ASSERT(0)
             return 0;
     }
 }
 
+static struct program * compile (BPredicate *p)
+{
+    struct program *prog = (struct program *)malloc(sizeof(*prog));
+    if (!prog) {
+        return NULL;
+    }
+    
+    prog->code = NULL;
+    prog->code_len = 0;
+    prog->code_size = 0;
+    prog->calls = NULL;
+    prog->num_calls = 0;
+    prog->calls_size = 0;
+    prog->num_memo = 0;
+    prog->memo = NULL;
+    prog->stack_depth = 0;
+    prog->stack_max = 0;
+    prog->stack = NULL;
+    
+    if (!compile_node(p, prog, (struct predicate_node *)p->root)) {
+        goto fail;
+    }
+    ASSERT(prog->stack_depth == 0)
+    
+    if (prog->num_memo > 0 && !(prog->memo = (int *)BAllocArray(prog->num_memo, sizeof(prog->memo[0])))) {
+        goto fail;
+    }
+    
+    if (prog->stack_max > 0 && !(prog->stack = (int *)BAllocArray(prog->stack_max, sizeof(prog->stack[0])))) {
+        goto fail;
+    }
+    
+    return prog;
+    
+fail:
+    free_program(prog);
+    return NULL;
+}
+
+static int run (BPredicate *p, struct program *prog)
+{
+    // forget results of the previous evaluation
+    for (int i = 0; i < prog->num_memo; i++) {
+        prog->memo[i] = -1;
+    }
+    
+    int acc = 0;
+    int sp = 0;
+    
+    for (int pc = 0; pc < prog->code_len; pc++) {
+        struct program_instr *in = &prog->code[pc];
+        
+        switch (in->op) {
+            case PROG_CONST:
+                acc = in->arg;
+                break;
+            case PROG_NOT:
+                acc = !acc;
+                break;
+            case PROG_JUMP_IF_FALSE:
+                if (!acc) {
+                    pc = in->arg - 1;
+                }
+                break;
+            case PROG_JUMP_IF_TRUE:
+                if (acc) {
+                    pc = in->arg - 1;
+                }
+                break;
+            case PROG_PUSH:
+                ASSERT(sp < prog->stack_max)
+                prog->stack[sp++] = acc;
+                break;
+            case PROG_CALL: {
+                struct program_call *c = &prog->calls[in->arg];
+                
+                if (c->memo_slot >= 0 && prog->memo[c->memo_slot] >= 0) {
+                    acc = prog->memo[c->memo_slot];
+                    break;
+                }
+                
+                // build arguments, pointing the logical ones to the stack
+                void *args[PREDICATE_MAX_ARGS];
+                memcpy(args, c->args, c->func->num_args * sizeof(args[0]));
+                ASSERT(sp >= c->num_bool_args)
+                sp -= c->num_bool_args;
+                for (int i = 0; i < c->num_bool_args; i++) {
+                    args[c->bool_args[i]] = &prog->stack[sp + i];
+                }
+                
+                // call callback
+                #ifndef NDEBUG
+                p->in_function = 1;
+                #endif
+                int res = c->func->callback(c->func->user, args);
+                #ifndef NDEBUG
+                p->in_function = 0;
+                #endif
+                if (res != 0 && res != 1) {
+                    BLog(BLOG_WARNING, "callback returned non-boolean");
+                    return -1;
+                }
+                
+                if (c->memo_slot >= 0) {
+                    prog->memo[c->memo_slot] = res;
+                }
+                
+                acc = res;
+            } break;
+            case PROG_ERROR:
+                BLog(BLOG_WARNING, "%s", program_error_messages[in->arg]);
+                return -1;
+            default:
+                ASSERT(0)
+                return -1;
+        }
+    }
+    
+    ASSERT(sp == 0)
+    
+    return acc;
+}
+
 int BPredicate_Init (BPredicate *p, char *str)
 {
     // initialize input buffer object
@@ -210,6 +453,9 @@ int BPredicate_Init (BPredicate *p, char *str)
     // init functions tree
     BAVL_Init(&p->functions_tree, OFFSET_DIFF(BPredicateFunction, name, tree_node), (BAVL_comparator)string_comparator, NULL);
     
+    // not compiled yet
+    p->program = NULL;
+    
     // init debuggind
     #ifndef NDEBUG
     p->in_function = 0;
@@ -229,6 +475,11 @@ void BPredicate_Free (BPredicate *p)
     // free debug object
     DebugObject_Free(&p->d_obj);
     
+    // free program
+    if (p->program) {
+        free_program((struct program *)p->program);
+    }
+    
     // free tree
     free_predicate_node((struct predicate_node *)p->root);
 }
@@ -237,11 +488,21 @@ int BPredicate_Eval (BPredicate *p)
 {
     ASSERT(!p->in_function)
     
-    if (!eval_predicate_node(p, (struct predicate_node *)p->root)) {
+    // compile if the functions have changed
+    if (!p->program && !(p->program = compile(p))) {
+        BLog(BLOG_ERROR, "failed to compile");
         return -1;
     }
     
-    return ((struct predicate_node *)p->root)->eval_value;
+    return run(p, (struct program *)p->program);
+}
+
+static void invalidate_program (BPredicate *p)
+{
+    if (p->program) {
+        free_program((struct program *)p->program);
+        p->program = NULL;
+    }
 }
 
 void BPredicateFunction_Init (BPredicateFunction *o, BPredicate *p, char *name, int *args, int num_args, BPredicate_callback callback, void *user)
@@ -266,6 +527,9 @@ void BPredicateFunction_Init (BPredicateFunction *o, BPredicate *p, char *name,
     // add to tree
     ASSERT_EXECUTE(BAVL_Insert(&p->functions_tree, &o->tree_node, NULL))
     
+    // the program may refer to this name
+    invalidate_program(p);
+    
     // init debug object
     DebugObject_Init(&o->d_obj);
 }
@@ -281,4 +545,7 @@ void BPredicateFunction_Free (BPredicateFunction *o)
     
     // remove from tree
     BAVL_Remove(&p->functions_tree, &o->tree_node);
+    
+    // the program may refer to this function
+    invalidate_program(p);
 }
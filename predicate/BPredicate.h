@@ -72,6 +72,12 @@
  *     Then the handler function is called. If it returns anything other
  *     than 1 and 0, the function evaluates to error. Otherwise it evaluates
  *     to what the handler function returned.
+ * 
+ * The expression is compiled to bytecode on the first evaluation after the
+ * set of custom functions changes, so that evaluation does not look up
+ * functions by name. Within one evaluation, calls of the same function
+ * with the same string arguments, and no logical arguments, invoke the
+ * handler function only once.
  */
 
 #ifndef BADVPN_PREDICATE_BPREDICATE_H
@@ -107,6 +113,7 @@ typedef struct {
     DebugObject d_obj;
     void *root;
     BAVL functions_tree;
+    void *program;
     #ifndef NDEBUG
     int in_function;
     #endif
@@ -66,7 +66,6 @@ struct predicate_node {
             struct arguments_node *args;
         } function;
     };
-    int eval_value;
 };
 
 #define ARGUMENT_INVALID 0
@@ -0,0 +1,199 @@
+/**
+ * @file linkproto.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Definitions for LinkProto, the protocol that the servers of a cluster
+ * communicate in with each other.
+ * 
+ * All multi-byte integers in structs are little-endian, unless stated otherwise.
+ * 
+ * Each server of a cluster has a cluster ID, and the IDs of the clients it
+ * accepts have this cluster ID in their top LP_SERVER_ID_BITS bits. The
+ * servers are connected in a full mesh, the server with the higher cluster
+ * ID connecting to the one with the lower ID. A link is a TCP connection
+ * carrying LinkProto packets, each encoded with PacketProto. If the servers
+ * use SSL, the link goes over TLS, with each server acting as the TLS server
+ * on connections it accepts and presenting its own certificate either way.
+ * 
+ * A LinkProto packet consists of:
+ *   - a header (struct {@link lp_header}) which contains the type of the
+ *     packet and the ID of the client the packet is about
+ *   - the payload
+ * 
+ * Both servers start by sending a "hello" packet, which contains their
+ * cluster ID. Then each server sends a "newclient" packet for each of its
+ * clients, and later "newclient" and "endclient" packets as its clients come
+ * and go. A server treats the other server's clients as its own, except that
+ * it does not inform them about peers; their own server does that.
+ * 
+ * Messages from a client to a client on the other server go into "data"
+ * packets, which contain the "inmsg" SCProto packet for the destination
+ * client. If a server resets a pair of clients where one of them is on the
+ * other server, it sends it a "resetpeer" packet, and the other server resets
+ * the pair too.
+ * 
+ * With SSL, a server accepts a link only if the other server's certificate is
+ * valid for TLS server usage and has the same subject as its own certificate.
+ * Without SSL, links carry client certificates and messages unencrypted, so
+ * they must only be used within a trusted network.
+ */
+
+#ifndef BADVPN_PROTOCOL_LINKPROTO_H
+#define BADVPN_PROTOCOL_LINKPROTO_H
+
+#include <stdint.h>
+
+#include <misc/packed.h>
+#include <protocol/scproto.h>
+
+#define LP_VERSION 1
+
+#define LP_KEEPALIVE_INTERVAL 10000
+
+// number of top bits in a client ID which are the cluster ID of its server
+#define LP_SERVER_ID_BITS 4
+#define LP_MAX_SERVERS (1 << LP_SERVER_ID_BITS)
+#define LP_CLIENT_ID_BITS (16 - LP_SERVER_ID_BITS)
+#define LP_CLIENT_ID_MASK ((1 << LP_CLIENT_ID_BITS) - 1)
+
+#define LP_SERVER_OF_CLIENT(_id) ((_id) >> LP_CLIENT_ID_BITS)
+
+/**
+ * LinkProto packet header.
+ */
+B_START_PACKED
+struct lp_header {
+    /**
+     * Message type.
+     */
+    uint8_t type;
+    
+    /**
+     * ID of the client the packet is about. Not used in "hello"
+     * and "keepalive" packets.
+     */
+    peerid_t id;
+} B_PACKED;
+B_END_PACKED
+
+#define LPID_KEEPALIVE 0
+#define LPID_HELLO 1
+#define LPID_NEWCLIENT 2
+#define LPID_ENDCLIENT 3
+#define LPID_DATA 4
+#define LPID_RESETPEER 5
+
+/**
+ * "hello" packet payload.
+ * Packet type is LPID_HELLO.
+ */
+B_START_PACKED
+struct lp_hello {
+    /**
+     * Protocol version the server is using.
+     */
+    uint16_t version;
+    
+    /**
+     * Cluster ID of the server.
+     */
+    uint8_t server_id;
+} B_PACKED;
+B_END_PACKED
+
+/**
+ * "newclient" packet payload, about the client in the header, which is
+ * connected to the sending server.
+ * Packet type is LPID_NEWCLIENT.
+ * Follows the client's certificate, its certificate as sent to clients with
+ * version SC_OLDVERSION_BROKENCERT, and its common name, with the lengths
+ * given here.
+ */
+B_START_PACKED
+struct lp_newclient {
+    /**
+     * SCProto version of the client.
+     */
+    uint16_t version;
+    
+    /**
+     * Type of the client's IP address: 4, 6, or 0 if none.
+     */
+    uint8_t addr_type;
+    
+    /**
+     * Client's IP address (network byte order). For IPv4,
+     * only the first four bytes are used.
+     */
+    uint8_t addr[16];
+    
+    /**
+     * Length of the certificate.
+     */
+    uint16_t cert_len;
+    
+    /**
+     * Length of the old certificate.
+     */
+    uint16_t cert_old_len;
+    
+    /**
+     * Length of the common name, without a null terminator.
+     */
+    uint16_t common_name_len;
+} B_PACKED;
+B_END_PACKED
+
+#define LP_MAX_COMMON_NAME_LEN 512
+
+#define LP_MAX_NEWCLIENT_PAYLOAD (sizeof(struct lp_newclient) + 2 * SCID_NEWCLIENT_MAX_CERT_LEN + LP_MAX_COMMON_NAME_LEN)
+
+/**
+ * "resetpeer" packet payload. The client in the header is connected
+ * to the sending server, and the peer to the receiving one.
+ * Packet type is LPID_RESETPEER.
+ */
+B_START_PACKED
+struct lp_resetpeer {
+    /**
+     * ID of the peer to reset.
+     */
+    peerid_t peerid;
+} B_PACKED;
+B_END_PACKED
+
+/*
+ * "data" packets are about a client of the receiving server, and their
+ * payload is a SCProto packet of type SCID_INMSG for it.
+ */
+
+#define LP_MAX_PAYLOAD (LP_MAX_NEWCLIENT_PAYLOAD > SC_MAX_ENC ? LP_MAX_NEWCLIENT_PAYLOAD : SC_MAX_ENC)
+#define LP_MAX_ENC (sizeof(struct lp_header) + LP_MAX_PAYLOAD)
+
+#endif
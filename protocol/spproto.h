@@ -40,18 +40,42 @@
  *   - One-time passwords. Adds a password to each packet
  *     for the receiver to recognize. Protects agains replaying
  *     packets and crafting new packets.
+ *   - Sequence numbers. Adds a 64-bit sequence number to each
+ *     packet, and the receiver rejects sequence numbers it has
+ *     already seen or which are too old for its replay window.
+ *     Requires encryption and hashes, or an AEAD cipher, since
+ *     otherwise a forged packet could advance the window.
+ *     Protects against replaying packets, without needing seeds.
  * 
  * A SPProto plaintext packet contains the following, in order:
  *   - if OTPs are used, a struct {@link spproto_otpdata} which contains
  *     the seed ID and the OTP,
+ *   - if sequence numbers are used, the sequence number as a 64-bit
+ *     little-endian integer. It starts at zero when the encryption key
+ *     is set.
  *   - if hashes are used, the hash,
  *   - payload data.
  * 
- * If encryption is used:
+ * If encryption is used with a block cipher:
  *   - the plaintext is padded by appending a 0x01 byte and as many 0x00
  *     bytes as needed to align to block size,
  *   - the padded plaintext is encrypted, and
  *   - the initialization vector (IV) is prepended.
+ * 
+ * If encryption is used with an AEAD cipher, hashes must not be used, since
+ * the cipher authenticates the packet itself. In this case:
+ *   - the plaintext is encrypted without padding,
+ *   - the nonce (BENCRYPTION_AEAD_NONCE_SIZE bytes) is prepended, and
+ *   - the authentication tag (BENCRYPTION_AEAD_TAG_SIZE bytes) is appended.
+ * The nonce consists of a 4-byte random prefix chosen when the key is set and
+ * a 64-bit big-endian packet counter.
+ * 
+ * With an AEAD cipher or sequence numbers, the key shared by the peers is
+ * not used directly.
+ * Each direction uses its own key, derived from the shared key (see
+ * {@link spproto_derive_direction_key}), so that the two senders never use the
+ * same nonce with the same key, and packets cannot be reflected back to
+ * their sender.
  */
 
 #ifndef BADVPN_PROTOCOL_SPPROTO_H
@@ -66,10 +90,12 @@
 #include <security/BHash.h>
 #include <security/BEncryption.h>
 #include <security/OTPCalculator.h>
+#include <security/ReplayWindow.h>
 
 #define SPPROTO_HASH_MODE_NONE 0
 #define SPPROTO_ENCRYPTION_MODE_NONE 0
 #define SPPROTO_OTP_MODE_NONE 0
+#define SPPROTO_REPLAY_WINDOW_NONE 0
 
 /**
  * Stores security parameters for SPProto.
@@ -101,6 +127,14 @@ struct spproto_security_params {
      * OTPs generated from a single seed.
      */
     int otp_num;
+    
+    /**
+     * Replay window for sequence numbers.
+     * Either SPPROTO_REPLAY_WINDOW_NONE for no sequence numbers, or the
+     * number of most recent sequence numbers the receiver keeps track of,
+     * at most REPLAYWINDOW_MAX_SIZE.
+     */
+    int replay_window;
 };
 
 #define SPPROTO_HAVE_HASH(_params) ((_params).hash_mode != SPPROTO_HASH_MODE_NONE)
@@ -112,6 +146,13 @@ struct spproto_security_params {
 
 #define SPPROTO_HAVE_ENCRYPTION(_params) ((_params).encryption_mode != SPPROTO_ENCRYPTION_MODE_NONE)
 
+#define SPPROTO_HAVE_AEAD(_params) (SPPROTO_HAVE_ENCRYPTION(_params) && BEncryption_cipher_is_aead((_params).encryption_mode))
+
+#define SPPROTO_AEAD_NONCE_PREFIX_LEN 4
+#define SPPROTO_AEAD_NONCE_COUNTER_OFF SPPROTO_AEAD_NONCE_PREFIX_LEN
+
+#define SPPROTO_HAVE_AUTHENTICATION(_params) (SPPROTO_HAVE_AEAD(_params) || (SPPROTO_HAVE_ENCRYPTION(_params) && SPPROTO_HAVE_HASH(_params)))
+
 #define SPPROTO_HAVE_OTP(_params) ((_params).otp_mode != SPPROTO_OTP_MODE_NONE)
 
 B_START_PACKED
@@ -121,9 +162,18 @@ struct spproto_otpdata {
 } B_PACKED;
 B_END_PACKED
 
+#define SPPROTO_HAVE_SEQNUM(_params) ((_params).replay_window != SPPROTO_REPLAY_WINDOW_NONE)
+
+#define SPPROTO_HAVE_DIRECTION_KEYS(_params) (SPPROTO_HAVE_AEAD(_params) || SPPROTO_HAVE_SEQNUM(_params))
+
+#define SPPROTO_KEY_LABEL_FROM_BINDER "badvpn spproto from binder"
+#define SPPROTO_KEY_LABEL_FROM_CONNECTOR "badvpn spproto from connector"
+
 #define SPPROTO_HEADER_OTPDATA_OFF(_params) 0
 #define SPPROTO_HEADER_OTPDATA_LEN(_params) (SPPROTO_HAVE_OTP(_params) ? sizeof(struct spproto_otpdata) : 0)
-#define SPPROTO_HEADER_HASH_OFF(_params) (SPPROTO_HEADER_OTPDATA_OFF(_params) + SPPROTO_HEADER_OTPDATA_LEN(_params))
+#define SPPROTO_HEADER_SEQNUM_OFF(_params) (SPPROTO_HEADER_OTPDATA_OFF(_params) + SPPROTO_HEADER_OTPDATA_LEN(_params))
+#define SPPROTO_HEADER_SEQNUM_LEN(_params) (SPPROTO_HAVE_SEQNUM(_params) ? sizeof(uint64_t) : 0)
+#define SPPROTO_HEADER_HASH_OFF(_params) (SPPROTO_HEADER_SEQNUM_OFF(_params) + SPPROTO_HEADER_SEQNUM_LEN(_params))
 #define SPPROTO_HEADER_HASH_LEN(_params) SPPROTO_HASH_SIZE(_params)
 #define SPPROTO_HEADER_LEN(_params) (SPPROTO_HEADER_HASH_OFF(_params) + SPPROTO_HEADER_HASH_LEN(_params))
 
@@ -136,8 +186,34 @@ static void spproto_assert_security_params (struct spproto_security_params param
 {
     ASSERT(params.hash_mode == SPPROTO_HASH_MODE_NONE || BHash_type_valid(params.hash_mode))
     ASSERT(params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE || BEncryption_cipher_valid(params.encryption_mode))
+    ASSERT(!SPPROTO_HAVE_AEAD(params) || params.hash_mode == SPPROTO_HASH_MODE_NONE)
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || BEncryption_cipher_valid(params.otp_mode))
+    ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || !BEncryption_cipher_is_aead(params.otp_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || params.otp_num > 0)
+    ASSERT(params.replay_window >= 0)
+    ASSERT(params.replay_window <= REPLAYWINDOW_MAX_SIZE)
+    ASSERT(params.replay_window == SPPROTO_REPLAY_WINDOW_NONE || SPPROTO_HAVE_AUTHENTICATION(params))
+}
+
+/**
+ * Derives the key for one direction of communication from the key
+ * shared by the peers.
+ * 
+ * @param params security parameters. Must use direction keys.
+ * @param key shared key
+ * @param from_binder 1 for the key of packets sent by the peer which bound to
+ *                    an address, 0 for the peer which connected to it
+ * @param out the derived key will be written here. It has the same size as
+ *            the shared key.
+ */
+static void spproto_derive_direction_key (struct spproto_security_params params, const uint8_t *key, int from_binder, uint8_t *out)
+{
+    spproto_assert_security_params(params);
+    ASSERT(SPPROTO_HAVE_DIRECTION_KEYS(params))
+    
+    BHash_derive_key(key, BEncryption_cipher_key_size(params.encryption_mode),
+                     (from_binder ? SPPROTO_KEY_LABEL_FROM_BINDER : SPPROTO_KEY_LABEL_FROM_CONNECTOR),
+                     out, BEncryption_cipher_key_size(params.encryption_mode));
 }
 
 /**
@@ -156,7 +232,11 @@ static int spproto_payload_mtu_for_carrier_mtu (struct spproto_security_params p
     
     if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         return (carrier_mtu - SPPROTO_HEADER_LEN(params));
-    } else {
+    }
+    else if (SPPROTO_HAVE_AEAD(params)) {
+        return (carrier_mtu - BENCRYPTION_AEAD_NONCE_SIZE - SPPROTO_HEADER_LEN(params) - BENCRYPTION_AEAD_TAG_SIZE);
+    }
+    else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         return (balign_down(carrier_mtu, block_size) - block_size - SPPROTO_HEADER_LEN(params) - 1);
     }
@@ -181,7 +261,15 @@ static int spproto_carrier_mtu_for_payload_mtu (struct spproto_security_params p
         }
         
         return (SPPROTO_HEADER_LEN(params) + payload_mtu);
-    } else {
+    }
+    else if (SPPROTO_HAVE_AEAD(params)) {
+        if (payload_mtu > INT_MAX - (BENCRYPTION_AEAD_NONCE_SIZE + SPPROTO_HEADER_LEN(params) + BENCRYPTION_AEAD_TAG_SIZE)) {
+            return -1;
+        }
+        
+        return (BENCRYPTION_AEAD_NONCE_SIZE + SPPROTO_HEADER_LEN(params) + payload_mtu + BENCRYPTION_AEAD_TAG_SIZE);
+    }
+    else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         
         if (payload_mtu > INT_MAX - (block_size + SPPROTO_HEADER_LEN(params) + block_size)) {
@@ -33,11 +33,26 @@
 
 #include <generated/blog_channel_BEncryption.h>
 
+static const EVP_CIPHER * aead_evp_cipher (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return EVP_aes_128_gcm();
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
 int BEncryption_cipher_valid (int cipher)
 {
     switch (cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
         case BENCRYPTION_CIPHER_AES:
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
             return 1;
         default:
             return 0;
@@ -51,6 +66,9 @@ int BEncryption_cipher_block_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_BLOCK_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return 1;
         default:
             ASSERT(0)
             return 0;
@@ -64,12 +82,27 @@ int BEncryption_cipher_key_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_KEY_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
         default:
             ASSERT(0)
             return 0;
     }
 }
 
+int BEncryption_cipher_is_aead (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
 {
     ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
@@ -139,6 +172,13 @@ fail1:
                 ASSERT_EXECUTE(res >= 0)
             }
             break;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            // set up the key schedule once; nonces are set per packet
+            enc->aead = EVP_CIPHER_CTX_new();
+            ASSERT_FORCE(enc->aead)
+            ASSERT_FORCE(EVP_CipherInit_ex(enc->aead, aead_evp_cipher(enc->cipher), NULL, key, NULL, !!(enc->mode&BENCRYPTION_MODE_ENCRYPT)) == 1)
+            break;
         default:
             ASSERT(0)
             ;
@@ -162,14 +202,20 @@ void BEncryption_Free (BEncryption *enc)
         ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
         ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
         ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+        return;
     }
     
     #endif
+    
+    if (BEncryption_cipher_is_aead(enc->cipher)) {
+        EVP_CIPHER_CTX_free(enc->aead);
+    }
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -206,6 +252,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -238,3 +285,87 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             ASSERT(0);
     }
 }
+
+void BEncryption_Seal (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(len >= 0)
+    
+    int out_len;
+    
+    ASSERT_FORCE(EVP_EncryptInit_ex(enc->aead, NULL, NULL, NULL, nonce) == 1)
+    if (len > 0) {
+        ASSERT_FORCE(EVP_EncryptUpdate(enc->aead, out, &out_len, in, len) == 1)
+        ASSERT(out_len == len)
+    }
+    ASSERT_FORCE(EVP_EncryptFinal_ex(enc->aead, out + len, &out_len) == 1)
+    ASSERT(out_len == 0)
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(enc->aead, EVP_CTRL_AEAD_GET_TAG, BENCRYPTION_AEAD_TAG_SIZE, tag) == 1)
+}
+
+int BEncryption_Open (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(len >= 0)
+    
+    int out_len;
+    
+    ASSERT_FORCE(EVP_DecryptInit_ex(enc->aead, NULL, NULL, NULL, nonce) == 1)
+    if (len > 0) {
+        ASSERT_FORCE(EVP_DecryptUpdate(enc->aead, out, &out_len, in, len) == 1)
+        ASSERT(out_len == len)
+    }
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(enc->aead, EVP_CTRL_AEAD_SET_TAG, BENCRYPTION_AEAD_TAG_SIZE, tag) == 1)
+    
+    return (EVP_DecryptFinal_ex(enc->aead, out + len, &out_len) > 0);
+}
+
+void BEncryption_EncryptBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_ops >= 0)
+    ASSERT(num_ops <= BENCRYPTION_MAX_BATCH)
+    
+    for (int i = 0; i < num_ops; i++) {
+        BEncryption_Encrypt(enc, ops[i].in, ops[i].out, ops[i].len, ops[i].iv);
+    }
+}
+
+void BEncryption_DecryptBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_ops >= 0)
+    ASSERT(num_ops <= BENCRYPTION_MAX_BATCH)
+    
+    for (int i = 0; i < num_ops; i++) {
+        BEncryption_Decrypt(enc, ops[i].in, ops[i].out, ops[i].len, ops[i].iv);
+    }
+}
+
+void BEncryption_SealBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_ops >= 0)
+    ASSERT(num_ops <= BENCRYPTION_MAX_BATCH)
+    
+    for (int i = 0; i < num_ops; i++) {
+        BEncryption_Seal(enc, ops[i].iv, ops[i].in, ops[i].out, ops[i].len, ops[i].tag);
+    }
+}
+
+void BEncryption_OpenBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_ops >= 0)
+    ASSERT(num_ops <= BENCRYPTION_MAX_BATCH)
+    
+    for (int i = 0; i < num_ops; i++) {
+        ops[i].authentic = BEncryption_Open(enc, ops[i].iv, ops[i].in, ops[i].out, ops[i].len, ops[i].tag);
+    }
+}
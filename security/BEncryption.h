@@ -29,6 +29,10 @@
  * @section DESCRIPTION
  * 
  * Block cipher encryption abstraction.
+ * 
+ * Besides block ciphers in CBC mode, AEAD ciphers are supported, which
+ * encrypt and authenticate in a single pass; see {@link BEncryption_Seal}
+ * and {@link BEncryption_Open}.
  */
 
 #ifndef BADVPN_SECURITY_BENCRYPTION_H
@@ -50,6 +54,7 @@
 
 #include <openssl/blowfish.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -58,7 +63,7 @@
 #define BENCRYPTION_MODE_DECRYPT 2
 
 #define BENCRYPTION_MAX_BLOCK_SIZE 16
-#define BENCRYPTION_MAX_KEY_SIZE 16
+#define BENCRYPTION_MAX_KEY_SIZE 32
 
 #define BENCRYPTION_CIPHER_BLOWFISH 1
 #define BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE 8
@@ -68,6 +73,19 @@
 #define BENCRYPTION_CIPHER_AES_BLOCK_SIZE 16
 #define BENCRYPTION_CIPHER_AES_KEY_SIZE 16
 
+// AEAD ciphers; block size is reported as 1 as there are no alignment requirements
+#define BENCRYPTION_CIPHER_AES_GCM 3
+#define BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE 16
+
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305 4
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE 32
+
+#define BENCRYPTION_AEAD_NONCE_SIZE 12
+#define BENCRYPTION_AEAD_TAG_SIZE 16
+
+// maximum number of buffers for batch operations
+#define BENCRYPTION_MAX_BATCH 16
+
 // NOTE: update the maximums above when adding a cipher!
 
 /**
@@ -94,9 +112,48 @@ typedef struct {
             uint32_t ses;
         } cryptodev;
         #endif
+        EVP_CIPHER_CTX *aead;
     };
 } BEncryption;
 
+/**
+ * Describes one buffer for the batch operations
+ * ({@link BEncryption_EncryptBatch}, {@link BEncryption_DecryptBatch},
+ * {@link BEncryption_SealBatch} and {@link BEncryption_OpenBatch}).
+ */
+struct BEncryption_op {
+    /**
+     * Input data.
+     */
+    uint8_t *in;
+    
+    /**
+     * Output data, len bytes. May be the same as in.
+     */
+    uint8_t *out;
+    
+    /**
+     * Number of bytes to process.
+     */
+    int len;
+    
+    /**
+     * IV for block ciphers (updated as with {@link BEncryption_Encrypt}),
+     * or nonce for AEAD ciphers.
+     */
+    uint8_t *iv;
+    
+    /**
+     * Authentication tag for AEAD ciphers; unused for block ciphers.
+     */
+    uint8_t *tag;
+    
+    /**
+     * Set by {@link BEncryption_OpenBatch} to whether the data is authentic.
+     */
+    int authentic;
+};
+
 /**
  * Checks if the given cipher number is valid.
  * 
@@ -121,10 +178,22 @@ int BEncryption_cipher_block_size (int cipher);
  */
 int BEncryption_cipher_key_size (int cipher);
 
+/**
+ * Checks if a cipher is an AEAD cipher.
+ * AEAD ciphers are used with {@link BEncryption_Seal} and {@link BEncryption_Open},
+ * other ciphers with {@link BEncryption_Encrypt} and {@link BEncryption_Decrypt}.
+ * 
+ * @param cipher cipher number. Must be valid.
+ * @return 1 if AEAD, 0 if not
+ */
+int BEncryption_cipher_is_aead (int cipher);
+
 /**
  * Initializes the object.
  * {@link BSecurity_GlobalInitThreadSafe} must have been done if this object
  * will be used from a non-main thread.
+ * The object must not be used from multiple threads at the same time if the cipher
+ * is an AEAD cipher.
  * 
  * @param enc the object
  * @param mode whether encryption or decryption is to be done, or both.
@@ -145,11 +214,11 @@ void BEncryption_Free (BEncryption *enc);
 /**
  * Encrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_ENCRYPT.
+ * BENCRYPTION_MODE_ENCRYPT, and with a cipher which is not AEAD.
  * 
  * @param enc the object
  * @param in data to encrypt
- * @param out ciphertext output
+ * @param out ciphertext output. May be the same as in.
  * @param len number of bytes to encrypt. Must be >=0 and a multiple of
  *            block size.
  * @param iv initialization vector. Updated such that continuing a previous encryption
@@ -160,11 +229,11 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 /**
  * Decrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_DECRYPT.
+ * BENCRYPTION_MODE_DECRYPT, and with a cipher which is not AEAD.
  * 
  * @param enc the object
  * @param in data to decrypt
- * @param out plaintext output
+ * @param out plaintext output. May be the same as in.
  * @param len number of bytes to decrypt. Must be >=0 and a multiple of
  *            block size.
  * @param iv initialization vector. Updated such that continuing a previous decryption
@@ -172,4 +241,76 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
  */
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv);
 
+/**
+ * Encrypts and authenticates data.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_ENCRYPT, and with an AEAD cipher.
+ * 
+ * @param enc the object
+ * @param nonce nonce, BENCRYPTION_AEAD_NONCE_SIZE bytes. Must never be reused
+ *              with the same key.
+ * @param in data to encrypt
+ * @param out ciphertext output, len bytes. May be the same as in.
+ * @param len number of bytes to encrypt. Must be >=0.
+ * @param tag authentication tag output, BENCRYPTION_AEAD_TAG_SIZE bytes
+ */
+void BEncryption_Seal (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag);
+
+/**
+ * Decrypts and verifies data.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_DECRYPT, and with an AEAD cipher.
+ * 
+ * @param enc the object
+ * @param nonce nonce, BENCRYPTION_AEAD_NONCE_SIZE bytes
+ * @param in data to decrypt
+ * @param out plaintext output, len bytes. May be the same as in.
+ *            Must not be used if verification fails.
+ * @param len number of bytes to decrypt. Must be >=0.
+ * @param tag authentication tag, BENCRYPTION_AEAD_TAG_SIZE bytes
+ * @return 1 if the data is authentic, 0 if not
+ */
+int BEncryption_Open (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag) WARN_UNUSED;
+
+/**
+ * Encrypts multiple independent buffers, as with {@link BEncryption_Encrypt}.
+ * The buffers are currently processed one after another; the batch interface
+ * allows an implementation which processes them together.
+ * 
+ * @param enc the object
+ * @param ops buffers to encrypt
+ * @param num_ops number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BATCH.
+ */
+void BEncryption_EncryptBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops);
+
+/**
+ * Decrypts multiple independent buffers, as with {@link BEncryption_Decrypt}.
+ * 
+ * @param enc the object
+ * @param ops buffers to decrypt
+ * @param num_ops number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BATCH.
+ */
+void BEncryption_DecryptBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops);
+
+/**
+ * Encrypts and authenticates multiple independent buffers, as with
+ * {@link BEncryption_Seal}.
+ * 
+ * @param enc the object
+ * @param ops buffers to encrypt
+ * @param num_ops number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BATCH.
+ */
+void BEncryption_SealBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops);
+
+/**
+ * Decrypts and verifies multiple independent buffers, as with
+ * {@link BEncryption_Open}. The result for each buffer is stored
+ * in its authentic field.
+ * 
+ * @param enc the object
+ * @param ops buffers to decrypt
+ * @param num_ops number of buffers. Must be >=0 and <=BENCRYPTION_MAX_BATCH.
+ */
+void BEncryption_OpenBatch (BEncryption *enc, struct BEncryption_op *ops, int num_ops);
+
 #endif
@@ -27,6 +27,11 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
 #include <security/BHash.h>
 
 int BHash_type_valid (int type)
@@ -67,3 +72,23 @@ void BHash_calculate (int type, uint8_t *data, int data_len, uint8_t *out)
             ;
     }
 }
+
+void BHash_derive_key (const uint8_t *secret, int secret_len, const char *label, uint8_t *out, int out_len)
+{
+    ASSERT(secret_len > 0)
+    ASSERT(out_len > 0)
+    ASSERT(out_len <= 255 * 32)
+    
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    ASSERT_FORCE(ctx)
+    
+    size_t len = out_len;
+    ASSERT_FORCE(EVP_PKEY_derive_init(ctx) == 1)
+    ASSERT_FORCE(EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1)
+    ASSERT_FORCE(EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secret_len) == 1)
+    ASSERT_FORCE(EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char *)label, strlen(label)) == 1)
+    ASSERT_FORCE(EVP_PKEY_derive(ctx, out, &len) == 1)
+    ASSERT_FORCE(len == out_len)
+    
+    EVP_PKEY_CTX_free(ctx);
+}
@@ -77,4 +77,16 @@ int BHash_size (int type);
  */
 void BHash_calculate (int type, uint8_t *data, int data_len, uint8_t *out);
 
+/**
+ * Derives a key from a secret and a label, using HKDF with SHA-256.
+ * Different labels give independent keys for the same secret.
+ * 
+ * @param secret secret to derive from
+ * @param secret_len length of secret. Must be >0.
+ * @param label null-terminated label identifying the purpose of the key
+ * @param out the key will be written here. Must not overlap with secret.
+ * @param out_len length of the key to derive. Must be >0 and <=255*32.
+ */
+void BHash_derive_key (const uint8_t *secret, int secret_len, const char *label, uint8_t *out, int out_len);
+
 #endif
@@ -0,0 +1,159 @@
+/**
+ * @file BRandomStream.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/byteorder.h>
+#include <security/BRandom.h>
+
+#include <security/BRandomStream.h>
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static uint32_t load32 (const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return ltoh32(x);
+}
+
+static void store32 (uint8_t *p, uint32_t x)
+{
+    x = htol32(x);
+    memcpy(p, &x, sizeof(x));
+}
+
+static void chacha20_block (const uint8_t *key, uint32_t counter, uint8_t *out)
+{
+    uint32_t in[16];
+    
+    // "expand 32-byte k", key, counter, zero nonce
+    in[0] = UINT32_C(0x61707865);
+    in[1] = UINT32_C(0x3320646e);
+    in[2] = UINT32_C(0x79622d32);
+    in[3] = UINT32_C(0x6b206574);
+    for (int i = 0; i < 8; i++) {
+        in[4 + i] = load32(key + 4 * i);
+    }
+    in[12] = counter;
+    in[13] = 0;
+    in[14] = 0;
+    in[15] = 0;
+    
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+    
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12])
+        QUARTERROUND(x[1], x[5], x[9], x[13])
+        QUARTERROUND(x[2], x[6], x[10], x[14])
+        QUARTERROUND(x[3], x[7], x[11], x[15])
+        QUARTERROUND(x[0], x[5], x[10], x[15])
+        QUARTERROUND(x[1], x[6], x[11], x[12])
+        QUARTERROUND(x[2], x[7], x[8], x[13])
+        QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+    
+    for (int i = 0; i < 16; i++) {
+        store32(out + 4 * i, x[i] + in[i]);
+    }
+}
+
+static void refill (BRandomStream *o)
+{
+    // reseed from BRandom periodically
+    if (o->until_reseed <= 0) {
+        BRandom_randomize(o->key, BRANDOMSTREAM_KEY_SIZE);
+        o->until_reseed = BRANDOMSTREAM_RESEED_INTERVAL;
+    }
+    
+    // generate keystream
+    for (int i = 0; i < BRANDOMSTREAM_BUF_BLOCKS; i++) {
+        chacha20_block(o->key, i, o->buf + i * BRANDOMSTREAM_BLOCK_SIZE);
+    }
+    
+    // replace key with the beginning of the output, and don't hand that out
+    memcpy(o->key, o->buf, BRANDOMSTREAM_KEY_SIZE);
+    memset(o->buf, 0, BRANDOMSTREAM_KEY_SIZE);
+    o->buf_pos = BRANDOMSTREAM_KEY_SIZE;
+    
+    o->until_reseed -= BRANDOMSTREAM_BUF_SIZE - BRANDOMSTREAM_KEY_SIZE;
+}
+
+void BRandomStream_Init (BRandomStream *o)
+{
+    // seed on first use
+    o->until_reseed = 0;
+    
+    // have no data
+    o->buf_pos = BRANDOMSTREAM_BUF_SIZE;
+    
+    // generate initial data
+    refill(o);
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void BRandomStream_Free (BRandomStream *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // don't leave the state in memory
+    memset(o->key, 0, sizeof(o->key));
+    memset(o->buf, 0, sizeof(o->buf));
+}
+
+void BRandomStream_GenBytes (BRandomStream *o, uint8_t *buf, int len)
+{
+    ASSERT(len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    while (len > 0) {
+        if (o->buf_pos == BRANDOMSTREAM_BUF_SIZE) {
+            refill(o);
+        }
+        
+        int avail = BRANDOMSTREAM_BUF_SIZE - o->buf_pos;
+        int to_copy = (len < avail ? len : avail);
+        
+        // hand out data and erase it from the buffer
+        memcpy(buf, o->buf + o->buf_pos, to_copy);
+        memset(o->buf + o->buf_pos, 0, to_copy);
+        o->buf_pos += to_copy;
+        
+        buf += to_copy;
+        len -= to_copy;
+    }
+}
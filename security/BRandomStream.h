@@ -0,0 +1,97 @@
+/**
+ * @file BRandomStream.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * 
+ * @section DESCRIPTION
+ * 
+ * Fast buffered random number generator for per-packet data like IVs.
+ */
+
+#ifndef BADVPN_SECURITY_BRANDOMSTREAM_H
+#define BADVPN_SECURITY_BRANDOMSTREAM_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+
+#define BRANDOMSTREAM_KEY_SIZE 32
+#define BRANDOMSTREAM_BLOCK_SIZE 64
+#define BRANDOMSTREAM_BUF_BLOCKS 8
+#define BRANDOMSTREAM_BUF_SIZE (BRANDOMSTREAM_BUF_BLOCKS * BRANDOMSTREAM_BLOCK_SIZE)
+
+// number of bytes generated after which the key is replaced from BRandom
+#define BRANDOMSTREAM_RESEED_INTERVAL (1 << 20)
+
+/**
+ * Random number generator producing a ChaCha20 keystream.
+ * 
+ * The key is taken from {@link BRandom_randomize} on init and again after every
+ * BRANDOMSTREAM_RESEED_INTERVAL generated bytes. In between, each refill of the
+ * internal buffer replaces the key with the first bytes of the new output, so
+ * earlier output cannot be recovered from the state.
+ * 
+ * The object holds no locks and is not thread-safe. Use one object per thread,
+ * or per unit of data which is only accessed from one thread at a time.
+ */
+typedef struct {
+    uint8_t key[BRANDOMSTREAM_KEY_SIZE];
+    uint8_t buf[BRANDOMSTREAM_BUF_SIZE];
+    int buf_pos;
+    int until_reseed;
+    DebugObject d_obj;
+} BRandomStream;
+
+/**
+ * Initializes the object and seeds it from {@link BRandom_randomize}.
+ * {@link BSecurity_GlobalInitThreadSafe} must have been done if this is
+ * being called from a non-main thread.
+ * 
+ * @param o the object
+ */
+void BRandomStream_Init (BRandomStream *o);
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void BRandomStream_Free (BRandomStream *o);
+
+/**
+ * Generates random data.
+ * {@link BSecurity_GlobalInitThreadSafe} must have been done if this is
+ * being called from a non-main thread, as reseeding uses {@link BRandom_randomize}.
+ * 
+ * @param o the object
+ * @param buf buffer to write data into
+ * @param len number of bytes to generate. Must be >=0.
+ */
+void BRandomStream_GenBytes (BRandomStream *o, uint8_t *buf, int len);
+
+#endif
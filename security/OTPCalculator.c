@@ -82,17 +82,19 @@ otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv,
     uint8_t iv_work[BENCRYPTION_MAX_BLOCK_SIZE];
     memcpy(iv_work, iv, calc->block_size);
     
-    // create zero block
-    uint8_t zero[BENCRYPTION_MAX_BLOCK_SIZE];
-    memset(zero, 0, calc->block_size);
-    
     // init encryptor
     BEncryption encryptor;
     BEncryption_Init(&encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key);
     
-    // encrypt zero blocks
-    for (size_t i = 0; i < calc->num_blocks; i++) {
-        BEncryption_Encrypt(&encryptor, zero, (uint8_t *)calc->data + i * calc->block_size, calc->block_size, iv_work);
+    // CBC-encrypt zero blocks in place, many blocks per call; each output
+    // block is the encryption of the previous one, as if encrypting them
+    // one by one
+    memset(calc->data, 0, calc->num_blocks * calc->block_size);
+    size_t blocks_per_call = OTPCALCULATOR_CHUNK_SIZE / calc->block_size;
+    for (size_t i = 0; i < calc->num_blocks; i += blocks_per_call) {
+        size_t n = (calc->num_blocks - i < blocks_per_call ? calc->num_blocks - i : blocks_per_call);
+        uint8_t *chunk = (uint8_t *)calc->data + i * calc->block_size;
+        BEncryption_Encrypt(&encryptor, chunk, chunk, n * calc->block_size, iv_work);
     }
     
     // free encryptor
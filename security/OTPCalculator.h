@@ -43,6 +43,9 @@
 #include <security/BEncryption.h>
 #include <base/DebugObject.h>
 
+// number of bytes to encrypt with a single call when generating OTPs
+#define OTPCALCULATOR_CHUNK_SIZE 65536
+
 /**
  * Type for an OTP.
  */
@@ -28,49 +28,91 @@
  */
 
 #include <string.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <misc/balloc.h>
 
 #include <security/OTPChecker.h>
 
 static void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t);
+static int OTPChecker_Bucket_Find (struct OTPChecker_bucket *b, otp_t otp);
 static void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
 static void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPCalculator *calc, uint8_t *key, uint8_t *iv);
 static int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
 
 void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t)
 {
-    for (int i = 0; i < mc->num_entries; i++) {
-        t->entries[i].avail = -1;
+    for (size_t i = 0; i < mc->num_buckets; i++) {
+        t->buckets[i].num_used = 0;
+    }
+}
+
+int OTPChecker_Bucket_Find (struct OTPChecker_bucket *b, otp_t otp)
+{
+    unsigned int match;
+    
+    #ifdef __SSE2__
+    
+    // compare all entries at once, including unused ones
+    __m128i key = _mm_set1_epi32((int)otp);
+    __m128i *otps = (__m128i *)b->otps;
+    match = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(&otps[0]), key)));
+    match |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(&otps[1]), key))) << 4;
+    match |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(&otps[2]), key))) << 8;
+    
+    #else
+    
+    match = 0;
+    for (int i = 0; i < OTPCHECKER_BUCKET_ENTRIES; i++) {
+        match |= (unsigned int)(b->otps[i] == otp) << i;
     }
+    
+    #endif
+    
+    // ignore unused entries
+    match &= (1u << b->num_used) - 1;
+    
+    if (!match) {
+        return -1;
+    }
+    
+    return __builtin_ctz(match);
 }
 
 void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    // calculate starting bucket; OTPs are random so their low bits will do
+    size_t index = otp & (mc->num_buckets - 1);
     
-    // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
+    // try buckets starting with the base position
+    for (size_t i = 0; i < mc->num_buckets; i++) {
+        struct OTPChecker_bucket *b = &t->buckets[index];
         
-        // if we find a free index, use it
-        if (entry->avail < 0) {
-            entry->otp = otp;
-            entry->avail = 1;
+        // if we find the same OTP, use it by incrementing its count
+        int k = OTPChecker_Bucket_Find(b, otp);
+        if (k >= 0) {
+            if (b->avail[k] < OTPCHECKER_MAX_AVAIL) {
+                b->avail[k]++;
+            }
             return;
         }
         
-        // if we find a used index with the same mac,
-        // use it by incrementing its count
-        if (entry->otp == otp) {
-            entry->avail++;
+        // if the bucket has a free entry, use it
+        if (b->num_used < OTPCHECKER_BUCKET_ENTRIES) {
+            b->otps[b->num_used] = otp;
+            b->avail[b->num_used] = 1;
+            b->num_used++;
             return;
         }
+        
+        index = (index + 1) & (mc->num_buckets - 1);
     }
     
-    // will never add more macs than we can hold
+    // will never add more OTPs than we can hold
     ASSERT(0)
 }
 
@@ -90,30 +132,32 @@ void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPC
 
 int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    // calculate starting bucket
+    size_t index = otp & (mc->num_buckets - 1);
     
-    // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
-        
-        // if we find an empty entry, there is no such mac
-        if (entry->avail < 0) {
-            return 0;
-        }
+    // try buckets starting with the base position
+    for (size_t i = 0; i < mc->num_buckets; i++) {
+        struct OTPChecker_bucket *b = &t->buckets[index];
         
         // if we find a matching entry, check its count
-        if (entry->otp == otp) {
-            if (entry->avail > 0) {
-                entry->avail--;
+        int k = OTPChecker_Bucket_Find(b, otp);
+        if (k >= 0) {
+            if (b->avail[k] > 0) {
+                b->avail[k]--;
                 return 1;
             }
             return 0;
         }
+        
+        // if the bucket is not full, there is no such OTP
+        if (b->num_used < OTPCHECKER_BUCKET_ENTRIES) {
+            return 0;
+        }
+        
+        index = (index + 1) & (mc->num_buckets - 1);
     }
     
-    // there are always empty slots
+    // there are always free entries
     ASSERT(0)
     return 0;
 }
@@ -153,6 +197,7 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     ASSERT(num_otps > 0)
     ASSERT(BEncryption_cipher_valid(cipher))
     ASSERT(num_tables > 0)
+    ASSERT(sizeof(struct OTPChecker_bucket) == OTPCHECKER_BUCKET_ALIGN)
     
     // init arguments
     mc->num_otps = num_otps;
@@ -163,11 +208,15 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     // set no handlers
     mc->handler = NULL;
     
-    // set number of entries
-    if (mc->num_otps > INT_MAX / 2) {
-        goto fail0;
+    // set number of buckets, a power of two large enough to keep the
+    // table at most half full
+    mc->num_buckets = 1;
+    while (mc->num_buckets * OTPCHECKER_BUCKET_ENTRIES < 2 * (size_t)mc->num_otps) {
+        if (mc->num_buckets > SIZE_MAX / 2 / sizeof(struct OTPChecker_bucket)) {
+            goto fail0;
+        }
+        mc->num_buckets *= 2;
     }
-    mc->num_entries = 2 * mc->num_otps;
     
     // set no tables used
     mc->tables_used = 0;
@@ -183,15 +232,21 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
         goto fail1;
     }
     
-    // allocate entries
-    if (!(mc->entries = (struct OTPChecker_entry *)BAllocArray2(mc->num_tables, mc->num_entries, sizeof(mc->entries[0])))) {
+    // allocate buckets, with room for aligning them to cache lines
+    size_t buckets_size;
+    if (mc->num_buckets > SIZE_MAX / mc->num_tables / sizeof(struct OTPChecker_bucket)) {
+        goto fail2;
+    }
+    buckets_size = (size_t)mc->num_tables * mc->num_buckets * sizeof(struct OTPChecker_bucket);
+    if (!(mc->buckets_mem = BAllocSize(bsize_add(bsize_fromsize(buckets_size), bsize_fromsize(OTPCHECKER_BUCKET_ALIGN - 1))))) {
         goto fail2;
     }
+    mc->buckets = (struct OTPChecker_bucket *)balign_up((uintptr_t)mc->buckets_mem, OTPCHECKER_BUCKET_ALIGN);
     
     // initialize tables
     for (int i = 0; i < mc->num_tables; i++) {
         struct OTPChecker_table *table = &mc->tables[i];
-        table->entries = mc->entries + (size_t)i * mc->num_entries;
+        table->buckets = mc->buckets + (size_t)i * mc->num_buckets;
         OTPChecker_Table_Empty(mc, table);
     }
     
@@ -218,8 +273,8 @@ void OTPChecker_Free (OTPChecker *mc)
         BThreadWork_Free(&mc->tw);
     }
     
-    // free entries
-    BFree(mc->entries);
+    // free buckets
+    BFree(mc->buckets_mem);
     
     // free tables
     BFree(mc->tables);
@@ -43,14 +43,23 @@
 #include <base/DebugObject.h>
 #include <threadwork/BThreadWork.h>
 
-struct OTPChecker_entry {
-    otp_t otp;
-    int avail;
+// number of OTPs in a bucket; a bucket fills a 64-byte cache line
+#define OTPCHECKER_BUCKET_ENTRIES 12
+#define OTPCHECKER_BUCKET_ALIGN 64
+
+// maximum value of an availability count
+#define OTPCHECKER_MAX_AVAIL UINT8_MAX
+
+struct OTPChecker_bucket {
+    otp_t otps[OTPCHECKER_BUCKET_ENTRIES];
+    uint8_t avail[OTPCHECKER_BUCKET_ENTRIES];
+    uint8_t num_used;
+    uint8_t pad[3];
 };
 
 struct OTPChecker_table {
     uint16_t id;
-    struct OTPChecker_entry *entries;
+    struct OTPChecker_bucket *buckets;
 };
 
 /**
@@ -63,6 +72,10 @@ typedef void (*OTPChecker_handler) (void *user);
 
 /**
  * Object that checks OTPs agains known seeds.
+ * 
+ * Each seed's OTPs are kept in a hash table of cache-line sized buckets.
+ * Checking an OTP compares it against a whole bucket at once, so an
+ * unknown OTP usually costs a single cache line access.
  */
 typedef struct {
     BThreadWorkDispatcher *twd;
@@ -70,13 +83,14 @@ typedef struct {
     void *user;
     int num_otps;
     int cipher;
-    int num_entries;
+    size_t num_buckets;
     int num_tables;
     int tables_used;
     int next_table;
     OTPCalculator calc;
     struct OTPChecker_table *tables;
-    struct OTPChecker_entry *entries;
+    void *buckets_mem;
+    struct OTPChecker_bucket *buckets;
     int tw_have;
     BThreadWork tw;
     uint8_t tw_key[BENCRYPTION_MAX_KEY_SIZE];
@@ -0,0 +1,116 @@
+/**
+ * @file ReplayWindow.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/balloc.h>
+
+#include <security/ReplayWindow.h>
+
+int ReplayWindow_Init (ReplayWindow *o, int size)
+{
+    ASSERT(size > 0)
+    ASSERT(size <= REPLAYWINDOW_MAX_SIZE)
+    
+    o->size = size;
+    
+    // The window can span (size-1)/64+2 words. Use a power of two so that
+    // word indices can be masked.
+    o->num_words = 1;
+    while (o->num_words < (size - 1) / 64 + 2) {
+        o->num_words *= 2;
+    }
+    
+    // allocate bitmap
+    if (!(o->bitmap = (uint64_t *)BAllocArray(o->num_words, sizeof(o->bitmap[0])))) {
+        goto fail0;
+    }
+    
+    // have seen nothing
+    ReplayWindow_Reset(o);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void ReplayWindow_Free (ReplayWindow *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free bitmap
+    BFree(o->bitmap);
+}
+
+void ReplayWindow_Reset (ReplayWindow *o)
+{
+    // An empty bitmap with last=0 accepts 0 and anything newer, which is
+    // the same as having seen nothing.
+    o->last = 0;
+    memset(o->bitmap, 0, o->num_words * sizeof(o->bitmap[0]));
+}
+
+int ReplayWindow_Check (ReplayWindow *o, uint64_t seq)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    uint64_t mask = o->num_words - 1;
+    
+    if (seq > o->last) {
+        // move window forward, clearing the words it moves over
+        uint64_t last_word = o->last / 64;
+        uint64_t num_clear = seq / 64 - last_word;
+        if (num_clear > o->num_words) {
+            num_clear = o->num_words;
+        }
+        for (uint64_t i = 1; i <= num_clear; i++) {
+            o->bitmap[(last_word + i) & mask] = 0;
+        }
+        o->last = seq;
+    }
+    else if (o->last - seq >= o->size) {
+        // too old
+        return 0;
+    }
+    
+    uint64_t *word = &o->bitmap[(seq / 64) & mask];
+    uint64_t bit = (uint64_t)1 << (seq % 64);
+    
+    // reject if seen
+    if (*word & bit) {
+        return 0;
+    }
+    
+    // mark as seen
+    *word |= bit;
+    
+    return 1;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file ReplayWindow.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object that rejects replayed sequence numbers using a sliding bitmap.
+ */
+
+#ifndef BADVPN_SECURITY_REPLAYWINDOW_H
+#define BADVPN_SECURITY_REPLAYWINDOW_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+
+// maximum window size
+#define REPLAYWINDOW_MAX_SIZE 65536
+
+/**
+ * Object that rejects replayed sequence numbers using a sliding bitmap.
+ * 
+ * It remembers the highest sequence number seen, and which of the size
+ * sequence numbers up to and including it have been seen. A sequence number
+ * is accepted if it is newer than the highest one, or if it is within the
+ * window and has not been seen yet.
+ * 
+ * The bitmap is a ring of 64-bit words, as in RFC 6479, so moving the window
+ * forward only clears the words it moves over.
+ */
+typedef struct {
+    int size;
+    int num_words;
+    uint64_t last;
+    uint64_t *bitmap;
+    DebugObject d_obj;
+} ReplayWindow;
+
+/**
+ * Initializes the object.
+ * Initially, no sequence numbers have been seen.
+ * 
+ * @param o the object
+ * @param size window size, in sequence numbers. Must be >0 and <=REPLAYWINDOW_MAX_SIZE.
+ * @return 1 on success, 0 on failure
+ */
+int ReplayWindow_Init (ReplayWindow *o, int size) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void ReplayWindow_Free (ReplayWindow *o);
+
+/**
+ * Forgets all sequence numbers seen.
+ * 
+ * @param o the object
+ */
+void ReplayWindow_Reset (ReplayWindow *o);
+
+/**
+ * Checks a sequence number and marks it as seen if it is accepted.
+ * This must only be done for packets which have been authenticated.
+ * 
+ * @param o the object
+ * @param seq sequence number
+ * @return 1 if the sequence number is accepted, 0 if it has already been
+ *         seen or is too old
+ */
+int ReplayWindow_Check (ReplayWindow *o, uint64_t seq);
+
+#endif
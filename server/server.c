@@ -40,6 +40,7 @@
 #include <prtypes.h>
 #include <nss/nss.h>
 #include <nss/ssl.h>
+#include <nss/sslerr.h>
 #include <nss/cert.h>
 #include <nss/keyhi.h>
 #include <nss/secasn1.h>
@@ -54,7 +55,7 @@
 #include <misc/loggers_string.h>
 #include <misc/open_standard_streams.h>
 #include <misc/compare.h>
-#include <misc/bsize.h>
+#include <misc/balloc.h>
 #include <predicate/BPredicate.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
@@ -88,6 +89,7 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int threads_cpu_affinity;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
     int ssl;
@@ -99,6 +101,12 @@ struct {
     char *relay_predicate;
     int client_socket_sndbuf;
     int max_clients;
+    int workers;
+    int cluster_id;
+    char *cluster_listen_addr;
+    int cluster_peer_ids[MAX_CLUSTER_PEERS];
+    char *cluster_peer_addrs[MAX_CLUSTER_PEERS];
+    int num_cluster_peers;
 } options;
 
 // listen addresses
@@ -167,6 +175,38 @@ LinkedList1 clients;
 // clients tree (by ID)
 BAVL clients_tree;
 
+// predicate classes of complete clients, and the ID for the next one
+BAVL client_classes_tree;
+uint64_t client_classes_nextid;
+
+// results of the predicates for pairs of classes
+struct predicate_cache_entry predicate_cache[PREDICATE_CACHE_SIZE];
+
+// other servers of the cluster
+struct cluster_peer cluster_peers[MAX_CLUSTER_PEERS];
+int num_cluster_peers;
+
+// address and listener for links from other servers of the cluster
+BAddr cluster_listen_addr;
+BListener cluster_listener;
+int have_cluster_listener;
+
+// links to other servers of the cluster
+LinkedList1 cluster_links;
+
+#ifndef BADVPN_USE_WINAPI
+// workers, if client connections are handled in worker threads
+struct worker workers[MAX_WORKERS];
+int num_workers;
+
+// whether the worker threads are running; after they are stopped, clients
+// are no longer passed back to them
+int workers_running;
+#endif
+
+// log function for a client, used by code common to the main thread and workers
+typedef void (*client_log_func) (struct client_data *client, int level, const char *fmt, ...);
+
 // prints help text to standard output
 static void print_help (const char *name);
 
@@ -187,21 +227,31 @@ static void signal_handler (void *unused);
 // listener handler, accepts new clients
 static void listener_handler (BListener *listener);
 
+// sets up SSL for a newly accepted client
+static int client_init_ssl (struct client_data *client, BReactor *reactor, BThreadWorkDispatcher *dispatcher, BSSLConnection_handler handler, client_log_func log);
+
+// stores the certificate and common name of a client after the SSL handshake
+static int client_read_cert (struct client_data *client, char **common_name, client_log_func log);
+
+// starts the disconnect timer of a new client and links it in
+static void client_link_in (struct client_data *client);
+
 // frees resources used by a client
 static void client_dealloc (struct client_data *client);
 
-static int client_compute_buffer_size (struct client_data *client);
-
 // initializes the I/O porition of the client
 static int client_init_io (struct client_data *client);
 
+// frees the part of the client's I/O which talks to the connection, or to the worker owning it
+static void client_free_connection_io (struct client_data *client);
+
 // deallocates the I/O portion of the client. Must have no outgoing flows.
 static void client_dealloc_io (struct client_data *client);
 
 // removes a client
 static void client_remove (struct client_data *client);
 
-// job to finish removal after clients are informed
+// job to finish removal
 static void client_dying_job (struct client_data *client);
 
 // appends client log prefix
@@ -222,21 +272,36 @@ static void client_sslcon_handler (struct client_data *client, int event);
 // decoder handler
 static void client_decoder_handler_error (struct client_data *client);
 
+// handler for the control buffer asking for a packet
+static void client_control_handler_recv (struct client_data *client, uint8_t *data);
+
+// sends the next pending control packet, if the control buffer has asked for one
+static void client_control_send (struct client_data *client);
+
 // provides a buffer for sending a control packet to the client
-static int client_start_control_packet (struct client_data *client, void **data, int len);
+static void client_start_control_packet (struct client_data *client, void **data, int len);
 
 // submits a packet written after client_start_control_packet
 static void client_end_control_packet (struct client_data *client, uint8_t id);
 
 // sends a newclient message to a client
-static int client_send_newclient (struct client_data *client, struct client_data *nc, int relay_server, int relay_client);
+static void client_send_newclient (struct client_data *client, struct client_data *nc, int relay_server, int relay_client);
 
 // sends an endclient message to a client
-static int client_send_endclient (struct client_data *client, peerid_t end_id);
+static void client_send_endclient (struct client_data *client, peerid_t end_id);
+
+// sends a serverhello message to a client
+static void client_send_serverhello (struct client_data *client);
 
 // handler for packets received from the client
 static void client_input_handler_send (struct client_data *client, uint8_t *data, int data_len);
 
+// creates flows between a newly complete client and the complete clients allowed to talk to it
+static void client_publish (struct client_data *client);
+
+// processes a packet received from the client
+static void client_process_packet (struct client_data *client, uint8_t *data, int data_len);
+
 // processes hello packets from clients
 static void process_packet_hello (struct client_data *client, uint8_t *data, int data_len);
 
@@ -267,6 +332,9 @@ static int peer_flow_start_packet (struct peer_flow *flow, void **data, int len)
 // submits a peer-to-peer packet written after peer_flow_start_packet
 static void peer_flow_end_packet (struct peer_flow *flow, uint8_t type);
 
+// forwards a message through a flow, resetting the pair if out of buffer
+static void peer_flow_send_message (struct peer_flow *flow, uint8_t *payload, int payload_size);
+
 // handler called by the queue when a peer flow can be freed after its source has gone away
 static void peer_flow_handler_canremove (struct peer_flow *flow);
 
@@ -318,17 +386,198 @@ static int relay_predicate_func_raddr_cb (void *user, void **args);
 // comparator for peerid_t used in AVL tree
 static int peerid_comparator (void *unused, peerid_t *p1, peerid_t *p2);
 
+// comparator for client classes used in AVL tree
+static int client_class_comparator (void *unused, struct client_class_key *k1, struct client_class_key *k2);
+
+// finds or creates the predicate class of a client
+static struct client_class * client_class_ref (struct client_data *client);
+
+// releases a predicate class reference, freeing the class after the last one
+static void client_class_unref (struct client_class *c);
+
+// returns the predicate cache entry for a pair of classes, resetting it
+// if it holds the results for another pair
+static struct predicate_cache_entry * predicate_cache_get (struct client_class *class1, struct client_class *class2);
+
 static struct peer_know * create_know (struct client_data *from, struct client_data *to, int relay_server, int relay_client);
 static void remove_know (struct peer_know *k);
-static void know_inform_job_handler (struct peer_know *k);
 static void uninform_know (struct peer_know *k);
-static void know_uninform_job_handler (struct peer_know *k);
 
 static int launch_pair (struct peer_flow *flow_to);
 
 // find flow from a client to some client
 static struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id);
 
+// starts connecting to another server of the cluster
+static void cluster_peer_connect (struct cluster_peer *peer);
+
+// listener handler for links from other servers of the cluster
+static void cluster_listener_handler (void *unused);
+
+// allocates a link and starts its I/O once connected
+static struct cluster_link * link_create (struct cluster_peer *peer);
+static int link_init_io (struct cluster_link *link);
+
+// sets up SSL for a link, with the server certificate used on both ends
+static int link_init_ssl (struct cluster_link *link);
+
+// provides our certificate when we connected the link
+static SECStatus link_client_auth_data_callback (struct cluster_link *link, PRFileDesc *fd, CERTDistNames *caNames, CERTCertificate **pRetCert, SECKEYPrivateKey **pRetKey);
+
+// checks that the other end of a link is a server of the cluster
+static SECStatus link_auth_certificate_callback (struct cluster_link *link, PRFileDesc *fd, PRBool checkSig, PRBool isServer);
+
+// frees a link, removing the other server's clients, and connects again later if we connect to it
+static void link_free (struct cluster_link *link);
+
+static void link_connector_handler (struct cluster_link *link, int is_error);
+static void link_connection_handler (struct cluster_link *link, int event);
+static void link_sslcon_handler (struct cluster_link *link, int event);
+static void link_decoder_handler_error (struct cluster_link *link);
+static void link_disconnect_timer_handler (struct cluster_link *link);
+static void link_keepalive_timer_handler (struct cluster_link *link);
+
+// appends link log prefix
+static void link_logfunc (struct cluster_link *link);
+
+// passes a message to the logger, prepending about the link
+static void link_log (struct cluster_link *link, int level, const char *fmt, ...);
+
+// handler for the control buffer asking for a packet
+static void link_control_handler_recv (struct cluster_link *link, uint8_t *data);
+
+// sends the next pending control packet, if the control buffer has asked for one
+static void link_control_send (struct cluster_link *link);
+
+// submits a control packet whose payload has been written after the header
+static void link_end_control_packet (struct cluster_link *link, uint8_t type, peerid_t id, int len);
+
+// sends the newclient packet about one of our clients
+static void link_send_newclient (struct cluster_link *link, struct client_data *client);
+
+// handler for packets received from the other server
+static void link_input_handler_send (struct cluster_link *link, uint8_t *data, int data_len);
+
+static void link_process_hello (struct cluster_link *link, uint8_t *data, int data_len);
+static void link_process_newclient (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len);
+static void link_process_endclient (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len);
+static void link_process_data (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len);
+static void link_process_resetpeer (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len);
+
+// finds a client of the other server
+static struct client_data * link_find_client (struct cluster_link *link, peerid_t id);
+
+// informs the other server about one of our clients
+static int link_create_know (struct cluster_link *link, struct client_data *client);
+static void link_remove_know (struct link_know *k);
+static void link_uninform_know (struct link_know *k);
+
+// handler for packets to send to a client of the other server
+static void client_output_link_handler_send (struct client_data *client, uint8_t *data, int data_len);
+
+// handler for a client's packet having been sent by the link
+static void link_flow_handler_done (struct link_flow *lf);
+
+// frees a link flow whose client has been removed, after the link is done with its packet
+static void link_flow_handler_canremove (struct link_flow *lf);
+
+static void link_flow_free (struct link_flow *lf);
+
+// asks the other server to reset a pair too, if one of the clients is on it
+static void cluster_notify_reset (struct peer_flow *flow);
+
+#ifndef BADVPN_USE_WINAPI
+
+// initializes a worker, including its listeners and queues
+static int worker_init (struct worker *w, int index);
+
+// frees a worker, and any clients it still has. The main thread's clients must
+// have been freed and the worker's thread must not be running.
+static void worker_free (struct worker *w);
+
+// worker thread
+static void * worker_thread (struct worker *w);
+
+// handler for stopping a worker
+static void worker_quit_signal_handler (BThreadSignal *thread_signal);
+
+// called in the worker when there is space in the queue to the main thread
+static void worker_to_main_handler_space (struct worker *w);
+
+// called in the main thread for each message from the worker
+static void worker_to_main_handler_recv (struct worker *w, uint8_t *data, int data_len);
+
+// called in the main thread when there is space in the queue to the worker
+static void worker_from_main_handler_space (struct worker *w);
+
+// called in the worker for each message from the main thread
+static void worker_from_main_handler_recv (struct worker *w, uint8_t *data, int data_len);
+
+// worker's listener handler, accepts new clients
+static void worker_listener_handler (struct worker_listener *l);
+
+// main thread: starts using a client accepted by a worker
+static void client_attach (struct client_data *client);
+
+// main thread: passes a client back to its worker, which frees it
+static void client_detach (struct client_data *client);
+
+// main thread: handler for packets to send to a client of a worker
+static void client_output_worker_handler_send (struct client_data *client, uint8_t *data, int data_len);
+
+// main thread: whether there is a message to send to the worker for a client
+static int client_worker_has_pending (struct client_data *client);
+
+// main thread: sends a pending message to the worker, or waits for space in the queue
+static void client_worker_flush (struct client_data *client);
+
+// main thread: sends a pending message to the worker. Returns 0 if the queue is full.
+static int client_worker_send_pending (struct client_data *client);
+
+// worker: initializes the client's I/O
+static int wclient_init_io (struct client_data *client);
+
+// worker: frees the client's connection
+static void wclient_free_transport (struct client_data *client);
+
+// worker: frees the connection after an error and reports the error to the main thread
+static void wclient_error (struct client_data *client);
+
+// worker: appends client log prefix
+static void wclient_logfunc (struct client_data *client);
+
+// worker: passes a message to the logger, prepending about the client
+static void wclient_log (struct client_data *client, int level, const char *fmt, ...);
+
+// worker: BConnection handler
+static void wclient_connection_handler (struct client_data *client, int event);
+
+// worker: BSSLConnection handler
+static void wclient_sslcon_handler (struct client_data *client, int event);
+
+// worker: decoder handler
+static void wclient_decoder_handler_error (struct client_data *client);
+
+// worker: handler for packets received from the client
+static void wclient_input_handler_send (struct client_data *client, uint8_t *data, int data_len);
+
+// worker: handler for packets sent to the client
+static void wclient_output_handler_done (struct client_data *client);
+
+// worker: starts sending the first packet in the client's output buffer
+static void wclient_send_next (struct client_data *client);
+
+// worker: job for reporting sent packets
+static void wclient_job_handler (struct client_data *client);
+
+// worker: sends pending messages to the main thread, or waits for space in the queue
+static void wclient_flush (struct client_data *client);
+
+// worker: sends pending messages to the main thread. Returns 0 if the queue got full.
+static int wclient_send_pending (struct client_data *client);
+
+#endif
+
 int main (int argc, char *argv[])
 {
     if (argc <= 0) {
@@ -490,8 +739,9 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
-        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+    int twd_flags = (options.threads_cpu_affinity ? BTHREADWORK_INIT_CPU_AFFINITY : 0);
+    if (!BThreadWorkDispatcher_Init2(&twd, &ss, options.threads, twd_flags)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init2 failed");
         goto fail3a;
     }
     
@@ -513,9 +763,37 @@ int main (int argc, char *argv[])
     // initialize clients tree
     BAVL_Init(&clients_tree, OFFSET_DIFF(struct client_data, id, tree_node), (BAVL_comparator)peerid_comparator, NULL);
     
+    // initialize client classes tree
+    BAVL_Init(&client_classes_tree, OFFSET_DIFF(struct client_class, key, tree_node), (BAVL_comparator)client_class_comparator, NULL);
+    
+    // first class ID will be one; cache entries start out with zero IDs, matching no class
+    client_classes_nextid = 1;
+    
+    // initialize cluster
+    LinkedList1_Init(&cluster_links);
+    have_cluster_listener = 0;
+    for (int i = 0; i < num_cluster_peers; i++) {
+        struct cluster_peer *peer = &cluster_peers[i];
+        peer->link = NULL;
+        BTimer_Init(&peer->reconnect_timer, LINK_RECONNECT_TIME, (BTimer_handler)cluster_peer_connect, peer);
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    // initialize workers, which listen instead of us
+    num_workers = 0;
+    workers_running = 0;
+    while (num_workers < options.workers) {
+        if (!worker_init(&workers[num_workers], num_workers)) {
+            BLog(BLOG_ERROR, "worker_init failed");
+            goto fail10;
+        }
+        num_workers++;
+    }
+#endif
+    
     // initialize listeners
     num_listeners = 0;
-    while (num_listeners < num_listen_addrs) {
+    while (options.workers == 0 && num_listeners < num_listen_addrs) {
         if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
             BLog(BLOG_ERROR, "BListener_Init failed");
             goto fail10;
@@ -523,12 +801,61 @@ int main (int argc, char *argv[])
         num_listeners++;
     }
     
+    // listen for links from servers with higher cluster IDs
+    if (options.cluster_listen_addr) {
+        if (!BListener_Init(&cluster_listener, cluster_listen_addr, &ss, NULL, (BListener_handler)cluster_listener_handler)) {
+            BLog(BLOG_ERROR, "BListener_Init failed");
+            goto fail10;
+        }
+        have_cluster_listener = 1;
+    }
+    
+    // connect to servers with lower cluster IDs
+    for (int i = 0; i < num_cluster_peers; i++) {
+        if (cluster_peers[i].server_id < options.cluster_id) {
+            cluster_peer_connect(&cluster_peers[i]);
+        }
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    // start worker threads
+    int num_threads = 0;
+    while (num_threads < num_workers) {
+        struct worker *w = &workers[num_threads];
+        if (pthread_create(&w->thread, NULL, (void * (*) (void *))worker_thread, w) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            goto fail11;
+        }
+        num_threads++;
+    }
+    workers_running = 1;
+#endif
+    
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
     BReactor_Exec(&ss);
     
-    // free clients
+#ifndef BADVPN_USE_WINAPI
+fail11:
+    // stop worker threads
+    while (num_threads > 0) {
+        num_threads--;
+        struct worker *w = &workers[num_threads];
+        ASSERT_FORCE(BThreadSignal_Thread_Signal(&w->quit_signal))
+        ASSERT_FORCE(pthread_join(w->thread, NULL) == 0)
+    }
+    workers_running = 0;
+#endif
+    
     LinkedList1Node *node;
+    
+    // free links, and the clients of other servers
+    while (node = LinkedList1_GetFirst(&cluster_links)) {
+        struct cluster_link *link = UPPER_OBJECT(node, struct cluster_link, list_node);
+        link_free(link);
+    }
+    
+    // free clients
     while (node = LinkedList1_GetFirst(&clients)) {
         struct client_data *client = UPPER_OBJECT(node, struct client_data, list_node);
         
@@ -563,10 +890,24 @@ int main (int argc, char *argv[])
         client_dealloc(client);
     }
 fail10:
+    ASSERT(LinkedList1_IsEmpty(&cluster_links))
+    for (int i = 0; i < num_cluster_peers; i++) {
+        BReactor_RemoveTimer(&ss, &cluster_peers[i].reconnect_timer);
+    }
+    if (have_cluster_listener) {
+        BListener_Free(&cluster_listener);
+    }
     while (num_listeners > 0) {
         num_listeners--;
         BListener_Free(&listeners[num_listeners]);
     }
+#ifndef BADVPN_USE_WINAPI
+    // free workers, and the clients they have left
+    while (num_workers > 0) {
+        num_workers--;
+        worker_free(&workers[num_workers]);
+    }
+#endif
     
     BSignal_Finish();
 fail4:
@@ -629,6 +970,7 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--threads-cpu-affinity]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
         "        [--listen-addr <addr>] ...\n"
@@ -637,8 +979,15 @@ void print_help (const char *name)
         "        [--relay-predicate <string>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--max-clients <number>]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--workers <number>]\n"
+        #endif
+        "        [--cluster-id <0-%d>\n"
+        "            [--cluster-listen-addr <addr>]\n"
+        "            [--cluster-peer <id> <addr>] ...\n"
+        "        ]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
-        name
+        name, LP_MAX_SERVERS - 1
     );
 }
 
@@ -661,6 +1010,7 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.threads_cpu_affinity = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
     options.ssl = 0;
@@ -671,6 +1021,10 @@ int parse_arguments (int argc, char *argv[])
     options.relay_predicate = NULL;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SNDBUF;
     options.max_clients = DEFAULT_MAX_CLIENTS;
+    options.workers = 0;
+    options.cluster_id = -1;
+    options.cluster_listen_addr = NULL;
+    options.num_cluster_peers = 0;
     
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -755,6 +1109,9 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--threads-cpu-affinity")) {
+            options.threads_cpu_affinity = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
@@ -825,12 +1182,63 @@ int parse_arguments (int argc, char *argv[])
                 fprintf(stderr, "%s: requires an argument\n", arg);
                 return 0;
             }
-            if ((options.max_clients = atoi(argv[i + 1])) <= 0) {
+            if ((options.max_clients = atoi(argv[i + 1])) <= 0 || options.max_clients > (1 << 16)) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--workers")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.workers = atoi(argv[i + 1])) < 0 || options.workers > MAX_WORKERS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
+        else if (!strcmp(arg, "--cluster-id")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.cluster_id = atoi(argv[i + 1])) < 0 || options.cluster_id >= LP_MAX_SERVERS) {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
             }
             i++;
         }
+        else if (!strcmp(arg, "--cluster-listen-addr")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.cluster_listen_addr = argv[i + 1];
+            i++;
+        }
+        else if (!strcmp(arg, "--cluster-peer")) {
+            if (2 >= argc - i) {
+                fprintf(stderr, "%s: requires two arguments\n", arg);
+                return 0;
+            }
+            if (options.num_cluster_peers == MAX_CLUSTER_PEERS) {
+                fprintf(stderr, "%s: too many\n", arg);
+                return 0;
+            }
+            int id = atoi(argv[i + 1]);
+            if (id < 0 || id >= LP_MAX_SERVERS) {
+                fprintf(stderr, "%s: wrong id argument\n", arg);
+                return 0;
+            }
+            options.cluster_peer_ids[options.num_cluster_peers] = id;
+            options.cluster_peer_addrs[options.num_cluster_peers] = argv[i + 2];
+            options.num_cluster_peers++;
+            i += 2;
+        }
         else {
             fprintf(stderr, "%s: unknown option\n", arg);
             return 0;
@@ -851,6 +1259,46 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    // workers do SSL in their own threads
+    if (options.workers > 0 && (options.use_threads_for_ssl_handshake || options.use_threads_for_ssl_data)) {
+        fprintf(stderr, "--workers cannot be used with --use-threads-for-ssl-handshake or --use-threads-for-ssl-data\n");
+        return 0;
+    }
+    
+    if (options.cluster_id < 0 && (options.cluster_listen_addr || options.num_cluster_peers > 0)) {
+        fprintf(stderr, "--cluster-listen-addr and --cluster-peer require --cluster-id\n");
+        return 0;
+    }
+    
+    int need_cluster_listen = 0;
+    for (int i = 0; i < options.num_cluster_peers; i++) {
+        if (options.cluster_peer_ids[i] == options.cluster_id) {
+            fprintf(stderr, "--cluster-peer: cannot have our own ID\n");
+            return 0;
+        }
+        for (int j = 0; j < i; j++) {
+            if (options.cluster_peer_ids[j] == options.cluster_peer_ids[i]) {
+                fprintf(stderr, "--cluster-peer: duplicate ID\n");
+                return 0;
+            }
+        }
+        if (options.cluster_peer_ids[i] > options.cluster_id) {
+            need_cluster_listen = 1;
+        }
+    }
+    
+    // servers with higher IDs connect to us
+    if (need_cluster_listen && !options.cluster_listen_addr) {
+        fprintf(stderr, "--cluster-peer with a higher ID than ours requires --cluster-listen-addr\n");
+        return 0;
+    }
+    
+    // client IDs have our cluster ID in the top bits
+    if (options.cluster_id >= 0 && options.max_clients > (1 << LP_CLIENT_ID_BITS)) {
+        fprintf(stderr, "--max-clients cannot be more than %d with --cluster-id\n", (1 << LP_CLIENT_ID_BITS));
+        return 0;
+    }
+    
     return 1;
 }
 
@@ -866,6 +1314,26 @@ int process_arguments (void)
         num_listen_addrs++;
     }
     
+    // resolve cluster listen address
+    if (options.cluster_listen_addr) {
+        if (!BAddr_Parse(&cluster_listen_addr, options.cluster_listen_addr, NULL, 0)) {
+            BLog(BLOG_ERROR, "cluster listen addr: BAddr_Parse failed");
+            return 0;
+        }
+    }
+    
+    // resolve addresses of the other servers of the cluster
+    num_cluster_peers = 0;
+    while (num_cluster_peers < options.num_cluster_peers) {
+        struct cluster_peer *peer = &cluster_peers[num_cluster_peers];
+        peer->server_id = options.cluster_peer_ids[num_cluster_peers];
+        if (!BAddr_Parse(&peer->addr, options.cluster_peer_addrs[num_cluster_peers], NULL, 0)) {
+            BLog(BLOG_ERROR, "cluster peer addr: BAddr_Parse failed");
+            return 0;
+        }
+        num_cluster_peers++;
+    }
+    
     return 1;
 }
 
@@ -903,6 +1371,12 @@ void listener_handler (BListener *listener)
         goto fail0;
     }
     
+    // we own the connection
+    client->worker = NULL;
+    
+    // the client is connected to us
+    client->link = NULL;
+    
     // accept connection
     if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
         BLog(BLOG_ERROR, "BConnection_Init failed");
@@ -929,37 +1403,10 @@ void listener_handler (BListener *listener)
     BConnection_RecvAsync_Init(&client->con);
     
     if (options.ssl) {
-        // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
-            client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+        // set up SSL
+        if (!client_init_ssl(client, &ss, &twd, (BSSLConnection_handler)client_sslcon_handler, client_log)) {
             goto fail2;
         }
-        
-        // create SSL file descriptor from the bottom NSPR file descriptor
-        if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
-            client_log(client, BLOG_ERROR, "SSL_ImportFD failed");
-            ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
-            goto fail2;
-        }
-        
-        // set server mode
-        if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
-            goto fail3;
-        }
-        
-        // set require client certificate
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
-            goto fail3;
-        }
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
-            goto fail3;
-        }
-        
-        // init SSL connection
-        BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
     } else {
         // initialize I/O
         if (!client_init_io(client)) {
@@ -967,38 +1414,10 @@ void listener_handler (BListener *listener)
         }
     }
     
-    // start disconnect timer
-    BTimer_Init(&client->disconnect_timer, CLIENT_NO_DATA_TIME_LIMIT, (BTimer_handler)client_disconnect_timer_handler, client);
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
-    
-    // link in
-    clients_num++;
-    LinkedList1_Append(&clients, &client->list_node);
-    ASSERT_EXECUTE(BAVL_Insert(&clients_tree, &client->tree_node, NULL))
-    
-    // init knowledge lists
-    LinkedList1_Init(&client->know_out_list);
-    LinkedList1_Init(&client->know_in_list);
-    
-    // initialize peer flows from us list and tree (flows for sending messages to other clients)
-    LinkedList1_Init(&client->peer_out_flows_list);
-    BAVL_Init(&client->peer_out_flows_tree, OFFSET_DIFF(struct peer_flow, dest_client_id, src_tree_node), (BAVL_comparator)peerid_comparator, NULL);
-    
-    // init dying
-    client->dying = 0;
-    BPending_Init(&client->dying_job, BReactor_PendingGroup(&ss), (BPending_handler)client_dying_job, client);
-    
-    // set state
-    client->initstatus = (options.ssl ? INITSTATUS_HANDSHAKE : INITSTATUS_WAITHELLO);
-    
-    client_log(client, BLOG_INFO, "initialized");
+    client_link_in(client);
     
     return;
     
-    if (options.ssl) {
-fail3:
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
 fail2:
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
@@ -1009,33 +1428,201 @@ fail0:
     return;
 }
 
-void client_dealloc (struct client_data *client)
+int client_init_ssl (struct client_data *client, BReactor *reactor, BThreadWorkDispatcher *dispatcher, BSSLConnection_handler handler, client_log_func log)
 {
-    ASSERT(LinkedList1_IsEmpty(&client->know_out_list))
-    ASSERT(LinkedList1_IsEmpty(&client->know_in_list))
-    ASSERT(LinkedList1_IsEmpty(&client->peer_out_flows_list))
+    // create bottom NSPR file descriptor
+    if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), dispatcher, ssl_flags())) {
+        log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+        goto fail0;
+    }
     
-    // free I/O
-    if (client->initstatus >= INITSTATUS_WAITHELLO && !client->dying) {
-        client_dealloc_io(client);
+    // create SSL file descriptor from the bottom NSPR file descriptor
+    if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
+        log(client, BLOG_ERROR, "SSL_ImportFD failed");
+        ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
+        goto fail0;
     }
     
-    // free dying
-    BPending_Free(&client->dying_job);
+    // set server mode
+    if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
+        log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
+        goto fail1;
+    }
     
-    // link out
-    BAVL_Remove(&clients_tree, &client->tree_node);
-    LinkedList1_Remove(&clients, &client->list_node);
-    clients_num--;
+    // set require client certificate
+    if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+        log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+        goto fail1;
+    }
+    if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+        log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+        goto fail1;
+    }
     
-    // stop disconnect timer
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    // init SSL connection
+    BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(reactor), client, handler);
     
-    // free SSL
-    if (options.ssl) {
-        BSSLConnection_Free(&client->sslcon);
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
+    return 1;
+    
+fail1:
+    ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+fail0:
+    return 0;
+}
+
+int client_read_cert (struct client_data *client, char **common_name, client_log_func log)
+{
+    // get client certificate
+    CERTCertificate *cert = SSL_PeerCertificate(client->ssl_prfd);
+    if (!cert) {
+        log(client, BLOG_ERROR, "SSL_PeerCertificate failed");
+        goto fail0;
+    }
+    
+    // remember common name
+    if (!(*common_name = CERT_GetCommonName(&cert->subject))) {
+        log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
+        goto fail1;
+    }
+    
+    // store certificate
+    SECItem der = cert->derCert;
+    if (der.len > sizeof(client->cert)) {
+        log(client, BLOG_NOTICE, "client certificate too big");
+        goto fail1;
+    }
+    memcpy(client->cert, der.data, der.len);
+    client->cert_len = der.len;
+    
+    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+    if (!arena) {
+        log(client, BLOG_ERROR, "PORT_NewArena failed");
+        goto fail1;
+    }
+    
+    // encode certificate
+    memset(&der, 0, sizeof(der));
+    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
+        log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
+        goto fail2;
+    }
+    
+    // store re-encoded certificate (for compatibility with old clients)
+    if (der.len > sizeof(client->cert_old)) {
+        log(client, BLOG_NOTICE, "client certificate too big");
+        goto fail2;
+    }
+    memcpy(client->cert_old, der.data, der.len);
+    client->cert_old_len = der.len;
+    
+    PORT_FreeArena(arena, PR_FALSE);
+    CERT_DestroyCertificate(cert);
+    
+    return 1;
+    
+fail2:
+    PORT_FreeArena(arena, PR_FALSE);
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    return 0;
+}
+
+void client_link_in (struct client_data *client)
+{
+    // start disconnect timer; a client of another server is timed out by its server
+    BTimer_Init(&client->disconnect_timer, CLIENT_NO_DATA_TIME_LIMIT, (BTimer_handler)client_disconnect_timer_handler, client);
+    if (!client->link) {
+        BReactor_SetTimer(&ss, &client->disconnect_timer);
+    }
+    
+    // link in; only our own clients count towards the limit
+    if (!client->link) {
+        clients_num++;
+    }
+    LinkedList1_Append(&clients, &client->list_node);
+    ASSERT_EXECUTE(BAVL_Insert(&clients_tree, &client->tree_node, NULL))
+    
+    // init knowledge lists
+    LinkedList1_Init(&client->know_out_list);
+    LinkedList1_Init(&client->know_in_list);
+    LinkedList1_Init(&client->know_send_list);
+    
+    // init list of knows of the other servers of the cluster
+    LinkedList1_Init(&client->link_know_list);
+    
+    // have no predicate class
+    client->class = NULL;
+    
+    // initialize peer flows from us list and tree (flows for sending messages to other clients)
+    LinkedList1_Init(&client->peer_out_flows_list);
+    BAVL_Init(&client->peer_out_flows_tree, OFFSET_DIFF(struct peer_flow, dest_client_id, src_tree_node), (BAVL_comparator)peerid_comparator, NULL);
+    
+    // init dying
+    client->dying = 0;
+    BPending_Init(&client->dying_job, BReactor_PendingGroup(&ss), (BPending_handler)client_dying_job, client);
+    
+    // set state; a client of another server is already complete
+    if (client->link) {
+        client->initstatus = INITSTATUS_COMPLETE;
+    } else {
+        client->initstatus = (options.ssl ? INITSTATUS_HANDSHAKE : INITSTATUS_WAITHELLO);
+    }
+    
+    client_log(client, BLOG_INFO, "initialized");
+    
+}
+
+void client_dealloc (struct client_data *client)
+{
+    ASSERT(LinkedList1_IsEmpty(&client->know_out_list))
+    ASSERT(LinkedList1_IsEmpty(&client->know_in_list))
+    ASSERT(LinkedList1_IsEmpty(&client->peer_out_flows_list))
+    
+    // free I/O
+    if (client->initstatus >= INITSTATUS_WAITHELLO && !client->dying) {
+        client_dealloc_io(client);
+    }
+    
+    // free dying
+    BPending_Free(&client->dying_job);
+    
+    // link out
+    BAVL_Remove(&clients_tree, &client->tree_node);
+    LinkedList1_Remove(&clients, &client->list_node);
+    if (!client->link) {
+        clients_num--;
+    }
+    
+    // stop disconnect timer
+    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    
+    // release predicate class
+    if (client->class) {
+        client_class_unref(client->class);
+    }
+    
+    if (client->link) {
+        // a client of another server has no connection
+        LinkedList1_Remove(&client->link->clients_list, &client->link_list_node);
+        free(client->common_name);
+        free(client);
+        return;
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    if (client->worker) {
+        // the worker frees the connection, then we free the memory
+        client_detach(client);
+        return;
+    }
+#endif
+    
+    // free SSL
+    if (options.ssl) {
+        BSSLConnection_Free(&client->sslcon);
+        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+    }
     
     // free common name
     if (client->common_name) {
@@ -1053,58 +1640,85 @@ void client_dealloc (struct client_data *client)
     free(client);
 }
 
-int client_compute_buffer_size (struct client_data *client)
-{
-    bsize_t s = bsize_add(bsize_fromsize(1), bsize_mul(bsize_fromsize(2), bsize_fromsize(options.max_clients - 1)));
-    
-    if (s.is_overflow || s.value > INT_MAX) {
-        return INT_MAX;
-    } else {
-        return s.value;
-    }
-}
-
 int client_init_io (struct client_data *client)
 {
-    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
-    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
-    
-    // init input
+    PacketPassInterface *output_if;
     
-    // init interface
-    PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
-    
-    // init decoder
-    if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
-        (PacketProtoDecoder_handler_error)client_decoder_handler_error
-    )) {
-        client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail1;
+    if (client->link) {
+        // packets for a client of another server go into the link to its server
+        struct link_flow *lf = (struct link_flow *)malloc(sizeof(*lf));
+        if (!lf) {
+            client_log(client, BLOG_ERROR, "malloc failed");
+            return 0;
+        }
+        lf->link = client->link;
+        lf->client = client;
+        PacketPassFairQueueFlow_Init(&lf->qflow, &client->link->output_data_fairqueue);
+        PacketPassInterface_Sender_Init(PacketPassFairQueueFlow_GetInput(&lf->qflow), (PacketPassInterface_handler_done)link_flow_handler_done, lf);
+        LinkedList1_Append(&client->link->link_flows_list, &lf->list_node);
+        client->output_link_flow = lf;
+        
+        // init interface for passing packets to the link
+        PacketPassInterface_Init(&client->output_link_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), (PacketPassInterface_handler_send)client_output_link_handler_send, client, BReactor_PendingGroup(&ss));
+        output_if = &client->output_link_if;
+    }
+#ifndef BADVPN_USE_WINAPI
+    else if (client->worker) {
+        // the worker receives packets and sends them for us; init interface for passing packets to it
+        PacketPassInterface_Init(&client->output_worker_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), (PacketPassInterface_handler_send)client_output_worker_handler_send, client, BReactor_PendingGroup(&ss));
+        output_if = &client->output_worker_if;
+    }
+#endif
+    else {
+        StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
+        StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
+        
+        // init input
+        
+        // init interface
+        PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
+        
+        // init decoder
+        if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
+            (PacketProtoDecoder_handler_error)client_decoder_handler_error
+        )) {
+            client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+            PacketPassInterface_Free(&client->input_interface);
+            return 0;
+        }
+        
+        // init sender
+        PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+        output_if = PacketStreamSender_GetInput(&client->output_sender);
     }
     
     // init output common
     
-    // init sender
-    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
-    
     // init queue
-    PacketPassPriorityQueue_Init(&client->output_priorityqueue, PacketStreamSender_GetInput(&client->output_sender), BReactor_PendingGroup(&ss), 0);
+    PacketPassPriorityQueue_Init(&client->output_priorityqueue, output_if, BReactor_PendingGroup(&ss), 0);
     
     // init output control flow
     
     // init queue flow
     PacketPassPriorityQueueFlow_Init(&client->output_control_qflow, &client->output_priorityqueue, -1);
     
-    // init PacketProtoFlow
-    if (!PacketProtoFlow_Init(
-        &client->output_control_oflow, SC_MAX_ENC, client_compute_buffer_size(client),
-        PacketPassPriorityQueueFlow_GetInput(&client->output_control_qflow), BReactor_PendingGroup(&ss)
+    // init source
+    PacketRecvInterface_Init(&client->output_control_source, SC_MAX_ENC, (PacketRecvInterface_handler_recv)client_control_handler_recv, client, BReactor_PendingGroup(&ss));
+    client->output_control_packet = NULL;
+    client->output_control_packet_len = -1;
+    client->output_control_hello = 0;
+    
+    // init encoder
+    PacketProtoEncoder_Init(&client->output_control_encoder, &client->output_control_source, BReactor_PendingGroup(&ss));
+    
+    // init buffer
+    if (!PacketBuffer_Init(
+        &client->output_control_buffer, PacketProtoEncoder_GetOutput(&client->output_control_encoder),
+        PacketPassPriorityQueueFlow_GetInput(&client->output_control_qflow), CLIENT_CONTROL_BUFFER_PACKETS, BReactor_PendingGroup(&ss)
     )) {
-        client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
+        client_log(client, BLOG_ERROR, "PacketBuffer_Init failed");
         goto fail2;
     }
-    client->output_control_input = PacketProtoFlow_GetInput(&client->output_control_oflow);
-    client->output_control_packet_len = -1;
     
     // init output peers flow
     
@@ -1125,23 +1739,62 @@ int client_init_io (struct client_data *client)
     
 fail3:
     PacketPassPriorityQueueFlow_Free(&client->output_peers_qflow);
-    PacketProtoFlow_Free(&client->output_control_oflow);
+    PacketBuffer_Free(&client->output_control_buffer);
 fail2:
+    PacketProtoEncoder_Free(&client->output_control_encoder);
+    PacketRecvInterface_Free(&client->output_control_source);
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
-    // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
-fail1:
-    PacketPassInterface_Free(&client->input_interface);
+    client_free_connection_io(client);
     return 0;
 }
 
+void client_free_connection_io (struct client_data *client)
+{
+    if (client->link) {
+        struct link_flow *lf = client->output_link_flow;
+        
+        // if the link is sending the client's packet, the link flow is freed after that
+        if (PacketPassFairQueueFlow_IsBusy(&lf->qflow)) {
+            lf->client = NULL;
+            PacketPassFairQueueFlow_SetBusyHandler(&lf->qflow, (PacketPassFairQueue_handler_busy)link_flow_handler_canremove, lf);
+        } else {
+            link_flow_free(lf);
+        }
+        
+        // free interface to the link
+        PacketPassInterface_Free(&client->output_link_if);
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    if (client->worker) {
+        // stop waiting to pass a packet to the worker
+        if (client->main_waiting) {
+            LinkedList1_Remove(&client->worker->from_main_waiting, &client->main_waiting_node);
+            client->main_waiting = 0;
+        }
+        client->output_worker_packet_len = -1;
+        
+        // free interface to the worker
+        PacketPassInterface_Free(&client->output_worker_if);
+    }
+#endif
+    
+    if (!client->worker && !client->link) {
+        // free sender
+        PacketStreamSender_Free(&client->output_sender);
+        
+        // free input
+        PacketProtoDecoder_Free(&client->input_decoder);
+        PacketPassInterface_Free(&client->input_interface);
+    }
+}
+
 void client_dealloc_io (struct client_data *client)
 {
     // stop using any buffers before they get freed
-    if (options.ssl) {
+    if (options.ssl && !client->worker && !client->link) {
         BSSLConnection_ReleaseBuffers(&client->sslcon);
     }
     
@@ -1164,16 +1817,16 @@ void client_dealloc_io (struct client_data *client)
     PacketPassPriorityQueueFlow_Free(&client->output_peers_qflow);
     
     // free output control flow
-    PacketProtoFlow_Free(&client->output_control_oflow);
+    PacketBuffer_Free(&client->output_control_buffer);
+    PacketProtoEncoder_Free(&client->output_control_encoder);
+    PacketRecvInterface_Free(&client->output_control_source);
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
     
-    // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
-    PacketPassInterface_Free(&client->input_interface);
+    // free sender and input, or the interface to the worker
+    client_free_connection_io(client);
 }
 
 void client_remove (struct client_data *client)
@@ -1204,7 +1857,7 @@ void client_remove (struct client_data *client)
         ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
         ASSERT(!flow->dest_client->dying)
         
-        if (flow->have_io && PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
+        if (flow->io && PacketPassFairQueueFlow_IsBusy(&flow->io->qflow)) {
             client_log(client, BLOG_DEBUG, "removing flow to %d later", (int)flow->dest_client->id);
             peer_flow_disconnect(flow);
         } else {
@@ -1213,7 +1866,7 @@ void client_remove (struct client_data *client)
         }
     }
     
-    // schedule job to finish removal after clients are informed
+    // schedule job to finish removal
     BPending_Set(&client->dying_job);
     
     // inform other clients that 'client' is no more
@@ -1224,6 +1877,15 @@ void client_remove (struct client_data *client)
         uninform_know(k);
         node = next;
     }
+    
+    // inform the other servers of the cluster that 'client' is no more
+    node = LinkedList1_GetFirst(&client->link_know_list);
+    while (node) {
+        LinkedList1Node *next = LinkedList1Node_Next(node);
+        struct link_know *k = UPPER_OBJECT(node, struct link_know, client_node);
+        link_uninform_know(k);
+        node = next;
+    }
 }
 
 void client_dying_job (struct client_data *client)
@@ -1237,10 +1899,15 @@ void client_dying_job (struct client_data *client)
 
 void client_logfunc (struct client_data *client)
 {
-    char addr[BADDR_MAX_PRINT_LEN];
-    BAddr_Print(&client->addr, addr);
-    
-    BLog_Append("client %d (%s)", (int)client->id, addr);
+    if (client->link) {
+        // the address is only known to the client's own server
+        BLog_Append("client %d (on server %d)", (int)client->id, client->link->peer->server_id);
+    } else {
+        char addr[BADDR_MAX_PRINT_LEN];
+        BAddr_Print(&client->addr, addr);
+        
+        BLog_Append("client %d (%s)", (int)client->id, addr);
+    }
     if (client->common_name) {
         BLog_Append(" (%s)", client->common_name);
     }
@@ -1292,57 +1959,16 @@ void client_sslcon_handler (struct client_data *client, int event)
         return;
     }
     
-    // get client certificate
-    CERTCertificate *cert = SSL_PeerCertificate(client->ssl_prfd);
-    if (!cert) {
-        client_log(client, BLOG_ERROR, "SSL_PeerCertificate failed");
+    // store certificate and common name
+    if (!client_read_cert(client, &client->common_name, client_log)) {
         goto fail0;
     }
     
-    // remember common name
-    if (!(client->common_name = CERT_GetCommonName(&cert->subject))) {
-        client_log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
-        goto fail1;
-    }
-    
-    // store certificate
-    SECItem der = cert->derCert;
-    if (der.len > sizeof(client->cert)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail1;
-    }
-    memcpy(client->cert, der.data, der.len);
-    client->cert_len = der.len;
-    
-    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
-    if (!arena) {
-        client_log(client, BLOG_ERROR, "PORT_NewArena failed");
-        goto fail1;
-    }
-    
-    // encode certificate
-    memset(&der, 0, sizeof(der));
-    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
-        client_log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
-        goto fail2;
-    }
-    
-    // store re-encoded certificate (for compatibility with old clients)
-    if (der.len > sizeof(client->cert_old)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail2;
-    }
-    memcpy(client->cert_old, der.data, der.len);
-    client->cert_old_len = der.len;
-    
     // init I/O chains
     if (!client_init_io(client)) {
-        goto fail2;
+        goto fail0;
     }
     
-    PORT_FreeArena(arena, PR_FALSE);
-    CERT_DestroyCertificate(cert);
-    
     // set client state
     client->initstatus = INITSTATUS_WAITHELLO;
     
@@ -1351,10 +1977,6 @@ void client_sslcon_handler (struct client_data *client, int event)
     return;
     
     // handle errors
-fail2:
-    PORT_FreeArena(arena, PR_FALSE);
-fail1:
-    CERT_DestroyCertificate(cert);
 fail0:
     client_remove(client);
 }
@@ -1370,61 +1992,95 @@ void client_decoder_handler_error (struct client_data *client)
     return;
 }
 
-int client_start_control_packet (struct client_data *client, void **data, int len)
+void client_control_handler_recv (struct client_data *client, uint8_t *data)
 {
-    ASSERT(len >= 0)
-    ASSERT(len <= SC_MAX_PAYLOAD)
-    ASSERT(!(len > 0) || data)
     ASSERT(INITSTATUS_HASLINK(client->initstatus))
     ASSERT(!client->dying)
-    ASSERT(client->output_control_packet_len == -1)
-    
-#ifdef SIMULATE_OUT_OF_CONTROL_BUFFER
-    uint8_t x;
-    BRandom_randomize(&x, sizeof(x));
-    if (x < SIMULATE_OUT_OF_CONTROL_BUFFER) {
-        client_log(client, BLOG_INFO, "out of control buffer, removing");
-        client_remove(client);
-        return -1;
-    }
-#endif
-    
-    // obtain location for writing the packet
-    if (!BufferWriter_StartPacket(client->output_control_input, &client->output_control_packet)) {
-        // out of buffer, kill client
-        client_log(client, BLOG_INFO, "out of control buffer, removing");
-        client_remove(client);
-        return -1;
-    }
-    
-    client->output_control_packet_len = len;
+    ASSERT(!client->output_control_packet)
     
-    if (data) {
-        *data = client->output_control_packet + sizeof(struct sc_header);
-    }
+    // remember where to write the packet
+    client->output_control_packet = data;
     
-    return 0;
+    client_control_send(client);
 }
 
-void client_end_control_packet (struct client_data *client, uint8_t type)
+void client_control_send (struct client_data *client)
 {
     ASSERT(INITSTATUS_HASLINK(client->initstatus))
     ASSERT(!client->dying)
-    ASSERT(client->output_control_packet_len >= 0)
-    ASSERT(client->output_control_packet_len <= SC_MAX_PAYLOAD)
     
-    // write header
+    // wait for the buffer to ask for a packet
+    if (!client->output_control_packet) {
+        return;
+    }
+    
+    // serverhello goes before anything else
+    if (client->output_control_hello) {
+        client->output_control_hello = 0;
+        client_send_serverhello(client);
+        return;
+    }
+    
+    LinkedList1Node *node = LinkedList1_GetFirst(&client->know_send_list);
+    if (!node) {
+        return;
+    }
+    struct peer_know *k = UPPER_OBJECT(node, struct peer_know, send_node);
+    ASSERT(k->from == client)
+    
+    if (k->state == KNOW_STATE_INFORM) {
+        // inform 'from' about 'to'
+        LinkedList1_Remove(&client->know_send_list, &k->send_node);
+        k->state = KNOW_STATE_INFORMED;
+        client_send_newclient(client, k->to, k->relay_server, k->relay_client);
+    } else {
+        ASSERT(k->state == KNOW_STATE_UNINFORM)
+        
+        // inform 'from' that 'to' is no more
+        peerid_t to_id = k->to_id;
+        remove_know(k);
+        client_send_endclient(client, to_id);
+    }
+}
+
+void client_start_control_packet (struct client_data *client, void **data, int len)
+{
+    ASSERT(len >= 0)
+    ASSERT(len <= SC_MAX_PAYLOAD)
+    ASSERT(!(len > 0) || data)
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    ASSERT(client->output_control_packet)
+    ASSERT(client->output_control_packet_len == -1)
+    
+    client->output_control_packet_len = len;
+    
+    if (data) {
+        *data = client->output_control_packet + sizeof(struct sc_header);
+    }
+}
+
+void client_end_control_packet (struct client_data *client, uint8_t type)
+{
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    ASSERT(client->output_control_packet)
+    ASSERT(client->output_control_packet_len >= 0)
+    ASSERT(client->output_control_packet_len <= SC_MAX_PAYLOAD)
+    
+    // write header
     struct sc_header header;
     header.type = htol8(type);
     memcpy(client->output_control_packet, &header, sizeof(header));
     
     // finish writing packet
-    BufferWriter_EndPacket(client->output_control_input, sizeof(struct sc_header) + client->output_control_packet_len);
+    PacketRecvInterface_Done(&client->output_control_source, sizeof(struct sc_header) + client->output_control_packet_len);
     
+    client->output_control_packet = NULL;
     client->output_control_packet_len = -1;
 }
 
-int client_send_newclient (struct client_data *client, struct client_data *nc, int relay_server, int relay_client)
+void client_send_newclient (struct client_data *client, struct client_data *nc, int relay_server, int relay_client)
 {
     ASSERT(client->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!client->dying)
@@ -1451,9 +2107,7 @@ int client_send_newclient (struct client_data *client, struct client_data *nc, i
     
     struct sc_server_newclient omsg;
     void *pack;
-    if (client_start_control_packet(client, &pack, sizeof(omsg) + cert_len) < 0) {
-        return -1;
-    }
+    client_start_control_packet(client, &pack, sizeof(omsg) + cert_len);
     omsg.id = htol16(nc->id);
     omsg.flags = htol16(flags);
     memcpy(pack, &omsg, sizeof(omsg));
@@ -1461,25 +2115,34 @@ int client_send_newclient (struct client_data *client, struct client_data *nc, i
         memcpy((char *)pack + sizeof(omsg), cert_data, cert_len);
     }
     client_end_control_packet(client, SCID_NEWCLIENT);
-    
-    return 0;
 }
 
-int client_send_endclient (struct client_data *client, peerid_t end_id)
+void client_send_endclient (struct client_data *client, peerid_t end_id)
 {
     ASSERT(client->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!client->dying)
     
     struct sc_server_endclient omsg;
     void *pack;
-    if (client_start_control_packet(client, &pack, sizeof(omsg)) < 0) {
-        return -1;
-    }
+    client_start_control_packet(client, &pack, sizeof(omsg));
     omsg.id = htol16(end_id);
     memcpy(pack, &omsg, sizeof(omsg));
     client_end_control_packet(client, SCID_ENDCLIENT);
+}
+
+void client_send_serverhello (struct client_data *client)
+{
+    ASSERT(client->initstatus == INITSTATUS_COMPLETE)
+    ASSERT(!client->dying)
     
-    return 0;
+    struct sc_server_hello omsg;
+    void *pack;
+    client_start_control_packet(client, &pack, sizeof(omsg));
+    omsg.flags = htol16(0);
+    omsg.id = htol16(client->id);
+    omsg.clientAddr = (client->addr.type == BADDR_TYPE_IPV4 ? client->addr.ipv4.ip : hton32(0));
+    memcpy(pack, &omsg, sizeof(omsg));
+    client_end_control_packet(client, SCID_SERVERHELLO);
 }
 
 void client_input_handler_send (struct client_data *client, uint8_t *data, int data_len)
@@ -1492,6 +2155,16 @@ void client_input_handler_send (struct client_data *client, uint8_t *data, int d
     // accept packet
     PacketPassInterface_Done(&client->input_interface);
     
+    client_process_packet(client, data, data_len);
+}
+
+void client_process_packet (struct client_data *client, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    ASSERT(!client->dying)
+    
     // restart disconnect timer
     BReactor_SetTimer(&ss, &client->disconnect_timer);
     
@@ -1565,13 +2238,57 @@ void process_packet_hello (struct client_data *client, uint8_t *data, int data_l
     
     client_log(client, BLOG_INFO, "received hello");
     
+    // get predicate class
+    if (!(client->class = client_class_ref(client))) {
+        client_log(client, BLOG_ERROR, "failed to allocate class");
+        client_remove(client);
+        return;
+    }
+    
     // set client state to complete
     client->initstatus = INITSTATUS_COMPLETE;
     
+    // send hello, before any newclient's
+    client->output_control_hello = 1;
+    client_control_send(client);
+    
     // publish client
+    client_publish(client);
+}
+
+void client_publish (struct client_data *client)
+{
+    ASSERT(client->initstatus == INITSTATUS_COMPLETE)
+    ASSERT(!client->dying)
+    ASSERT(client->class)
+    
+    // inform the other servers of the cluster about our client, before
+    // it can send them any messages
+    if (!client->link) {
+        for (LinkedList1Node *list_node = LinkedList1_GetFirst(&cluster_links); list_node; list_node = LinkedList1Node_Next(list_node)) {
+            struct cluster_link *link = UPPER_OBJECT(list_node, struct cluster_link, list_node);
+            if (link->state == LINK_STATE_UP && !link_create_know(link, client)) {
+                client_log(client, BLOG_ERROR, "failed to allocate know for server %d", link->peer->server_id);
+                goto fail;
+            }
+        }
+    }
+    
+    // pair with every client we're allowed to; each pair has its flows, so memory
+    // grows with the square of the number of clients unless the comm predicate
+    // limits the pairs
     for (LinkedList1Node *list_node = LinkedList1_GetFirst(&clients); list_node; list_node = LinkedList1Node_Next(list_node)) {
         struct client_data *client2 = UPPER_OBJECT(list_node, struct client_data, list_node);
-        if (client2 == client || client2->initstatus != INITSTATUS_COMPLETE || client2->dying || !clients_allowed(client, client2)) {
+        if (client2 == client || client2->initstatus != INITSTATUS_COMPLETE || client2->dying) {
+            continue;
+        }
+        
+        // clients of other servers are paired by their own servers
+        if (client->link && client2->link) {
+            continue;
+        }
+        
+        if (!clients_allowed(client, client2)) {
             continue;
         }
         
@@ -1599,18 +2316,6 @@ void process_packet_hello (struct client_data *client, uint8_t *data, int data_l
         }
     }
     
-    // send hello
-    struct sc_server_hello omsg;
-    void *pack;
-    if (client_start_control_packet(client, &pack, sizeof(omsg)) < 0) {
-        return;
-    }
-    omsg.flags = htol16(0);
-    omsg.id = htol16(client->id);
-    omsg.clientAddr = (client->addr.type == BADDR_TYPE_IPV4 ? client->addr.ipv4.ip : hton32(0));
-    memcpy(pack, &omsg, sizeof(omsg));
-    client_end_control_packet(client, SCID_SERVERHELLO);
-    
     return;
     
 fail:
@@ -1663,29 +2368,7 @@ void process_packet_outmsg (struct client_data *client, uint8_t *data, int data_
         return;
     }
     
-#ifdef SIMULATE_OUT_OF_FLOW_BUFFER
-    uint8_t x;
-    BRandom_randomize(&x, sizeof(x));
-    if (x < SIMULATE_OUT_OF_FLOW_BUFFER) {
-        client_log(client, BLOG_WARNING, "simulating error; resetting to %d", (int)flow->dest_client->id);
-        peer_flow_start_reset(flow);
-        return;
-    }
-#endif
-    
-    // send packet
-    struct sc_server_inmsg omsg;
-    void *pack;
-    if (!peer_flow_start_packet(flow, &pack, sizeof(omsg) + payload_size)) {
-        // out of buffer, reset these two clients
-        client_log(client, BLOG_WARNING, "out of buffer; resetting to %d", (int)flow->dest_client->id);
-        peer_flow_start_reset(flow);
-        return;
-    }
-    omsg.clientid = htol16(client->id);
-    memcpy(pack, &omsg, sizeof(omsg));
-    memcpy((char *)pack + sizeof(omsg), payload, payload_size);
-    peer_flow_end_packet(flow, SCID_INMSG);
+    peer_flow_send_message(flow, payload, payload_size);
 }
 
 void process_packet_resetpeer (struct client_data *client, uint8_t *data, int data_len)
@@ -1729,6 +2412,7 @@ void process_packet_resetpeer (struct client_data *client, uint8_t *data, int da
     
     // reset clients
     peer_flow_start_reset(flow);
+    cluster_notify_reset(flow);
 }
 
 void process_packet_acceptpeer (struct client_data *client, uint8_t *data, int data_len)
@@ -1772,11 +2456,18 @@ void process_packet_acceptpeer (struct client_data *client, uint8_t *data, int d
     // set accepted
     flow->accepted = 1;
     
-    // if pair is resetting, continue
+    // if pair is resetting, continue, else init I/O for messages from the client;
+    // this allocates the flow buffer now, not on the first message, as a new
+    // buffer only accepts packets after pending jobs have run, while messages
+    // have to be written as they are processed
     if (flow->resetting) {
         peer_flow_drive_reset(flow);
     } else if (flow->opposite->resetting) {
         peer_flow_drive_reset(flow->opposite);
+    } else if (!peer_flow_init_io(flow)) {
+        client_log(client, BLOG_ERROR, "acceptpeer: failed to init flow to %d", (int)id);
+        client_remove(client);
+        return;
     }
 }
 
@@ -1808,7 +2499,10 @@ struct peer_flow * peer_flow_create (struct client_data *src_client, struct clie
     LinkedList1_Append(&flow->dest_client->output_peers_flows, &flow->dest_list_node);
     
     // have no I/O
-    flow->have_io = 0;
+    flow->io = NULL;
+    
+    // no reset to send to another server
+    flow->link_reset = 0;
     
     // init reset timer
     BTimer_Init(&flow->reset_timer, CLIENT_RESET_TIME, (BTimer_handler)peer_flow_reset_timer_handler, flow);
@@ -1821,13 +2515,18 @@ fail0:
 
 void peer_flow_dealloc (struct peer_flow *flow)
 {
-    if (flow->have_io) { PacketPassFairQueueFlow_AssertFree(&flow->qflow); }
+    if (flow->io) { PacketPassFairQueueFlow_AssertFree(&flow->io->qflow); }
     
     // free reset timer
     BReactor_RemoveTimer(&ss, &flow->reset_timer);
     
+    // don't send a reset for the pair
+    if (flow->link_reset) {
+        LinkedList1_Remove(&flow->dest_client->link->reset_list, &flow->link_reset_node);
+    }
+    
     // free I/O
-    if (flow->have_io) {
+    if (flow->io) {
         peer_flow_free_io(flow);
     }
     
@@ -1846,47 +2545,59 @@ void peer_flow_dealloc (struct peer_flow *flow)
 
 int peer_flow_init_io (struct peer_flow *flow)
 {
-    ASSERT(!flow->have_io)
+    ASSERT(!flow->io)
+    
+    // allocate I/O structure
+    struct peer_flow_io *io = (struct peer_flow_io *)malloc(sizeof(*io));
+    if (!io) {
+        BLog(BLOG_ERROR, "malloc failed");
+        goto fail0;
+    }
     
     // init queue flow
-    PacketPassFairQueueFlow_Init(&flow->qflow, &flow->dest_client->output_peers_fairqueue);
+    PacketPassFairQueueFlow_Init(&io->qflow, &flow->dest_client->output_peers_fairqueue);
     
     // init PacketProtoFlow
     if (!PacketProtoFlow_Init(
-        &flow->oflow, SC_MAX_ENC, CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS,
-        PacketPassFairQueueFlow_GetInput(&flow->qflow), BReactor_PendingGroup(&ss)
+        &io->oflow, SC_MAX_ENC, CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS,
+        PacketPassFairQueueFlow_GetInput(&io->qflow), BReactor_PendingGroup(&ss)
     )) {
         BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
-    flow->input = PacketProtoFlow_GetInput(&flow->oflow);
+    io->input = PacketProtoFlow_GetInput(&io->oflow);
     
     // set no packet
-    flow->packet_len = -1;
+    io->packet_len = -1;
     
     // set have I/O
-    flow->have_io = 1;
+    flow->io = io;
     
     return 1;
     
 fail1:
-    PacketPassFairQueueFlow_Free(&flow->qflow);
+    PacketPassFairQueueFlow_Free(&io->qflow);
+    free(io);
+fail0:
     return 0;
 }
 
 void peer_flow_free_io (struct peer_flow *flow)
 {
-    ASSERT(flow->have_io)
-    PacketPassFairQueueFlow_AssertFree(&flow->qflow);
+    ASSERT(flow->io)
+    PacketPassFairQueueFlow_AssertFree(&flow->io->qflow);
     
     // free PacketProtoFlow
-    PacketProtoFlow_Free(&flow->oflow);
+    PacketProtoFlow_Free(&flow->io->oflow);
     
     // free queue flow
-    PacketPassFairQueueFlow_Free(&flow->qflow);
+    PacketPassFairQueueFlow_Free(&flow->io->qflow);
+    
+    // free I/O structure
+    free(flow->io);
     
     // set have no I/O
-    flow->have_io = 0;
+    flow->io = NULL;
 }
 
 void peer_flow_disconnect (struct peer_flow *flow)
@@ -1894,12 +2605,18 @@ void peer_flow_disconnect (struct peer_flow *flow)
     ASSERT(flow->src_client)
     ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!flow->dest_client->dying)
-    ASSERT(flow->have_io)
-    ASSERT(PacketPassFairQueueFlow_IsBusy(&flow->qflow))
+    ASSERT(flow->io)
+    ASSERT(PacketPassFairQueueFlow_IsBusy(&flow->io->qflow))
     
     // stop reset timer
     BReactor_RemoveTimer(&ss, &flow->reset_timer);
     
+    // don't send a reset for the pair
+    if (flow->link_reset) {
+        LinkedList1_Remove(&flow->dest_client->link->reset_list, &flow->link_reset_node);
+        flow->link_reset = 0;
+    }
+    
     // remove from source list and hash table
     BAVL_Remove(&flow->src_client->peer_out_flows_tree, &flow->src_tree_node);
     LinkedList1_Remove(&flow->src_client->peer_out_flows_list, &flow->src_list_node);
@@ -1908,7 +2625,7 @@ void peer_flow_disconnect (struct peer_flow *flow)
     flow->src_client = NULL;
     
     // set busy handler
-    PacketPassFairQueueFlow_SetBusyHandler(&flow->qflow, (PacketPassFairQueue_handler_busy)peer_flow_handler_canremove, flow);
+    PacketPassFairQueueFlow_SetBusyHandler(&flow->io->qflow, (PacketPassFairQueue_handler_busy)peer_flow_handler_canremove, flow);
 }
 
 int peer_flow_start_packet (struct peer_flow *flow, void **data, int len)
@@ -1919,42 +2636,80 @@ int peer_flow_start_packet (struct peer_flow *flow, void **data, int len)
     ASSERT(!flow->src_client->dying)
     ASSERT(!flow->resetting)
     ASSERT(!flow->opposite->resetting)
-    ASSERT(flow->have_io)
-    ASSERT(flow->packet_len == -1)
+    ASSERT(flow->io)
+    ASSERT(flow->io->packet_len == -1)
     ASSERT(len >= 0)
     ASSERT(len <= SC_MAX_PAYLOAD)
     ASSERT(!(len > 0) || data)
     
     // obtain location for writing the packet
-    if (!BufferWriter_StartPacket(flow->input, &flow->packet)) {
+    if (!BufferWriter_StartPacket(flow->io->input, &flow->io->packet)) {
         return 0;
     }
     
     // remember packet length
-    flow->packet_len = len;
+    flow->io->packet_len = len;
     
     if (data) {
-        *data = flow->packet + sizeof(struct sc_header);
+        *data = flow->io->packet + sizeof(struct sc_header);
     }
     return 1;
 }
 
 void peer_flow_end_packet (struct peer_flow *flow, uint8_t type)
 {
-    ASSERT(flow->have_io)
-    ASSERT(flow->packet_len >= 0)
-    ASSERT(flow->packet_len <= SC_MAX_PAYLOAD)
+    ASSERT(flow->io)
+    ASSERT(flow->io->packet_len >= 0)
+    ASSERT(flow->io->packet_len <= SC_MAX_PAYLOAD)
     
     // write header
     struct sc_header header;
     header.type = type;
-    memcpy(flow->packet, &header, sizeof(header));
+    memcpy(flow->io->packet, &header, sizeof(header));
     
     // finish writing packet
-    BufferWriter_EndPacket(flow->input, sizeof(struct sc_header) + flow->packet_len);
+    BufferWriter_EndPacket(flow->io->input, sizeof(struct sc_header) + flow->io->packet_len);
     
     // set have no packet
-    flow->packet_len = -1;
+    flow->io->packet_len = -1;
+}
+
+void peer_flow_send_message (struct peer_flow *flow, uint8_t *payload, int payload_size)
+{
+    ASSERT(flow->accepted)
+    ASSERT(!flow->resetting)
+    ASSERT(!flow->opposite->resetting)
+    ASSERT(flow->io)
+    ASSERT(payload_size >= 0)
+    ASSERT(payload_size <= SC_MAX_MSGLEN)
+    
+    struct client_data *client = flow->src_client;
+    
+#ifdef SIMULATE_OUT_OF_FLOW_BUFFER
+    uint8_t x;
+    BRandom_randomize(&x, sizeof(x));
+    if (x < SIMULATE_OUT_OF_FLOW_BUFFER) {
+        client_log(client, BLOG_WARNING, "simulating error; resetting to %d", (int)flow->dest_client->id);
+        peer_flow_start_reset(flow);
+        cluster_notify_reset(flow);
+        return;
+    }
+#endif
+    
+    // send packet
+    struct sc_server_inmsg omsg;
+    void *pack;
+    if (!peer_flow_start_packet(flow, &pack, sizeof(omsg) + payload_size)) {
+        // out of buffer, reset these two clients
+        client_log(client, BLOG_WARNING, "out of buffer; resetting to %d", (int)flow->dest_client->id);
+        peer_flow_start_reset(flow);
+        cluster_notify_reset(flow);
+        return;
+    }
+    omsg.clientid = htol16(client->id);
+    memcpy(pack, &omsg, sizeof(omsg));
+    memcpy((char *)pack + sizeof(omsg), payload, payload_size);
+    peer_flow_end_packet(flow, SCID_INMSG);
 }
 
 void peer_flow_handler_canremove (struct peer_flow *flow)
@@ -1962,8 +2717,8 @@ void peer_flow_handler_canremove (struct peer_flow *flow)
     ASSERT(!flow->src_client)
     ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!flow->dest_client->dying)
-    ASSERT(flow->have_io)
-    PacketPassFairQueueFlow_AssertFree(&flow->qflow);
+    ASSERT(flow->io)
+    PacketPassFairQueueFlow_AssertFree(&flow->io->qflow);
     
     client_log(flow->dest_client, BLOG_DEBUG, "removing old flow");
     
@@ -1979,8 +2734,6 @@ void peer_flow_start_reset (struct peer_flow *flow)
     ASSERT(!flow->dest_client->dying)
     ASSERT(!flow->resetting)
     ASSERT(!flow->opposite->resetting)
-    ASSERT(flow->have_io)
-    ASSERT(flow->opposite->have_io)
     
     client_log(flow->src_client, BLOG_INFO, "starting reset to %d", (int)flow->dest_client->id);
     
@@ -2001,25 +2754,25 @@ void peer_flow_drive_reset (struct peer_flow *flow)
     ASSERT(!BTimer_IsRunning(&flow->reset_timer))
     
     // try to free I/O
-    if (flow->have_io) {
-        if (PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
-            PacketPassFairQueueFlow_SetBusyHandler(&flow->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow);
+    if (flow->io) {
+        if (PacketPassFairQueueFlow_IsBusy(&flow->io->qflow)) {
+            PacketPassFairQueueFlow_SetBusyHandler(&flow->io->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow);
         } else {
             peer_flow_free_io(flow);
         }
     }
     
     // try to free opposite I/O
-    if (flow->opposite->have_io) {
-        if (PacketPassFairQueueFlow_IsBusy(&flow->opposite->qflow)) {
-            PacketPassFairQueueFlow_SetBusyHandler(&flow->opposite->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow->opposite);
+    if (flow->opposite->io) {
+        if (PacketPassFairQueueFlow_IsBusy(&flow->opposite->io->qflow)) {
+            PacketPassFairQueueFlow_SetBusyHandler(&flow->opposite->io->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow->opposite);
         } else {
             peer_flow_free_io(flow->opposite);
         }
     }
     
     // if we still got some I/O, or some client hasn't accepted yet, wait
-    if (flow->have_io || flow->opposite->have_io || !flow->accepted || !flow->opposite->accepted) {
+    if (flow->io || flow->opposite->io || !flow->accepted || !flow->opposite->accepted) {
         return;
     }
     
@@ -2034,8 +2787,8 @@ void peer_flow_reset_qflow_handler_busy (struct peer_flow *flow)
     ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!flow->dest_client->dying)
     ASSERT(flow->resetting || flow->opposite->resetting)
-    ASSERT(flow->have_io)
-    ASSERT(!PacketPassFairQueueFlow_IsBusy(&flow->qflow))
+    ASSERT(flow->io)
+    ASSERT(!PacketPassFairQueueFlow_IsBusy(&flow->io->qflow))
     
     if (flow->resetting) {
         peer_flow_drive_reset(flow);
@@ -2052,24 +2805,23 @@ void peer_flow_reset_timer_handler (struct peer_flow *flow)
     ASSERT(!flow->dest_client->dying)
     ASSERT(flow->resetting)
     ASSERT(!flow->opposite->resetting)
-    ASSERT(!flow->have_io)
-    ASSERT(!flow->opposite->have_io)
+    ASSERT(!flow->io)
+    ASSERT(!flow->opposite->io)
     ASSERT(flow->accepted)
     ASSERT(flow->opposite->accepted)
     
     client_log(flow->src_client, BLOG_INFO, "finally resetting to %d", (int)flow->dest_client->id);
     
-    struct peer_know *know = flow->know;
-    struct peer_know *know_opposite = flow->opposite->know;
-    
-    // launch pair
-    if (!launch_pair(flow)) {
-        return;
+    // remove old knows, so that the clients get endclient before the new newclient
+    if (flow->know) {
+        uninform_know(flow->know);
+    }
+    if (flow->opposite->know) {
+        uninform_know(flow->opposite->know);
     }
     
-    // remove old knows
-    uninform_know(know);
-    uninform_know(know_opposite);
+    // launch pair
+    launch_pair(flow);
 }
 
 peerid_t new_client_id (void)
@@ -2078,6 +2830,12 @@ peerid_t new_client_id (void)
     
     for (int i = 0; i < options.max_clients; i++) {
         peerid_t id = clients_nextid++;
+        
+        // in a cluster, the top bits of our clients' IDs are our cluster ID
+        if (options.cluster_id >= 0) {
+            id = (options.cluster_id << LP_CLIENT_ID_BITS) | (id & LP_CLIENT_ID_MASK);
+        }
+        
         if (!find_client_by_id(id)) {
             return id;
         }
@@ -2108,6 +2866,12 @@ int clients_allowed (struct client_data *client1, struct client_data *client2)
         return 1;
     }
     
+    // use the cached result for the clients' classes, if any
+    struct predicate_cache_entry *e = predicate_cache_get(client1->class, client2->class);
+    if (e->comm >= 0) {
+        return e->comm;
+    }
+    
     // set values to compare against
     comm_predicate_p1name = (client1->common_name ? client1->common_name : "");
     comm_predicate_p2name = (client2->common_name ? client2->common_name : "");
@@ -2117,9 +2881,12 @@ int clients_allowed (struct client_data *client1, struct client_data *client2)
     // evaluate predicate
     int res = BPredicate_Eval(&comm_predicate);
     if (res < 0) {
-        return 0;
+        res = 0;
     }
     
+    // cache result
+    e->comm = res;
+    
     return res;
 }
 
@@ -2165,10 +2932,19 @@ int comm_predicate_func_p2addr_cb (void *user, void **args)
 
 int relay_allowed (struct client_data *client, struct client_data *relay)
 {
+    ASSERT(client->class)
+    ASSERT(relay->class)
+    
     if (!options.relay_predicate) {
         return 0;
     }
     
+    // use the cached result for the clients' classes, if any
+    struct predicate_cache_entry *e = predicate_cache_get(client->class, relay->class);
+    if (e->relay >= 0) {
+        return e->relay;
+    }
+    
     // set values to compare against
     relay_predicate_pname = (client->common_name ? client->common_name : "");
     relay_predicate_rname = (relay->common_name ? relay->common_name : "");
@@ -2178,9 +2954,12 @@ int relay_allowed (struct client_data *client, struct client_data *relay)
     // evaluate predicate
     int res = BPredicate_Eval(&relay_predicate);
     if (res < 0) {
-        return 0;
+        res = 0;
     }
     
+    // cache result
+    e->relay = res;
+    
     return res;
 }
 
@@ -2229,6 +3008,96 @@ int peerid_comparator (void *unused, peerid_t *p1, peerid_t *p2)
     return B_COMPARE(*p1, *p2);
 }
 
+int client_class_comparator (void *unused, struct client_class_key *k1, struct client_class_key *k2)
+{
+    int c = B_COMPARE(k1->addr.type, k2->addr.type);
+    if (c) {
+        return c;
+    }
+    
+    switch (k1->addr.type) {
+        case BADDR_TYPE_IPV4:
+            c = B_COMPARE(k1->addr.ipv4, k2->addr.ipv4);
+            break;
+        case BADDR_TYPE_IPV6:
+            c = B_COMPARE(memcmp(k1->addr.ipv6, k2->addr.ipv6, sizeof(k1->addr.ipv6)), 0);
+            break;
+    }
+    if (c) {
+        return c;
+    }
+    
+    return B_COMPARE(strcmp(k1->common_name, k2->common_name), 0);
+}
+
+struct client_class * client_class_ref (struct client_data *client)
+{
+    struct client_class_key key;
+    BAddr_GetIPAddr(&client->addr, &key.addr);
+    key.common_name = (client->common_name ? client->common_name : "");
+    
+    // look for an existing class
+    BAVLNode *node = BAVL_LookupExact(&client_classes_tree, &key);
+    if (node) {
+        struct client_class *c = UPPER_OBJECT(node, struct client_class, tree_node);
+        ASSERT(c->refcnt > 0)
+        c->refcnt++;
+        return c;
+    }
+    
+    // allocate structure, with the common name after it
+    size_t name_len = strlen(key.common_name);
+    struct client_class *c = (struct client_class *)malloc(sizeof(*c) + name_len + 1);
+    if (!c) {
+        return NULL;
+    }
+    char *name = (char *)(c + 1);
+    memcpy(name, key.common_name, name_len + 1);
+    
+    // init structure
+    c->key.addr = key.addr;
+    c->key.common_name = name;
+    c->id = client_classes_nextid++;
+    c->refcnt = 1;
+    
+    // insert to tree
+    ASSERT_EXECUTE(BAVL_Insert(&client_classes_tree, &c->tree_node, NULL))
+    
+    return c;
+}
+
+void client_class_unref (struct client_class *c)
+{
+    ASSERT(c->refcnt > 0)
+    
+    if (--c->refcnt > 0) {
+        return;
+    }
+    
+    // remove from tree
+    BAVL_Remove(&client_classes_tree, &c->tree_node);
+    
+    // free structure
+    free(c);
+}
+
+struct predicate_cache_entry * predicate_cache_get (struct client_class *class1, struct client_class *class2)
+{
+    // hash class IDs
+    uint64_t h = class1->id * UINT64_C(0x9E3779B97F4A7C15) + class2->id * UINT64_C(0xC2B2AE3D27D4EB4F);
+    struct predicate_cache_entry *e = &predicate_cache[(h >> 32) & (PREDICATE_CACHE_SIZE - 1)];
+    
+    // take over the entry if it belongs to another pair
+    if (e->class1_id != class1->id || e->class2_id != class2->id) {
+        e->class1_id = class1->id;
+        e->class2_id = class2->id;
+        e->comm = -1;
+        e->relay = -1;
+    }
+    
+    return e;
+}
+
 struct peer_know * create_know (struct client_data *from, struct client_data *to, int relay_server, int relay_client)
 {
     ASSERT(from->initstatus == INITSTATUS_COMPLETE)
@@ -2245,6 +3114,7 @@ struct peer_know * create_know (struct client_data *from, struct client_data *to
     // init arguments
     k->from = from;
     k->to = to;
+    k->to_id = to->id;
     k->relay_server = relay_server;
     k->relay_client = relay_client;
     
@@ -2252,67 +3122,50 @@ struct peer_know * create_know (struct client_data *from, struct client_data *to
     LinkedList1_Append(&from->know_out_list, &k->from_node);
     LinkedList1_Append(&to->know_in_list, &k->to_node);
     
-    // init and set inform job to inform client 'from' about client 'to'
-    BPending_Init(&k->inform_job, BReactor_PendingGroup(&ss), (BPending_handler)know_inform_job_handler, k);
-    BPending_Set(&k->inform_job);
-    
-    // init uninform job
-    BPending_Init(&k->uninform_job, BReactor_PendingGroup(&ss), (BPending_handler)know_uninform_job_handler, k);
+    // queue informing client 'from' about client 'to'
+    k->state = KNOW_STATE_INFORM;
+    LinkedList1_Append(&from->know_send_list, &k->send_node);
+    client_control_send(from);
     
     return k;
 }
 
 void remove_know (struct peer_know *k)
 {
-    // free uninform job
-    BPending_Free(&k->uninform_job);
-    
-    // free inform job
-    BPending_Free(&k->inform_job);
+    // remove from send list
+    if (k->state != KNOW_STATE_INFORMED) {
+        LinkedList1_Remove(&k->from->know_send_list, &k->send_node);
+    }
     
     // remove from lists
-    LinkedList1_Remove(&k->to->know_in_list, &k->to_node);
+    if (k->to) {
+        LinkedList1_Remove(&k->to->know_in_list, &k->to_node);
+    }
     LinkedList1_Remove(&k->from->know_out_list, &k->from_node);
     
     // free structure
     free(k);
 }
 
-void know_inform_job_handler (struct peer_know *k)
-{
-    ASSERT(!k->from->dying)
-    ASSERT(!k->to->dying)
-    
-    client_send_newclient(k->from, k->to, k->relay_server, k->relay_client);
-    return;
-}
-
 void uninform_know (struct peer_know *k)
 {
     ASSERT(!k->from->dying)
+    ASSERT(k->state != KNOW_STATE_UNINFORM)
     
-    // if 'from' has not been informed about 'to' yet, remove know, otherwise
-    // schedule informing 'from' that 'to' is no more
-    if (BPending_IsSet(&k->inform_job)) {
+    // if 'from' has not been informed about 'to' yet, just remove know
+    if (k->state == KNOW_STATE_INFORM) {
         remove_know(k);
-    } else {
-        BPending_Set(&k->uninform_job);
+        return;
     }
-}
-
-void know_uninform_job_handler (struct peer_know *k)
-{
-    ASSERT(!k->from->dying)
-    ASSERT(!BPending_IsSet(&k->inform_job))
     
-    struct client_data *from = k->from;
-    struct client_data *to = k->to;
-    
-    // remove know
-    remove_know(k);
+    // detach from 'to', which does not have to wait for 'from' to be informed
+    LinkedList1_Remove(&k->to->know_in_list, &k->to_node);
+    k->to = NULL;
     
-    // uninform
-    client_send_endclient(from, to->id);
+    // queue informing 'from' that 'to' is no more
+    k->state = KNOW_STATE_UNINFORM;
+    LinkedList1_Append(&k->from->know_send_list, &k->send_node);
+    client_control_send(k->from);
 }
 
 int launch_pair (struct peer_flow *flow_to)
@@ -2323,35 +3176,25 @@ int launch_pair (struct peer_flow *flow_to)
     ASSERT(!client->dying)
     ASSERT(client2->initstatus == INITSTATUS_COMPLETE)
     ASSERT(!client2->dying)
-    ASSERT(!flow_to->have_io)
-    ASSERT(!flow_to->opposite->have_io)
+    ASSERT(!flow_to->io)
+    ASSERT(!flow_to->opposite->io)
     ASSERT(!BTimer_IsRunning(&flow_to->reset_timer))
     ASSERT(!BTimer_IsRunning(&flow_to->opposite->reset_timer))
     
-    // init I/O
-    if (!peer_flow_init_io(flow_to)) {
-        goto fail;
-    }
-    
-    // init opposite I/O
-    if (!peer_flow_init_io(flow_to->opposite)) {
-        goto fail;
-    }
-    
     // determine relay relations
     int relay_to = relay_allowed(client, client2);
     int relay_from = relay_allowed(client2, client);
     
-    // create know to
-    struct peer_know *know_to = create_know(client, client2, relay_to, relay_from);
-    if (!know_to) {
+    // create know to; a client of another server is informed by its own server
+    struct peer_know *know_to = NULL;
+    if (!client->link && !(know_to = create_know(client, client2, relay_to, relay_from))) {
         client_log(client, BLOG_ERROR, "failed to allocate know to %d", (int)client2->id);
         goto fail;
     }
     
     // create know from
-    struct peer_know *know_from = create_know(client2, client, relay_from, relay_to);
-    if (!know_from) {
+    struct peer_know *know_from = NULL;
+    if (!client2->link && !(know_from = create_know(client2, client, relay_from, relay_to))) {
         client_log(client, BLOG_ERROR, "failed to allocate know from %d", (int)client2->id);
         goto fail;
     }
@@ -2360,14 +3203,23 @@ int launch_pair (struct peer_flow *flow_to)
     flow_to->know = know_to;
     flow_to->opposite->know = know_from;
     
-    // set not accepted, or assume accepted for old version
-    flow_to->accepted = (flow_to->src_client->version <= SC_OLDVERSION_NOSSL);
-    flow_to->opposite->accepted = (flow_to->opposite->src_client->version <= SC_OLDVERSION_NOSSL);
+    // set not accepted, or assume accepted for old version; a client of another
+    // server accepts on its server, which then forwards its messages
+    flow_to->accepted = (flow_to->src_client->link || flow_to->src_client->version <= SC_OLDVERSION_NOSSL);
+    flow_to->opposite->accepted = (flow_to->opposite->src_client->link || flow_to->opposite->src_client->version <= SC_OLDVERSION_NOSSL);
     
     // set not resetting
     flow_to->resetting = 0;
     flow_to->opposite->resetting = 0;
     
+    // init I/O of flows which are accepted; others get it when their client accepts
+    if (flow_to->accepted && !peer_flow_init_io(flow_to)) {
+        goto fail;
+    }
+    if (flow_to->opposite->accepted && !peer_flow_init_io(flow_to->opposite)) {
+        goto fail;
+    }
+    
     return 1;
     
 fail:
@@ -2392,3 +3244,1985 @@ struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id)
     
     return flow;
 }
+
+void cluster_peer_connect (struct cluster_peer *peer)
+{
+    ASSERT(!peer->link)
+    ASSERT(peer->server_id < options.cluster_id)
+    
+    BLog(BLOG_INFO, "connecting to server %d", peer->server_id);
+    
+    // create link, or try again later
+    if (!link_create(peer)) {
+        BReactor_SetTimer(&ss, &peer->reconnect_timer);
+    }
+}
+
+void cluster_listener_handler (void *unused)
+{
+    // create link for the accepted connection; the other server tells who it is in hello
+    link_create(NULL);
+}
+
+struct cluster_link * link_create (struct cluster_peer *peer)
+{
+    ASSERT(!peer || !peer->link)
+    
+    // allocate structure
+    struct cluster_link *link = (struct cluster_link *)malloc(sizeof(*link));
+    if (!link) {
+        BLog(BLOG_ERROR, "malloc failed");
+        goto fail0;
+    }
+    
+    // init arguments
+    link->peer = peer;
+    link->outgoing = !!peer;
+    link->state = LINK_STATE_CONNECTING;
+    
+    // init timers
+    BTimer_Init(&link->disconnect_timer, LINK_NO_DATA_TIME_LIMIT, (BTimer_handler)link_disconnect_timer_handler, link);
+    BTimer_Init(&link->keepalive_timer, LP_KEEPALIVE_INTERVAL, (BTimer_handler)link_keepalive_timer_handler, link);
+    
+    // init lists
+    LinkedList1_Init(&link->link_flows_list);
+    LinkedList1_Init(&link->clients_list);
+    LinkedList1_Init(&link->know_list);
+    LinkedList1_Init(&link->know_send_list);
+    LinkedList1_Init(&link->reset_list);
+    
+    if (peer) {
+        // start connecting
+        link->addr = peer->addr;
+        if (!BConnector_Init(&link->connector, peer->addr, &ss, link, (BConnector_handler)link_connector_handler)) {
+            BLog(BLOG_ERROR, "BConnector_Init failed");
+            goto fail1;
+        }
+    } else {
+        // accept connection
+        if (!link_init_io(link)) {
+            goto fail1;
+        }
+    }
+    
+    // link in
+    LinkedList1_Append(&cluster_links, &link->list_node);
+    if (peer) {
+        peer->link = link;
+    }
+    
+    return link;
+    
+fail1:
+    free(link);
+fail0:
+    return NULL;
+}
+
+int link_init_io (struct cluster_link *link)
+{
+    ASSERT(link->state == LINK_STATE_CONNECTING)
+    
+    // init connection
+    struct BConnection_source source = (link->outgoing ?
+        BConnection_source_connector(&link->connector) :
+        BConnection_source_listener(&cluster_listener, &link->addr)
+    );
+    if (!BConnection_Init(&link->con, source, &ss, link, (BConnection_handler)link_connection_handler)) {
+        BLog(BLOG_ERROR, "BConnection_Init failed");
+        goto fail0;
+    }
+    
+    // limit socket send buffer, else our scheduling is pointless
+    if (!BConnection_SetSendBuffer(&link->con, LINK_SOCKET_SNDBUF)) {
+        link_log(link, BLOG_WARNING, "BConnection_SetSendBuffer failed");
+    }
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&link->con);
+    BConnection_RecvAsync_Init(&link->con);
+    
+    StreamPassInterface *send_if = BConnection_SendAsync_GetIf(&link->con);
+    StreamRecvInterface *recv_if = BConnection_RecvAsync_GetIf(&link->con);
+    
+    if (options.ssl) {
+        // set up SSL
+        if (!link_init_ssl(link)) {
+            goto fail1;
+        }
+        
+        send_if = BSSLConnection_GetSendIf(&link->sslcon);
+        recv_if = BSSLConnection_GetRecvIf(&link->sslcon);
+    }
+    
+    // init input
+    PacketPassInterface_Init(&link->input_interface, LP_MAX_ENC, (PacketPassInterface_handler_send)link_input_handler_send, link, BReactor_PendingGroup(&ss));
+    if (!PacketProtoDecoder_Init(&link->input_decoder, recv_if, &link->input_interface, BReactor_PendingGroup(&ss), link,
+        (PacketProtoDecoder_handler_error)link_decoder_handler_error
+    )) {
+        link_log(link, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        goto fail2;
+    }
+    
+    // init output common
+    PacketStreamSender_Init(&link->output_sender, send_if, PACKETPROTO_ENCLEN(LP_MAX_ENC), BReactor_PendingGroup(&ss));
+    PacketPassPriorityQueue_Init(&link->output_priorityqueue, PacketStreamSender_GetInput(&link->output_sender), BReactor_PendingGroup(&ss), 0);
+    
+    // init output control flow, starting with hello
+    PacketPassPriorityQueueFlow_Init(&link->output_control_qflow, &link->output_priorityqueue, -1);
+    PacketRecvInterface_Init(&link->output_control_source, LP_MAX_ENC, (PacketRecvInterface_handler_recv)link_control_handler_recv, link, BReactor_PendingGroup(&ss));
+    link->output_control_packet = NULL;
+    link->output_control_hello = 1;
+    link->output_control_keepalive = 0;
+    PacketProtoEncoder_Init(&link->output_control_encoder, &link->output_control_source, BReactor_PendingGroup(&ss));
+    if (!PacketBuffer_Init(
+        &link->output_control_buffer, PacketProtoEncoder_GetOutput(&link->output_control_encoder),
+        PacketPassPriorityQueueFlow_GetInput(&link->output_control_qflow), LINK_CONTROL_BUFFER_PACKETS, BReactor_PendingGroup(&ss)
+    )) {
+        link_log(link, BLOG_ERROR, "PacketBuffer_Init failed");
+        goto fail3;
+    }
+    
+    // init output data flow, with lower priority than control flow
+    PacketPassPriorityQueueFlow_Init(&link->output_data_qflow, &link->output_priorityqueue, 0);
+    if (!PacketPassFairQueue_Init(&link->output_data_fairqueue, PacketPassPriorityQueueFlow_GetInput(&link->output_data_qflow), BReactor_PendingGroup(&ss), 0, 1)) {
+        link_log(link, BLOG_ERROR, "PacketPassFairQueue_Init failed");
+        goto fail4;
+    }
+    
+    // start timers
+    BReactor_SetTimer(&ss, &link->disconnect_timer);
+    BReactor_SetTimer(&ss, &link->keepalive_timer);
+    
+    // set state
+    link->state = LINK_STATE_WAITHELLO;
+    
+    return 1;
+    
+fail4:
+    PacketPassPriorityQueueFlow_Free(&link->output_data_qflow);
+    PacketBuffer_Free(&link->output_control_buffer);
+fail3:
+    PacketProtoEncoder_Free(&link->output_control_encoder);
+    PacketRecvInterface_Free(&link->output_control_source);
+    PacketPassPriorityQueueFlow_Free(&link->output_control_qflow);
+    PacketPassPriorityQueue_Free(&link->output_priorityqueue);
+    PacketStreamSender_Free(&link->output_sender);
+    PacketProtoDecoder_Free(&link->input_decoder);
+fail2:
+    PacketPassInterface_Free(&link->input_interface);
+    if (options.ssl) {
+        BSSLConnection_Free(&link->sslcon);
+        ASSERT_FORCE(PR_Close(link->ssl_prfd) == PR_SUCCESS)
+    }
+fail1:
+    BConnection_RecvAsync_Free(&link->con);
+    BConnection_SendAsync_Free(&link->con);
+    BConnection_Free(&link->con);
+fail0:
+    return 0;
+}
+
+int link_init_ssl (struct cluster_link *link)
+{
+    ASSERT(options.ssl)
+    
+    // create bottom NSPR file descriptor
+    if (!BSSLConnection_MakeBackend(&link->bottom_prfd, BConnection_SendAsync_GetIf(&link->con), BConnection_RecvAsync_GetIf(&link->con), &twd, ssl_flags())) {
+        link_log(link, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+        goto fail0;
+    }
+    
+    // create SSL file descriptor from the bottom NSPR file descriptor
+    if (!(link->ssl_prfd = SSL_ImportFD(model_prfd, &link->bottom_prfd))) {
+        link_log(link, BLOG_ERROR, "SSL_ImportFD failed");
+        ASSERT_FORCE(PR_Close(&link->bottom_prfd) == PR_SUCCESS)
+        goto fail0;
+    }
+    
+    // the server which connected is the SSL client
+    if (SSL_ResetHandshake(link->ssl_prfd, (link->outgoing ? PR_FALSE : PR_TRUE)) != SECSuccess) {
+        link_log(link, BLOG_ERROR, "SSL_ResetHandshake failed");
+        goto fail1;
+    }
+    
+    if (link->outgoing) {
+        // set client certificate callback
+        if (SSL_GetClientAuthDataHook(link->ssl_prfd, (SSLGetClientAuthData)link_client_auth_data_callback, link) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_GetClientAuthDataHook failed");
+            goto fail1;
+        }
+    } else {
+        // set require client certificate
+        if (SSL_OptionSet(link->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+            goto fail1;
+        }
+        if (SSL_OptionSet(link->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            link_log(link, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+            goto fail1;
+        }
+    }
+    
+    // set verify peer certificate hook
+    if (SSL_AuthCertificateHook(link->ssl_prfd, (SSLAuthCertificate)link_auth_certificate_callback, link) != SECSuccess) {
+        link_log(link, BLOG_ERROR, "SSL_AuthCertificateHook failed");
+        goto fail1;
+    }
+    
+    // init SSL connection
+    BSSLConnection_Init(&link->sslcon, link->ssl_prfd, 0, BReactor_PendingGroup(&ss), link, (BSSLConnection_handler)link_sslcon_handler);
+    
+    return 1;
+    
+fail1:
+    ASSERT_FORCE(PR_Close(link->ssl_prfd) == PR_SUCCESS)
+fail0:
+    return 0;
+}
+
+SECStatus link_client_auth_data_callback (struct cluster_link *link, PRFileDesc *fd, CERTDistNames *caNames, CERTCertificate **pRetCert, SECKEYPrivateKey **pRetKey)
+{
+    ASSERT(options.ssl)
+    ASSERT(link->outgoing)
+    
+    CERTCertificate *cert = CERT_DupCertificate(server_cert);
+    if (!cert) {
+        link_log(link, BLOG_ERROR, "CERT_DupCertificate failed");
+        goto fail0;
+    }
+    
+    SECKEYPrivateKey *key = SECKEY_CopyPrivateKey(server_key);
+    if (!key) {
+        link_log(link, BLOG_ERROR, "SECKEY_CopyPrivateKey failed");
+        goto fail1;
+    }
+    
+    *pRetCert = cert;
+    *pRetKey = key;
+    return SECSuccess;
+    
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    return SECFailure;
+}
+
+SECStatus link_auth_certificate_callback (struct cluster_link *link, PRFileDesc *fd, PRBool checkSig, PRBool isServer)
+{
+    ASSERT(options.ssl)
+    
+    // Clients have certificates from the same CA, so in both directions we
+    // require a certificate valid for TLS server usage, and with the same
+    // subject as ours. Servers don't have to know each other's domain names.
+    
+    SECStatus ret = SECFailure;
+    
+    CERTCertificate *cert = SSL_PeerCertificate(link->ssl_prfd);
+    if (!cert) {
+        link_log(link, BLOG_ERROR, "SSL_PeerCertificate failed");
+        PORT_SetError(SSL_ERROR_BAD_CERTIFICATE);
+        goto fail1;
+    }
+    
+    if (CERT_VerifyCertNow(CERT_GetDefaultCertDB(), cert, PR_TRUE, certUsageSSLServer, SSL_RevealPinArg(link->ssl_prfd)) != SECSuccess) {
+        link_log(link, BLOG_ERROR, "certificate of other server is not valid for server usage");
+        goto fail2;
+    }
+    
+    if (CERT_CompareName(&cert->subject, &server_cert->subject) != SECEqual) {
+        link_log(link, BLOG_ERROR, "certificate of other server has a different subject than ours");
+        PORT_SetError(SSL_ERROR_BAD_CERTIFICATE);
+        goto fail2;
+    }
+    
+    ret = SECSuccess;
+    
+fail2:
+    CERT_DestroyCertificate(cert);
+fail1:
+    return ret;
+}
+
+void link_free (struct cluster_link *link)
+{
+    link_log(link, BLOG_INFO, "removing");
+    
+    if (link->state != LINK_STATE_CONNECTING) {
+        // stop using any buffers before they get freed
+        if (options.ssl) {
+            BSSLConnection_ReleaseBuffers(&link->sslcon);
+        }
+        
+        // remove the other server's clients; those already dying are deallocated
+        // now too, so that none is left pointing to the link
+        LinkedList1Node *node;
+        while (node = LinkedList1_GetFirst(&link->clients_list)) {
+            struct client_data *client = UPPER_OBJECT(node, struct client_data, link_list_node);
+            ASSERT(client->link == link)
+            if (!client->dying) {
+                client_remove(client);
+            }
+            client_dealloc(client);
+        }
+        
+        // removing the clients has removed the flows with pending resets
+        ASSERT(LinkedList1_IsEmpty(&link->reset_list))
+        
+        // forget what the other server knows about our clients
+        while (node = LinkedList1_GetFirst(&link->know_list)) {
+            struct link_know *k = UPPER_OBJECT(node, struct link_know, link_node);
+            link_remove_know(k);
+        }
+        
+        // allow freeing fair queue flows
+        PacketPassFairQueue_PrepareFree(&link->output_data_fairqueue);
+        
+        // free link flows of removed clients
+        while (node = LinkedList1_GetFirst(&link->link_flows_list)) {
+            struct link_flow *lf = UPPER_OBJECT(node, struct link_flow, list_node);
+            ASSERT(!lf->client)
+            link_flow_free(lf);
+        }
+        
+        // allow freeing priority queue flows
+        PacketPassPriorityQueue_PrepareFree(&link->output_priorityqueue);
+        
+        // free output data flow
+        PacketPassFairQueue_Free(&link->output_data_fairqueue);
+        PacketPassPriorityQueueFlow_Free(&link->output_data_qflow);
+        
+        // free output control flow
+        PacketBuffer_Free(&link->output_control_buffer);
+        PacketProtoEncoder_Free(&link->output_control_encoder);
+        PacketRecvInterface_Free(&link->output_control_source);
+        PacketPassPriorityQueueFlow_Free(&link->output_control_qflow);
+        
+        // free output common
+        PacketPassPriorityQueue_Free(&link->output_priorityqueue);
+        PacketStreamSender_Free(&link->output_sender);
+        
+        // free input
+        PacketProtoDecoder_Free(&link->input_decoder);
+        PacketPassInterface_Free(&link->input_interface);
+        
+        // free SSL
+        if (options.ssl) {
+            BSSLConnection_Free(&link->sslcon);
+            ASSERT_FORCE(PR_Close(link->ssl_prfd) == PR_SUCCESS)
+        }
+        
+        // free connection
+        BConnection_RecvAsync_Free(&link->con);
+        BConnection_SendAsync_Free(&link->con);
+        BConnection_Free(&link->con);
+    }
+    
+    // free timers
+    BReactor_RemoveTimer(&ss, &link->keepalive_timer);
+    BReactor_RemoveTimer(&ss, &link->disconnect_timer);
+    
+    // free connector
+    if (link->outgoing) {
+        BConnector_Free(&link->connector);
+    }
+    
+    // link out, and connect again later if we connect to the server
+    LinkedList1_Remove(&cluster_links, &link->list_node);
+    if (link->peer) {
+        link->peer->link = NULL;
+        if (link->outgoing) {
+            BReactor_SetTimer(&ss, &link->peer->reconnect_timer);
+        }
+    }
+    
+    // free memory
+    free(link);
+}
+
+void link_connector_handler (struct cluster_link *link, int is_error)
+{
+    ASSERT(link->state == LINK_STATE_CONNECTING)
+    
+    if (is_error) {
+        link_log(link, BLOG_ERROR, "connection failed");
+        link_free(link);
+        return;
+    }
+    
+    // init I/O
+    if (!link_init_io(link)) {
+        link_free(link);
+        return;
+    }
+    
+    link_log(link, BLOG_INFO, "connected");
+}
+
+void link_connection_handler (struct cluster_link *link, int event)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    if (event == BCONNECTION_EVENT_RECVCLOSED) {
+        link_log(link, BLOG_INFO, "connection closed");
+    } else {
+        link_log(link, BLOG_INFO, "connection error");
+    }
+    
+    link_free(link);
+}
+
+void link_sslcon_handler (struct cluster_link *link, int event)
+{
+    ASSERT(options.ssl)
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    ASSERT(event == BSSLCONNECTION_EVENT_ERROR)
+    
+    link_log(link, BLOG_ERROR, "SSL error");
+    
+    link_free(link);
+}
+
+void link_decoder_handler_error (struct cluster_link *link)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    link_log(link, BLOG_ERROR, "decoder error");
+    
+    link_free(link);
+}
+
+void link_disconnect_timer_handler (struct cluster_link *link)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    link_log(link, BLOG_WARNING, "timed out");
+    
+    link_free(link);
+}
+
+void link_keepalive_timer_handler (struct cluster_link *link)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    // send keepalive, unless one is still waiting
+    link->output_control_keepalive = 1;
+    link_control_send(link);
+    
+    // restart timer
+    BReactor_SetTimer(&ss, &link->keepalive_timer);
+}
+
+void link_logfunc (struct cluster_link *link)
+{
+    char addr[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(&link->addr, addr);
+    
+    if (link->peer) {
+        BLog_Append("server %d (%s): ", link->peer->server_id, addr);
+    } else {
+        BLog_Append("server link (%s): ", addr);
+    }
+}
+
+void link_log (struct cluster_link *link, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)link_logfunc, link, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+void link_control_handler_recv (struct cluster_link *link, uint8_t *data)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    ASSERT(!link->output_control_packet)
+    
+    // remember where to write the packet
+    link->output_control_packet = data;
+    
+    link_control_send(link);
+}
+
+void link_control_send (struct cluster_link *link)
+{
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    // wait for the buffer to ask for a packet
+    if (!link->output_control_packet) {
+        return;
+    }
+    
+    uint8_t *pack = link->output_control_packet + sizeof(struct lp_header);
+    
+    // hello goes before anything else
+    if (link->output_control_hello) {
+        link->output_control_hello = 0;
+        struct lp_hello msg;
+        msg.version = htol16(LP_VERSION);
+        msg.server_id = htol8(options.cluster_id);
+        memcpy(pack, &msg, sizeof(msg));
+        link_end_control_packet(link, LPID_HELLO, 0, sizeof(msg));
+        return;
+    }
+    
+    if (link->output_control_keepalive) {
+        link->output_control_keepalive = 0;
+        link_end_control_packet(link, LPID_KEEPALIVE, 0, 0);
+        return;
+    }
+    
+    // newclient's and endclient's, in the order the clients came and went
+    LinkedList1Node *node = LinkedList1_GetFirst(&link->know_send_list);
+    if (node) {
+        struct link_know *k = UPPER_OBJECT(node, struct link_know, send_node);
+        ASSERT(k->link == link)
+        
+        if (k->state == KNOW_STATE_INFORM) {
+            LinkedList1_Remove(&link->know_send_list, &k->send_node);
+            k->state = KNOW_STATE_INFORMED;
+            link_send_newclient(link, k->client);
+        } else {
+            ASSERT(k->state == KNOW_STATE_UNINFORM)
+            peerid_t client_id = k->client_id;
+            link_remove_know(k);
+            link_end_control_packet(link, LPID_ENDCLIENT, client_id, 0);
+        }
+        return;
+    }
+    
+    // resets of pairs with the other server's clients
+    node = LinkedList1_GetFirst(&link->reset_list);
+    if (node) {
+        struct peer_flow *flow = UPPER_OBJECT(node, struct peer_flow, link_reset_node);
+        ASSERT(flow->link_reset)
+        ASSERT(!flow->src_client->link)
+        ASSERT(flow->dest_client->link == link)
+        
+        LinkedList1_Remove(&link->reset_list, &flow->link_reset_node);
+        flow->link_reset = 0;
+        
+        struct lp_resetpeer msg;
+        msg.peerid = htol16(flow->dest_client->id);
+        memcpy(pack, &msg, sizeof(msg));
+        link_end_control_packet(link, LPID_RESETPEER, flow->src_client->id, sizeof(msg));
+        return;
+    }
+}
+
+void link_end_control_packet (struct cluster_link *link, uint8_t type, peerid_t id, int len)
+{
+    ASSERT(link->output_control_packet)
+    ASSERT(len >= 0)
+    ASSERT(len <= LP_MAX_PAYLOAD)
+    
+    // write header
+    struct lp_header header;
+    header.type = htol8(type);
+    header.id = htol16(id);
+    memcpy(link->output_control_packet, &header, sizeof(header));
+    
+    // finish writing packet
+    PacketRecvInterface_Done(&link->output_control_source, sizeof(struct lp_header) + len);
+    
+    link->output_control_packet = NULL;
+}
+
+void link_send_newclient (struct cluster_link *link, struct client_data *client)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    ASSERT(!client->link)
+    ASSERT(client->initstatus == INITSTATUS_COMPLETE)
+    ASSERT(!client->dying)
+    
+    int cert_len = (options.ssl ? client->cert_len : 0);
+    int cert_old_len = (options.ssl ? client->cert_old_len : 0);
+    int common_name_len = (client->common_name ? strlen(client->common_name) : 0);
+    ASSERT(common_name_len <= LP_MAX_COMMON_NAME_LEN)
+    
+    struct lp_newclient msg;
+    msg.version = htol16(client->version);
+    memset(msg.addr, 0, sizeof(msg.addr));
+    switch (client->addr.type) {
+        case BADDR_TYPE_IPV4:
+            msg.addr_type = htol8(4);
+            memcpy(msg.addr, &client->addr.ipv4.ip, 4);
+            break;
+        case BADDR_TYPE_IPV6:
+            msg.addr_type = htol8(6);
+            memcpy(msg.addr, client->addr.ipv6.ip, 16);
+            break;
+        default:
+            msg.addr_type = htol8(0);
+            break;
+    }
+    msg.cert_len = htol16(cert_len);
+    msg.cert_old_len = htol16(cert_old_len);
+    msg.common_name_len = htol16(common_name_len);
+    
+    uint8_t *pack = link->output_control_packet + sizeof(struct lp_header);
+    memcpy(pack, &msg, sizeof(msg));
+    pack += sizeof(msg);
+    if (cert_len > 0) {
+        memcpy(pack, client->cert, cert_len);
+        pack += cert_len;
+    }
+    if (cert_old_len > 0) {
+        memcpy(pack, client->cert_old, cert_old_len);
+        pack += cert_old_len;
+    }
+    if (common_name_len > 0) {
+        memcpy(pack, client->common_name, common_name_len);
+    }
+    
+    link_end_control_packet(link, LPID_NEWCLIENT, client->id, sizeof(msg) + cert_len + cert_old_len + common_name_len);
+}
+
+void link_input_handler_send (struct cluster_link *link, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= LP_MAX_ENC)
+    ASSERT(link->state != LINK_STATE_CONNECTING)
+    
+    // accept packet
+    PacketPassInterface_Done(&link->input_interface);
+    
+    // restart disconnect timer
+    BReactor_SetTimer(&ss, &link->disconnect_timer);
+    
+    // parse header
+    if (data_len < sizeof(struct lp_header)) {
+        link_log(link, BLOG_NOTICE, "packet too short");
+        link_free(link);
+        return;
+    }
+    struct lp_header header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    data_len -= sizeof(header);
+    uint8_t type = ltoh8(header.type);
+    peerid_t id = ltoh16(header.id);
+    
+    if (type == LPID_KEEPALIVE) {
+        return;
+    }
+    
+    if (type == LPID_HELLO) {
+        link_process_hello(link, data, data_len);
+        return;
+    }
+    
+    // everything else is about clients, which come after hello
+    if (link->state != LINK_STATE_UP) {
+        link_log(link, BLOG_NOTICE, "packet before hello");
+        link_free(link);
+        return;
+    }
+    
+    switch (type) {
+        case LPID_NEWCLIENT:
+            link_process_newclient(link, id, data, data_len);
+            return;
+        case LPID_ENDCLIENT:
+            link_process_endclient(link, id, data, data_len);
+            return;
+        case LPID_DATA:
+            link_process_data(link, id, data, data_len);
+            return;
+        case LPID_RESETPEER:
+            link_process_resetpeer(link, id, data, data_len);
+            return;
+        default:
+            link_log(link, BLOG_NOTICE, "unknown packet type %d, removing", (int)type);
+            link_free(link);
+            return;
+    }
+}
+
+void link_process_hello (struct cluster_link *link, uint8_t *data, int data_len)
+{
+    if (link->state != LINK_STATE_WAITHELLO) {
+        link_log(link, BLOG_NOTICE, "hello: not expected");
+        link_free(link);
+        return;
+    }
+    
+    if (data_len != sizeof(struct lp_hello)) {
+        link_log(link, BLOG_NOTICE, "hello: invalid length");
+        link_free(link);
+        return;
+    }
+    
+    struct lp_hello msg;
+    memcpy(&msg, data, sizeof(msg));
+    int version = ltoh16(msg.version);
+    int server_id = ltoh8(msg.server_id);
+    
+    if (version != LP_VERSION) {
+        link_log(link, BLOG_ERROR, "hello: unknown version (%d)", version);
+        link_free(link);
+        return;
+    }
+    
+    if (link->peer) {
+        // we connected; make sure it is the server we wanted
+        if (server_id != link->peer->server_id) {
+            link_log(link, BLOG_ERROR, "hello: wrong server ID (%d)", server_id);
+            link_free(link);
+            return;
+        }
+    } else {
+        // accepted; only servers with higher IDs connect to us
+        struct cluster_peer *peer = NULL;
+        for (int i = 0; i < num_cluster_peers; i++) {
+            if (cluster_peers[i].server_id == server_id) {
+                peer = &cluster_peers[i];
+                break;
+            }
+        }
+        if (!peer || server_id < options.cluster_id) {
+            link_log(link, BLOG_ERROR, "hello: unexpected server ID (%d)", server_id);
+            link_free(link);
+            return;
+        }
+        if (peer->link) {
+            link_log(link, BLOG_ERROR, "hello: already have a link to server %d", server_id);
+            link_free(link);
+            return;
+        }
+        link->peer = peer;
+        peer->link = link;
+    }
+    
+    link->state = LINK_STATE_UP;
+    
+    link_log(link, BLOG_NOTICE, "up");
+    
+    // inform the other server about our clients
+    for (LinkedList1Node *list_node = LinkedList1_GetFirst(&clients); list_node; list_node = LinkedList1Node_Next(list_node)) {
+        struct client_data *client = UPPER_OBJECT(list_node, struct client_data, list_node);
+        if (client->link || client->initstatus != INITSTATUS_COMPLETE || client->dying) {
+            continue;
+        }
+        if (!link_create_know(link, client)) {
+            link_log(link, BLOG_ERROR, "failed to allocate know for %d", (int)client->id);
+            link_free(link);
+            return;
+        }
+    }
+}
+
+void link_process_newclient (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    
+    if (data_len < sizeof(struct lp_newclient)) {
+        link_log(link, BLOG_NOTICE, "newclient: wrong size");
+        link_free(link);
+        return;
+    }
+    
+    struct lp_newclient msg;
+    memcpy(&msg, data, sizeof(msg));
+    int version = ltoh16(msg.version);
+    int addr_type = ltoh8(msg.addr_type);
+    int cert_len = ltoh16(msg.cert_len);
+    int cert_old_len = ltoh16(msg.cert_old_len);
+    int common_name_len = ltoh16(msg.common_name_len);
+    
+    if (cert_len > SCID_NEWCLIENT_MAX_CERT_LEN || cert_old_len > SCID_NEWCLIENT_MAX_CERT_LEN || common_name_len > LP_MAX_COMMON_NAME_LEN ||
+        data_len != sizeof(msg) + cert_len + cert_old_len + common_name_len
+    ) {
+        link_log(link, BLOG_NOTICE, "newclient: wrong size");
+        link_free(link);
+        return;
+    }
+    
+    // the client's ID must be from the server's part
+    if (LP_SERVER_OF_CLIENT(id) != link->peer->server_id) {
+        link_log(link, BLOG_NOTICE, "newclient: ID %d is not of the server", (int)id);
+        link_free(link);
+        return;
+    }
+    
+    switch (version) {
+        case SC_VERSION:
+        case SC_OLDVERSION_NOSSL:
+        case SC_OLDVERSION_BROKENCERT:
+            break;
+        default:
+            link_log(link, BLOG_NOTICE, "newclient: unknown version (%d)", version);
+            link_free(link);
+            return;
+    }
+    
+    // an old client with the same ID may still be waiting to be freed; finish that
+    struct client_data *old = find_client_by_id(id);
+    if (old) {
+        if (old->link != link || !old->dying) {
+            link_log(link, BLOG_NOTICE, "newclient: ID %d already exists", (int)id);
+            link_free(link);
+            return;
+        }
+        client_dealloc(old);
+    }
+    
+    // allocate the client structure
+    // on failure, drop the link, as the other server would otherwise think that
+    // we know about the client
+    struct client_data *client = (struct client_data *)malloc(sizeof(*client));
+    if (!client) {
+        link_log(link, BLOG_ERROR, "failed to allocate client");
+        goto fail0;
+    }
+    
+    // init client data
+    client->worker = NULL;
+    client->link = link;
+    client->id = id;
+    client->version = version;
+    switch (addr_type) {
+        case 4: {
+            uint32_t ip;
+            memcpy(&ip, msg.addr, sizeof(ip));
+            BAddr_InitIPv4(&client->addr, ip, hton16(0));
+        } break;
+        case 6:
+            BAddr_InitIPv6(&client->addr, msg.addr, hton16(0));
+            break;
+        default:
+            BAddr_InitNone(&client->addr);
+            break;
+    }
+    
+    uint8_t *pos = data + sizeof(msg);
+    memcpy(client->cert, pos, cert_len);
+    client->cert_len = cert_len;
+    pos += cert_len;
+    memcpy(client->cert_old, pos, cert_old_len);
+    client->cert_old_len = cert_old_len;
+    pos += cert_old_len;
+    
+    client->common_name = NULL;
+    if (common_name_len > 0) {
+        if (!(client->common_name = (char *)malloc(common_name_len + 1))) {
+            link_log(link, BLOG_ERROR, "failed to allocate common name");
+            goto fail1;
+        }
+        memcpy(client->common_name, pos, common_name_len);
+        client->common_name[common_name_len] = '\0';
+    }
+    
+    // initialize I/O
+    if (!client_init_io(client)) {
+        goto fail2;
+    }
+    
+    client_link_in(client);
+    LinkedList1_Append(&link->clients_list, &client->link_list_node);
+    
+    // get predicate class
+    if (!(client->class = client_class_ref(client))) {
+        client_log(client, BLOG_ERROR, "failed to allocate class");
+        client_remove(client);
+        link_free(link);
+        return;
+    }
+    
+    // publish client
+    client_publish(client);
+    return;
+    
+fail2:
+    free(client->common_name);
+fail1:
+    free(client);
+fail0:
+    link_free(link);
+}
+
+void link_process_endclient (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    
+    if (data_len != 0) {
+        link_log(link, BLOG_NOTICE, "endclient: wrong size");
+        link_free(link);
+        return;
+    }
+    
+    struct client_data *client = link_find_client(link, id);
+    if (!client) {
+        link_log(link, BLOG_INFO, "endclient: no client %d", (int)id);
+        return;
+    }
+    
+    client_remove(client);
+}
+
+void link_process_data (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    
+    // the payload is an inmsg for our client
+    struct sc_header header;
+    struct sc_server_inmsg msg;
+    if (data_len < sizeof(header) + sizeof(msg)) {
+        link_log(link, BLOG_NOTICE, "data: wrong size");
+        link_free(link);
+        return;
+    }
+    memcpy(&header, data, sizeof(header));
+    memcpy(&msg, data + sizeof(header), sizeof(msg));
+    if (ltoh8(header.type) != SCID_INMSG) {
+        link_log(link, BLOG_NOTICE, "data: not inmsg");
+        link_free(link);
+        return;
+    }
+    peerid_t src_id = ltoh16(msg.clientid);
+    uint8_t *payload = data + sizeof(header) + sizeof(msg);
+    int payload_size = data_len - (sizeof(header) + sizeof(msg));
+    
+    if (payload_size > SC_MAX_MSGLEN) {
+        link_log(link, BLOG_NOTICE, "data: too large payload");
+        link_free(link);
+        return;
+    }
+    
+    // the clients may have gone away meanwhile
+    struct client_data *client = link_find_client(link, src_id);
+    if (!client) {
+        link_log(link, BLOG_DEBUG, "data: no client %d", (int)src_id);
+        return;
+    }
+    struct peer_flow *flow = find_flow(client, id);
+    if (!flow) {
+        client_log(client, BLOG_DEBUG, "no flow for message to %d", (int)id);
+        return;
+    }
+    ASSERT(!flow->dest_client->link)
+    ASSERT(flow->accepted)
+    
+    // if pair is resetting, ignore message
+    if (flow->resetting || flow->opposite->resetting) {
+        client_log(client, BLOG_INFO, "pair is resetting; not forwarding message to %d", (int)id);
+        return;
+    }
+    
+    peer_flow_send_message(flow, payload, payload_size);
+}
+
+void link_process_resetpeer (struct cluster_link *link, peerid_t id, uint8_t *data, int data_len)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    
+    if (data_len != sizeof(struct lp_resetpeer)) {
+        link_log(link, BLOG_NOTICE, "resetpeer: wrong size");
+        link_free(link);
+        return;
+    }
+    
+    struct lp_resetpeer msg;
+    memcpy(&msg, data, sizeof(msg));
+    peerid_t peer_id = ltoh16(msg.peerid);
+    
+    // the clients may have gone away meanwhile
+    struct client_data *client = link_find_client(link, id);
+    if (!client) {
+        link_log(link, BLOG_DEBUG, "resetpeer: no client %d", (int)id);
+        return;
+    }
+    struct peer_flow *flow = find_flow(client, peer_id);
+    if (!flow) {
+        client_log(client, BLOG_INFO, "no flow for reset to %d", (int)peer_id);
+        return;
+    }
+    ASSERT(!flow->dest_client->link)
+    
+    // if pair is resetting, ignore message
+    if (flow->resetting || flow->opposite->resetting) {
+        client_log(client, BLOG_INFO, "pair is resetting; not resetting to %d", (int)peer_id);
+        return;
+    }
+    
+    client_log(client, BLOG_WARNING, "reset by its server; resetting to %d", (int)peer_id);
+    
+    // reset clients, without telling the other server, which already did
+    peer_flow_start_reset(flow);
+}
+
+struct client_data * link_find_client (struct cluster_link *link, peerid_t id)
+{
+    struct client_data *client = find_client_by_id(id);
+    if (!client || client->link != link || client->dying) {
+        return NULL;
+    }
+    
+    ASSERT(client->initstatus == INITSTATUS_COMPLETE)
+    
+    return client;
+}
+
+int link_create_know (struct cluster_link *link, struct client_data *client)
+{
+    ASSERT(link->state == LINK_STATE_UP)
+    ASSERT(!client->link)
+    ASSERT(client->initstatus == INITSTATUS_COMPLETE)
+    ASSERT(!client->dying)
+    
+    // the common name has to fit into newclient
+    if (client->common_name && strlen(client->common_name) > LP_MAX_COMMON_NAME_LEN) {
+        client_log(client, BLOG_WARNING, "common name too long; not visible to server %d", link->peer->server_id);
+        return 1;
+    }
+    
+    // allocate structure
+    struct link_know *k = (struct link_know *)malloc(sizeof(*k));
+    if (!k) {
+        return 0;
+    }
+    
+    // init arguments
+    k->link = link;
+    k->client = client;
+    k->client_id = client->id;
+    
+    // append to lists
+    LinkedList1_Append(&link->know_list, &k->link_node);
+    LinkedList1_Append(&client->link_know_list, &k->client_node);
+    
+    // queue informing the other server about the client
+    k->state = KNOW_STATE_INFORM;
+    LinkedList1_Append(&link->know_send_list, &k->send_node);
+    link_control_send(link);
+    
+    return 1;
+}
+
+void link_remove_know (struct link_know *k)
+{
+    // remove from send list
+    if (k->state != KNOW_STATE_INFORMED) {
+        LinkedList1_Remove(&k->link->know_send_list, &k->send_node);
+    }
+    
+    // remove from lists
+    if (k->client) {
+        LinkedList1_Remove(&k->client->link_know_list, &k->client_node);
+    }
+    LinkedList1_Remove(&k->link->know_list, &k->link_node);
+    
+    // free structure
+    free(k);
+}
+
+void link_uninform_know (struct link_know *k)
+{
+    ASSERT(k->client)
+    ASSERT(k->state != KNOW_STATE_UNINFORM)
+    
+    // if the other server has not been informed about the client yet, just remove know
+    if (k->state == KNOW_STATE_INFORM) {
+        link_remove_know(k);
+        return;
+    }
+    
+    // detach from the client
+    LinkedList1_Remove(&k->client->link_know_list, &k->client_node);
+    k->client = NULL;
+    
+    // queue informing the other server that the client is no more
+    k->state = KNOW_STATE_UNINFORM;
+    LinkedList1_Append(&k->link->know_send_list, &k->send_node);
+    link_control_send(k->link);
+}
+
+void client_output_link_handler_send (struct client_data *client, uint8_t *data, int data_len)
+{
+    ASSERT(client->link)
+    ASSERT(client->output_link_flow->client == client)
+    ASSERT(data_len >= sizeof(struct packetproto_header))
+    ASSERT(data_len <= PACKETPROTO_ENCLEN(SC_MAX_ENC))
+    
+    struct link_flow *lf = client->output_link_flow;
+    int sc_len = data_len - sizeof(struct packetproto_header);
+    
+    // copy the packet, prepending a data header, so that the client can be
+    // removed while the link is sending it
+    struct packetproto_header pp;
+    pp.len = htol16(sizeof(struct lp_header) + sc_len);
+    struct lp_header header;
+    header.type = htol8(LPID_DATA);
+    header.id = htol16(client->id);
+    memcpy(lf->packet, &pp, sizeof(pp));
+    memcpy(lf->packet + sizeof(pp), &header, sizeof(header));
+    memcpy(lf->packet + sizeof(pp) + sizeof(header), data + sizeof(struct packetproto_header), sc_len);
+    
+    PacketPassInterface_Sender_Send(PacketPassFairQueueFlow_GetInput(&lf->qflow), lf->packet, sizeof(pp) + sizeof(header) + sc_len);
+}
+
+void link_flow_handler_done (struct link_flow *lf)
+{
+    ASSERT(lf->client)
+    
+    PacketPassInterface_Done(&lf->client->output_link_if);
+}
+
+void link_flow_handler_canremove (struct link_flow *lf)
+{
+    ASSERT(!lf->client)
+    PacketPassFairQueueFlow_AssertFree(&lf->qflow);
+    
+    link_flow_free(lf);
+}
+
+void link_flow_free (struct link_flow *lf)
+{
+    // free queue flow
+    PacketPassFairQueueFlow_Free(&lf->qflow);
+    
+    // remove from list
+    LinkedList1_Remove(&lf->link->link_flows_list, &lf->list_node);
+    
+    // free memory
+    free(lf);
+}
+
+void cluster_notify_reset (struct peer_flow *flow)
+{
+    // find the flow from our client to the other server's client
+    if (flow->src_client->link) {
+        flow = flow->opposite;
+    }
+    if (flow->src_client->link || !flow->dest_client->link) {
+        return;
+    }
+    
+    // already queued
+    if (flow->link_reset) {
+        return;
+    }
+    
+    // queue sending resetpeer
+    struct cluster_link *link = flow->dest_client->link;
+    ASSERT(link->state == LINK_STATE_UP)
+    flow->link_reset = 1;
+    LinkedList1_Append(&link->reset_list, &flow->link_reset_node);
+    link_control_send(link);
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+int worker_init (struct worker *w, int index)
+{
+    w->index = index;
+    
+    // init reactor
+    if (!BReactor_Init(&w->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init quit signal
+    if (!BThreadSignal_Init(&w->quit_signal, &w->reactor, worker_quit_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail1;
+    }
+    
+    // init queue to the main thread
+    if (!BThreadPacketQueue_Init(&w->to_main, WORKER_MSG_MTU, WORKER_QUEUE_PACKETS, &w->reactor, &ss, w,
+        (BThreadPacketQueue_handler_space)worker_to_main_handler_space, (BThreadPacketQueue_handler_recv)worker_to_main_handler_recv
+    )) {
+        BLog(BLOG_ERROR, "BThreadPacketQueue_Init failed");
+        goto fail2;
+    }
+    
+    // init queue from the main thread
+    if (!BThreadPacketQueue_Init(&w->from_main, WORKER_MSG_MTU, WORKER_QUEUE_PACKETS, &ss, &w->reactor, w,
+        (BThreadPacketQueue_handler_space)worker_from_main_handler_space, (BThreadPacketQueue_handler_recv)worker_from_main_handler_recv
+    )) {
+        BLog(BLOG_ERROR, "BThreadPacketQueue_Init failed");
+        goto fail3;
+    }
+    
+    // init lists
+    LinkedList1_Init(&w->clients_list);
+    LinkedList1_Init(&w->to_main_waiting);
+    LinkedList1_Init(&w->from_main_waiting);
+    LinkedList1_Init(&w->detaching_list);
+    
+    // initialize listeners
+    w->num_listeners = 0;
+    while (w->num_listeners < num_listen_addrs) {
+        struct worker_listener *l = &w->listeners[w->num_listeners];
+        l->worker = w;
+        
+        // with multiple workers, the kernel distributes clients among their listeners
+        int res = (options.workers > 1) ?
+            BListener_InitReusePort(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)worker_listener_handler) :
+            BListener_Init(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)worker_listener_handler);
+        if (!res) {
+            BLog(BLOG_ERROR, "BListener_Init failed");
+            goto fail4;
+        }
+        w->num_listeners++;
+    }
+    
+    return 1;
+    
+fail4:
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    BThreadPacketQueue_Free(&w->from_main);
+fail3:
+    BThreadPacketQueue_Free(&w->to_main);
+fail2:
+    BThreadSignal_Free(&w->quit_signal);
+fail1:
+    BReactor_Free(&w->reactor);
+fail0:
+    return 0;
+}
+
+void worker_free (struct worker *w)
+{
+    ASSERT(!workers_running)
+    
+    // free clients the worker still has
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&w->clients_list)) {
+        struct client_data *client = UPPER_OBJECT(node, struct client_data, w_list_node);
+        
+        // free connection
+        if (!client->w_closed) {
+            wclient_free_transport(client);
+        }
+        
+        // free the rest of the worker's part
+        BPending_Free(&client->w_job);
+        if (client->w_common_name) {
+            PORT_Free(client->w_common_name);
+        }
+        BFree(client->w_out_buf);
+        LinkedList1_Remove(&w->clients_list, &client->w_list_node);
+        
+        // free memory, unless the main thread has detached the client,
+        // in which case it's freed below
+        if (!client->detaching) {
+            free(client);
+        }
+    }
+    
+    // free clients the main thread has detached
+    while (node = LinkedList1_GetFirst(&w->detaching_list)) {
+        struct client_data *client = UPPER_OBJECT(node, struct client_data, detaching_node);
+        LinkedList1_Remove(&w->detaching_list, &client->detaching_node);
+        free(client);
+    }
+    
+    // free listeners
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    
+    // free queues
+    BThreadPacketQueue_Free(&w->from_main);
+    BThreadPacketQueue_Free(&w->to_main);
+    
+    // free quit signal
+    BThreadSignal_Free(&w->quit_signal);
+    
+    // free reactor
+    BReactor_Free(&w->reactor);
+}
+
+void * worker_thread (struct worker *w)
+{
+    BReactor_Exec(&w->reactor);
+    
+    return NULL;
+}
+
+void worker_quit_signal_handler (BThreadSignal *thread_signal)
+{
+    struct worker *w = UPPER_OBJECT(thread_signal, struct worker, quit_signal);
+    
+    // exit event loop
+    BReactor_Quit(&w->reactor, 0);
+}
+
+void worker_to_main_handler_space (struct worker *w)
+{
+    // send messages of waiting clients, in order; a client leaves the list
+    // when it has sent all its messages
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&w->to_main_waiting)) {
+        struct client_data *client = UPPER_OBJECT(node, struct client_data, w_waiting_node);
+        ASSERT(client->w_waiting)
+        
+        if (!wclient_send_pending(client)) {
+            return;
+        }
+    }
+}
+
+void worker_to_main_handler_recv (struct worker *w, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= sizeof(struct worker_msg))
+    
+    struct worker_msg msg;
+    memcpy(&msg, data, sizeof(msg));
+    struct client_data *client = msg.client;
+    ASSERT(client->worker == w)
+    
+    switch (msg.type) {
+        case WMSG_CONNECTED: {
+            client_attach(client);
+        } return;
+        
+        case WMSG_DETACHED: {
+            ASSERT(client->detaching)
+            
+            // the worker is done with the client
+            LinkedList1_Remove(&w->detaching_list, &client->detaching_node);
+            free(client);
+        } return;
+    }
+    
+    // ignore messages for clients we are done with
+    if (client->detaching || client->dying) {
+        return;
+    }
+    
+    switch (msg.type) {
+        case WMSG_UP: {
+            ASSERT(options.ssl)
+            ASSERT(client->initstatus == INITSTATUS_HANDSHAKE)
+            
+            // use the common name the worker got from the certificate
+            client->common_name = client->w_common_name;
+            
+            // init I/O chains
+            if (!client_init_io(client)) {
+                client_remove(client);
+                return;
+            }
+            
+            // set client state
+            client->initstatus = INITSTATUS_WAITHELLO;
+            
+            client_log(client, BLOG_INFO, "handshake complete");
+        } break;
+        
+        case WMSG_PACKET: {
+            client_process_packet(client, data + sizeof(msg), data_len - sizeof(msg));
+        } break;
+        
+        case WMSG_SENT: {
+            ASSERT(INITSTATUS_HASLINK(client->initstatus))
+            ASSERT(msg.arg > 0)
+            ASSERT(msg.arg <= CLIENT_WORKER_OUTPUT_PACKETS - client->output_worker_credits)
+            
+            // the worker has room for more packets
+            client->output_worker_credits += msg.arg;
+            client_worker_flush(client);
+        } break;
+        
+        case WMSG_ERROR: {
+            client_remove(client);
+        } break;
+        
+        default:
+            ASSERT(0);
+    }
+}
+
+void worker_from_main_handler_space (struct worker *w)
+{
+    // send messages of waiting clients, in order; a client leaves the list
+    // when it has sent its message
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&w->from_main_waiting)) {
+        struct client_data *client = UPPER_OBJECT(node, struct client_data, main_waiting_node);
+        ASSERT(client->main_waiting)
+        
+        if (!client_worker_send_pending(client)) {
+            return;
+        }
+    }
+}
+
+void worker_from_main_handler_recv (struct worker *w, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= sizeof(struct worker_msg))
+    
+    struct worker_msg msg;
+    memcpy(&msg, data, sizeof(msg));
+    struct client_data *client = msg.client;
+    ASSERT(client->worker == w)
+    
+    switch (msg.type) {
+        case MMSG_PACKET: {
+            int len = data_len - sizeof(msg);
+            ASSERT(len <= PACKETPROTO_ENCLEN(SC_MAX_ENC))
+            
+            // drop packets after the connection has failed
+            if (client->w_closed) {
+                return;
+            }
+            
+            // the main thread never passes more packets than we have room for
+            ASSERT(client->w_out_used < CLIENT_WORKER_OUTPUT_PACKETS)
+            
+            // copy packet to the output buffer
+            int i = (client->w_out_start + client->w_out_used) % CLIENT_WORKER_OUTPUT_PACKETS;
+            memcpy(client->w_out_buf + i * PACKETPROTO_ENCLEN(SC_MAX_ENC), data + sizeof(msg), len);
+            client->w_out_lens[i] = len;
+            client->w_out_used++;
+            
+            // start sending if we weren't
+            if (client->w_out_used == 1) {
+                wclient_send_next(client);
+            }
+        } break;
+        
+        case MMSG_DETACH: {
+            // free connection
+            if (!client->w_closed) {
+                wclient_free_transport(client);
+            }
+            
+            // free the rest of our part; the main thread is no longer using the common name
+            BPending_Free(&client->w_job);
+            if (client->w_common_name) {
+                PORT_Free(client->w_common_name);
+            }
+            BFree(client->w_out_buf);
+            LinkedList1_Remove(&w->clients_list, &client->w_list_node);
+            
+            // tell the main thread to free the client, dropping any other messages
+            client->w_pending = (1 << WMSG_DETACHED);
+            wclient_flush(client);
+        } break;
+        
+        default:
+            ASSERT(0);
+    }
+}
+
+void worker_listener_handler (struct worker_listener *l)
+{
+    struct worker *w = l->worker;
+    
+    // allocate the client structure
+    struct client_data *client = (struct client_data *)malloc(sizeof(*client));
+    if (!client) {
+        BLog(BLOG_ERROR, "failed to allocate client");
+        goto fail0;
+    }
+    
+    // we own the connection
+    client->worker = w;
+    
+    // allocate output buffer
+    if (!(client->w_out_buf = (uint8_t *)BAllocArray(CLIENT_WORKER_OUTPUT_PACKETS, PACKETPROTO_ENCLEN(SC_MAX_ENC)))) {
+        BLog(BLOG_ERROR, "failed to allocate output buffer");
+        goto fail1;
+    }
+    
+    // accept connection
+    if (!BConnection_Init(&client->con, BConnection_source_listener(&l->listener, &client->addr), &w->reactor, client, (BConnection_handler)wclient_connection_handler)) {
+        BLog(BLOG_ERROR, "BConnection_Init failed");
+        goto fail2;
+    }
+    
+    // limit socket send buffer, else our scheduling is pointless
+    if (options.client_socket_sndbuf > 0) {
+        if (!BConnection_SetSendBuffer(&client->con, options.client_socket_sndbuf)) {
+            BLog(BLOG_WARNING, "BConnection_SetSendBuffer failed");
+        }
+    }
+    
+    // set no common name
+    client->w_common_name = NULL;
+    
+    // now wclient_log() works
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&client->con);
+    BConnection_RecvAsync_Init(&client->con);
+    
+    // init state
+    client->w_have_io = 0;
+    client->w_closed = 0;
+    client->w_input_packet_len = -1;
+    client->w_credits = 0;
+    client->w_out_start = 0;
+    client->w_out_used = 0;
+    
+    if (options.ssl) {
+        // set up SSL
+        if (!client_init_ssl(client, &w->reactor, NULL, (BSSLConnection_handler)wclient_sslcon_handler, wclient_log)) {
+            goto fail3;
+        }
+    } else {
+        // initialize I/O
+        if (!wclient_init_io(client)) {
+            goto fail3;
+        }
+    }
+    
+    // init job for reporting sent packets
+    BPending_Init(&client->w_job, BReactor_PendingGroup(&w->reactor), (BPending_handler)wclient_job_handler, client);
+    
+    // link in
+    LinkedList1_Append(&w->clients_list, &client->w_list_node);
+    
+    // the main thread reads this when freeing clients on shutdown, possibly
+    // without having seen the client
+    client->detaching = 0;
+    
+    // tell the main thread about the client
+    client->w_waiting = 0;
+    client->w_pending = (1 << WMSG_CONNECTED);
+    wclient_flush(client);
+    
+    wclient_log(client, BLOG_INFO, "accepted");
+    
+    return;
+    
+fail3:
+    BConnection_RecvAsync_Free(&client->con);
+    BConnection_SendAsync_Free(&client->con);
+    BConnection_Free(&client->con);
+fail2:
+    BFree(client->w_out_buf);
+fail1:
+    free(client);
+fail0:
+    return;
+}
+
+void client_attach (struct client_data *client)
+{
+    ASSERT(client->worker)
+    
+    // init the main thread's side of the worker interface
+    client->output_worker_packet_len = -1;
+    client->output_worker_credits = CLIENT_WORKER_OUTPUT_PACKETS;
+    client->main_waiting = 0;
+    client->detaching = 0;
+    client->detach_pending = 0;
+    
+    if (clients_num == options.max_clients) {
+        BLog(BLOG_WARNING, "too many clients for new client");
+        goto fail0;
+    }
+    
+    // the client is connected to us
+    client->link = NULL;
+    
+    // assign ID
+    client->id = new_client_id();
+    
+    // set no common name
+    client->common_name = NULL;
+    
+    // initialize I/O, unless waiting for the SSL handshake
+    if (!options.ssl && !client_init_io(client)) {
+        goto fail0;
+    }
+    
+    client_link_in(client);
+    
+    return;
+    
+fail0:
+    client_detach(client);
+}
+
+void client_detach (struct client_data *client)
+{
+    ASSERT(client->worker)
+    ASSERT(!client->detaching)
+    ASSERT(!client->main_waiting)
+    
+    // keep the client until the worker is done with it, so that it can be
+    // freed on shutdown
+    client->detaching = 1;
+    LinkedList1_Append(&client->worker->detaching_list, &client->detaching_node);
+    
+    // tell the worker, unless it has been stopped
+    if (workers_running) {
+        client->detach_pending = 1;
+        client_worker_flush(client);
+    }
+}
+
+void client_output_worker_handler_send (struct client_data *client, uint8_t *data, int data_len)
+{
+    ASSERT(client->worker)
+    ASSERT(client->output_worker_packet_len == -1)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= PACKETPROTO_ENCLEN(SC_MAX_ENC))
+    
+    // remember packet, pass it to the worker when it has room for it
+    client->output_worker_packet = data;
+    client->output_worker_packet_len = data_len;
+    
+    client_worker_flush(client);
+}
+
+int client_worker_has_pending (struct client_data *client)
+{
+    return (client->detach_pending || (client->output_worker_packet_len >= 0 && client->output_worker_credits > 0));
+}
+
+void client_worker_flush (struct client_data *client)
+{
+    struct worker *w = client->worker;
+    
+    if (client->main_waiting || !client_worker_has_pending(client)) {
+        return;
+    }
+    
+    // get in line behind other clients, else try sending now
+    if (!LinkedList1_IsEmpty(&w->from_main_waiting) || !client_worker_send_pending(client)) {
+        client->main_waiting = 1;
+        LinkedList1_Append(&w->from_main_waiting, &client->main_waiting_node);
+    }
+}
+
+int client_worker_send_pending (struct client_data *client)
+{
+    struct worker *w = client->worker;
+    ASSERT(client_worker_has_pending(client))
+    
+    uint8_t *out;
+    if (!BThreadPacketQueue_Producer_StartPacket(&w->from_main, &out)) {
+        return 0;
+    }
+    
+    struct worker_msg msg;
+    msg.client = client;
+    msg.arg = 0;
+    int len = sizeof(msg);
+    
+    if (client->detach_pending) {
+        msg.type = MMSG_DETACH;
+        client->detach_pending = 0;
+    } else {
+        msg.type = MMSG_PACKET;
+        memcpy(out + sizeof(msg), client->output_worker_packet, client->output_worker_packet_len);
+        len += client->output_worker_packet_len;
+        
+        client->output_worker_credits--;
+        client->output_worker_packet_len = -1;
+        
+        // accept packet
+        PacketPassInterface_Done(&client->output_worker_if);
+    }
+    
+    memcpy(out, &msg, sizeof(msg));
+    BThreadPacketQueue_Producer_EndPacket(&w->from_main, len);
+    
+    // leave the waiting list
+    if (client->main_waiting) {
+        LinkedList1_Remove(&w->from_main_waiting, &client->main_waiting_node);
+        client->main_waiting = 0;
+    }
+    
+    return 1;
+}
+
+int wclient_init_io (struct client_data *client)
+{
+    struct worker *w = client->worker;
+    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
+    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
+    
+    // init input interface
+    PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)wclient_input_handler_send, client, BReactor_PendingGroup(&w->reactor));
+    
+    // init decoder
+    if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&w->reactor), client,
+        (PacketProtoDecoder_handler_error)wclient_decoder_handler_error
+    )) {
+        wclient_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        goto fail1;
+    }
+    
+    // init sender; packets come from the main thread already encoded
+    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&w->reactor));
+    PacketPassInterface_Sender_Init(PacketStreamSender_GetInput(&client->output_sender), (PacketPassInterface_handler_done)wclient_output_handler_done, client);
+    
+    client->w_have_io = 1;
+    
+    return 1;
+    
+fail1:
+    PacketPassInterface_Free(&client->input_interface);
+    return 0;
+}
+
+void wclient_free_transport (struct client_data *client)
+{
+    ASSERT(!client->w_closed)
+    
+    if (client->w_have_io) {
+        // stop using any buffers before they get freed
+        if (options.ssl) {
+            BSSLConnection_ReleaseBuffers(&client->sslcon);
+        }
+        
+        // free sender
+        PacketStreamSender_Free(&client->output_sender);
+        
+        // free input
+        PacketProtoDecoder_Free(&client->input_decoder);
+        PacketPassInterface_Free(&client->input_interface);
+    }
+    
+    // free SSL
+    if (options.ssl) {
+        BSSLConnection_Free(&client->sslcon);
+        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
+    }
+    
+    // free connection interfaces
+    BConnection_RecvAsync_Free(&client->con);
+    BConnection_SendAsync_Free(&client->con);
+    
+    // free connection
+    BConnection_Free(&client->con);
+    
+    // drop unsent packets
+    client->w_out_used = 0;
+    client->w_input_packet_len = -1;
+    
+    client->w_closed = 1;
+}
+
+void wclient_error (struct client_data *client)
+{
+    ASSERT(!client->w_closed)
+    
+    wclient_free_transport(client);
+    
+    // report the error; the main thread will remove the client and detach it
+    client->w_pending = (client->w_pending & (1 << WMSG_CONNECTED)) | (1 << WMSG_ERROR);
+    wclient_flush(client);
+}
+
+void wclient_logfunc (struct client_data *client)
+{
+    char addr[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(&client->addr, addr);
+    
+    BLog_Append("worker %d client (%s)", client->worker->index, addr);
+    if (client->w_common_name) {
+        BLog_Append(" (%s)", client->w_common_name);
+    }
+    BLog_Append(": ");
+}
+
+void wclient_log (struct client_data *client, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)wclient_logfunc, client, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+void wclient_connection_handler (struct client_data *client, int event)
+{
+    ASSERT(!client->w_closed)
+    
+    if (event == BCONNECTION_EVENT_RECVCLOSED) {
+        wclient_log(client, BLOG_INFO, "connection closed");
+    } else {
+        wclient_log(client, BLOG_INFO, "connection error");
+    }
+    
+    wclient_error(client);
+    return;
+}
+
+void wclient_sslcon_handler (struct client_data *client, int event)
+{
+    ASSERT(options.ssl)
+    ASSERT(!client->w_closed)
+    ASSERT(!client->w_have_io)
+    ASSERT(event == BSSLCONNECTION_EVENT_UP || event == BSSLCONNECTION_EVENT_ERROR)
+    
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        wclient_log(client, BLOG_ERROR, "SSL error");
+        goto fail0;
+    }
+    
+    // store certificate and common name for the main thread
+    if (!client_read_cert(client, &client->w_common_name, wclient_log)) {
+        goto fail0;
+    }
+    
+    // init I/O
+    if (!wclient_init_io(client)) {
+        goto fail0;
+    }
+    
+    // let the main thread start using the client
+    client->w_pending |= (1 << WMSG_UP);
+    wclient_flush(client);
+    
+    return;
+    
+fail0:
+    wclient_error(client);
+}
+
+void wclient_decoder_handler_error (struct client_data *client)
+{
+    ASSERT(client->w_have_io)
+    ASSERT(!client->w_closed)
+    
+    wclient_log(client, BLOG_ERROR, "decoder error");
+    
+    wclient_error(client);
+    return;
+}
+
+void wclient_input_handler_send (struct client_data *client, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
+    ASSERT(client->w_input_packet_len == -1)
+    ASSERT(!client->w_closed)
+    
+    // pass packet to the main thread; we accept it when it's in the queue
+    client->w_input_packet = data;
+    client->w_input_packet_len = data_len;
+    client->w_pending |= (1 << WMSG_PACKET);
+    
+    wclient_flush(client);
+}
+
+void wclient_output_handler_done (struct client_data *client)
+{
+    ASSERT(client->w_out_used > 0)
+    ASSERT(!client->w_closed)
+    
+    // free the slot, and report it to the main thread from a job, together
+    // with other packets sent by then
+    client->w_out_start = (client->w_out_start + 1) % CLIENT_WORKER_OUTPUT_PACKETS;
+    client->w_out_used--;
+    client->w_credits++;
+    client->w_pending |= (1 << WMSG_SENT);
+    BPending_Set(&client->w_job);
+    
+    // send the next packet
+    if (client->w_out_used > 0) {
+        wclient_send_next(client);
+    }
+}
+
+void wclient_send_next (struct client_data *client)
+{
+    ASSERT(client->w_out_used > 0)
+    ASSERT(client->w_have_io)
+    ASSERT(!client->w_closed)
+    
+    int i = client->w_out_start;
+    PacketPassInterface_Sender_Send(PacketStreamSender_GetInput(&client->output_sender), client->w_out_buf + i * PACKETPROTO_ENCLEN(SC_MAX_ENC), client->w_out_lens[i]);
+}
+
+void wclient_job_handler (struct client_data *client)
+{
+    wclient_flush(client);
+}
+
+void wclient_flush (struct client_data *client)
+{
+    struct worker *w = client->worker;
+    
+    if (client->w_waiting || !client->w_pending) {
+        return;
+    }
+    
+    // get in line behind other clients, else try sending now
+    if (!LinkedList1_IsEmpty(&w->to_main_waiting) || !wclient_send_pending(client)) {
+        client->w_waiting = 1;
+        LinkedList1_Append(&w->to_main_waiting, &client->w_waiting_node);
+    }
+}
+
+int wclient_send_pending (struct client_data *client)
+{
+    struct worker *w = client->worker;
+    
+    while (client->w_pending) {
+        // send messages in the order of their types
+        int type = WMSG_CONNECTED;
+        while (!(client->w_pending & (1 << type))) {
+            type++;
+        }
+        
+        uint8_t *out;
+        if (!BThreadPacketQueue_Producer_StartPacket(&w->to_main, &out)) {
+            return 0;
+        }
+        
+        struct worker_msg msg;
+        msg.client = client;
+        msg.type = type;
+        msg.arg = 0;
+        int len = sizeof(msg);
+        
+        switch (type) {
+            case WMSG_PACKET: {
+                memcpy(out + sizeof(msg), client->w_input_packet, client->w_input_packet_len);
+                len += client->w_input_packet_len;
+            } break;
+            
+            case WMSG_SENT: {
+                msg.arg = client->w_credits;
+                client->w_credits = 0;
+            } break;
+            
+            case WMSG_DETACHED: {
+                ASSERT(client->w_pending == (1 << WMSG_DETACHED))
+                
+                if (client->w_waiting) {
+                    LinkedList1_Remove(&w->to_main_waiting, &client->w_waiting_node);
+                }
+                
+                // the main thread may free the client once this is in the queue
+                memcpy(out, &msg, sizeof(msg));
+                BThreadPacketQueue_Producer_EndPacket(&w->to_main, len);
+            } return 1;
+        }
+        
+        memcpy(out, &msg, sizeof(msg));
+        BThreadPacketQueue_Producer_EndPacket(&w->to_main, len);
+        
+        client->w_pending &= ~(1 << type);
+        
+        // accept packet
+        if (type == WMSG_PACKET) {
+            client->w_input_packet_len = -1;
+            PacketPassInterface_Done(&client->input_interface);
+        }
+    }
+    
+    // leave the waiting list
+    if (client->w_waiting) {
+        LinkedList1_Remove(&w->to_main_waiting, &client->w_waiting_node);
+        client->w_waiting = 0;
+    }
+    
+    return 1;
+}
+
+#endif
@@ -29,7 +29,12 @@
 
 #include <stdint.h>
 
+#ifndef BADVPN_USE_WINAPI
+#include <pthread.h>
+#endif
+
 #include <protocol/scproto.h>
+#include <protocol/linkproto.h>
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
 #include <flow/PacketProtoDecoder.h>
@@ -37,7 +42,13 @@
 #include <flow/PacketPassPriorityQueue.h>
 #include <flow/PacketPassFairQueue.h>
 #include <flow/PacketProtoFlow.h>
+#include <flow/PacketProtoEncoder.h>
+#include <flow/PacketBuffer.h>
 #include <system/BReactor.h>
+#ifndef BADVPN_USE_WINAPI
+#include <system/BThreadSignal.h>
+#include <system/BThreadPacketQueue.h>
+#endif
 #include <system/BConnection.h>
 #include <nspr_support/BSSLConnection.h>
 
@@ -47,9 +58,9 @@
 // maxiumum number of connected clients. Must be <=2^16.
 #define DEFAULT_MAX_CLIENTS 30
 // client output control flow buffer size in packets
-// it must hold: initdata, newclient's, endclient's (if other peers die when informing them)
-// make it big enough to hold the initial packet burst (initdata, newclient's),
-#define CLIENT_CONTROL_BUFFER_MIN_PACKETS (1 + 2*(MAX_CLIENTS - 1))
+// newclient's and endclient's are only generated when there is space,
+// so this does not depend on the number of clients
+#define CLIENT_CONTROL_BUFFER_PACKETS 4
 // size of client-to-client buffers in packets
 #define CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS 10
 // after how long of not hearing anything from the client we disconnect it
@@ -62,7 +73,30 @@
 // maxiumum listen addresses
 #define MAX_LISTEN_ADDRS 16
 
-//#define SIMULATE_OUT_OF_CONTROL_BUFFER 20
+// number of cached predicate results. Must be a power of two.
+#define PREDICATE_CACHE_SIZE 4096
+
+// maximum number of worker threads
+#define MAX_WORKERS 64
+// size of the message queues between the main thread and a worker, in packets
+#define WORKER_QUEUE_PACKETS 256
+// maximum message size in the queues between the main thread and a worker
+#define WORKER_MSG_MTU (sizeof(struct worker_msg) + PACKETPROTO_ENCLEN(SC_MAX_ENC))
+// number of packets for a client which the main thread may pass to a worker
+// before the worker reports them sent
+#define CLIENT_WORKER_OUTPUT_PACKETS 8
+
+// maximum number of other servers in the cluster
+#define MAX_CLUSTER_PEERS (LP_MAX_SERVERS - 1)
+// link output control flow buffer size in packets
+#define LINK_CONTROL_BUFFER_PACKETS 8
+// after how long of not hearing anything from the other server we drop the link
+#define LINK_NO_DATA_TIME_LIMIT 30000
+// how long to wait before connecting to a server again
+#define LINK_RECONNECT_TIME 5000
+// SO_SNDBFUF socket option for links
+#define LINK_SOCKET_SNDBUF 131072
+
 //#define SIMULATE_OUT_OF_FLOW_BUFFER 100
 
 
@@ -75,8 +109,189 @@
 
 #define INITSTATUS_HASLINK(status) ((status) == INITSTATUS_WAITHELLO || (status) == INITSTATUS_COMPLETE)
 
+// 'from' is yet to be sent newclient
+#define KNOW_STATE_INFORM 1
+// 'from' has been sent newclient
+#define KNOW_STATE_INFORMED 2
+// 'from' is yet to be sent endclient; 'to' may be gone
+#define KNOW_STATE_UNINFORM 3
+
+// messages from a worker to the main thread
+// client connection was accepted
+#define WMSG_CONNECTED 1
+// SSL handshake is complete, certificate and common name are set
+#define WMSG_UP 2
+// packet received from the client
+#define WMSG_PACKET 3
+// arg packets passed with MMSG_PACKET have been sent
+#define WMSG_SENT 4
+// connection failed, the worker has freed it
+#define WMSG_ERROR 5
+// reply to MMSG_DETACH; the worker is done with the client
+#define WMSG_DETACHED 6
+
+// messages from the main thread to a worker
+// packet to send to the client, already encoded with PacketProto
+#define MMSG_PACKET 1
+// the main thread is done with the client
+#define MMSG_DETACH 2
+
+// connecting to the other server
+#define LINK_STATE_CONNECTING 1
+// waiting for hello from the other server
+#define LINK_STATE_WAITHELLO 2
+// hello received; exchanging clients
+#define LINK_STATE_UP 3
+
 struct client_data;
 struct peer_know;
+struct worker;
+struct cluster_link;
+
+struct worker_msg {
+    struct client_data *client;
+    int type;
+    int arg;
+};
+
+#ifndef BADVPN_USE_WINAPI
+
+struct worker_listener {
+    struct worker *worker;
+    BListener listener;
+};
+
+// With --workers, client connections, including SSL and PacketProto framing, are
+// handled by worker threads, each with its own reactor. The main thread keeps all
+// other client state and forwards packets between clients. A worker and the main
+// thread exchange messages for their clients through a pair of lock-free queues.
+struct worker {
+    int index;
+    BReactor reactor;
+    BThreadSignal quit_signal;
+    pthread_t thread;
+    struct worker_listener listeners[MAX_LISTEN_ADDRS];
+    int num_listeners;
+    
+    // clients whose connections the worker owns, until they are detached
+    LinkedList1 clients_list;
+    
+    // messages to the main thread, and clients waiting for space there
+    BThreadPacketQueue to_main;
+    LinkedList1 to_main_waiting;
+    
+    // messages from the main thread, and clients (in the main thread) waiting for space there
+    BThreadPacketQueue from_main;
+    LinkedList1 from_main_waiting;
+    
+    // clients which the main thread has detached but which the worker has not released yet
+    LinkedList1 detaching_list;
+};
+
+#endif
+
+// With --cluster-id, servers form a cluster, and each server represents the
+// clients of the other servers as its own clients, with their output going into
+// the link to their server. Such a client's queued packet is copied here, where
+// it stays until the link sends it, even if the client is removed meanwhile.
+struct link_flow {
+    struct cluster_link *link;
+    // client whose packets these are, or NULL after it is removed
+    struct client_data *client;
+    PacketPassFairQueueFlow qflow;
+    LinkedList1Node list_node;
+    uint8_t packet[PACKETPROTO_ENCLEN(sizeof(struct lp_header) + SC_MAX_ENC)];
+};
+
+// another server of the cluster, as configured
+struct cluster_peer {
+    int server_id;
+    BAddr addr;
+    // link to it, or NULL
+    struct cluster_link *link;
+    // for connecting again, if we connect to it
+    BTimer reconnect_timer;
+};
+
+struct cluster_link {
+    // configured server this link is to, or NULL if accepted and hello not received yet
+    struct cluster_peer *peer;
+    // whether we connected, rather than accepted the connection
+    int outgoing;
+    int state;
+    // node in the list of all links
+    LinkedList1Node list_node;
+    
+    // connection
+    BConnector connector;
+    BConnection con;
+    BAddr addr;
+    
+    // SSL, if used
+    PRFileDesc bottom_prfd;
+    PRFileDesc *ssl_prfd;
+    BSSLConnection sslcon;
+    
+    // no data timer, and keepalive timer
+    BTimer disconnect_timer;
+    BTimer keepalive_timer;
+    
+    // input
+    PacketProtoDecoder input_decoder;
+    PacketPassInterface input_interface;
+    
+    // output common
+    PacketStreamSender output_sender;
+    PacketPassPriorityQueue output_priorityqueue;
+    
+    // output control flow; packets are generated when the buffer asks for them
+    PacketPassPriorityQueueFlow output_control_qflow;
+    PacketRecvInterface output_control_source;
+    PacketProtoEncoder output_control_encoder;
+    PacketBuffer output_control_buffer;
+    uint8_t *output_control_packet;
+    int output_control_hello;
+    int output_control_keepalive;
+    
+    // output data flow, shared fairly by the other server's clients
+    PacketPassPriorityQueueFlow output_data_qflow;
+    PacketPassFairQueue output_data_fairqueue;
+    LinkedList1 link_flows_list;
+    
+    // clients of the other server
+    LinkedList1 clients_list;
+    
+    // our clients as known to the other server
+    LinkedList1 know_list;
+    // knows waiting for newclient or endclient to be sent
+    LinkedList1 know_send_list;
+    // flows from our clients to the other server's clients, whose pair is to be reset there
+    LinkedList1 reset_list;
+};
+
+// our client as known to another server
+struct link_know {
+    struct cluster_link *link;
+    // NULL in KNOW_STATE_UNINFORM
+    struct client_data *client;
+    peerid_t client_id;
+    int state;
+    // node in link's know_list
+    LinkedList1Node link_node;
+    // node in client's link_know_list, only when client != NULL
+    LinkedList1Node client_node;
+    // node in link's know_send_list, only in KNOW_STATE_INFORM and KNOW_STATE_UNINFORM
+    LinkedList1Node send_node;
+};
+
+// output chain of a flow, allocated when the source client accepts the destination
+struct peer_flow_io {
+    PacketPassFairQueueFlow qflow;
+    PacketProtoFlow oflow;
+    BufferWriter *input;
+    int packet_len;
+    uint8_t *packet;
+};
 
 struct peer_flow {
     // source client
@@ -90,35 +305,74 @@ struct peer_flow {
     LinkedList1Node src_list_node;
     // node in destination client list
     LinkedList1Node dest_list_node;
-    // output chain
-    int have_io;
-    PacketPassFairQueueFlow qflow;
-    PacketProtoFlow oflow;
-    BufferWriter *input;
-    int packet_len;
-    uint8_t *packet;
+    // output chain, or NULL
+    struct peer_flow_io *io;
     // reset timer
     BTimer reset_timer;
     // opposite flow
     struct peer_flow *opposite;
-    // pair data
+    // pair data; know is NULL if the source client is on another server
     struct peer_know *know;
     int accepted;
     int resetting;
+    // whether the pair is to be reset on the destination client's server,
+    // and the node in the link's reset_list
+    int link_reset;
+    LinkedList1Node link_reset_node;
 };
 
 struct peer_know {
     struct client_data *from;
+    // NULL in KNOW_STATE_UNINFORM
     struct client_data *to;
+    peerid_t to_id;
     int relay_server;
     int relay_client;
+    int state;
     LinkedList1Node from_node;
+    // node in to's know_in_list, only when to != NULL
     LinkedList1Node to_node;
-    BPending inform_job;
-    BPending uninform_job;
+    // node in from's know_send_list, only in KNOW_STATE_INFORM and KNOW_STATE_UNINFORM
+    LinkedList1Node send_node;
+};
+
+// The predicates only see a client's common name and IP address, so clients
+// with the same ones are in the same class and their results can be shared.
+struct client_class_key {
+    BIPAddr addr;
+    const char *common_name;
+};
+
+struct client_class {
+    struct client_class_key key;
+    // never reused, so that cached results of a freed class are not mistaken for a new one's
+    uint64_t id;
+    int refcnt;
+    BAVLNode tree_node;
+};
+
+struct predicate_cache_entry {
+    uint64_t class1_id;
+    uint64_t class2_id;
+    // results of the communication and relay predicates, or -1 if not evaluated yet
+    int comm;
+    int relay;
 };
 
 struct client_data {
+    // worker owning the connection, or NULL if the main thread owns it
+    struct worker *worker;
+    
+    // link to the server the client is connected to, if it is another server
+    // of the cluster; such a client is complete from the start and has no connection
+    struct cluster_link *link;
+    LinkedList1Node link_list_node;
+    struct link_flow *output_link_flow;
+    PacketPassInterface output_link_if;
+    
+    // for our own clients, the knows of the other servers about them
+    LinkedList1 link_know_list;
+    
     // socket
     BConnection con;
     BAddr addr;
@@ -141,6 +395,9 @@ struct client_data {
     // client version
     int version;
     
+    // predicate class, once the client is complete
+    struct client_class *class;
+    
     // no data timer
     BTimer disconnect_timer;
     
@@ -156,6 +413,9 @@ struct client_data {
     LinkedList1 know_out_list;
     LinkedList1 know_in_list;
     
+    // outgoing knows waiting for newclient or endclient to be sent
+    LinkedList1 know_send_list;
+    
     // flows from us
     LinkedList1 peer_out_flows_list;
     BAVL peer_out_flows_tree;
@@ -172,15 +432,45 @@ struct client_data {
     PacketStreamSender output_sender;
     PacketPassPriorityQueue output_priorityqueue;
     
-    // output control flow
+    // output control flow; packets are generated when the buffer asks for them
     PacketPassPriorityQueueFlow output_control_qflow;
-    PacketProtoFlow output_control_oflow;
-    BufferWriter *output_control_input;
-    int output_control_packet_len;
+    PacketRecvInterface output_control_source;
+    PacketProtoEncoder output_control_encoder;
+    PacketBuffer output_control_buffer;
     uint8_t *output_control_packet;
+    int output_control_packet_len;
+    int output_control_hello;
     
     // output peers flow
     PacketPassPriorityQueueFlow output_peers_qflow;
     PacketPassFairQueue output_peers_fairqueue;
     LinkedList1 output_peers_flows;
+    
+    // main thread side of a worker's client
+    PacketPassInterface output_worker_if;
+    int output_worker_packet_len;
+    uint8_t *output_worker_packet;
+    int output_worker_credits;
+    int main_waiting;
+    LinkedList1Node main_waiting_node;
+    int detaching;
+    int detach_pending;
+    LinkedList1Node detaching_node;
+    
+    // worker side of a worker's client
+    LinkedList1Node w_list_node;
+    char *w_common_name;
+    int w_have_io;
+    int w_closed;
+    int w_pending;
+    int w_waiting;
+    LinkedList1Node w_waiting_node;
+    BPending w_job;
+    int w_input_packet_len;
+    uint8_t *w_input_packet;
+    int w_credits;
+    uint8_t *w_out_buf;
+    int w_out_lens[CLIENT_WORKER_OUTPUT_PACKETS];
+    int w_out_start;
+    int w_out_used;
 };
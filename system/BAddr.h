@@ -281,6 +281,16 @@ static int BAddr_Compare (BAddr *addr1, BAddr *addr2);
 
 static int BAddr_CompareOrder (BAddr *addr1, BAddr *addr2);
 
+/**
+ * Computes a hash of an address, continuing from a previous hash value.
+ * Addresses equal according to {@link BAddr_Compare} hash equally.
+ * 
+ * @param addr the address
+ * @param hash previous hash value, or any constant to start a new hash
+ * @return new hash value
+ */
+static size_t BAddr_Hash (BAddr *addr, size_t hash);
+
 void BIPAddr_InitInvalid (BIPAddr *addr)
 {
     addr->type = BADDR_TYPE_NONE;
@@ -807,6 +817,41 @@ int BAddr_CompareOrder (BAddr *addr1, BAddr *addr2)
     }
 }
 
+size_t BAddr_Hash (BAddr *addr, size_t hash)
+{
+    BAddr_Assert(addr);
+    
+    const uint8_t *ip;
+    size_t ip_len;
+    uint16_t port;
+    
+    switch (addr->type) {
+        case BADDR_TYPE_IPV4: {
+            ip = (const uint8_t *)&addr->ipv4.ip;
+            ip_len = sizeof(addr->ipv4.ip);
+            port = addr->ipv4.port;
+        } break;
+        case BADDR_TYPE_IPV6: {
+            ip = addr->ipv6.ip;
+            ip_len = sizeof(addr->ipv6.ip);
+            port = addr->ipv6.port;
+        } break;
+        default: {
+            return ((hash << 5) + hash) + addr->type;
+        } break;
+    }
+    
+    // djb2 over the type, IP and port
+    hash = ((hash << 5) + hash) + addr->type;
+    for (size_t i = 0; i < ip_len; i++) {
+        hash = ((hash << 5) + hash) + ip[i];
+    }
+    hash = ((hash << 5) + hash) + (port >> 8);
+    hash = ((hash << 5) + hash) + (port & 0xFF);
+    
+    return hash;
+}
+
 void BIPAddr_InitLocalhost (BIPAddr *addr, int addr_type)
 {
     if (addr_type == BADDR_TYPE_IPV4) {
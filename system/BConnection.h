@@ -57,6 +57,7 @@ struct BLisCon_from {
     union {
         struct {
             BAddr addr;
+            int reuse_port;
         } from_addr;
 #ifndef BADVPN_USE_WINAPI
         struct {
@@ -71,6 +72,7 @@ static struct BLisCon_from BLisCon_from_addr (BAddr addr)
     struct BLisCon_from res;
     res.type = BLISCON_FROM_ADDR;
     res.u.from_addr.addr = addr;
+    res.u.from_addr.reuse_port = 0;
     return res;
 }
 
@@ -129,6 +131,23 @@ int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
                     BListener_handler handler) WARN_UNUSED;
 
 #ifndef BADVPN_USE_WINAPI
+/**
+ * Initializes the object for listening on an address, with SO_REUSEPORT set
+ * on the socket. Multiple listeners, possibly in different threads, can be
+ * bound to the same address this way, and the kernel spreads incoming
+ * connections among them.
+ * {@link BNetwork_GlobalInit} must have been done.
+ * 
+ * @param o the object
+ * @param addr address to listen on
+ * @param reactor reactor we live in
+ * @param user argument to handler
+ * @param handler handler called when a connection can be accepted
+ * @return 1 on success, 0 on failure
+ */
+int BListener_InitReusePort (BListener *o, BAddr addr, BReactor *reactor, void *user,
+                             BListener_handler handler) WARN_UNUSED;
+
 /**
  * Initializes the object for listening on a Unix socket.
  * {@link BNetwork_GlobalInit} must have been done.
@@ -36,6 +36,15 @@ int BListener_Init (BListener *o, BAddr addr, BReactor *reactor, void *user,
 }
 
 #ifndef BADVPN_USE_WINAPI
+int BListener_InitReusePort (BListener *o, BAddr addr, BReactor *reactor, void *user,
+                             BListener_handler handler)
+{
+    struct BLisCon_from from = BLisCon_from_addr(addr);
+    from.u.from_addr.reuse_port = 1;
+    
+    return BListener_InitFrom(o, from, reactor, user, handler);
+}
+
 int BListener_InitUnix (BListener *o, const char *socket_path, BReactor *reactor, void *user,
                         BListener_handler handler)
 {
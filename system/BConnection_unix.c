@@ -519,6 +519,19 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
             BLog(BLOG_ERROR, "setsockopt(SO_REUSEADDR) failed");
         }
         
+        // set SO_REUSEPORT if requested
+        if (from.u.from_addr.reuse_port) {
+#ifdef SO_REUSEPORT
+            if (setsockopt(o->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(SO_REUSEPORT) failed");
+                goto fail2;
+            }
+#else
+            BLog(BLOG_ERROR, "SO_REUSEPORT is not supported");
+            goto fail2;
+#endif
+        }
+        
         // bind
         if (bind(o->fd, &sysaddr.addr.generic, sysaddr.len) < 0) {
             BLog(BLOG_ERROR, "bind failed");
@@ -442,6 +442,7 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
                         BListener_handler handler)
 {
     ASSERT(from.type == BLISCON_FROM_ADDR)
+    ASSERT(!from.u.from_addr.reuse_port)
     ASSERT(handler)
     BNetwork_Assert();
     
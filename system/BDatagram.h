@@ -48,6 +48,9 @@ typedef struct BDatagram_s BDatagram;
 
 #define BDATAGRAM_EVENT_ERROR 1
 
+// maximum number of packets for batched sending and receiving
+#define BDATAGRAM_MAX_BATCH 64
+
 /**
  * Handler called when an error occurs with the datagram object.
  * The datagram object is no longer usable and must be freed from withing the job closure of
@@ -175,6 +178,22 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse);
  */
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the send interface for batched sending.
+ * The send interface must not be initialized.
+ * Packets are copied to an internal buffer and accepted right away, and
+ * once the pending jobs have run, up to batch of them are sent with a
+ * single system call. Each packet is sent with the addresses set when it
+ * was submitted. Where the system has no batched sending (other than
+ * Linux), or if batch is 1, this is like {@link BDatagram_SendAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch maximum number of packets sent at once. Must be >=1 and <=BDATAGRAM_MAX_BATCH.
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch) WARN_UNUSED;
+
 /**
  * Frees the send interface.
  * The send interface must be initialized.
@@ -204,6 +223,22 @@ PacketPassInterface * BDatagram_SendAsync_GetIf (BDatagram *o);
  */
 void BDatagram_RecvAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the receive interface for batched receiving.
+ * The receive interface must not be initialized.
+ * Up to batch packets are received with a single system call; those beyond
+ * the first are kept in the object and returned by the following receive
+ * operations. {@link BDatagram_GetLastReceiveAddrs} reports the addresses
+ * of the packet returned last. Where the system has no batched receiving
+ * (other than Linux), or if batch is 1, this is like {@link BDatagram_RecvAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch maximum number of packets received at once. Must be >=1 and <=BDATAGRAM_MAX_BATCH.
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch) WARN_UNUSED;
+
 /**
  * Frees the receive interface.
  * The receive interface must be initialized.
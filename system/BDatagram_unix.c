@@ -43,12 +43,17 @@
 #endif
 
 #include <misc/nonblocking.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include "BDatagram.h"
 
 #include <generated/blog_channel_BDatagram.h>
 
+#if defined(BADVPN_LINUX)
+#define BDATAGRAM_HAVE_BATCH 1
+#endif
+
 struct sys_addr {
     socklen_t len;
     union {
@@ -61,11 +66,31 @@ struct sys_addr {
     } addr;
 };
 
+union pktinfo_cdata {
+#ifdef BADVPN_FREEBSD
+    char in[CMSG_SPACE(sizeof(struct in_addr))];
+#else
+    char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+    char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+};
+
 static int family_socket_to_sys (int family);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void set_pktinfo (int fd, int family);
+static void prepare_send_msg (struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union pktinfo_cdata *cdata,
+                              const uint8_t *data, int data_len, BAddr remote_addr, BIPAddr local_addr);
+static void prepare_recv_msg (struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union pktinfo_cdata *cdata,
+                              uint8_t *data, int mtu);
+static void parse_recv_msg (struct msghdr *msg, struct sys_addr *sysaddr, BAddr *out_remote_addr, BIPAddr *out_local_addr);
 static void report_error (BDatagram *o);
+static int send_ready (BDatagram *o);
+static void send_sent (BDatagram *o);
+#ifdef BDATAGRAM_HAVE_BATCH
+static void send_batch_add (BDatagram *o);
+static void do_send_batch (BDatagram *o);
+#endif
 static void do_send (BDatagram *o);
 static void do_recv (BDatagram *o);
 static void fd_handler (BDatagram *o, int events);
@@ -73,6 +98,8 @@ static void send_job_handler (BDatagram *o);
 static void recv_job_handler (BDatagram *o);
 static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len);
 static void recv_if_handler_recv (BDatagram *o, uint8_t *data);
+static int send_init (BDatagram *o, int mtu, int batch);
+static int recv_init (BDatagram *o, int mtu, int batch);
 
 static int family_socket_to_sys (int family)
 {
@@ -231,61 +258,28 @@ static void set_pktinfo (int fd, int family)
     }
 }
 
-static void report_error (BDatagram *o)
+static void prepare_send_msg (struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union pktinfo_cdata *cdata,
+                              const uint8_t *data, int data_len, BAddr remote_addr, BIPAddr local_addr)
 {
-    DebugError_AssertNoError(&o->d_err);
-    
-    // report error
-    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
-    return;
-}
-
-static void do_send (BDatagram *o)
-{
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
-    
-    // limit
-    if (!BReactorLimit_Increment(&o->send.limit)) {
-        // wait for fd
-        o->wait_events |= BREACTOR_WRITE;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-        return;
-    }
-    
     // convert destination address
-    struct sys_addr sysaddr;
-    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
+    addr_socket_to_sys(sysaddr, remote_addr);
     
-    struct iovec iov;
-    iov.iov_base = (uint8_t *)o->send.busy_data;
-    iov.iov_len = o->send.busy_data_len;
+    iov->iov_base = (uint8_t *)data;
+    iov->iov_len = data_len;
     
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &sysaddr->addr.generic;
+    msg->msg_namelen = sysaddr->len;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = cdata;
+    msg->msg_controllen = sizeof(*cdata);
     
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sysaddr.len;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
-    
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
     
     size_t controllen = 0;
     
-    switch (o->send.local_addr.type) {
+    switch (local_addr.type) {
         case BADDR_TYPE_IPV4: {
 #ifdef BADVPN_FREEBSD
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
@@ -293,7 +287,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IP_SENDSRCADDR;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
             struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            addrinfo->s_addr = o->send.local_addr.ipv4;
+            addrinfo->s_addr = local_addr.ipv4;
             controllen += CMSG_SPACE(sizeof(struct in_addr));
 #else
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
@@ -301,7 +295,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IP_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
             struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
+            pktinfo->ipi_spec_dst.s_addr = local_addr.ipv4;
             controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
 #endif
         } break;
@@ -312,17 +306,217 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IPV6_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
             struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
+            memcpy(pktinfo->ipi6_addr.s6_addr, local_addr.ipv6, 16);
             controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
         } break;
     }
     
-    msg.msg_controllen = controllen;
+    msg->msg_controllen = controllen;
+    
+    if (msg->msg_controllen == 0) {
+        msg->msg_control = NULL;
+    }
+}
+
+static void prepare_recv_msg (struct msghdr *msg, struct iovec *iov, struct sys_addr *sysaddr, union pktinfo_cdata *cdata,
+                              uint8_t *data, int mtu)
+{
+    iov->iov_base = data;
+    iov->iov_len = mtu;
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &sysaddr->addr.generic;
+    msg->msg_namelen = sizeof(sysaddr->addr);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = cdata;
+    msg->msg_controllen = sizeof(*cdata);
+}
+
+static void parse_recv_msg (struct msghdr *msg, struct sys_addr *sysaddr, BAddr *out_remote_addr, BIPAddr *out_local_addr)
+{
+    // read returned address
+    sysaddr->len = msg->msg_namelen;
+    addr_sys_to_socket(out_remote_addr, *sysaddr);
+    
+    // read returned local address
+    BIPAddr_InitInvalid(out_local_addr);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef BADVPN_FREEBSD
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out_local_addr, addrinfo->s_addr);
+        }
+#else
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out_local_addr, pktinfo->ipi_addr.s_addr);
+        }
+#endif
+        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv6(out_local_addr, pktinfo->ipi6_addr.s6_addr);
+        }
+    }
+}
+
+static void report_error (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    
+    // report error
+    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
+    return;
+}
+
+static int send_ready (BDatagram *o)
+{
+    return (o->send.busy && o->send.have_addrs) || o->send.batch_count > 0;
+}
+
+static void send_sent (BDatagram *o)
+{
+    // if recv wasn't started yet, start it
+    if (!o->recv.started) {
+        // set recv started
+        o->recv.started = 1;
+        
+        // continue receiving
+        if (o->recv.inited && o->recv.busy) {
+            BPending_Set(&o->recv.job);
+        }
+    }
+}
+
+#ifdef BDATAGRAM_HAVE_BATCH
+
+static void send_batch_add (BDatagram *o)
+{
+    ASSERT(o->send.batch > 1)
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
+    ASSERT(o->send.batch_count < o->send.batch)
+    ASSERT(o->send.busy_data_len <= o->send.mtu - o->send.batch_buf_used)
+    
+    // copy the packet, remembering the current addresses
+    struct BDatagram__packet *p = &o->send.batch_packets[o->send.batch_count];
+    p->data = o->send.batch_buf + o->send.batch_buf_used;
+    p->len = o->send.busy_data_len;
+    p->remote_addr = o->send.remote_addr;
+    p->local_addr = o->send.local_addr;
+    memcpy(p->data, o->send.busy_data, p->len);
+    o->send.batch_buf_used += p->len;
+    o->send.batch_count++;
+    
+    // Send once the pending jobs have run. The done job set below runs before
+    // the send job, so the sender can submit more packets to go with this one.
+    if (!(o->wait_events & BREACTOR_WRITE)) {
+        BPending_Set(&o->send.job);
+    }
+    
+    // set not busy
+    o->send.busy = 0;
+    
+    // done
+    PacketPassInterface_Done(&o->send.iface);
+}
+
+static void do_send_batch (BDatagram *o)
+{
+    ASSERT(o->send.batch > 1)
     
-    if (msg.msg_controllen == 0) {
-        msg.msg_control = NULL;
+    if (o->send.batch_sent < o->send.batch_count) {
+        struct mmsghdr msgs[BDATAGRAM_MAX_BATCH];
+        struct iovec iovs[BDATAGRAM_MAX_BATCH];
+        struct sys_addr sysaddrs[BDATAGRAM_MAX_BATCH];
+        union pktinfo_cdata cdatas[BDATAGRAM_MAX_BATCH];
+        
+        int num = o->send.batch_count - o->send.batch_sent;
+        for (int i = 0; i < num; i++) {
+            struct BDatagram__packet *p = &o->send.batch_packets[o->send.batch_sent + i];
+            prepare_send_msg(&msgs[i].msg_hdr, &iovs[i], &sysaddrs[i], &cdatas[i], p->data, p->len, p->remote_addr, p->local_addr);
+            msgs[i].msg_len = 0;
+        }
+        
+        // send
+        int res = sendmmsg(o->fd, msgs, num, 0);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for fd
+                o->wait_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                return;
+            }
+            
+            report_error(o);
+            return;
+        }
+        
+        ASSERT(res > 0)
+        ASSERT(res <= num)
+        
+        for (int i = 0; i < res; i++) {
+            if (msgs[i].msg_len < o->send.batch_packets[o->send.batch_sent + i].len) {
+                BLog(BLOG_ERROR, "send sent too little");
+            }
+        }
+        
+        o->send.batch_sent += res;
+        
+        send_sent(o);
+        
+        // if not everything was sent, wait for fd
+        if (o->send.batch_sent < o->send.batch_count) {
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
+        }
+        
+        // empty the batch
+        o->send.batch_count = 0;
+        o->send.batch_sent = 0;
+        o->send.batch_buf_used = 0;
     }
     
+    // accept a packet which didn't fit into the batch
+    if (o->send.busy && o->send.have_addrs) {
+        send_batch_add(o);
+        return;
+    }
+}
+
+#endif
+
+static void do_send (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(send_ready(o))
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+#ifdef BDATAGRAM_HAVE_BATCH
+    if (o->send.batch > 1) {
+        do_send_batch(o);
+        return;
+    }
+#endif
+    
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
+    
+    struct sys_addr sysaddr;
+    struct iovec iov;
+    union pktinfo_cdata cdata;
+    struct msghdr msg;
+    prepare_send_msg(&msg, &iov, &sysaddr, &cdata, o->send.busy_data, o->send.busy_data_len, o->send.remote_addr, o->send.local_addr);
+    
     // send
     int bytes = sendmsg(o->fd, &msg, 0);
     if (bytes < 0) {
@@ -344,16 +538,7 @@ static void do_send (BDatagram *o)
         BLog(BLOG_ERROR, "send sent too little");
     }
     
-    // if recv wasn't started yet, start it
-    if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
-    }
+    send_sent(o);
     
     // set not busy
     o->send.busy = 0;
@@ -369,6 +554,22 @@ static void do_recv (BDatagram *o)
     ASSERT(o->recv.busy)
     ASSERT(o->recv.started)
     
+#ifdef BDATAGRAM_HAVE_BATCH
+    // return a packet received earlier
+    if (o->recv.batch_pos < o->recv.batch_count) {
+        struct BDatagram__packet *p = &o->recv.batch_packets[o->recv.batch_pos];
+        o->recv.batch_pos++;
+        
+        memcpy(o->recv.busy_data, p->data, p->len);
+        o->recv.remote_addr = p->remote_addr;
+        o->recv.local_addr = p->local_addr;
+        o->recv.have_addrs = 1;
+        o->recv.busy = 0;
+        PacketRecvInterface_Done(&o->recv.iface, p->len);
+        return;
+    }
+#endif
+    
     // limit
     if (!BReactorLimit_Increment(&o->recv.limit)) {
         // wait for fd
@@ -377,29 +578,63 @@ static void do_recv (BDatagram *o)
         return;
     }
     
-    struct sys_addr sysaddr;
-    
-    struct iovec iov;
-    iov.iov_base = o->recv.busy_data;
-    iov.iov_len = o->recv.mtu;
-    
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#ifdef BDATAGRAM_HAVE_BATCH
+    if (o->recv.batch > 1) {
+        struct mmsghdr msgs[BDATAGRAM_MAX_BATCH];
+        struct iovec iovs[BDATAGRAM_MAX_BATCH];
+        struct sys_addr sysaddrs[BDATAGRAM_MAX_BATCH];
+        union pktinfo_cdata cdatas[BDATAGRAM_MAX_BATCH];
+        
+        // the first packet goes directly to the receiver, the rest to our slots
+        for (int i = 0; i < o->recv.batch; i++) {
+            uint8_t *data = (i == 0) ? o->recv.busy_data : o->recv.batch_packets[i].data;
+            prepare_recv_msg(&msgs[i].msg_hdr, &iovs[i], &sysaddrs[i], &cdatas[i], data, o->recv.mtu);
+            msgs[i].msg_len = 0;
+        }
+        
+        // recv
+        int res = recvmmsg(o->fd, msgs, o->recv.batch, 0, NULL);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for fd
+                o->wait_events |= BREACTOR_READ;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                return;
+            }
+            
+            BLog(BLOG_ERROR, "recv failed");
+            report_error(o);
+            return;
+        }
+        
+        ASSERT(res > 0)
+        ASSERT(res <= o->recv.batch)
+        
+        for (int i = 0; i < res; i++) {
+            struct BDatagram__packet *p = &o->recv.batch_packets[i];
+            ASSERT(msgs[i].msg_len <= o->recv.mtu)
+            p->len = msgs[i].msg_len;
+            parse_recv_msg(&msgs[i].msg_hdr, &sysaddrs[i], &p->remote_addr, &p->local_addr);
+        }
+        
+        // remember the other packets
+        o->recv.batch_count = res;
+        o->recv.batch_pos = 1;
+        
+        o->recv.remote_addr = o->recv.batch_packets[0].remote_addr;
+        o->recv.local_addr = o->recv.batch_packets[0].local_addr;
+        o->recv.have_addrs = 1;
+        o->recv.busy = 0;
+        PacketRecvInterface_Done(&o->recv.iface, o->recv.batch_packets[0].len);
+        return;
+    }
 #endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
     
+    struct sys_addr sysaddr;
+    struct iovec iov;
+    union pktinfo_cdata cdata;
     struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sizeof(sysaddr.addr);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
+    prepare_recv_msg(&msg, &iov, &sysaddr, &cdata, o->recv.busy_data, o->recv.mtu);
     
     // recv
     int bytes = recvmsg(o->fd, &msg, 0);
@@ -419,29 +654,8 @@ static void do_recv (BDatagram *o)
     ASSERT(bytes >= 0)
     ASSERT(bytes <= o->recv.mtu)
     
-    // read returned address
-    sysaddr.len = msg.msg_namelen;
-    addr_sys_to_socket(&o->recv.remote_addr, sysaddr);
-    
-    // read returned local address
-    BIPAddr_InitInvalid(&o->recv.local_addr);
-    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-#ifdef BADVPN_FREEBSD
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
-            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, addrinfo->s_addr);
-        }
-#else
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
-            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, pktinfo->ipi_addr.s_addr);
-        }
-#endif
-        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
-            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv6(&o->recv.local_addr, pktinfo->ipi6_addr.s6_addr);
-        }
-    }
+    // read addresses
+    parse_recv_msg(&msg, &sysaddr, &o->recv.remote_addr, &o->recv.local_addr);
     
     // set have addresses
     o->recv.have_addrs = 1;
@@ -465,10 +679,9 @@ static void fd_handler (BDatagram *o, int events)
     int have_send = 0;
     int have_recv = 0;
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && send_ready(o))) {
         ASSERT(o->send.inited)
-        ASSERT(o->send.busy)
-        ASSERT(o->send.have_addrs)
+        ASSERT(send_ready(o))
         
         have_send = 1;
     }
@@ -505,8 +718,7 @@ static void send_job_handler (BDatagram *o)
     DebugObject_Access(&o->d_obj);
     DebugError_AssertNoError(&o->d_err);
     ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
+    ASSERT(send_ready(o))
     
     do_send(o);
     return;
@@ -545,6 +757,16 @@ static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len)
         return;
     }
     
+#ifdef BDATAGRAM_HAVE_BATCH
+    // add to the batch if there's space, else wait for it to be sent
+    if (o->send.batch > 1) {
+        if (o->send.batch_count < o->send.batch && data_len <= o->send.mtu - o->send.batch_buf_used) {
+            send_batch_add(o);
+        }
+        return;
+    }
+#endif
+    
     // set job
     BPending_Set(&o->send.job);
 }
@@ -571,6 +793,87 @@ static void recv_if_handler_recv (BDatagram *o, uint8_t *data)
     BPending_Set(&o->recv.job);
 }
 
+static int send_init (BDatagram *o, int mtu, int batch)
+{
+    // init arguments
+    o->send.mtu = mtu;
+    o->send.batch = batch;
+    
+    // allocate batch buffer and packets
+    o->send.batch_buf = NULL;
+    o->send.batch_packets = NULL;
+    if (o->send.batch > 1) {
+        if (!(o->send.batch_buf = (uint8_t *)BAlloc(o->send.mtu)) ||
+            !(o->send.batch_packets = (struct BDatagram__packet *)BAllocArray(o->send.batch, sizeof(o->send.batch_packets[0])))
+        ) {
+            BLog(BLOG_ERROR, "BAlloc failed");
+            BFree(o->send.batch_buf);
+            return 0;
+        }
+    }
+    
+    // set batch empty
+    o->send.batch_buf_used = 0;
+    o->send.batch_count = 0;
+    o->send.batch_sent = 0;
+    
+    // init interface
+    PacketPassInterface_Init(&o->send.iface, o->send.mtu, (PacketPassInterface_handler_send)send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    
+    // init job
+    BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
+    
+    // set not busy
+    o->send.busy = 0;
+    
+    // set inited
+    o->send.inited = 1;
+    
+    return 1;
+}
+
+static int recv_init (BDatagram *o, int mtu, int batch)
+{
+    // init arguments
+    o->recv.mtu = mtu;
+    o->recv.batch = batch;
+    
+    // allocate slots for packets after the first one
+    o->recv.batch_buf = NULL;
+    o->recv.batch_packets = NULL;
+    if (o->recv.batch > 1) {
+        if (!(o->recv.batch_buf = (uint8_t *)BAllocArray(o->recv.batch - 1, o->recv.mtu)) ||
+            !(o->recv.batch_packets = (struct BDatagram__packet *)BAllocArray(o->recv.batch, sizeof(o->recv.batch_packets[0])))
+        ) {
+            BLog(BLOG_ERROR, "BAlloc failed");
+            BFree(o->recv.batch_buf);
+            return 0;
+        }
+        o->recv.batch_packets[0].data = NULL;
+        for (int i = 1; i < o->recv.batch; i++) {
+            o->recv.batch_packets[i].data = o->recv.batch_buf + (size_t)(i - 1) * o->recv.mtu;
+        }
+    }
+    
+    // set no packets received
+    o->recv.batch_count = 0;
+    o->recv.batch_pos = 0;
+    
+    // init interface
+    PacketRecvInterface_Init(&o->recv.iface, o->recv.mtu, (PacketRecvInterface_handler_recv)recv_if_handler_recv, o, BReactor_PendingGroup(o->reactor));
+    
+    // init job
+    BPending_Init(&o->recv.job, BReactor_PendingGroup(o->reactor), (BPending_handler)recv_job_handler, o);
+    
+    // set not busy
+    o->recv.busy = 0;
+    
+    // set inited
+    o->recv.inited = 1;
+    
+    return 1;
+}
+
 int BDatagram_AddressFamilySupported (int family)
 {
     switch (family) {
@@ -784,20 +1087,24 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     ASSERT(!o->send.inited)
     ASSERT(mtu >= 0)
     
-    // init arguments
-    o->send.mtu = mtu;
-    
-    // init interface
-    PacketPassInterface_Init(&o->send.iface, o->send.mtu, (PacketPassInterface_handler_send)send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
-    
-    // init job
-    BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
+    // nothing is allocated without batching, so this cannot fail
+    ASSERT_EXECUTE(send_init(o, mtu, 1))
+}
+
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->send.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(batch >= 1)
+    ASSERT(batch <= BDATAGRAM_MAX_BATCH)
     
-    // set not busy
-    o->send.busy = 0;
+#ifndef BDATAGRAM_HAVE_BATCH
+    batch = 1;
+#endif
     
-    // set inited
-    o->send.inited = 1;
+    return send_init(o, mtu, batch);
 }
 
 void BDatagram_SendAsync_Free (BDatagram *o)
@@ -815,6 +1122,10 @@ void BDatagram_SendAsync_Free (BDatagram *o)
     // free interface
     PacketPassInterface_Free(&o->send.iface);
     
+    // free batch (unsent packets are dropped)
+    BFree(o->send.batch_packets);
+    BFree(o->send.batch_buf);
+    
     // set not inited
     o->send.inited = 0;
 }
@@ -834,20 +1145,24 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     ASSERT(!o->recv.inited)
     ASSERT(mtu >= 0)
     
-    // init arguments
-    o->recv.mtu = mtu;
-    
-    // init interface
-    PacketRecvInterface_Init(&o->recv.iface, o->recv.mtu, (PacketRecvInterface_handler_recv)recv_if_handler_recv, o, BReactor_PendingGroup(o->reactor));
-    
-    // init job
-    BPending_Init(&o->recv.job, BReactor_PendingGroup(o->reactor), (BPending_handler)recv_job_handler, o);
+    // nothing is allocated without batching, so this cannot fail
+    ASSERT_EXECUTE(recv_init(o, mtu, 1))
+}
+
+int BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->recv.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(batch >= 1)
+    ASSERT(batch <= BDATAGRAM_MAX_BATCH)
     
-    // set not busy
-    o->recv.busy = 0;
+#ifndef BDATAGRAM_HAVE_BATCH
+    batch = 1;
+#endif
     
-    // set inited
-    o->recv.inited = 1;
+    return recv_init(o, mtu, batch);
 }
 
 void BDatagram_RecvAsync_Free (BDatagram *o)
@@ -865,6 +1180,10 @@ void BDatagram_RecvAsync_Free (BDatagram *o)
     // free interface
     PacketRecvInterface_Free(&o->recv.iface);
     
+    // free batch (packets not yet returned are dropped)
+    BFree(o->recv.batch_packets);
+    BFree(o->recv.batch_buf);
+    
     // set not inited
     o->recv.inited = 0;
 }
@@ -33,6 +33,13 @@
 #define BDATAGRAM_SEND_LIMIT 2
 #define BDATAGRAM_RECV_LIMIT 2
 
+struct BDatagram__packet {
+    uint8_t *data;
+    int len;
+    BAddr remote_addr;
+    BIPAddr local_addr;
+};
+
 struct BDatagram_s {
     BReactor *reactor;
     void *user;
@@ -52,6 +59,12 @@ struct BDatagram_s {
         int busy;
         const uint8_t *busy_data;
         int busy_data_len;
+        int batch;
+        uint8_t *batch_buf;
+        int batch_buf_used;
+        struct BDatagram__packet *batch_packets;
+        int batch_count;
+        int batch_sent;
     } send;
     struct {
         BReactorLimit limit;
@@ -65,6 +78,11 @@ struct BDatagram_s {
         BPending job;
         int busy;
         uint8_t *busy_data;
+        int batch;
+        uint8_t *batch_buf;
+        struct BDatagram__packet *batch_packets;
+        int batch_count;
+        int batch_pos;
     } recv;
     DebugError d_err;
     DebugObject d_obj;
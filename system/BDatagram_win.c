@@ -696,6 +696,16 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     o->send.inited = 1;
 }
 
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch)
+{
+    ASSERT(batch >= 1)
+    ASSERT(batch <= BDATAGRAM_MAX_BATCH)
+    
+    // no batched sending here
+    BDatagram_SendAsync_Init(o, mtu);
+    return 1;
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -748,6 +758,16 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     o->recv.inited = 1;
 }
 
+int BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch)
+{
+    ASSERT(batch >= 1)
+    ASSERT(batch <= BDATAGRAM_MAX_BATCH)
+    
+    // no batched receiving here
+    BDatagram_RecvAsync_Init(o, mtu);
+    return 1;
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -0,0 +1,339 @@
+/**
+ * @file BThreadPacketQueue.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+
+#include <misc/offset.h>
+#include <misc/balign.h>
+#include <misc/balloc.h>
+#include <misc/maxalign.h>
+
+#include "BThreadPacketQueue.h"
+
+/*
+ * head is written only by the consumer and tail only by the producer; each
+ * side also keeps a cached copy of the other side's position, and only reads
+ * the shared one when the cached one says the queue is empty or full.
+ * 
+ * A side which finds nothing to do sets its sleeping flag and then checks the
+ * other side's position again. The other side, after publishing its position,
+ * checks the flag and, if it clears it, sends a wakeup. Either the sleeping
+ * side sees the new position or the other side sees the flag, which is why
+ * these accesses are sequentially consistent.
+ */
+
+#define LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+#define EXCHANGE(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+
+// how many packets the consumer handles before yielding to its reactor
+#define CONSUMER_BATCH 64
+
+// positions run from 0 to 2*num_packets-1, so that a full queue can be
+// told apart from an empty one
+
+static unsigned int pos_next (BThreadPacketQueue *o, unsigned int pos)
+{
+    return (pos + 1 == 2 * (unsigned int)o->num_packets ? 0 : pos + 1);
+}
+
+static unsigned int pos_count (BThreadPacketQueue *o, unsigned int tail, unsigned int head)
+{
+    return (tail >= head ? tail - head : tail + 2 * (unsigned int)o->num_packets - head);
+}
+
+static size_t pos_index (BThreadPacketQueue *o, unsigned int pos)
+{
+    return (pos >= (unsigned int)o->num_packets ? pos - o->num_packets : pos);
+}
+
+static void wakeup (BThreadSignal *thread_signal, int *sleeping)
+{
+    if (LOAD(sleeping) && EXCHANGE(sleeping, 0)) {
+        BThreadSignal_Thread_Signal(thread_signal);
+    }
+}
+
+static void producer_publish (BThreadPacketQueue *o)
+{
+    STORE(&o->tail, o->producer_tail);
+    
+    wakeup(&o->consumer_signal, &o->consumer_sleeping);
+}
+
+static int producer_has_space (BThreadPacketQueue *o)
+{
+    if (pos_count(o, o->producer_tail, o->producer_head_cache) < (unsigned int)o->num_packets) {
+        return 1;
+    }
+    
+    o->producer_head_cache = LOAD(&o->head);
+    
+    return (pos_count(o, o->producer_tail, o->producer_head_cache) < (unsigned int)o->num_packets);
+}
+
+static int producer_wait_space (BThreadPacketQueue *o)
+{
+    // go to sleep
+    STORE(&o->producer_sleeping, 1);
+    
+    // check again, the consumer may have freed space before seeing the flag
+    if (!producer_has_space(o)) {
+        return 0;
+    }
+    
+    EXCHANGE(&o->producer_sleeping, 0);
+    
+    return 1;
+}
+
+static void producer_flush_job_handler (BThreadPacketQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    producer_publish(o);
+}
+
+static void producer_signal_handler (BThreadSignal *thread_signal)
+{
+    BThreadPacketQueue *o = UPPER_OBJECT(thread_signal, BThreadPacketQueue, producer_signal);
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->producer_blocked) {
+        return;
+    }
+    
+    // the wakeup may be from before the producer went to sleep last time
+    if (!producer_has_space(o) && !producer_wait_space(o)) {
+        return;
+    }
+    
+    o->producer_blocked = 0;
+    
+    o->handler_space(o->user);
+    return;
+}
+
+static void consumer_publish (BThreadPacketQueue *o)
+{
+    STORE(&o->head, o->consumer_head);
+    
+    wakeup(&o->producer_signal, &o->producer_sleeping);
+}
+
+static void consumer_job_handler (BThreadPacketQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    unsigned int head = o->consumer_head;
+    
+    if (head == o->consumer_tail_cache) {
+        // return the slots we have handled
+        consumer_publish(o);
+        
+        o->consumer_tail_cache = LOAD(&o->tail);
+        
+        if (head == o->consumer_tail_cache) {
+            // go to sleep
+            STORE(&o->consumer_sleeping, 1);
+            
+            // check again, the producer may have published before seeing the flag
+            o->consumer_tail_cache = LOAD(&o->tail);
+            if (head == o->consumer_tail_cache) {
+                o->consumer_count = 0;
+                return;
+            }
+            
+            EXCHANGE(&o->consumer_sleeping, 0);
+        }
+    }
+    
+    if (o->consumer_count == CONSUMER_BATCH) {
+        // yield to the reactor, and continue when it gets to our signal
+        o->consumer_count = 0;
+        consumer_publish(o);
+        BThreadSignal_Thread_Signal(&o->consumer_signal);
+        return;
+    }
+    
+    // continue with the next packet after any jobs set by the handler
+    BPending_Set(&o->consumer_job);
+    
+    // handle packet
+    size_t index = pos_index(o, head);
+    o->handler_recv(o->user, o->slots + index * o->slot_size, o->lens[index]);
+    
+    // consume it
+    o->consumer_head = pos_next(o, head);
+    o->consumer_count++;
+}
+
+static void consumer_signal_handler (BThreadSignal *thread_signal)
+{
+    BThreadPacketQueue *o = UPPER_OBJECT(thread_signal, BThreadPacketQueue, consumer_signal);
+    DebugObject_Access(&o->d_obj);
+    
+    BPending_Set(&o->consumer_job);
+}
+
+int BThreadPacketQueue_Init (BThreadPacketQueue *o, int mtu, int num_packets, BReactor *producer_reactor, BReactor *consumer_reactor,
+                             void *user, BThreadPacketQueue_handler_space handler_space, BThreadPacketQueue_handler_recv handler_recv)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(num_packets > 0)
+    ASSERT(num_packets <= UINT_MAX / 2)
+    ASSERT(handler_space)
+    ASSERT(handler_recv)
+    
+    // init arguments
+    o->mtu = mtu;
+    o->num_packets = num_packets;
+    o->producer_reactor = producer_reactor;
+    o->consumer_reactor = consumer_reactor;
+    o->user = user;
+    o->handler_space = handler_space;
+    o->handler_recv = handler_recv;
+    
+    // compute slot size
+    if (balign_up_overflows(mtu, BMAX_ALIGN)) {
+        goto fail0;
+    }
+    o->slot_size = balign_up(mtu, BMAX_ALIGN);
+    if (o->slot_size == 0) {
+        o->slot_size = BMAX_ALIGN;
+    }
+    
+    // allocate slots
+    if (!(o->slots = (uint8_t *)BAllocArray(num_packets, o->slot_size))) {
+        goto fail0;
+    }
+    
+    // allocate lengths
+    if (!(o->lens = (int *)BAllocArray(num_packets, sizeof(o->lens[0])))) {
+        goto fail1;
+    }
+    
+    // init signals
+    if (!BThreadSignal_Init(&o->producer_signal, producer_reactor, producer_signal_handler)) {
+        goto fail2;
+    }
+    if (!BThreadSignal_Init(&o->consumer_signal, consumer_reactor, consumer_signal_handler)) {
+        goto fail3;
+    }
+    
+    // init jobs
+    BPending_Init(&o->producer_flush_job, BReactor_PendingGroup(producer_reactor), (BPending_handler)producer_flush_job_handler, o);
+    BPending_Init(&o->consumer_job, BReactor_PendingGroup(consumer_reactor), (BPending_handler)consumer_job_handler, o);
+    
+    // init shared state; the consumer starts sleeping
+    o->head = 0;
+    o->tail = 0;
+    o->producer_sleeping = 0;
+    o->consumer_sleeping = 1;
+    
+    // init producer state
+    o->producer_tail = 0;
+    o->producer_head_cache = 0;
+    o->producer_blocked = 0;
+#ifndef NDEBUG
+    o->producer_writing = 0;
+#endif
+    
+    // init consumer state
+    o->consumer_head = 0;
+    o->consumer_tail_cache = 0;
+    o->consumer_count = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+
+fail3:
+    BThreadSignal_Free(&o->producer_signal);
+fail2:
+    BFree(o->lens);
+fail1:
+    BFree(o->slots);
+fail0:
+    return 0;
+}
+
+void BThreadPacketQueue_Free (BThreadPacketQueue *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    BPending_Free(&o->consumer_job);
+    BPending_Free(&o->producer_flush_job);
+    BThreadSignal_Free(&o->consumer_signal);
+    BThreadSignal_Free(&o->producer_signal);
+    BFree(o->lens);
+    BFree(o->slots);
+}
+
+int BThreadPacketQueue_Producer_StartPacket (BThreadPacketQueue *o, uint8_t **data)
+{
+    ASSERT(!o->producer_writing)
+    ASSERT(data)
+    DebugObject_Access(&o->d_obj);
+    
+    if (!producer_has_space(o)) {
+        // let the consumer see what we have before waiting for it
+        producer_publish(o);
+        
+        if (!producer_wait_space(o)) {
+            o->producer_blocked = 1;
+            return 0;
+        }
+    }
+    
+    *data = o->slots + pos_index(o, o->producer_tail) * o->slot_size;
+    
+#ifndef NDEBUG
+    o->producer_writing = 1;
+#endif
+    
+    return 1;
+}
+
+void BThreadPacketQueue_Producer_EndPacket (BThreadPacketQueue *o, int len)
+{
+    ASSERT(o->producer_writing)
+    ASSERT(len >= 0)
+    ASSERT(len <= o->mtu)
+    DebugObject_Access(&o->d_obj);
+    
+    o->lens[pos_index(o, o->producer_tail)] = len;
+    o->producer_tail = pos_next(o, o->producer_tail);
+    
+    // publish from a job, together with any further packets
+    BPending_Set(&o->producer_flush_job);
+    
+#ifndef NDEBUG
+    o->producer_writing = 0;
+#endif
+}
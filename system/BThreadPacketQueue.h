@@ -0,0 +1,172 @@
+/**
+ * @file BThreadPacketQueue.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Lock-free single-producer single-consumer packet queue between two
+ * threads, each running its own {@link BReactor}.
+ */
+
+#ifndef BADVPN_B_THREAD_PACKET_QUEUE_H
+#define BADVPN_B_THREAD_PACKET_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <system/BThreadSignal.h>
+
+/**
+ * Handler called in the consumer's reactor for each packet in the queue,
+ * in order. The packet data is only valid until the handler returns.
+ * The handler must not free the queue.
+ * 
+ * Each packet is handled from its own job, which is set before the handler
+ * is called; jobs which the handler sets therefore run before the next packet
+ * is handled, as if the packets came from a {@link PacketPassInterface}.
+ * 
+ * @param user as in {@link BThreadPacketQueue_Init}
+ * @param data packet data
+ * @param data_len packet length
+ */
+typedef void (*BThreadPacketQueue_handler_recv) (void *user, uint8_t *data, int data_len);
+
+/**
+ * Handler called in the producer's reactor when the queue has space again
+ * after {@link BThreadPacketQueue_Producer_StartPacket} found it full.
+ * 
+ * @param user as in {@link BThreadPacketQueue_Init}
+ */
+typedef void (*BThreadPacketQueue_handler_space) (void *user);
+
+/**
+ * Lock-free single-producer single-consumer packet queue between two
+ * threads, each running its own {@link BReactor}.
+ * 
+ * The producer writes packets directly into the queue's slots. Packets are
+ * published to the consumer from a job, so a burst of packets written in one
+ * pass of the producer's event loop costs one atomic store, and at most one
+ * wakeup of the consumer. The consumer is only woken up (through a
+ * {@link BThreadSignal}) when it has gone to sleep after finding the queue
+ * empty, and likewise the producer only when it is waiting for space.
+ * 
+ * The consumer yields to its reactor after a number of packets, so that a
+ * busy producer cannot starve the consumer's other events.
+ */
+typedef struct {
+    int mtu;
+    int num_packets;
+    size_t slot_size;
+    uint8_t *slots;
+    int *lens;
+    
+    // shared state, on separate cache lines to avoid false sharing
+    char pad0[64];
+    unsigned int head;
+    int producer_sleeping;
+    char pad1[64];
+    unsigned int tail;
+    int consumer_sleeping;
+    char pad2[64];
+    
+    // producer side
+    BReactor *producer_reactor;
+    BThreadPacketQueue_handler_space handler_space;
+    BThreadSignal producer_signal;
+    BPending producer_flush_job;
+    unsigned int producer_tail;
+    unsigned int producer_head_cache;
+    int producer_blocked;
+#ifndef NDEBUG
+    int producer_writing;
+#endif
+    
+    // consumer side
+    BReactor *consumer_reactor;
+    BThreadPacketQueue_handler_recv handler_recv;
+    BThreadSignal consumer_signal;
+    BPending consumer_job;
+    unsigned int consumer_head;
+    unsigned int consumer_tail_cache;
+    int consumer_count;
+    
+    void *user;
+    DebugObject d_obj;
+} BThreadPacketQueue;
+
+/**
+ * Initializes the queue.
+ * Neither of the reactors may be running in another thread while this is called;
+ * typically, queues are set up before the threads are started.
+ * 
+ * @param o the object
+ * @param mtu maximum packet size. Must be >=0.
+ * @param num_packets number of packets the queue holds. Must be >0.
+ * @param producer_reactor reactor of the thread writing packets
+ * @param consumer_reactor reactor of the thread receiving packets
+ * @param user value to pass to handlers
+ * @param handler_space handler called in the producer's reactor when the queue has space again
+ * @param handler_recv handler called in the consumer's reactor for each packet
+ * @return 1 on success, 0 on failure
+ */
+int BThreadPacketQueue_Init (BThreadPacketQueue *o, int mtu, int num_packets, BReactor *producer_reactor, BReactor *consumer_reactor,
+                             void *user, BThreadPacketQueue_handler_space handler_space, BThreadPacketQueue_handler_recv handler_recv) WARN_UNUSED;
+
+/**
+ * Frees the queue. Packets still in the queue are dropped.
+ * Neither of the reactors may be running in another thread while this is called.
+ * 
+ * @param o the object
+ */
+void BThreadPacketQueue_Free (BThreadPacketQueue *o);
+
+/**
+ * Starts writing a packet. Must be called from the producer's thread.
+ * If the queue is full, returns 0, and the space handler will be called
+ * once there is space.
+ * 
+ * @param o the object
+ * @param data on success, will be set to where the packet should be written.
+ *             There are mtu bytes available.
+ * @return 1 on success, 0 if the queue is full
+ */
+int BThreadPacketQueue_Producer_StartPacket (BThreadPacketQueue *o, uint8_t **data);
+
+/**
+ * Finishes writing a packet. Must be called from the producer's thread,
+ * after a successful {@link BThreadPacketQueue_Producer_StartPacket}.
+ * 
+ * @param o the object
+ * @param len packet length. Must be >=0 and <=mtu.
+ */
+void BThreadPacketQueue_Producer_EndPacket (BThreadPacketQueue *o, int len);
+
+#endif
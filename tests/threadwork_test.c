@@ -1,7 +1,13 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/compare.h>
 #include <base/BLog.h>
 #include <base/DebugObject.h>
 #include <threadwork/BThreadWork.h>
@@ -13,6 +19,29 @@ BThreadWork tw2;
 BThreadWork tw3;
 int num_left;
 
+struct bench_work {
+    BThreadWork tw;
+    uint64_t start_time;
+};
+
+int bench_work_size;
+int bench_num_works;
+int bench_num_started;
+int bench_num_done;
+uint64_t *bench_latencies;
+
+static uint64_t get_time_ns (void)
+{
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64 (const void *v1, const void *v2)
+{
+    return B_COMPARE(*(const uint64_t *)v1, *(const uint64_t *)v2);
+}
+
 static void handler_done (void *user)
 {
     printf("work done\n");
@@ -45,16 +74,124 @@ static void dummy_works (int n)
     }
 }
 
-int main ()
+static void bench_work_func (struct bench_work *w)
 {
+    volatile unsigned int x = 0;
+    
+    for (int i = 0; i < bench_work_size; i++) {
+        x++;
+    }
+}
+
+static void bench_start (struct bench_work *w);
+
+static void bench_handler_done (struct bench_work *w)
+{
+    bench_latencies[bench_num_done++] = get_time_ns() - w->start_time;
+    BThreadWork_Free(&w->tw);
+    
+    if (bench_num_done == bench_num_works) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    if (bench_num_started < bench_num_works) {
+        bench_start(w);
+    }
+}
+
+static void bench_start (struct bench_work *w)
+{
+    bench_num_started++;
+    w->start_time = get_time_ns();
+    BThreadWork_Init(&w->tw, &twd, (BThreadWork_handler_done)bench_handler_done, w, (BThreadWork_work_func)bench_work_func, w);
+}
+
+static int run_bench (int num_threads, int num_works, int work_size, int in_flight, int flags)
+{
+    int ret = 1;
+    
+    if (!BThreadWorkDispatcher_Init2(&twd, &reactor, num_threads, flags)) {
+        DEBUG("BThreadWorkDispatcher_Init2 failed");
+        goto fail0;
+    }
+    
+    struct bench_work *works = BAllocArray(in_flight, sizeof(works[0]));
+    bench_latencies = BAllocArray(num_works, sizeof(bench_latencies[0]));
+    if (!works || !bench_latencies) {
+        DEBUG("BAllocArray failed");
+        goto fail1;
+    }
+    
+    bench_work_size = work_size;
+    bench_num_works = num_works;
+    bench_num_started = 0;
+    bench_num_done = 0;
+    
+    uint64_t start = get_time_ns();
+    
+    for (int i = 0; i < in_flight && i < num_works; i++) {
+        bench_start(&works[i]);
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    uint64_t elapsed = get_time_ns() - start;
+    
+    qsort(bench_latencies, num_works, sizeof(bench_latencies[0]), compare_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < num_works; i++) {
+        sum += bench_latencies[i];
+    }
+    
+    printf("threads=%d works=%d size=%d in_flight=%d\n", num_threads, num_works, work_size, in_flight);
+    printf("throughput: %.0f works/s\n", (double)num_works / ((double)elapsed / 1e9));
+    printf("latency us: avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+           (double)sum / num_works / 1e3,
+           (double)bench_latencies[num_works / 2] / 1e3,
+           (double)bench_latencies[(int)((int64_t)num_works * 99 / 100)] / 1e3,
+           (double)bench_latencies[num_works - 1] / 1e3);
+    
+    ret = 0;
+    
+fail1:
+    BFree(bench_latencies);
+    BFree(works);
+    BThreadWorkDispatcher_Free(&twd);
+fail0:
+    return ret;
+}
+
+int main (int argc, char *argv[])
+{
+    if (!(argc == 1 || argc == 5 || argc == 6)) {
+        fprintf(stderr, "Usage: %s [<num_threads> <num_works> <work_size> <in_flight> [affinity]]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    int ret = 1;
+    
     BLog_InitStdout();
-    BLog_SetChannelLoglevel(BLOG_CHANNEL_BThreadWork, BLOG_DEBUG);
     
     if (!BReactor_Init(&reactor)) {
         DEBUG("BReactor_Init failed");
         goto fail1;
     }
     
+    if (argc > 1) {
+        int num_works = atoi(argv[2]);
+        int in_flight = atoi(argv[4]);
+        if (num_works <= 0 || in_flight <= 0) {
+            fprintf(stderr, "num_works and in_flight must be >0\n");
+            goto fail2;
+        }
+        int flags = (argc == 6 && !strcmp(argv[5], "affinity") ? BTHREADWORK_INIT_CPU_AFFINITY : 0);
+        ret = run_bench(atoi(argv[1]), num_works, atoi(argv[3]), in_flight, flags);
+        goto fail2;
+    }
+    
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_BThreadWork, BLOG_DEBUG);
+    
     if (!BThreadWorkDispatcher_Init(&twd, &reactor, 1)) {
         DEBUG("BThreadWorkDispatcher_Init failed");
         goto fail2;
@@ -78,10 +215,11 @@ int main ()
     BThreadWork_Free(&tw2);
     BThreadWork_Free(&tw1);
     BThreadWorkDispatcher_Free(&twd);
+    ret = 0;
 fail2:
     BReactor_Free(&reactor);
 fail1:
     BLog_Free();
     DebugObjectGlobal_Finish();
-    return 0;
+    return ret;
 }
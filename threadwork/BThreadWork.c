@@ -27,6 +27,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef BADVPN_LINUX
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stddef.h>
 
@@ -34,9 +38,14 @@
     #include <unistd.h>
     #include <errno.h>
     #include <fcntl.h>
+    #ifdef BADVPN_LINUX
+        #include <sched.h>
+        #include <sys/eventfd.h>
+    #endif
 #endif
 
 #include <misc/offset.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <generated/blog_channel_BThreadWork.h>
@@ -45,70 +54,246 @@
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 
-static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+/*
+ * Each thread has a ring of queued works. Only the event loop adds works
+ * (advancing queue_tail), while the owning thread and idle threads remove them
+ * (advancing queue_head). A work is claimed by atomically replacing its slot
+ * with NULL, which is also how the event loop takes back a work which has not
+ * started. Consumers advance queue_head only over NULL slots.
+ * 
+ * Finished works are pushed onto finished_stack, and the event loop is notified
+ * when the stack becomes non-empty. The event loop grabs the whole stack at once
+ * and moves the works to finished_list, from where the handlers are called.
+ * 
+ * Atomics use GCC builtins with sequentially consistent ordering wherever a
+ * sleep/wakeup decision depends on them.
+ */
+
+#define LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+#define CAS(ptr, expected, desired) __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+static BThreadWork * queue_take (struct BThreadWorkDispatcher_thread *t)
 {
-    BThreadWorkDispatcher *o = t->d;
+    while (1) {
+        unsigned int head = LOAD(&t->queue_head);
+        if (head == LOAD(&t->queue_tail)) {
+            return NULL;
+        }
+        
+        BThreadWork **slot = &t->queue[head % BTHREADWORK_QUEUE_SIZE];
+        BThreadWork *w = LOAD(slot);
+        
+        // claim the work
+        int claimed = (w && CAS(slot, &w, NULL));
+        
+        // the slot is now empty, move the head past it unless someone else did
+        CAS(&t->queue_head, &head, head + 1);
+        
+        if (claimed) {
+            return w;
+        }
+    }
+}
+
+static int queue_put (struct BThreadWorkDispatcher_thread *t, BThreadWork *w)
+{
+    unsigned int tail = t->queue_tail;
+    if (tail - LOAD(&t->queue_head) >= BTHREADWORK_QUEUE_SIZE) {
+        return 0;
+    }
     
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+    BThreadWork **slot = &t->queue[tail % BTHREADWORK_QUEUE_SIZE];
+    ASSERT(!LOAD(slot))
     
-    while (1) {
-        // exit if requested
-        if (o->cancel) {
-            break;
+    w->queue_slot = slot;
+    STORE(slot, w);
+    STORE(&t->queue_tail, tail + 1);
+    
+    return 1;
+}
+
+static int queue_empty (struct BThreadWorkDispatcher_thread *t)
+{
+    return (LOAD(&t->queue_head) == LOAD(&t->queue_tail));
+}
+
+static BThreadWork * find_work (BThreadWorkDispatcher *o, struct BThreadWorkDispatcher_thread *t)
+{
+    // try own queue
+    BThreadWork *w = queue_take(t);
+    if (w) {
+        return w;
+    }
+    
+    // steal from other threads
+    int self = t - o->threads;
+    for (int i = 1; i < o->num_queues; i++) {
+        if ((w = queue_take(&o->threads[(self + i) % o->num_queues]))) {
+            return w;
+        }
+    }
+    
+    return NULL;
+}
+
+static int have_work (BThreadWorkDispatcher *o)
+{
+    for (int i = 0; i < o->num_queues; i++) {
+        if (!queue_empty(&o->threads[i])) {
+            return 1;
         }
+    }
+    
+    return 0;
+}
+
+static void notify_event_loop (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_LINUX
+    uint64_t v = 1;
+    int res = write(o->notify_fd[1], &v, sizeof(v));
+    #else
+    uint8_t b = 0;
+    int res = write(o->notify_fd[1], &b, sizeof(b));
+    #endif
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
+static void finish_work (BThreadWorkDispatcher *o, BThreadWork *w)
+{
+    // push onto finished stack; the work may be freed as soon as this succeeds
+    BThreadWork *head = LOAD(&o->finished_stack);
+    do {
+        w->stack_next = head;
+    } while (!CAS(&o->finished_stack, &head, w));
+    
+    // notify event loop if this starts a new batch
+    if (!head) {
+        notify_event_loop(o);
+    }
+    
+    // wake up BThreadWork_Free waiting for a work
+    if (LOAD(&o->num_waiters) > 0) {
+        ASSERT_FORCE(pthread_mutex_lock(&o->wait_mutex) == 0)
+        ASSERT_FORCE(pthread_cond_broadcast(&o->wait_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_unlock(&o->wait_mutex) == 0)
+    }
+}
+
+static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    BThreadWorkDispatcher *o = t->d;
+    
+    while (!LOAD(&o->cancel)) {
+        BThreadWork *w = find_work(o, t);
         
-        if (LinkedList1_IsEmpty(&o->pending_list)) {
-            // wait for event
-            ASSERT_FORCE(pthread_cond_wait(&t->new_cond, &o->mutex) == 0)
+        if (!w) {
+            ASSERT_FORCE(pthread_mutex_lock(&t->sleep_mutex) == 0)
+            
+            // announce that we're going to sleep before checking for work
+            // once more, so that a work queued meanwhile wakes us up
+            STORE(&t->sleeping, 1);
+            
+            if (!have_work(o)) {
+                while (LOAD(&t->sleeping) && !LOAD(&o->cancel)) {
+                    ASSERT_FORCE(pthread_cond_wait(&t->sleep_cond, &t->sleep_mutex) == 0)
+                }
+            }
+            
+            STORE(&t->sleeping, 0);
+            
+            ASSERT_FORCE(pthread_mutex_unlock(&t->sleep_mutex) == 0)
             continue;
         }
         
-        // grab the work
-        BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->pending_list), BThreadWork, list_node);
-        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
-        LinkedList1_Remove(&o->pending_list, &w->list_node);
-        t->running_work = w;
-        w->state = BTHREADWORK_STATE_RUNNING;
-        
         // do the work
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         w->work_func(w->work_func_user);
-        ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-        
-        // release the work
-        t->running_work = NULL;
-        LinkedList1_Append(&o->finished_list, &w->list_node);
-        w->state = BTHREADWORK_STATE_FINISHED;
-        ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
         
-        // write to pipe
-        uint8_t b = 0;
-        int res = write(o->pipe[1], &b, sizeof(b));
-        if (res < 0) {
-            int error = errno;
-            ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
-        }
+        // report it
+        finish_work(o, w);
     }
     
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-    
     return NULL;
 }
 
-static void dispatch_job (BThreadWorkDispatcher *o)
+static void wake_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    if (!LOAD(&t->sleeping)) {
+        return;
+    }
+    
+    ASSERT_FORCE(pthread_mutex_lock(&t->sleep_mutex) == 0)
+    STORE(&t->sleeping, 0);
+    ASSERT_FORCE(pthread_cond_signal(&t->sleep_cond) == 0)
+    ASSERT_FORCE(pthread_mutex_unlock(&t->sleep_mutex) == 0)
+}
+
+static void collect_finished (BThreadWorkDispatcher *o)
+{
+    // grab all finished works
+    BThreadWork *w = __atomic_exchange_n(&o->finished_stack, NULL, __ATOMIC_SEQ_CST);
+    
+    // reverse the stack to get them in the order they finished
+    BThreadWork *first = NULL;
+    while (w) {
+        BThreadWork *next = w->stack_next;
+        w->stack_next = first;
+        first = w;
+        w = next;
+    }
+    
+    // move them to the finished list
+    for (w = first; w; w = w->stack_next) {
+        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
+        w->state = BTHREADWORK_STATE_FINISHED;
+        LinkedList1_Append(&o->finished_list, &w->list_node);
+    }
+    
+    // schedule calling handlers
+    if (!LinkedList1_IsEmpty(&o->finished_list)) {
+        BPending_Set(&o->more_job);
+    }
+}
+
+static void notify_fd_handler (BThreadWorkDispatcher *o, int events)
 {
     ASSERT(o->num_threads > 0)
+    DebugObject_Access(&o->d_obj);
     
-    // lock
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+    // clear notification; this must happen before collecting, or we could
+    // miss a notification for a batch started after collecting
+    #ifdef BADVPN_LINUX
+    uint64_t v;
+    int res = read(o->notify_fd[0], &v, sizeof(v));
+    #else
+    uint8_t b[64];
+    int res = read(o->notify_fd[0], b, sizeof(b));
+    #endif
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    } else {
+        ASSERT(res > 0)
+    }
     
-    // check for finished job
+    collect_finished(o);
+}
+
+static void more_job_handler (BThreadWorkDispatcher *o)
+{
+    ASSERT(o->num_threads > 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // check for finished work
     if (LinkedList1_IsEmpty(&o->finished_list)) {
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         return;
     }
     
-    // grab finished job
+    // grab finished work
     BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->finished_list), BThreadWork, list_node);
     ASSERT(w->state == BTHREADWORK_STATE_FINISHED)
     LinkedList1_Remove(&o->finished_list, &w->list_node);
@@ -121,60 +306,88 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     // set state forgotten
     w->state = BTHREADWORK_STATE_FORGOTTEN;
     
-    // unlock
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-    
     // call handler
     w->handler_done(w->user);
     return;
 }
 
-static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
+static int init_notify_fd (BThreadWorkDispatcher *o)
 {
-    ASSERT(o->num_threads > 0)
-    DebugObject_Access(&o->d_obj);
+    #ifdef BADVPN_LINUX
     
-    // read data from pipe
-    uint8_t b[64];
-    int res = read(o->pipe[0], b, sizeof(b));
-    if (res < 0) {
-        int error = errno;
-        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
-    } else {
-        ASSERT(res > 0)
+    if ((o->notify_fd[0] = eventfd(0, EFD_NONBLOCK)) < 0) {
+        BLog(BLOG_ERROR, "eventfd failed");
+        return 0;
     }
+    o->notify_fd[1] = o->notify_fd[0];
     
-    dispatch_job(o);
-    return;
+    #else
+    
+    if (pipe(o->notify_fd) < 0) {
+        BLog(BLOG_ERROR, "pipe failed");
+        return 0;
+    }
+    
+    if (fcntl(o->notify_fd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(o->notify_fd[1], F_SETFL, O_NONBLOCK) < 0) {
+        BLog(BLOG_ERROR, "fcntl failed");
+        ASSERT_FORCE(close(o->notify_fd[0]) == 0)
+        ASSERT_FORCE(close(o->notify_fd[1]) == 0)
+        return 0;
+    }
+    
+    #endif
+    
+    return 1;
 }
 
-static void more_job_handler (BThreadWorkDispatcher *o)
+static void free_notify_fd (BThreadWorkDispatcher *o)
 {
-    ASSERT(o->num_threads > 0)
-    DebugObject_Access(&o->d_obj);
+    ASSERT_FORCE(close(o->notify_fd[0]) == 0)
+    if (o->notify_fd[1] != o->notify_fd[0]) {
+        ASSERT_FORCE(close(o->notify_fd[1]) == 0)
+    }
+}
+
+// pins the thread to a CPU; does nothing where that is not supported
+static void set_affinity (struct BThreadWorkDispatcher_thread *t, int index)
+{
+    #ifdef BADVPN_LINUX
     
-    dispatch_job(o);
-    return;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus <= 0) {
+        return;
+    }
+    
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % num_cpus, &set);
+    
+    if (pthread_setaffinity_np(t->thread, sizeof(set), &set) != 0) {
+        BLog(BLOG_WARNING, "pthread_setaffinity_np failed");
+    }
+    
+    #endif
 }
 
 static void stop_threads (BThreadWorkDispatcher *o)
 {
     // set cancelling
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-    o->cancel = 1;
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    STORE(&o->cancel, 1);
     
     while (o->num_threads > 0) {
         struct BThreadWorkDispatcher_thread *t = &o->threads[o->num_threads - 1];
         
         // wake up thread
-        ASSERT_FORCE(pthread_cond_signal(&t->new_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_lock(&t->sleep_mutex) == 0)
+        ASSERT_FORCE(pthread_cond_signal(&t->sleep_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_unlock(&t->sleep_mutex) == 0)
         
         // wait for thread to exit
         ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
         
-        // free condition variable
-        ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
+        // free condition variable and mutex
+        ASSERT_FORCE(pthread_cond_destroy(&t->sleep_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_destroy(&t->sleep_mutex) == 0)
         
         o->num_threads--;
     }
@@ -199,87 +412,111 @@ static void work_job_handler (BThreadWork *o)
 
 int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
 {
+    return BThreadWorkDispatcher_Init2(o, reactor, num_threads_hint, 0);
+}
+
+int BThreadWorkDispatcher_Init2 (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint, int flags)
+{
+    ASSERT((flags & ~(BTHREADWORK_INIT_CPU_AFFINITY)) == 0)
+    
     // init arguments
     o->reactor = reactor;
     
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    
+    // use a thread per CPU by default
     if (num_threads_hint < 0) {
-        num_threads_hint = 2;
-    }
-    if (num_threads_hint > BTHREADWORK_MAX_THREADS) {
-        num_threads_hint = BTHREADWORK_MAX_THREADS;
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads_hint = (num_cpus > 0 ? num_cpus : 2);
     }
     
-    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    o->num_threads = 0;
     
     if (num_threads_hint > 0) {
-        // init pending list
-        LinkedList1_Init(&o->pending_list);
-        
-        // init finished list
+        // have no finished works
+        o->finished_stack = NULL;
         LinkedList1_Init(&o->finished_list);
         
-        // init mutex
-        if (pthread_mutex_init(&o->mutex, NULL) != 0) {
+        // init waiting for works
+        o->num_waiters = 0;
+        if (pthread_mutex_init(&o->wait_mutex, NULL) != 0) {
             BLog(BLOG_ERROR, "pthread_mutex_init failed");
             goto fail0;
         }
-        
-        // init pipe
-        if (pipe(o->pipe) < 0) {
-            BLog(BLOG_ERROR, "pipe failed");
+        if (pthread_cond_init(&o->wait_cond, NULL) != 0) {
+            BLog(BLOG_ERROR, "pthread_cond_init failed");
             goto fail1;
         }
         
-        // set read end non-blocking
-        if (fcntl(o->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
-            goto fail2;
-        }
-        
-        // set write end non-blocking
-        if (fcntl(o->pipe[1], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
+        // init notification fd
+        if (!init_notify_fd(o)) {
             goto fail2;
         }
         
         // init BFileDescriptor
-        BFileDescriptor_Init(&o->bfd, o->pipe[0], (BFileDescriptor_handler)pipe_fd_handler, o);
+        BFileDescriptor_Init(&o->bfd, o->notify_fd[0], (BFileDescriptor_handler)notify_fd_handler, o);
         if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
             BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-            goto fail2;
+            goto fail3;
         }
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
         
         // init more job
         BPending_Init(&o->more_job, BReactor_PendingGroup(o->reactor), (BPending_handler)more_job_handler, o);
         
+        // allocate threads
+        if (!(o->threads = (struct BThreadWorkDispatcher_thread *)BAllocArray(num_threads_hint, sizeof(o->threads[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail4;
+        }
+        
         // set not cancelling
         o->cancel = 0;
         
-        // init threads
-        o->num_threads = 0;
-        for (int i = 0; i < num_threads_hint; i++) {
+        // start queueing at first thread
+        o->next_thread = 0;
+        
+        // init queues before starting threads, since threads look at all queues
+        o->num_queues = num_threads_hint;
+        for (int i = 0; i < o->num_queues; i++) {
             struct BThreadWorkDispatcher_thread *t = &o->threads[i];
-            
-            // set parent pointer
             t->d = o;
+            for (int j = 0; j < BTHREADWORK_QUEUE_SIZE; j++) {
+                t->queue[j] = NULL;
+            }
+            t->queue_head = 0;
+            t->queue_tail = 0;
+            t->sleeping = 0;
+        }
+        
+        // init threads
+        for (int i = 0; i < o->num_queues; i++) {
+            struct BThreadWorkDispatcher_thread *t = &o->threads[i];
             
-            // set no running work
-            t->running_work = NULL;
-            
-            // init condition variable
-            if (pthread_cond_init(&t->new_cond, NULL) != 0) {
+            // init sleep mutex and condition variable
+            if (pthread_mutex_init(&t->sleep_mutex, NULL) != 0) {
+                BLog(BLOG_ERROR, "pthread_mutex_init failed");
+                goto fail5;
+            }
+            if (pthread_cond_init(&t->sleep_cond, NULL) != 0) {
                 BLog(BLOG_ERROR, "pthread_cond_init failed");
-                goto fail3;
+                ASSERT_FORCE(pthread_mutex_destroy(&t->sleep_mutex) == 0)
+                goto fail5;
             }
             
             // init thread
             if (pthread_create(&t->thread, NULL, (void * (*) (void *))dispatcher_thread, t) != 0) {
                 BLog(BLOG_ERROR, "pthread_create failed");
-                ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
-                goto fail3;
+                ASSERT_FORCE(pthread_cond_destroy(&t->sleep_cond) == 0)
+                ASSERT_FORCE(pthread_mutex_destroy(&t->sleep_mutex) == 0)
+                goto fail5;
             }
-        
+            
+            // pin thread
+            if ((flags & BTHREADWORK_INIT_CPU_AFFINITY)) {
+                set_affinity(t, i);
+            }
+            
             o->num_threads++;
         }
     }
@@ -291,15 +528,18 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     return 1;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-fail3:
+fail5:
     stop_threads(o);
+    BFree(o->threads);
+fail4:
     BPending_Free(&o->more_job);
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+fail3:
+    free_notify_fd(o);
 fail2:
-    ASSERT_FORCE(close(o->pipe[0]) == 0)
-    ASSERT_FORCE(close(o->pipe[1]) == 0)
+    ASSERT_FORCE(pthread_cond_destroy(&o->wait_cond) == 0)
 fail1:
-    ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+    ASSERT_FORCE(pthread_mutex_destroy(&o->wait_mutex) == 0)
 fail0:
     return 0;
     #endif
@@ -309,8 +549,11 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
 {
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (o->num_threads > 0) {
-        ASSERT(LinkedList1_IsEmpty(&o->pending_list))
-        for (int i = 0; i < o->num_threads; i++) { ASSERT(!o->threads[i].running_work) }
+        // queues may still have slots of removed works, but no works
+        for (int i = 0; i < o->num_threads; i++) {
+            for (int j = 0; j < BTHREADWORK_QUEUE_SIZE; j++) { ASSERT(!o->threads[i].queue[j]) }
+        }
+        ASSERT(!o->finished_stack)
         ASSERT(LinkedList1_IsEmpty(&o->finished_list))
     }
     #endif
@@ -323,18 +566,21 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
         // stop threads
         stop_threads(o);
         
+        // free threads
+        BFree(o->threads);
+        
         // free more job
         BPending_Free(&o->more_job);
         
         // free BFileDescriptor
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
         
-        // free pipe
-        ASSERT_FORCE(close(o->pipe[0]) == 0)
-        ASSERT_FORCE(close(o->pipe[1]) == 0)
+        // free notification fd
+        free_notify_fd(o);
         
-        // free mutex
-        ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+        // free waiting for works
+        ASSERT_FORCE(pthread_cond_destroy(&o->wait_cond) == 0)
+        ASSERT_FORCE(pthread_mutex_destroy(&o->wait_mutex) == 0)
     }
     
     #endif
@@ -365,19 +611,38 @@ void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_han
         // set state
         o->state = BTHREADWORK_STATE_PENDING;
         
-        // init finished semaphore
-        ASSERT_FORCE(sem_init(&o->finished_sem, 0, 0) == 0)
+        // choose a thread, preferring an idle one
+        int start = d->next_thread;
+        int index = start;
+        for (int i = 0; i < d->num_threads; i++) {
+            int j = (start + i) % d->num_threads;
+            if (LOAD(&d->threads[j].sleeping)) {
+                index = j;
+                break;
+            }
+        }
+        d->next_thread = (index + 1) % d->num_threads;
         
-        // post work
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        LinkedList1_Append(&d->pending_list, &o->list_node);
+        // queue work, trying other threads if the queue is full
+        int queued = 0;
         for (int i = 0; i < d->num_threads; i++) {
-            if (!d->threads[i].running_work) {
-                ASSERT_FORCE(pthread_cond_signal(&d->threads[i].new_cond) == 0)
+            struct BThreadWorkDispatcher_thread *t = &d->threads[(index + i) % d->num_threads];
+            if (queue_put(t, o)) {
+                wake_thread(t);
+                queued = 1;
                 break;
             }
         }
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
+        
+        // all queues are full, do the work here
+        if (!queued) {
+            BLog(BLOG_DEBUG, "queues full, working in event loop");
+            o->queue_slot = NULL;
+            o->work_func(o->work_func_user);
+            o->state = BTHREADWORK_STATE_FINISHED;
+            LinkedList1_Append(&d->finished_list, &o->list_node);
+            BPending_Set(&d->more_job);
+        }
     } else {
     #endif
         // schedule job
@@ -399,25 +664,29 @@ void BThreadWork_Free (BThreadWork *o)
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     if (d->num_threads > 0) {
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        
         switch (o->state) {
             case BTHREADWORK_STATE_PENDING: {
-                BLog(BLOG_DEBUG, "remove pending work");
+                // take the work back if no thread has claimed it
+                BThreadWork *expected = o;
+                if (o->queue_slot && CAS(o->queue_slot, &expected, NULL)) {
+                    BLog(BLOG_DEBUG, "remove pending work");
+                    break;
+                }
                 
-                // remove from pending list
-                LinkedList1_Remove(&d->pending_list, &o->list_node);
-            } break;
-            
-            case BTHREADWORK_STATE_RUNNING: {
                 BLog(BLOG_DEBUG, "remove running work");
                 
-                // wait for the work to finish running
-                ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-                ASSERT_FORCE(sem_wait(&o->finished_sem) == 0)
-                ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-                
-                ASSERT(o->state == BTHREADWORK_STATE_FINISHED)
+                // wait for the work to be finished
+                ASSERT_FORCE(pthread_mutex_lock(&d->wait_mutex) == 0)
+                __atomic_add_fetch(&d->num_waiters, 1, __ATOMIC_SEQ_CST);
+                while (1) {
+                    collect_finished(d);
+                    if (o->state == BTHREADWORK_STATE_FINISHED) {
+                        break;
+                    }
+                    ASSERT_FORCE(pthread_cond_wait(&d->wait_cond, &d->wait_mutex) == 0)
+                }
+                __atomic_sub_fetch(&d->num_waiters, 1, __ATOMIC_SEQ_CST);
+                ASSERT_FORCE(pthread_mutex_unlock(&d->wait_mutex) == 0)
                 
                 // remove from finished list
                 LinkedList1_Remove(&d->finished_list, &o->list_node);
@@ -437,11 +706,6 @@ void BThreadWork_Free (BThreadWork *o)
             default:
                 ASSERT(0);
         }
-        
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-        
-        // free finished semaphore
-        ASSERT_FORCE(sem_destroy(&o->finished_sem) == 0)
     } else {
     #endif
         BPending_Free(&o->job);
@@ -37,7 +37,6 @@
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
     #include <pthread.h>
-    #include <semaphore.h>
 #endif
 
 #include <misc/debug.h>
@@ -46,11 +45,14 @@
 #include <system/BReactor.h>
 
 #define BTHREADWORK_STATE_PENDING 1
-#define BTHREADWORK_STATE_RUNNING 2
-#define BTHREADWORK_STATE_FINISHED 3
-#define BTHREADWORK_STATE_FORGOTTEN 4
+#define BTHREADWORK_STATE_FINISHED 2
+#define BTHREADWORK_STATE_FORGOTTEN 3
 
-#define BTHREADWORK_MAX_THREADS 8
+// number of works which can be queued to a single thread
+#define BTHREADWORK_QUEUE_SIZE 256
+
+// flags for BThreadWorkDispatcher_Init2
+#define BTHREADWORK_INIT_CPU_AFFINITY (1 << 0)
 
 struct BThreadWork_s;
 struct BThreadWorkDispatcher_s;
@@ -73,8 +75,12 @@ typedef void (*BThreadWork_handler_done) (void *user);
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 struct BThreadWorkDispatcher_thread {
     struct BThreadWorkDispatcher_s *d;
-    struct BThreadWork_s *running_work;
-    pthread_cond_t new_cond;
+    struct BThreadWork_s *queue[BTHREADWORK_QUEUE_SIZE];
+    unsigned int queue_head;
+    unsigned int queue_tail;
+    int sleeping;
+    pthread_mutex_t sleep_mutex;
+    pthread_cond_t sleep_cond;
     pthread_t thread;
 };
 #endif
@@ -82,15 +88,19 @@ struct BThreadWorkDispatcher_thread {
 typedef struct BThreadWorkDispatcher_s {
     BReactor *reactor;
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    LinkedList1 pending_list;
+    struct BThreadWork_s *finished_stack;
     LinkedList1 finished_list;
-    pthread_mutex_t mutex;
-    int pipe[2];
+    int num_waiters;
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+    int notify_fd[2];
     BFileDescriptor bfd;
     BPending more_job;
     int cancel;
+    int next_thread;
+    int num_queues;
     int num_threads;
-    struct BThreadWorkDispatcher_thread threads[BTHREADWORK_MAX_THREADS];
+    struct BThreadWorkDispatcher_thread *threads;
     #endif
     DebugObject d_obj;
     DebugCounter d_ctr;
@@ -105,9 +115,10 @@ typedef struct BThreadWork_s {
     union {
         #ifdef BADVPN_THREADWORK_USE_PTHREAD
         struct {
+            struct BThreadWork_s **queue_slot;
+            struct BThreadWork_s *stack_next;
             LinkedList1Node list_node;
             int state;
-            sem_t finished_sem;
         };
         #endif
         struct {
@@ -131,6 +142,24 @@ typedef struct BThreadWork_s {
  */
 int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint) WARN_UNUSED;
 
+/**
+ * Initializes the work dispatcher, with flags.
+ * 
+ * Each thread has its own queue of works. Works are queued round-robin, preferring
+ * idle threads, and idle threads take works from other threads' queues. Finished
+ * works are reported to the event loop in batches.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param num_threads_hint as in {@link BThreadWorkDispatcher_Init}. With <0, one thread
+ *                         per online CPU is used.
+ * @param flags zero or more of:
+ *              BTHREADWORK_INIT_CPU_AFFINITY - pin thread i to CPU (i mod number of CPUs).
+ *                Only supported on Linux; ignored elsewhere.
+ * @return 1 on success, 0 on failure
+ */
+int BThreadWorkDispatcher_Init2 (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint, int flags) WARN_UNUSED;
+
 /**
  * Frees the work dispatcher.
  * There must be no {@link BThreadWork}'s with this dispatcher.
@@ -53,7 +53,6 @@
 #include <system/BSignal.h>
 #include <system/BAddr.h>
 #include <system/BNetwork.h>
-#include <flow/SinglePacketBuffer.h>
 #include <socksclient/BSocksClient.h>
 #include <tuntap/BTap.h>
 #include <lwip/init.h>
@@ -71,6 +70,12 @@
 #include <base/BLog_syslog.h>
 #endif
 
+#ifdef BADVPN_LINUX
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#endif
+
 #include <tun2socks/tun2socks.h>
 
 #include <generated/blog_channel_tun2socks.h>
@@ -104,6 +109,8 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *tundev;
+    int workers;
+    int tun_offload;
     char *netif_ipaddr;
     char *netif_netmask;
     char *netif_ip6addr;
@@ -117,6 +124,10 @@ struct {
     int udpgw_connection_buffer_size;
     int udpgw_transparent_dns;
     int socks5_udp;
+    int tcp_mss;
+    int tcp_wnd;
+    int tcp_snd_buf;
+    int tcp_max_connections;
 } options;
 
 // TCP client
@@ -128,7 +139,8 @@ struct tcp_client {
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
-    uint8_t buf[TCP_WND];
+    int client_closing;
+    uint8_t *buf;
     int buf_used;
     char *socks_username;
     BSocksClient socks_client;
@@ -136,11 +148,11 @@ struct tcp_client {
     int socks_closed;
     StreamPassInterface *socks_send_if;
     StreamRecvInterface *socks_recv_if;
-    uint8_t socks_recv_buf[CLIENT_SOCKS_RECV_BUF_SIZE];
-    int socks_recv_buf_used;
-    int socks_recv_buf_sent;
-    int socks_recv_waiting;
+    uint8_t *socks_recv_buf;
+    int socks_recv_buf_start;
     int socks_recv_tcp_pending;
+    int socks_recv_buf_unsent;
+    int socks_recv_active;
 };
 
 // IP address of netif
@@ -165,6 +177,9 @@ size_t socks_num_auth_info;
 // remote udpgw server addr, if provided
 BAddr udpgw_remote_server_addr;
 
+// index of this worker process, 0 for the main process
+int worker_index;
+
 // reactor
 BReactor ss;
 
@@ -177,9 +192,11 @@ BTap device;
 // device write buffer
 uint8_t *device_write_buf;
 
-// device reading
-SinglePacketBuffer device_read_buffer;
-PacketPassInterface device_read_interface;
+// device reading; packets are read directly into lwIP pbufs,
+// or into the fallback buffer if a pbuf cannot be allocated
+PacketRecvInterface *device_read_if;
+struct pbuf *device_read_pbuf;
+uint8_t *device_read_fallback_buf;
 
 // UDP support mode
 enum UdpMode {UdpModeNone, UdpModeUdpgw, UdpModeSocks};
@@ -215,17 +232,22 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+// size of the SOCKS receive ring buffer of clients
+int client_socks_recv_buf_size;
+
 static void terminate (void);
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
+static int spawn_workers (void);
 static void signal_handler (void *unused);
 static BAddr baddr_from_lwip (const ip_addr_t *ip_addr, uint16_t port_hostorder);
 static void lwip_init_job_hadler (void *unused);
 static void tcp_timer_handler (void *unused);
 static void device_error_handler (void *unused);
-static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
+static void device_read_start (void);
+static void device_read_handler_done (void *unused, int data_len);
 static int process_device_udp_packet (uint8_t *data, int data_len);
 static err_t netif_init_func (struct netif *netif);
 static err_t netif_output_func (struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr);
@@ -248,6 +270,7 @@ static void client_socks_handler (struct tcp_client *client, int event);
 static void client_send_to_socks (struct tcp_client *client);
 static void client_socks_send_handler_done (struct tcp_client *client, int data_len);
 static void client_socks_recv_initiate (struct tcp_client *client);
+static int client_socks_recv_buf_free (struct tcp_client *client);
 static void client_socks_recv_handler_done (struct tcp_client *client, int data_len);
 static int client_socks_recv_send_out (struct tcp_client *client);
 static err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len);
@@ -280,6 +303,12 @@ int main (int argc, char **argv)
         return 0;
     }
     
+    // fork additional worker processes, each serving one device queue
+    if (!spawn_workers()) {
+        fprintf(stderr, "Failed to start worker processes\n");
+        goto fail0;
+    }
+    
     // initialize logger
     switch (options.logger) {
         case LOGGER_STDOUT:
@@ -309,6 +338,10 @@ int main (int argc, char **argv)
     
     BLog(BLOG_NOTICE, "initializing "GLOBAL_PRODUCT_NAME" "PROGRAM_NAME" "GLOBAL_VERSION);
     
+    if (options.workers > 1) {
+        BLog(BLOG_NOTICE, "worker %d of %d", worker_index + 1, options.workers);
+    }
+    
     // clear password contents pointer
     password_file_contents = NULL;
     
@@ -343,8 +376,19 @@ int main (int argc, char **argv)
     }
     
     // init TUN device
-    if (!BTap_Init(&device, &ss, options.tundev, device_error_handler, NULL, 1)) {
-        BLog(BLOG_ERROR, "BTap_Init failed");
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_STRING;
+    init_data.flags = 0;
+    if (options.workers > 1) {
+        init_data.flags |= BTAP_FLAG_MULTI_QUEUE;
+    }
+    if (options.tun_offload) {
+        init_data.flags |= BTAP_FLAG_OFFLOAD;
+    }
+    init_data.init.string = options.tundev;
+    if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
+        BLog(BLOG_ERROR, "BTap_Init2 failed");
         goto fail3;
     }
     
@@ -354,11 +398,18 @@ int main (int argc, char **argv)
     // then device reading (so it can pass received packets to lwip).
     
     // init device reading
-    PacketPassInterface_Init(&device_read_interface, BTap_GetMTU(&device), device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
-    if (!SinglePacketBuffer_Init(&device_read_buffer, BTap_GetOutput(&device), &device_read_interface, BReactor_PendingGroup(&ss))) {
-        BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
+    device_read_if = BTap_GetOutput(&device);
+    if (PacketRecvInterface_GetMTU(device_read_if) > UINT16_MAX) {
+        BLog(BLOG_ERROR, "device MTU is too large");
+        goto fail4;
+    }
+    if (!(device_read_fallback_buf = (uint8_t *)BAlloc(PacketRecvInterface_GetMTU(device_read_if)))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
         goto fail4;
     }
+    PacketRecvInterface_Receiver_Init(device_read_if, device_read_handler_done, NULL);
+    device_read_pbuf = NULL;
+    device_read_start();
     
     // Compute the largest possible UDP payload that we can receive from or send to the
     // TUN device.
@@ -466,9 +517,11 @@ fail5:
         SocksUdpClient_Free(&socks_udp_client);
     }
 fail4a:
-    SinglePacketBuffer_Free(&device_read_buffer);
+    if (device_read_pbuf) {
+        pbuf_free(device_read_pbuf);
+    }
+    BFree(device_read_fallback_buf);
 fail4:
-    PacketPassInterface_Free(&device_read_interface);
     BTap_Free(&device);
 fail3:
     BSignal_Finish();
@@ -514,6 +567,10 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--tundev <name>]\n"
+        #ifdef BADVPN_LINUX
+        "        [--workers <number>]\n"
+        "        [--tun-offload]\n"
+        #endif
         "        --netif-ipaddr <ipaddr>\n"
         "        --netif-netmask <ipnetmask>\n"
         "        --socks-server-addr <addr>\n"
@@ -527,6 +584,10 @@ void print_help (const char *name)
         "        [--udpgw-connection-buffer-size <number>]\n"
         "        [--udpgw-transparent-dns]\n"
         "        [--socks5-udp]\n"
+        "        [--tcp-mss <bytes>]\n"
+        "        [--tcp-wnd <bytes>]\n"
+        "        [--tcp-snd-buf <bytes>]\n"
+        "        [--tcp-max-connections <number>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -555,6 +616,8 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.tundev = NULL;
+    options.workers = 1;
+    options.tun_offload = 0;
     options.netif_ipaddr = NULL;
     options.netif_netmask = NULL;
     options.netif_ip6addr = NULL;
@@ -568,6 +631,10 @@ int parse_arguments (int argc, char *argv[])
     options.udpgw_connection_buffer_size = DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE;
     options.udpgw_transparent_dns = 0;
     options.socks5_udp = 0;
+    options.tcp_mss = 0;
+    options.tcp_wnd = 0;
+    options.tcp_snd_buf = 0;
+    options.tcp_max_connections = 0;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -653,6 +720,22 @@ int parse_arguments (int argc, char *argv[])
             options.tundev = argv[i + 1];
             i++;
         }
+        #ifdef BADVPN_LINUX
+        else if (!strcmp(arg, "--workers")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.workers = atoi(argv[i + 1])) <= 0 || options.workers > MAX_WORKERS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tun-offload")) {
+            options.tun_offload = 1;
+        }
+        #endif
         else if (!strcmp(arg, "--netif-ipaddr")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -731,6 +814,50 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--tcp-mss")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_mss = atoi(argv[i + 1])) < TCP_MSS_MIN || options.tcp_mss > TCP_MSS_LIMIT) {
+                fprintf(stderr, "%s: wrong argument (must be between %d and %d)\n", arg, (int)TCP_MSS_MIN, (int)TCP_MSS_LIMIT);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-wnd")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_wnd = atoi(argv[i + 1])) < TCP_MSS_MIN || options.tcp_wnd > TCP_WND_LIMIT) {
+                fprintf(stderr, "%s: wrong argument (must be between %d and %d)\n", arg, (int)TCP_MSS_MIN, (int)TCP_WND_LIMIT);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-snd-buf")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_snd_buf = atoi(argv[i + 1])) < 2 * TCP_MSS_MIN || options.tcp_snd_buf > TCP_SND_BUF_LIMIT) {
+                fprintf(stderr, "%s: wrong argument (must be between %d and %d)\n", arg, (int)(2 * TCP_MSS_MIN), (int)TCP_SND_BUF_LIMIT);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-max-connections")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_max_connections = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else if (!strcmp(arg, "--udpgw-connection-buffer-size")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -773,6 +900,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (options.workers > 1 && !options.tundev) {
+        fprintf(stderr, "--workers requires --tundev\n");
+        return 0;
+    }
+    
     if (options.username) {
         if (!options.password && !options.password_file) {
             fprintf(stderr, "username given but password not given\n");
@@ -859,7 +991,68 @@ int process_arguments (void)
         }
     }
     
+    // set TCP parameters, zero meaning the default; lwIP reads these when
+    // creating connections
+    lwip_custom_tcp_mss = options.tcp_mss;
+    lwip_custom_tcp_wnd = options.tcp_wnd;
+    lwip_custom_tcp_snd_buf = options.tcp_snd_buf;
+    client_socks_recv_buf_size = TCP_SND_BUF + CLIENT_SOCKS_RECV_BUF_EXTRA;
+    
+    // lwIP's own sanity checks only see the defaults, so check the actual values
+    if (TCP_WND < TCP_MSS || (TCP_WND >> TCP_RCV_SCALE) == 0 || TCP_WND > TCP_WND_LIMIT) {
+        BLog(BLOG_ERROR, "TCP window does not work with MSS %d and window scale %d", (int)TCP_MSS, (int)TCP_RCV_SCALE);
+        return 0;
+    }
+    if (TCP_SND_BUF < 2 * TCP_MSS || TCP_SND_QUEUELEN < 2 * (TCP_SND_BUF / TCP_MSS) || TCP_SNDLOWAT >= TCP_SND_BUF) {
+        BLog(BLOG_ERROR, "TCP send buffer does not work with MSS %d and send queue length %d", (int)TCP_MSS, (int)TCP_SND_QUEUELEN);
+        return 0;
+    }
+    
+    return 1;
+}
+
+int spawn_workers (void)
+{
+    worker_index = 0;
+    
+    if (options.workers == 1) {
+        return 1;
+    }
+    
+#ifdef BADVPN_LINUX
+    // Each worker is a complete tun2socks instance (reactor, lwIP, SOCKS and
+    // udpgw clients) attached to its own queue of the multi-queue TUN device.
+    // The kernel keeps each flow on one queue, so workers share no state.
+    
+    // don't leave zombies behind if a worker exits
+    signal(SIGCHLD, SIG_IGN);
+    
+    pid_t parent_pid = getpid();
+    
+    for (int i = 1; i < options.workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork failed\n");
+            return 0;
+        }
+        
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            
+            // terminate when the main process goes away
+            if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent_pid) {
+                _exit(1);
+            }
+            
+            worker_index = i;
+            return 1;
+        }
+    }
+    
     return 1;
+#else
+    return 0;
+#endif
 }
 
 void signal_handler (void *unused)
@@ -1038,40 +1231,65 @@ void device_error_handler (void *unused)
     return;
 }
 
-void device_read_handler_send (void *unused, uint8_t *data, int data_len)
+void device_read_start (void)
+{
+    // Receive into a fresh single-chunk pbuf which can be passed to lwIP
+    // as-is, so that packets don't have to be copied.
+    if (!device_read_pbuf) {
+        device_read_pbuf = pbuf_alloc(PBUF_RAW, PacketRecvInterface_GetMTU(device_read_if), PBUF_RAM);
+    }
+    
+    uint8_t *buf = device_read_pbuf ? (uint8_t *)device_read_pbuf->payload : device_read_fallback_buf;
+    
+    PacketRecvInterface_Receiver_Recv(device_read_if, buf);
+}
+
+void device_read_handler_done (void *unused, int data_len)
 {
     ASSERT(!quitting)
     ASSERT(data_len >= 0)
     
     BLog(BLOG_DEBUG, "device: received packet");
     
-    // accept packet
-    PacketPassInterface_Done(&device_read_interface);
+    struct pbuf *p = device_read_pbuf;
+    uint8_t *data = p ? (uint8_t *)p->payload : device_read_fallback_buf;
     
-    // process UDP directly
+    // process UDP directly; the buffer is reused for the next packet
     if (process_device_udp_packet(data, data_len)) {
-        return;
+        goto out;
     }
     
-    // obtain pbuf
-    if (data_len > UINT16_MAX) {
-        BLog(BLOG_WARNING, "device read: packet too large");
-        return;
-    }
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
     if (!p) {
         BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
-        return;
+        goto out;
     }
     
-    // write packet to pbuf
-    ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
+    // With offload, the read buffer is large enough for segmentation offload
+    // packets, and pbuf_realloc doesn't free any memory. Copy packets of
+    // regular size, so that lwIP doesn't hold on to mostly unused buffers.
+    if (data_len <= BTap_GetMTU(&device) && p->len > BTap_GetMTU(&device)) {
+        struct pbuf *cp = pbuf_alloc(PBUF_RAW, data_len, PBUF_RAM);
+        if (!cp) {
+            BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
+            goto out;
+        }
+        memcpy(cp->payload, data, data_len);
+        p = cp;
+    } else {
+        // hand the pbuf over to lwIP
+        device_read_pbuf = NULL;
+        pbuf_realloc(p, data_len);
+    }
     
     // pass pbuf to input
     if (the_netif.input(p, &the_netif) != ERR_OK) {
         BLog(BLOG_WARNING, "device read: input failed");
         pbuf_free(p);
     }
+    
+out:
+    // receive next packet
+    device_read_start();
 }
 
 int process_device_udp_packet (uint8_t *data, int data_len)
@@ -1230,7 +1448,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
         return ERR_OK;
     }
     
-    // if there is just one chunk, send it directly, else via buffer
+    // if there is just one chunk, send it directly
     if (!p->next) {
         if (p->len > BTap_GetMTU(&device)) {
             BLog(BLOG_WARNING, "netif func output: no space left");
@@ -1240,7 +1458,28 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
         SYNC_FROMHERE
         BTap_Send(&device, (uint8_t *)p->payload, p->len);
         SYNC_COMMIT
-    } else {
+    }
+    // if there are few chunks, let the device gather them
+    else if (pbuf_clen(p) <= BTAP_MAX_SEND_CHUNKS) {
+        if (p->tot_len > BTap_GetMTU(&device)) {
+            BLog(BLOG_WARNING, "netif func output: no space left");
+            goto out;
+        }
+        
+        struct BTap_send_chunk chunks[BTAP_MAX_SEND_CHUNKS];
+        int num_chunks = 0;
+        do {
+            chunks[num_chunks].data = (uint8_t *)p->payload;
+            chunks[num_chunks].len = p->len;
+            num_chunks++;
+        } while (p = p->next);
+        
+        SYNC_FROMHERE
+        BTap_SendChunks(&device, chunks, num_chunks);
+        SYNC_COMMIT
+    }
+    // else send via buffer
+    else {
         int len = 0;
         do {
             if (p->len > BTap_GetMTU(&device) - len) {
@@ -1304,12 +1543,22 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
 {
     ASSERT(err == ERR_OK)
     
-    // allocate client structure
-    struct tcp_client *client = (struct tcp_client *)malloc(sizeof(*client));
+    // check connection limit
+    if (options.tcp_max_connections > 0 && num_clients >= options.tcp_max_connections) {
+        BLog(BLOG_WARNING, "listener accept: too many connections");
+        goto fail0;
+    }
+    
+    // allocate client structure, together with the receive buffer (sized to the
+    // TCP window) and the SOCKS receive buffer
+    size_t alloc_size = sizeof(struct tcp_client) + TCP_WND + client_socks_recv_buf_size;
+    struct tcp_client *client = (struct tcp_client *)malloc(alloc_size);
     if (!client) {
         BLog(BLOG_ERROR, "listener accept: malloc failed");
         goto fail0;
     }
+    client->buf = (uint8_t *)(client + 1);
+    client->socks_recv_buf = client->buf + TCP_WND;
     client->socks_username = NULL;
     
     SYNC_DECL
@@ -1362,6 +1611,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     
     // set client not closed
     client->client_closed = 0;
+    client->client_closing = 0;
     
     // setup handler argument
     tcp_arg(client->pcb, client);
@@ -1484,7 +1734,7 @@ void client_free_socks (struct tcp_client *client)
     client->socks_closed = 1;
     
     // if we have data to be sent to the client and we can send it, keep sending
-    if (client->socks_up && (client->socks_recv_buf_used >= 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
+    if (client->socks_up && (client->socks_recv_buf_unsent > 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
         client_log(client, BLOG_INFO, "waiting until buffered data is sent to client");
     } else {
         if (!client->client_closed) {
@@ -1568,12 +1818,25 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
     
     if (!p) {
         client_log(client, BLOG_INFO, "client closed");
-        client_free_client(client);
+        
+        if (client->socks_up && client->socks_recv_tcp_pending > 0) {
+            // Data queued to TCP points into socks_recv_buf and lwIP may need it
+            // for retransmission, so the pcb can't be closed (and the client freed)
+            // before it is confirmed. Continue in client_sent_func.
+            client_log(client, BLOG_INFO, "waiting until data sent to client is confirmed");
+            
+            client->client_closing = 1;
+            
+            // drop data not yet queued to TCP
+            client->socks_recv_buf_unsent = 0;
+        } else {
+            client_free_client(client);
+        }
     } else {
         ASSERT(p->tot_len > 0)
         
         // check if we have enough buffer
-        if (p->tot_len > sizeof(client->buf) - client->buf_used) {
+        if (p->tot_len > TCP_WND - client->buf_used) {
             client_log(client, BLOG_ERROR, "no buffer for data !?!");
             DEAD_LEAVE2(client->dead_aborted)
             return ERR_MEM;
@@ -1627,8 +1890,10 @@ void client_socks_handler (struct tcp_client *client, int event)
             // init receiving
             client->socks_recv_if = BSocksClient_GetRecvInterface(&client->socks_client);
             StreamRecvInterface_Receiver_Init(client->socks_recv_if, (StreamRecvInterface_handler_done)client_socks_recv_handler_done, client);
-            client->socks_recv_buf_used = -1;
+            client->socks_recv_buf_start = 0;
             client->socks_recv_tcp_pending = 0;
+            client->socks_recv_buf_unsent = 0;
+            client->socks_recv_active = 0;
             if (!client->client_closed) {
                 tcp_sent(client->pcb, client_sent_func);
             }
@@ -1680,8 +1945,12 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     client->buf_used -= data_len;
     
     if (!client->client_closed) {
-        // confirm sent data
-        tcp_recved(client->pcb, data_len);
+        // confirm sent data (tcp_recved takes at most 0xFFFF bytes at a time)
+        for (int left = data_len; left > 0;) {
+            int confirm = bmin_int(left, UINT16_MAX);
+            tcp_recved(client->pcb, confirm);
+            left -= confirm;
+        }
     }
     
     if (client->buf_used > 0) {
@@ -1699,38 +1968,54 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
 void client_socks_recv_initiate (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
+    ASSERT(!client->client_closing)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(!client->socks_recv_active)
+    ASSERT(client_socks_recv_buf_free(client) > 0)
     
-    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, sizeof(client->socks_recv_buf));
+    // receive into the free space following the buffered data,
+    // up to the end of the ring buffer
+    int pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending + client->socks_recv_buf_unsent) % client_socks_recv_buf_size;
+    int len = bmin_int(client_socks_recv_buf_free(client), client_socks_recv_buf_size - pos);
+    
+    client->socks_recv_active = 1;
+    
+    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf + pos, len);
+}
+
+int client_socks_recv_buf_free (struct tcp_client *client)
+{
+    return client_socks_recv_buf_size - client->socks_recv_tcp_pending - client->socks_recv_buf_unsent;
 }
 
 void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= sizeof(client->socks_recv_buf))
+    ASSERT(data_len <= client_socks_recv_buf_free(client))
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(client->socks_recv_active)
+    
+    // set not receiving
+    client->socks_recv_active = 0;
     
     // if client was closed, stop receiving
-    if (client->client_closed) {
+    if (client->client_closed || client->client_closing) {
         return;
     }
     
-    // set amount of data in buffer
-    client->socks_recv_buf_used = data_len;
-    client->socks_recv_buf_sent = 0;
-    client->socks_recv_waiting = 0;
+    // add data to buffer
+    client->socks_recv_buf_unsent += data_len;
     
     // send to client
     if (client_socks_recv_send_out(client) < 0) {
         return;
     }
     
-    // continue receiving if needed
-    if (client->socks_recv_buf_used == -1) {
+    // continue receiving if there is space; the data queued to TCP
+    // doesn't need to be confirmed first
+    if (client_socks_recv_buf_free(client) > 0) {
         client_socks_recv_initiate(client);
     }
 }
@@ -1738,21 +2023,24 @@ void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 int client_socks_recv_send_out (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
+    ASSERT(!client->client_closing)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used > 0)
-    ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-    ASSERT(!client->socks_recv_waiting)
+    ASSERT(client->socks_recv_buf_unsent > 0)
     
     // return value -1 means tcp_abort() was done,
     // 0 means it wasn't and the client (pcb) is still up
     
     do {
-        int to_write = bmin_int(client->socks_recv_buf_used - client->socks_recv_buf_sent, tcp_sndbuf(client->pcb));
+        int pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending) % client_socks_recv_buf_size;
+        int to_write = bmin_int(client->socks_recv_buf_unsent, client_socks_recv_buf_size - pos);
+        to_write = bmin_int(to_write, tcp_sndbuf(client->pcb));
         if (to_write == 0) {
             break;
         }
         
-        err_t err = tcp_write(client->pcb, client->socks_recv_buf + client->socks_recv_buf_sent, to_write, TCP_WRITE_FLAG_COPY);
+        // Queue without copying. The data stays in place until client_sent_func
+        // reports it confirmed, and that part of the buffer is not reused before.
+        err_t err = tcp_write(client->pcb, client->socks_recv_buf + pos, to_write, 0);
         if (err != ERR_OK) {
             if (err == ERR_MEM) {
                 break;
@@ -1764,9 +2052,9 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
-        client->socks_recv_buf_sent += to_write;
         client->socks_recv_tcp_pending += to_write;
-    } while (client->socks_recv_buf_sent < client->socks_recv_buf_used);
+        client->socks_recv_buf_unsent -= to_write;
+    } while (client->socks_recv_buf_unsent > 0);
     
     // start sending now
     err_t err = tcp_output(client->pcb);
@@ -1777,23 +2065,14 @@ int client_socks_recv_send_out (struct tcp_client *client)
         return -1;
     }
     
-    // more data to queue?
-    if (client->socks_recv_buf_sent < client->socks_recv_buf_used) {
-        if (client->socks_recv_tcp_pending == 0) {
-            client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
-            
-            client_abort_client(client);
-            return -1;
-        }
+    // any remaining data is queued from client_sent_func
+    if (client->socks_recv_buf_unsent > 0 && client->socks_recv_tcp_pending == 0) {
+        client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
         
-        // set waiting, continue in client_sent_func
-        client->socks_recv_waiting = 1;
-        return 0;
+        client_abort_client(client);
+        return -1;
     }
     
-    // everything was queued
-    client->socks_recv_buf_used = -1;
-    
     return 0;
 }
 
@@ -1808,17 +2087,21 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
     
     DEAD_ENTER(client->dead_aborted)
     
-    // decrement pending
+    // release confirmed data from the buffer
     client->socks_recv_tcp_pending -= len;
+    client->socks_recv_buf_start = (client->socks_recv_buf_start + len) % client_socks_recv_buf_size;
+    
+    // if the client has closed, close the pcb once lwIP no longer needs the buffer
+    if (client->client_closing) {
+        if (client->socks_recv_tcp_pending == 0) {
+            client_log(client, BLOG_INFO, "data sent to client confirmed, closing");
+            client_free_client(client);
+        }
+        goto out;
+    }
     
     // continue queuing
-    if (client->socks_recv_buf_used > 0) {
-        ASSERT(client->socks_recv_waiting)
-        ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
-        
-        // set not waiting
-        client->socks_recv_waiting = 0;
-        
+    if (client->socks_recv_buf_unsent > 0) {
         // possibly send more data
         if (client_socks_recv_send_out(client) < 0) {
             goto out;
@@ -1826,17 +2109,21 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
         
         // we just queued some data, so it can't have been confirmed yet
         ASSERT(client->socks_recv_tcp_pending > 0)
-        
+    }
+    
+    if (!client->socks_closed) {
         // continue receiving if needed
-        if (client->socks_recv_buf_used == -1 && !client->socks_closed) {
+        if (!client->socks_recv_active && client_socks_recv_buf_free(client) > 0) {
             SYNC_DECL
             SYNC_FROMHERE
             client_socks_recv_initiate(client);
             SYNC_COMMIT
         }
-    } else {    
+    } else {
         // have we sent everything after SOCKS was closed?
-        if (client->socks_closed && client->socks_recv_tcp_pending == 0) {
+        if (client->socks_recv_tcp_pending == 0) {
+            ASSERT(client->socks_recv_buf_unsent == 0)
+            
             client_log(client, BLOG_INFO, "removing after SOCKS went down");
             client_free_client(client);
         }
@@ -1858,7 +2145,7 @@ void udp_send_packet_to_device (void *unused, BAddr local_addr, BAddr remote_add
 
     char const *source_name = (udp_mode == UdpModeUdpgw) ? "udpgw" : "SOCKS UDP";
     
-    int packet_length = 0;
+    int headers_length = 0;
     
     switch (local_addr.type) {
         case BADDR_TYPE_IPV4: {
@@ -1893,11 +2180,10 @@ void udp_send_packet_to_device (void *unused, BAddr local_addr, BAddr remote_add
             udph.checksum = hton16(0);
             udph.checksum = udp_checksum(&udph, data, data_len, iph.source_address, iph.destination_address);
             
-            // write packet
+            // write headers, data is sent from where it is
             memcpy(device_write_buf, &iph, sizeof(iph));
             memcpy(device_write_buf + sizeof(iph), &udph, sizeof(udph));
-            memcpy(device_write_buf + sizeof(iph) + sizeof(udph), data, data_len);
-            packet_length = sizeof(iph) + sizeof(udph) + data_len;
+            headers_length = sizeof(iph) + sizeof(udph);
         } break;
         
         case BADDR_TYPE_IPV6: {
@@ -1934,14 +2220,18 @@ void udp_send_packet_to_device (void *unused, BAddr local_addr, BAddr remote_add
             udph.checksum = hton16(0);
             udph.checksum = udp_ip6_checksum(&udph, data, data_len, iph.source_address, iph.destination_address);
             
-            // write packet
+            // write headers, data is sent from where it is
             memcpy(device_write_buf, &iph, sizeof(iph));
             memcpy(device_write_buf + sizeof(iph), &udph, sizeof(udph));
-            memcpy(device_write_buf + sizeof(iph) + sizeof(udph), data, data_len);
-            packet_length = sizeof(iph) + sizeof(udph) + data_len;
+            headers_length = sizeof(iph) + sizeof(udph);
         } break;
     }
     
     // submit packet
-    BTap_Send(&device, device_write_buf, packet_length);
+    struct BTap_send_chunk chunks[2];
+    chunks[0].data = device_write_buf;
+    chunks[0].len = headers_length;
+    chunks[1].data = data;
+    chunks[1].len = data_len;
+    BTap_SendChunks(&device, chunks, 2);
 }
@@ -27,8 +27,13 @@
 // name of the program
 #define PROGRAM_NAME "tun2socks"
 
-// size of temporary buffer for passing data from the SOCKS server to TCP for sending
-#define CLIENT_SOCKS_RECV_BUF_SIZE 8192
+// maximum number of worker processes for --workers
+#define MAX_WORKERS 64
+
+// size of the ring buffer for passing data from the SOCKS server to TCP for sending,
+// in addition to the TCP send buffer; data stays here until the client confirms it,
+// so this is what allows reading from SOCKS to continue while data is in flight
+#define CLIENT_SOCKS_RECV_BUF_EXTRA 16384
 
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
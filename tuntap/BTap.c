@@ -45,10 +45,12 @@
     #include <sys/types.h>
     #include <sys/stat.h>
     #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <net/if.h>
     #include <net/if_arp.h>
     #ifdef BADVPN_LINUX
         #include <linux/if_tun.h>
+        #include <linux/virtio_net.h>
     #endif
     #ifdef BADVPN_FREEBSD
         #include <net/if_tun.h>
@@ -56,6 +58,7 @@
     #endif
 #endif
 
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <tuntap/BTap.h>
@@ -91,6 +94,74 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
 
 #else
 
+#ifdef BADVPN_LINUX
+
+static void complete_checksum (uint8_t *data, int len, int start, int offset)
+{
+    // The checksum field holds the pseudo-header sum; the rest of the
+    // checksum covers everything from start to the end of the packet.
+    if (start < 0 || offset < 0 || start > len || offset > len - start - 2) {
+        return;
+    }
+    
+    uint64_t sum = 0;
+    int i = start;
+    for (; i + 4 <= len; i += 4) {
+        sum += ((uint32_t)data[i] << 24) | ((uint32_t)data[i + 1] << 16) | ((uint32_t)data[i + 2] << 8) | data[i + 3];
+    }
+    for (; i + 2 <= len; i += 2) {
+        sum += ((uint32_t)data[i] << 8) | data[i + 1];
+    }
+    if (i < len) {
+        sum += (uint32_t)data[i] << 8;
+    }
+    
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    
+    uint16_t checksum = ~(uint16_t)sum;
+    data[start + offset] = checksum >> 8;
+    data[start + offset + 1] = checksum & 0xFF;
+}
+
+#endif
+
+static int read_packet (BTap *o, uint8_t *data)
+{
+#ifdef BADVPN_LINUX
+    if (o->offload) {
+        struct virtio_net_hdr vhdr;
+        struct iovec iov[2];
+        iov[0].iov_base = &vhdr;
+        iov[0].iov_len = sizeof(vhdr);
+        iov[1].iov_base = data;
+        iov[1].iov_len = o->recv_mtu;
+        
+        int bytes = readv(o->fd, iov, 2);
+        if (bytes <= 0) {
+            return bytes;
+        }
+        if (bytes < sizeof(vhdr)) {
+            BLog(BLOG_ERROR, "read packet without virtio header");
+            errno = EINVAL;
+            return -1;
+        }
+        bytes -= sizeof(vhdr);
+        
+        // Segmentation needs no work, lwIP and the rest of the stack take
+        // large packets as they are. Partial checksums must be completed.
+        if ((vhdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            complete_checksum(data, bytes, vhdr.csum_start, vhdr.csum_offset);
+        }
+        
+        return bytes;
+    }
+#endif
+    
+    return read(o->fd, data, o->recv_mtu);
+}
+
 static void fd_handler (BTap *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -101,10 +172,17 @@ static void fd_handler (BTap *o, int events)
     }
     
     if (events&BREACTOR_READ) do {
-        ASSERT(o->output_packet)
+        // Read events are left enabled after a packet is received, so that
+        // a steady stream of packets doesn't cost two epoll_ctl calls per
+        // packet. If nobody is waiting for a packet, disable them now.
+        if (!o->output_packet) {
+            o->poll_events &= ~BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+            break;
+        }
         
         // try reading into the buffer
-        int bytes = read(o->fd, o->output_packet, o->frame_mtu);
+        int bytes = read_packet(o, o->output_packet);
         if (bytes <= 0) {
             // Treat zero return value the same as EAGAIN.
             // See: https://bugzilla.kernel.org/show_bug.cgi?id=96381
@@ -117,14 +195,13 @@ static void fd_handler (BTap *o, int events)
             return;
         }
         
-        ASSERT_FORCE(bytes <= o->frame_mtu)
+        ASSERT_FORCE(bytes <= o->recv_mtu)
         
         // set no output packet
         o->output_packet = NULL;
         
-        // update events
-        o->poll_events &= ~BREACTOR_READ;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+        // start a new burst of direct reads
+        o->recv_burst = 1;
         
         // inform receiver we finished the packet
         PacketRecvInterface_Done(&o->output, bytes);
@@ -161,27 +238,37 @@ void output_handler_recv (BTap *o, uint8_t *data)
     
 #else
     
-    // attempt read
-    int bytes = read(o->fd, data, o->frame_mtu);
-    if (bytes <= 0) {
-        if (bytes == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
-            // See note about zero return in fd_handler.
-            // retry later in fd_handler
-            // remember packet
-            o->output_packet = data;
-            // update events
-            o->poll_events |= BREACTOR_READ;
-            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+    // Read directly until the burst limit is reached, then let the event
+    // loop run so that other sources get a chance before we read more.
+    if (o->recv_burst < BTAP_RECV_BURST) {
+        // attempt read
+        int bytes = read_packet(o, data);
+        if (bytes > 0) {
+            ASSERT_FORCE(bytes <= o->recv_mtu)
+            
+            o->recv_burst++;
+            
+            PacketRecvInterface_Done(&o->output, bytes);
+            return;
+        }
+        
+        // See note about zero return in fd_handler.
+        if (!(bytes == 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // report fatal error
+            report_error(o);
             return;
         }
-        // report fatal error
-        report_error(o);
-        return;
     }
     
-    ASSERT_FORCE(bytes <= o->frame_mtu)
+    // retry later in fd_handler
+    // remember packet
+    o->output_packet = data;
     
-    PacketRecvInterface_Done(&o->output, bytes);
+    // update events
+    if (!(o->poll_events & BREACTOR_READ)) {
+        o->poll_events |= BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+    }
     
 #endif
 }
@@ -193,6 +280,7 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
     struct BTap_init_data init_data;
     init_data.dev_type = tun ? BTAP_DEV_TUN : BTAP_DEV_TAP;
     init_data.init_type = BTAP_INIT_STRING;
+    init_data.flags = 0;
     init_data.init.string = devname;
     
     return BTap_Init2(o, reactor, init_data, handler_error, handler_error_user);
@@ -201,6 +289,8 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
 int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTap_handler_error handler_error, void *handler_error_user)
 {
     ASSERT(init_data.dev_type == BTAP_DEV_TUN || init_data.dev_type == BTAP_DEV_TAP)
+    ASSERT(!(init_data.flags & BTAP_FLAG_MULTI_QUEUE) || init_data.init_type == BTAP_INIT_STRING)
+    ASSERT(!(init_data.flags & BTAP_FLAG_OFFLOAD) || init_data.init_type == BTAP_INIT_STRING)
     
     // init arguments
     o->reactor = reactor;
@@ -211,6 +301,16 @@ int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTa
     
     ASSERT(init_data.init_type == BTAP_INIT_STRING)
     
+    if ((init_data.flags & BTAP_FLAG_MULTI_QUEUE)) {
+        BLog(BLOG_ERROR, "multi-queue devices not supported on Windows");
+        goto fail0;
+    }
+    
+    if ((init_data.flags & BTAP_FLAG_OFFLOAD)) {
+        BLog(BLOG_ERROR, "offload not supported on Windows");
+        goto fail0;
+    }
+    
     // parse device specification
     
     if (!init_data.init.string) {
@@ -304,11 +404,20 @@ int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTa
     // init recv olap
     BReactorIOCPOverlapped_Init(&o->recv_olap, o->reactor, o, (BReactorIOCPOverlapped_handler)recv_olap_handler);
     
+    // allocate buffer for assembling chunked packets
+    if (!(o->send_buf = (uint8_t *)BAlloc(o->frame_mtu))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail3;
+    }
+    
     free(device_name);
     free(device_component_id);
     
     goto success;
     
+fail3:
+    BReactorIOCPOverlapped_Free(&o->recv_olap);
+    BReactorIOCPOverlapped_Free(&o->send_olap);
 fail2:
     ASSERT_FORCE(CloseHandle(o->device))
 fail1:
@@ -322,6 +431,7 @@ fail0:
     #if defined(BADVPN_LINUX) || defined(BADVPN_FREEBSD)
     
     o->close_fd = (init_data.init_type != BTAP_INIT_FD);
+    o->offload = 0;
     
     switch (init_data.init_type) {
         case BTAP_INIT_FD: {
@@ -355,6 +465,21 @@ fail0:
             } else {
                 ifr.ifr_flags |= IFF_TAP;
             }
+            if ((init_data.flags & BTAP_FLAG_MULTI_QUEUE)) {
+                #ifdef IFF_MULTI_QUEUE
+                ifr.ifr_flags |= IFF_MULTI_QUEUE;
+                #else
+                BLog(BLOG_ERROR, "multi-queue devices not supported by kernel headers");
+                goto fail1;
+                #endif
+            }
+            if ((init_data.flags & BTAP_FLAG_OFFLOAD)) {
+                if (init_data.dev_type != BTAP_DEV_TUN) {
+                    BLog(BLOG_ERROR, "offload is only supported for TUN devices");
+                    goto fail1;
+                }
+                ifr.ifr_flags |= IFF_VNET_HDR;
+            }
             if (init_data.init.string) {
                 snprintf(ifr.ifr_name, IFNAMSIZ, "%s", init_data.init.string);
             }
@@ -366,6 +491,16 @@ fail0:
             
             strcpy(devname_real, ifr.ifr_name);
             
+            // Let the kernel pass TCP packets unsegmented and without
+            // checksums; the virtio header tells us what needs completing.
+            if ((init_data.flags & BTAP_FLAG_OFFLOAD)) {
+                if (ioctl(o->fd, TUNSETOFFLOAD, (unsigned long)(TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6)) < 0) {
+                    BLog(BLOG_ERROR, "error enabling offload");
+                    goto fail1;
+                }
+                o->offload = 1;
+            }
+            
             #endif
             
             #ifdef BADVPN_FREEBSD
@@ -375,6 +510,16 @@ fail0:
                 goto fail0;
             }
             
+            if ((init_data.flags & BTAP_FLAG_MULTI_QUEUE)) {
+                BLog(BLOG_ERROR, "multi-queue devices not supported on FreeBSD");
+                goto fail0;
+            }
+            
+            if ((init_data.flags & BTAP_FLAG_OFFLOAD)) {
+                BLog(BLOG_ERROR, "offload not supported on FreeBSD");
+                goto fail0;
+            }
+            
             if (!init_data.init.string) {
                 BLog(BLOG_ERROR, "no device specified");
                 goto fail0;
@@ -432,6 +577,11 @@ fail0:
         
         default: ASSERT(0);
     }
+    
+    o->recv_mtu = o->frame_mtu;
+    if (o->offload && o->recv_mtu < BTAP_OFFLOAD_MAX_PACKET) {
+        o->recv_mtu = BTAP_OFFLOAD_MAX_PACKET;
+    }
         
     // set non-blocking
     if (fcntl(o->fd, F_SETFL, O_NONBLOCK) < 0) {
@@ -446,6 +596,7 @@ fail0:
         goto fail1;
     }
     o->poll_events = 0;
+    o->recv_burst = 0;
     
     goto success;
     
@@ -460,7 +611,12 @@ fail0:
     
 success:
     // init output
-    PacketRecvInterface_Init(&o->output, o->frame_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, BReactor_PendingGroup(o->reactor));
+#ifdef BADVPN_USE_WINAPI
+    int output_mtu = o->frame_mtu;
+#else
+    int output_mtu = o->recv_mtu;
+#endif
+    PacketRecvInterface_Init(&o->output, output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, BReactor_PendingGroup(o->reactor));
     
     // set no output packet
     o->output_packet = NULL;
@@ -495,6 +651,9 @@ void BTap_Free (BTap *o)
     // free send olap
     BReactorIOCPOverlapped_Free(&o->send_olap);
     
+    // free send buffer
+    BFree(o->send_buf);
+    
     // close device
     ASSERT_FORCE(CloseHandle(o->device))
     
@@ -559,13 +718,72 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
     
 #else
     
-    int bytes = write(o->fd, data, data_len);
+    struct BTap_send_chunk chunk;
+    chunk.data = data;
+    chunk.len = data_len;
+    
+    BTap_SendChunks(o, &chunk, 1);
+    
+#endif
+}
+
+void BTap_SendChunks (BTap *o, const struct BTap_send_chunk *chunks, int num_chunks)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(num_chunks > 0)
+    ASSERT(num_chunks <= BTAP_MAX_SEND_CHUNKS)
+    
+#ifdef BADVPN_USE_WINAPI
+    
+    // assemble packet
+    int len = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        ASSERT(chunks[i].len >= 0)
+        ASSERT(chunks[i].len <= o->frame_mtu - len)
+        memcpy(o->send_buf + len, chunks[i].data, chunks[i].len);
+        len += chunks[i].len;
+    }
+    
+    BTap_Send(o, o->send_buf, len);
+    
+#else
+    
+    struct iovec iov[1 + BTAP_MAX_SEND_CHUNKS];
+    int num_iov = 0;
+    int hdr_len = 0;
+    
+#ifdef BADVPN_LINUX
+    // with offload, packets are preceded by a virtio header; an empty
+    // one says that the packet is complete as it is
+    struct virtio_net_hdr vhdr;
+    if (o->offload) {
+        memset(&vhdr, 0, sizeof(vhdr));
+        vhdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+        iov[num_iov].iov_base = &vhdr;
+        iov[num_iov].iov_len = sizeof(vhdr);
+        num_iov++;
+        hdr_len = sizeof(vhdr);
+    }
+#endif
+    
+    int len = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        ASSERT(chunks[i].len >= 0)
+        ASSERT(chunks[i].len <= o->frame_mtu - len)
+        iov[num_iov].iov_base = (void *)chunks[i].data;
+        iov[num_iov].iov_len = chunks[i].len;
+        num_iov++;
+        len += chunks[i].len;
+    }
+    
+    int bytes = writev(o->fd, iov, num_iov);
     if (bytes < 0) {
         // malformed packets will cause errors, ignore them and act like
         // the packet was accepeted
     } else {
-        if (bytes != data_len) {
-            BLog(BLOG_WARNING, "written %d expected %d", bytes, data_len);
+        if (bytes != hdr_len + len) {
+            BLog(BLOG_WARNING, "written %d expected %d", bytes - hdr_len, len);
         }
     }
     
@@ -53,6 +53,26 @@
 
 #define BTAP_ETHERNET_HEADER_LENGTH 14
 
+// maximum number of frames read from the device per wakeup before
+// returning to the event loop
+#define BTAP_RECV_BURST 32
+
+// maximum number of chunks for {@link BTap_SendChunks}
+#define BTAP_MAX_SEND_CHUNKS 8
+
+// largest packet which may be received with BTAP_FLAG_OFFLOAD; Linux keeps
+// segmentation offload packets below 64 KiB with room to spare for headers,
+// and this is a multiple of 4 so that aligned buffers fit in 16-bit lengths
+#define BTAP_OFFLOAD_MAX_PACKET 65532
+
+/**
+ * Part of a frame passed to {@link BTap_SendChunks}.
+ */
+struct BTap_send_chunk {
+    const uint8_t *data;
+    int len;
+};
+
 /**
  * Handler called when an error occurs on the device.
  * The object must be destroyed from the job context of this
@@ -74,11 +94,15 @@ typedef struct {
     HANDLE device;
     BReactorIOCPOverlapped send_olap;
     BReactorIOCPOverlapped recv_olap;
+    uint8_t *send_buf;
 #else
     int close_fd;
     int fd;
     BFileDescriptor bfd;
     int poll_events;
+    int recv_burst;
+    int offload;
+    int recv_mtu;
 #endif
     
     DebugError d_err;
@@ -109,6 +133,23 @@ int BTap_Init (BTap *o, BReactor *bsys, char *devname, BTap_handler_error handle
 
 enum BTap_dev_type {BTAP_DEV_TUN, BTAP_DEV_TAP};
 
+/**
+ * Open one queue of a multi-queue device (Linux only, BTAP_INIT_STRING only).
+ * Several {@link BTap} objects (possibly in different processes) which open
+ * the same named device with this flag each receive a subset of the traffic,
+ * as distributed by the kernel's flow hashing.
+ */
+#define BTAP_FLAG_MULTI_QUEUE (1 << 0)
+
+/**
+ * Enable TCP segmentation offload (Linux only, TUN only, BTAP_INIT_STRING only).
+ * The kernel may then pass TCP packets larger than the MTU, up to
+ * BTAP_OFFLOAD_MAX_PACKET bytes, and leave checksums for the device to
+ * compute; BTap completes them, so received packets are always regular
+ * IP packets with valid checksums. Sent packets must still fit the MTU.
+ */
+#define BTAP_FLAG_OFFLOAD (1 << 1)
+
 enum BTap_init_type {
     BTAP_INIT_STRING,
 #ifndef BADVPN_USE_WINAPI
@@ -119,6 +160,7 @@ enum BTap_init_type {
 struct BTap_init_data {
     enum BTap_dev_type dev_type;
     enum BTap_init_type init_type;
+    int flags;
     union {
         char *string;
         struct {
@@ -153,6 +195,7 @@ struct BTap_init_data {
  *                  and init_data.init.fd.mtu must be set to the largest IP packet or
  *                  Ethernet frame supported, for a TUN or TAP device, respectively.
  *                  File descriptor initialization is not supported on Windows.
+ *                  init_data.flags is a bitmask of BTAP_FLAG_* values, or 0.
  * @param handler_error error handler function
  * @param handler_error_user value passed to error handler
  * @return 1 on success, 0 on failure
@@ -184,9 +227,21 @@ int BTap_GetMTU (BTap *o);
  */
 void BTap_Send (BTap *o, uint8_t *data, int data_len);
 
+/**
+ * Like {@link BTap_Send}, but the packet is given as chunks, which are not
+ * first copied into a contiguous buffer where the system allows.
+ * 
+ * @param o the object
+ * @param chunks array of chunks which make up the packet, in order
+ * @param num_chunks number of chunks. Must be >0 and <=BTAP_MAX_SEND_CHUNKS.
+ *                   The total length of the chunks must be <=MTU.
+ */
+void BTap_SendChunks (BTap *o, const struct BTap_send_chunk *chunks, int num_chunks);
+
 /**
  * Returns a {@link PacketRecvInterface} for reading packets from the device.
- * The MTU of the interface will be {@link BTap_GetMTU}.
+ * The MTU of the interface will be {@link BTap_GetMTU}, or BTAP_OFFLOAD_MAX_PACKET
+ * if that is larger and the device was opened with BTAP_FLAG_OFFLOAD.
  * 
  * @param o the object
  * @return output interface
@@ -45,8 +45,11 @@
 #include <misc/compare.h>
 #include <misc/print_macros.h>
 #include <structure/LinkedList1.h>
+#define BAVL_COUNT
 #include <structure/BAVL.h>
+#include <structure/CHash.h>
 #include <base/BLog.h>
+#include <base/BMutex.h>
 #include <system/BReactor.h>
 #include <system/BNetwork.h>
 #include <system/BConnection.h>
@@ -59,7 +62,9 @@
 #include <flow/SinglePacketBuffer.h>
 
 #ifndef BADVPN_USE_WINAPI
+#include <pthread.h>
 #include <base/BLog_syslog.h>
+#include <system/BThreadSignal.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #endif
@@ -73,7 +78,41 @@
 
 #define DNS_UPDATE_TIME 2000
 
+struct worker;
+
+struct listener {
+    struct worker *worker;
+    BListener listener;
+};
+
+// a worker owns its clients and everything belonging to them; workers other
+// than the first one run in their own threads
+struct worker {
+    int index;
+    BReactor reactor;
+    struct listener listeners[MAX_LISTEN_ADDRS];
+    int num_listeners;
+    LinkedList1 clients_list;
+    BAVL remotes_tree;
+    BAddr local_udp_addr;
+    int local_udp_num_ports;
+    BAddr local_udp_ip6_addr;
+    int local_udp_ip6_num_ports;
+    BAddr dns_addr;
+    btime_t last_dns_update_time;
+#ifndef BADVPN_USE_WINAPI
+    BThreadSignal quit_signal;
+    pthread_t thread;
+#endif
+};
+
+struct connection;
+
+#include <udpgw/udpgw_hash.h>
+#include <structure/CHash_decl.h>
+
 struct client {
+    struct worker *worker;
     BConnection con;
     BAddr addr;
     BTimer disconnect_timer;
@@ -81,13 +120,23 @@ struct client {
     PacketPassInterface recv_if;
     PacketPassFairQueue send_queue;
     PacketStreamSender send_sender;
-    BAVL connections_tree;
+    ConnectionsHash connections_hash;
     LinkedList1 connections_list;
     int num_connections;
     LinkedList1 closing_connections_list;
     LinkedList1Node clients_list_node;
 };
 
+// connections bound to local ports which share a remote address (or only
+// the remote IP, with --unique-local-ports); a port can be used by one
+// connection of each remote
+struct remote {
+    BAddr addr;
+    BAVL connections_tree;
+    LinkedList1 connections_list;
+    BAVLNode remotes_tree_node;
+};
+
 struct connection {
     struct client *client;
     uint16_t conid;
@@ -105,11 +154,14 @@ struct connection {
         struct {
             BDatagram udp_dgram;
             int local_port_index;
+            struct remote *remote;
+            BAVLNode remote_tree_node;
+            LinkedList1Node remote_list_node;
             BufferWriter udp_send_writer;
             PacketBuffer udp_send_buffer;
             SinglePacketBuffer udp_recv_buffer;
             PacketPassInterface udp_recv_if;
-            BAVLNode connections_tree_node;
+            struct connection *connections_hash_next;
             LinkedList1Node connections_list_node;
         };
         struct {
@@ -118,6 +170,9 @@ struct connection {
     };
 };
 
+#include <udpgw/udpgw_hash.h>
+#include <structure/CHash_impl.h>
+
 // command-line options
 struct {
     int help;
@@ -132,6 +187,7 @@ struct {
     char *listen_addrs[MAX_LISTEN_ADDRS];
     int num_listen_addrs;
     int udp_mtu;
+    int udp_batch;
     int max_clients;
     int max_connections_for_client;
     int client_socket_sndbuf;
@@ -140,6 +196,7 @@ struct {
     int local_udp_ip6_num_ports;
     char *local_udp_ip6_addr;
     int unique_local_ports;
+    int threads;
 } options;
 
 // MTUs
@@ -156,19 +213,12 @@ BAddr local_udp_addr;
 // local UDP/IPv6 port range, if options.local_udp_ip6_num_ports>=0
 BAddr local_udp_ip6_addr;
 
-// DNS forwarding
-BAddr dns_addr;
-btime_t last_dns_update_time;
+// workers
+struct worker workers[MAX_THREADS];
+int num_workers;
 
-// reactor
-BReactor ss;
-
-// listeners
-BListener listeners[MAX_LISTEN_ADDRS];
-int num_listeners;
-
-// clients
-LinkedList1 clients_list;
+// number of clients of all workers
+BMutex clients_mutex;
 int num_clients;
 
 static void print_help (const char *name);
@@ -176,7 +226,14 @@ static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
 static void signal_handler (void *unused);
-static void listener_handler (BListener *listener);
+static int worker_init (struct worker *w, int index);
+static void worker_free (struct worker *w);
+static void worker_get_local_ports (struct worker *w, BAddr addr, int num_ports, BAddr *out_addr, int *out_num_ports);
+#ifndef BADVPN_USE_WINAPI
+static void * worker_thread (struct worker *w);
+static void worker_quit_signal_handler (BThreadSignal *thread_signal);
+#endif
+static void listener_handler (struct listener *l);
 static void client_free (struct client *client);
 static void client_logfunc (struct client *client);
 static void client_log (struct client *client, int level, const char *fmt, ...);
@@ -184,14 +241,20 @@ static void client_disconnect_timer_handler (struct client *client);
 static void client_connection_handler (struct client *client, int event);
 static void client_decoder_handler_error (struct client *client);
 static void client_recv_if_handler_send (struct client *client, uint8_t *data, int data_len);
-static int get_local_num_ports (int addr_type);
-static BAddr get_local_addr (int addr_type);
-static uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con);
+static int get_local_num_ports (struct worker *w, int addr_type);
+static BAddr get_local_addr (struct worker *w, int addr_type);
+static BAddr get_remote_key (BAddr addr);
+static struct remote * find_remote (struct worker *w, BAddr addr);
+static int find_first_free_port (struct remote *remote);
+static struct connection * find_least_used_connection (struct remote *remote);
 static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len);
 static void connection_free (struct connection *con);
 static void connection_logfunc (struct connection *con);
 static void connection_log (struct connection *con, int level, const char *fmt, ...);
 static void connection_free_udp (struct connection *con);
+static int connection_add_to_remote (struct connection *con);
+static void connection_remove_from_remote (struct connection *con);
+static void connection_touch (struct connection *con);
 static void connection_first_job_handler (struct connection *con);
 static void connection_send_to_client (struct connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len);
@@ -200,8 +263,9 @@ static void connection_send_qflow_busy_handler (struct connection *con);
 static void connection_dgram_handler_event (struct connection *con, int event);
 static void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len);
 static struct connection * find_connection (struct client *client, uint16_t conid);
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static void maybe_update_dns (void);
+static int int_comparator (void *unused, int *v1, int *v2);
+static int remote_addr_comparator (void *unused, BAddr *v1, BAddr *v2);
+static void maybe_update_dns (struct worker *w);
 
 int main (int argc, char **argv)
 {
@@ -281,57 +345,67 @@ int main (int argc, char **argv)
     // init time
     BTime_Init();
     
-    // init DNS forwarding
-    BAddr_InitNone(&dns_addr);
-    last_dns_update_time = INT64_MIN;
-    maybe_update_dns();
-    
-    // init reactor
-    if (!BReactor_Init(&ss)) {
-        BLog(BLOG_ERROR, "BReactor_Init failed");
+    // init clients count
+    if (!BMutex_Init(&clients_mutex)) {
+        BLog(BLOG_ERROR, "BMutex_Init failed");
         goto fail1;
     }
+    num_clients = 0;
+    
+    // init workers
+    num_workers = 0;
+    while (num_workers < options.threads) {
+        if (!worker_init(&workers[num_workers], num_workers)) {
+            BLog(BLOG_ERROR, "worker_init failed");
+            goto fail3;
+        }
+        num_workers++;
+    }
     
-    // setup signal handler
-    if (!BSignal_Init(&ss, signal_handler, NULL)) {
+    // setup signal handler; this also blocks the signals in threads started later
+    if (!BSignal_Init(&workers[0].reactor, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
-        goto fail2;
+        goto fail3;
     }
     
-    // initialize listeners
-    num_listeners = 0;
-    while (num_listeners < num_listen_addrs) {
-        if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
-            BLog(BLOG_ERROR, "Listener_Init failed");
-            goto fail3;
+#ifndef BADVPN_USE_WINAPI
+    // start worker threads
+    int num_threads = 1;
+    while (num_threads < num_workers) {
+        struct worker *w = &workers[num_threads];
+        if (pthread_create(&w->thread, NULL, (void * (*) (void *))worker_thread, w) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            goto fail4;
         }
-        num_listeners++;
+        num_threads++;
     }
-    
-    // init clients list
-    LinkedList1_Init(&clients_list);
-    num_clients = 0;
+#endif
     
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
-    BReactor_Exec(&ss);
+    BReactor_Exec(&workers[0].reactor);
     
-    // free clients
-    while (!LinkedList1_IsEmpty(&clients_list)) {
-        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&clients_list), struct client, clients_list_node);
-        client_free(client);
-    }
-fail3:
-    // free listeners
-    while (num_listeners > 0) {
-        num_listeners--;
-        BListener_Free(&listeners[num_listeners]);
+#ifndef BADVPN_USE_WINAPI
+fail4:
+    // stop worker threads
+    while (num_threads > 1) {
+        num_threads--;
+        struct worker *w = &workers[num_threads];
+        ASSERT_FORCE(BThreadSignal_Thread_Signal(&w->quit_signal))
+        ASSERT_FORCE(pthread_join(w->thread, NULL) == 0)
     }
+#endif
+    
     // finish signal handling
     BSignal_Finish();
-fail2:
-    // free reactor
-    BReactor_Free(&ss);
+fail3:
+    // free workers
+    while (num_workers > 0) {
+        num_workers--;
+        worker_free(&workers[num_workers]);
+    }
+    ASSERT(num_clients == 0)
+    BMutex_Free(&clients_mutex);
 fail1:
     // free logger
     BLog(BLOG_NOTICE, "exiting");
@@ -361,12 +435,16 @@ void print_help (const char *name)
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--listen-addr <addr>] ...\n"
         "        [--udp-mtu <bytes>]\n"
+        "        [--udp-batch <packets>]\n"
         "        [--max-clients <number>]\n"
         "        [--max-connections-for-client <number>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--local-udp-addrs <addr> <num_ports>]\n"
         "        [--local-udp-ip6-addrs <addr> <num_ports>]\n"
         "        [--unique-local-ports]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--threads <number>]\n"
+        #endif
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -396,12 +474,14 @@ int parse_arguments (int argc, char *argv[])
     }
     options.num_listen_addrs = 0;
     options.udp_mtu = DEFAULT_UDP_MTU;
+    options.udp_batch = DEFAULT_UDP_BATCH;
     options.max_clients = DEFAULT_MAX_CLIENTS;
     options.max_connections_for_client = DEFAULT_MAX_CONNECTIONS_FOR_CLIENT;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SEND_BUFFER;
     options.local_udp_num_ports = -1;
     options.local_udp_ip6_num_ports = -1;
     options.unique_local_ports = 0;
+    options.threads = 1;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -514,6 +594,17 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--udp-batch")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_batch = atoi(argv[i + 1])) <= 0 || options.udp_batch > BDATAGRAM_MAX_BATCH) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else if (!strcmp(arg, "--max-connections-for-client")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -563,6 +654,19 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--unique-local-ports")) {
             options.unique_local_ports = 1;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--threads")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.threads = atoi(argv[i + 1])) <= 0 || options.threads > MAX_THREADS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -612,6 +716,14 @@ int process_arguments (void)
         }
     }
     
+    // every thread needs some local ports of its own
+    if ((options.local_udp_num_ports > 0 && options.local_udp_num_ports < options.threads) ||
+        (options.local_udp_ip6_num_ports > 0 && options.local_udp_ip6_num_ports < options.threads)
+    ) {
+        BLog(BLOG_ERROR, "fewer local udp ports than threads");
+        return 0;
+    }
+    
     return 1;
 }
 
@@ -619,13 +731,154 @@ void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
     
+    // exit event loop; the other workers are stopped from main()
+    BReactor_Quit(&workers[0].reactor, 1);
+}
+
+int worker_init (struct worker *w, int index)
+{
+    w->index = index;
+    
+    // init reactor
+    if (!BReactor_Init(&w->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    // init quit signal
+    if (!BThreadSignal_Init(&w->quit_signal, &w->reactor, worker_quit_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail1;
+    }
+#endif
+    
+    // initialize listeners
+    w->num_listeners = 0;
+    while (w->num_listeners < num_listen_addrs) {
+        struct listener *l = &w->listeners[w->num_listeners];
+        l->worker = w;
+        
+#ifndef BADVPN_USE_WINAPI
+        // with multiple workers, the kernel distributes clients among their listeners
+        int res = (options.threads > 1) ?
+            BListener_InitReusePort(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)listener_handler) :
+            BListener_Init(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)listener_handler);
+#else
+        int res = BListener_Init(&l->listener, listen_addrs[w->num_listeners], &w->reactor, l, (BListener_handler)listener_handler);
+#endif
+        if (!res) {
+            BLog(BLOG_ERROR, "Listener_Init failed");
+            goto fail2;
+        }
+        w->num_listeners++;
+    }
+    
+    // init clients list
+    LinkedList1_Init(&w->clients_list);
+    
+    // init remotes tree
+    BAVL_Init(&w->remotes_tree, OFFSET_DIFF(struct remote, addr, remotes_tree_node), (BAVL_comparator)remote_addr_comparator, NULL);
+    
+    // take our share of local UDP ports
+    worker_get_local_ports(w, local_udp_addr, options.local_udp_num_ports, &w->local_udp_addr, &w->local_udp_num_ports);
+    worker_get_local_ports(w, local_udp_ip6_addr, options.local_udp_ip6_num_ports, &w->local_udp_ip6_addr, &w->local_udp_ip6_num_ports);
+    
+    // init DNS forwarding
+    BAddr_InitNone(&w->dns_addr);
+    w->last_dns_update_time = INT64_MIN;
+    maybe_update_dns(w);
+    
+    return 1;
+    
+fail2:
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+#ifndef BADVPN_USE_WINAPI
+    BThreadSignal_Free(&w->quit_signal);
+fail1:
+#endif
+    BReactor_Free(&w->reactor);
+fail0:
+    return 0;
+}
+
+void worker_free (struct worker *w)
+{
+    // free clients
+    while (!LinkedList1_IsEmpty(&w->clients_list)) {
+        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&w->clients_list), struct client, clients_list_node);
+        client_free(client);
+    }
+    ASSERT(BAVL_IsEmpty(&w->remotes_tree))
+    
+    // free listeners
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    // free quit signal
+    BThreadSignal_Free(&w->quit_signal);
+#endif
+    
+    // free reactor
+    BReactor_Free(&w->reactor);
+}
+
+void worker_get_local_ports (struct worker *w, BAddr addr, int num_ports, BAddr *out_addr, int *out_num_ports)
+{
+    *out_addr = addr;
+    *out_num_ports = num_ports;
+    
+    if (num_ports < 0) {
+        return;
+    }
+    
+    // Each worker gets its own range of ports. Port uniqueness is then kept by
+    // each worker's remotes tree alone, without locking on every connection.
+    int first = (int)((int64_t)num_ports * w->index / options.threads);
+    int end = (int)((int64_t)num_ports * (w->index + 1) / options.threads);
+    
+    BAddr_SetPort(out_addr, hton16(ntoh16(BAddr_GetPort(&addr)) + (uint16_t)first));
+    *out_num_ports = end - first;
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+void * worker_thread (struct worker *w)
+{
+    BReactor_Exec(&w->reactor);
+    
+    return NULL;
+}
+
+void worker_quit_signal_handler (BThreadSignal *thread_signal)
+{
+    struct worker *w = UPPER_OBJECT(thread_signal, struct worker, quit_signal);
+    
     // exit event loop
-    BReactor_Quit(&ss, 1);
+    BReactor_Quit(&w->reactor, 1);
 }
 
-void listener_handler (BListener *listener)
+#endif
+
+void listener_handler (struct listener *l)
 {
-    if (num_clients == options.max_clients) {
+    struct worker *w = l->worker;
+    
+    // reserve a place among the clients of all workers
+    BMutex_Lock(&clients_mutex);
+    int full = (num_clients == options.max_clients);
+    if (!full) {
+        num_clients++;
+    }
+    BMutex_Unlock(&clients_mutex);
+    
+    if (full) {
         BLog(BLOG_ERROR, "maximum number of clients reached");
         goto fail0;
     }
@@ -634,13 +887,16 @@ void listener_handler (BListener *listener)
     struct client *client = (struct client *)malloc(sizeof(*client));
     if (!client) {
         BLog(BLOG_ERROR, "malloc failed");
-        goto fail0;
+        goto fail1;
     }
     
+    // init arguments
+    client->worker = w;
+    
     // accept client
-    if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
+    if (!BConnection_Init(&client->con, BConnection_source_listener(&l->listener, &client->addr), &w->reactor, client, (BConnection_handler)client_connection_handler)) {
         BLog(BLOG_ERROR, "BConnection_Init failed");
-        goto fail1;
+        goto fail2;
     }
     
     // limit socket send buffer, else our scheduling is pointless
@@ -656,30 +912,33 @@ void listener_handler (BListener *listener)
     
     // init disconnect timer
     BTimer_Init(&client->disconnect_timer, CLIENT_DISCONNECT_TIMEOUT, (BTimer_handler)client_disconnect_timer_handler, client);
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&w->reactor, &client->disconnect_timer);
     
     // init recv interface
-    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&w->reactor));
     
     // init recv decoder
-    if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&ss), client,
+    if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&w->reactor), client,
         (PacketProtoDecoder_handler_error)client_decoder_handler_error
     )) {
         BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail2;
+        goto fail3;
     }
     
     // init send sender
-    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&ss));
+    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&w->reactor));
     
     // init send queue
-    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
+    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&w->reactor), 0, 1)) {
         BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
-        goto fail3;
+        goto fail4;
     }
     
-    // init connections tree
-    BAVL_Init(&client->connections_tree, OFFSET_DIFF(struct connection, conid, connections_tree_node), (BAVL_comparator)uint16_comparator, NULL);
+    // init connections hash
+    if (!ConnectionsHash_Init(&client->connections_hash, options.max_connections_for_client)) {
+        BLog(BLOG_ERROR, "ConnectionsHash_Init failed");
+        goto fail5;
+    }
     
     // init connections list
     LinkedList1_Init(&client->connections_list);
@@ -691,24 +950,29 @@ void listener_handler (BListener *listener)
     LinkedList1_Init(&client->closing_connections_list);
     
     // insert to clients list
-    LinkedList1_Append(&clients_list, &client->clients_list_node);
-    num_clients++;
+    LinkedList1_Append(&w->clients_list, &client->clients_list_node);
     
     client_log(client, BLOG_INFO, "connected");
     
     return;
     
-fail3:
+fail5:
+    PacketPassFairQueue_Free(&client->send_queue);
+fail4:
     PacketStreamSender_Free(&client->send_sender);
     PacketProtoDecoder_Free(&client->recv_decoder);
-fail2:
+fail3:
     PacketPassInterface_Free(&client->recv_if);
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&w->reactor, &client->disconnect_timer);
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
     BConnection_Free(&client->con);
-fail1:
+fail2:
     free(client);
+fail1:
+    BMutex_Lock(&clients_mutex);
+    num_clients--;
+    BMutex_Unlock(&clients_mutex);
 fail0:
     return;
 }
@@ -731,8 +995,15 @@ void client_free (struct client *client)
     }
     
     // remove from clients list
-    LinkedList1_Remove(&clients_list, &client->clients_list_node);
+    LinkedList1_Remove(&client->worker->clients_list, &client->clients_list_node);
+    
+    // decrement number of clients
+    BMutex_Lock(&clients_mutex);
     num_clients--;
+    BMutex_Unlock(&clients_mutex);
+    
+    // free connections hash
+    ConnectionsHash_Free(&client->connections_hash);
     
     // free send queue
     PacketPassFairQueue_Free(&client->send_queue);
@@ -747,7 +1018,7 @@ void client_free (struct client *client)
     PacketPassInterface_Free(&client->recv_if);
     
     // free disconnect timer
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // free connection interfaces
     BConnection_RecvAsync_Free(&client->con);
@@ -825,7 +1096,7 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     uint16_t conid = ltoh16(header.conid);
     
     // reset disconnect timer
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // if this is keepalive, ignore any payload
     if ((flags & UDPGW_CLIENT_FLAG_KEEPALIVE)) {
@@ -886,12 +1157,12 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
         // if this is DNS, replace actual address, but keep still remember the orig_addr
         BAddr addr = orig_addr;
         if ((flags & UDPGW_CLIENT_FLAG_DNS)) {
-            maybe_update_dns();
-            if (dns_addr.type == BADDR_TYPE_NONE) {
+            maybe_update_dns(client->worker);
+            if (client->worker->dns_addr.type == BADDR_TYPE_NONE) {
                 client_log(client, BLOG_WARNING, "received DNS packet, but no DNS server available");
             } else {
                 client_log(client, BLOG_DEBUG, "received DNS");
-                addr = dns_addr;
+                addr = client->worker->dns_addr;
             }
         }
         
@@ -903,84 +1174,85 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     }
 }
 
-int get_local_num_ports (int addr_type)
+int get_local_num_ports (struct worker *w, int addr_type)
 {
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return options.local_udp_num_ports;
-        case BADDR_TYPE_IPV6: return options.local_udp_ip6_num_ports;
+        case BADDR_TYPE_IPV4: return w->local_udp_num_ports;
+        case BADDR_TYPE_IPV6: return w->local_udp_ip6_num_ports;
         default: ASSERT(0); return 0;
     }
 }
 
-BAddr get_local_addr (int addr_type)
+BAddr get_local_addr (struct worker *w, int addr_type)
 {
-    ASSERT(get_local_num_ports(addr_type) >= 0)
+    ASSERT(get_local_num_ports(w, addr_type) >= 0)
     
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return local_udp_addr;
-        case BADDR_TYPE_IPV6: return local_udp_ip6_addr;
+        case BADDR_TYPE_IPV4: return w->local_udp_addr;
+        case BADDR_TYPE_IPV6: return w->local_udp_ip6_addr;
         default: ASSERT(0); return BAddr_MakeNone();
     }
 }
 
-uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con)
+BAddr get_remote_key (BAddr addr)
 {
-    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
-    ASSERT(get_local_num_ports(remote_addr.type) >= 0)
+    ASSERT(addr.type == BADDR_TYPE_IPV4 || addr.type == BADDR_TYPE_IPV6)
+    
+    // with unique local ports, connections to any port of an IP can't share local ports
+    if (options.unique_local_ports) {
+        BAddr_SetPort(&addr, 0);
+    }
     
-    int local_num_ports = get_local_num_ports(remote_addr.type);
+    return addr;
+}
+
+struct remote * find_remote (struct worker *w, BAddr addr)
+{
+    BAddr key = get_remote_key(addr);
     
-    // allocate port usage array
-    uint8_t *port_usage = (uint8_t *)BAllocSize(bsize_fromint(local_num_ports));
-    if (!port_usage) {
+    BAVLNode *tree_node = BAVL_LookupExact(&w->remotes_tree, &key);
+    if (!tree_node) {
         return NULL;
     }
     
-    // zero array
-    memset(port_usage, 0, local_num_ports);
-    
-    struct connection *least_con = NULL;
+    return UPPER_OBJECT(tree_node, struct remote, remotes_tree_node);
+}
+
+int find_first_free_port (struct remote *remote)
+{
+    // The connections tree is ordered by port index, and port indices are
+    // unique, so the entry at position i has port index at least i, with
+    // equality exactly for the entries before the first free port.
+    uint64_t low = 0;
+    uint64_t high = BAVL_Count(&remote->connections_tree);
+    
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        struct connection *con = UPPER_OBJECT(BAVL_GetAt(&remote->connections_tree, mid), struct connection, remote_tree_node);
+        if (con->local_port_index == mid) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
     
-    // flag inappropriate ports (those with the same remote address)
-    for (LinkedList1Node *ln = LinkedList1_GetFirst(&clients_list); ln; ln = LinkedList1Node_Next(ln)) {
-        struct client *client = UPPER_OBJECT(ln, struct client, clients_list_node);
+    return low;
+}
+
+struct connection * find_least_used_connection (struct remote *remote)
+{
+    // the list is ordered by last use time
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&remote->connections_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, remote_list_node);
+        ASSERT(con->remote == remote)
+        ASSERT(!con->closing)
         
-        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&client->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
-            struct connection *con = UPPER_OBJECT(ln2, struct connection, connections_list_node);
-            ASSERT(con->client == client)
-            ASSERT(!con->closing)
-            
-            if (con->addr.type != remote_addr.type || con->local_port_index < 0) {
-                continue;
-            }
-            ASSERT(con->local_port_index < local_num_ports)
-            
-            if (options.unique_local_ports) {
-                BIPAddr ip1;
-                BIPAddr ip2;
-                BAddr_GetIPAddr(&con->addr, &ip1);
-                BAddr_GetIPAddr(&remote_addr, &ip2);
-                if (!BIPAddr_Compare(&ip1, &ip2)) {
-                    continue;
-                }
-            } else {
-                if (!BAddr_Compare(&con->addr, &remote_addr)) {
-                    continue;
-                }
-            }
-            
-            port_usage[con->local_port_index] = 1;
-            
-            if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
-                if (!least_con || con->last_use_time < least_con->last_use_time) {
-                    least_con = con;
-                }
-            }
+        if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+            return con;
         }
     }
     
-    *out_con = least_con;
-    return port_usage;
+    return NULL;
 }
 
 void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len)
@@ -1015,38 +1287,30 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     con->closing = 0;
     
     // init first job
-    BPending_Init(&con->first_job, BReactor_PendingGroup(&ss), (BPending_handler)connection_first_job_handler, con);
+    BPending_Init(&con->first_job, BReactor_PendingGroup(&client->worker->reactor), (BPending_handler)connection_first_job_handler, con);
     BPending_Set(&con->first_job);
     
     // init send queue flow
     PacketPassFairQueueFlow_Init(&con->send_qflow, &client->send_queue);
     
     // init send PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
+    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE * options.udp_batch, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
     // init UDP dgram
-    if (!BDatagram_Init(&con->udp_dgram, addr.type, &ss, con, (BDatagram_handler)connection_dgram_handler_event)) {
+    if (!BDatagram_Init(&con->udp_dgram, addr.type, &client->worker->reactor, con, (BDatagram_handler)connection_dgram_handler_event)) {
         client_log(client, BLOG_ERROR, "BDatagram_Init failed");
         goto fail2;
     }
     
     con->local_port_index = -1;
     
-    int local_num_ports = get_local_num_ports(addr.type);
+    int local_num_ports = get_local_num_ports(client->worker, addr.type);
     
     if (local_num_ports >= 0) {
-        // build port usage array, find least used connection
-        struct connection *least_con;
-        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(addr, &least_con);
-        if (!port_usage) {
-            client_log(client, BLOG_ERROR, "build_port_usage_array failed");
-            goto failed;
-        }
-        
         // set SO_REUSEADDR
         if (!BDatagram_SetReuseAddr(&con->udp_dgram, 1)) {
             client_log(client, BLOG_ERROR, "set SO_REUSEADDR failed");
@@ -1054,12 +1318,22 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // get starting local address
-        BAddr local_addr = get_local_addr(addr.type);
+        BAddr local_addr = get_local_addr(client->worker, addr.type);
         
-        // try different ports
-        for (int i = 0; i < local_num_ports; i++) {
-            // skip inappropriate ports
-            if (port_usage[i]) {
+        // find ports used by other connections with the same remote address
+        struct remote *remote = find_remote(client->worker, addr);
+        
+        // try free ports, starting with the first one
+        int i = 0;
+        BAVLNode *used_node = NULL;
+        if (remote) {
+            i = find_first_free_port(remote);
+            used_node = BAVL_GetAt(&remote->connections_tree, i);
+        }
+        for (; i < local_num_ports; i++) {
+            // skip used ports
+            if (used_node && UPPER_OBJECT(used_node, struct connection, remote_tree_node)->local_port_index == i) {
+                used_node = BAVL_GetNext(&remote->connections_tree, used_node);
                 continue;
             }
             
@@ -1073,6 +1347,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // try closing an unused connection with the same remote addr
+        struct connection *least_con = (remote ? find_least_used_connection(remote) : NULL);
         if (!least_con) {
             goto failed;
         }
@@ -1082,7 +1357,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         ASSERT(least_con->local_port_index < local_num_ports)
         ASSERT(!PacketPassFairQueueFlow_IsBusy(&least_con->send_qflow))
         
-        int i = least_con->local_port_index;
+        i = least_con->local_port_index;
         
         BLog(BLOG_INFO, "closing connection for its remote address");
         
@@ -1101,7 +1376,12 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     failed:
         client_log(client, BLOG_WARNING, "failed to bind to any local address; proceeding regardless");
     cont:;
-        BFree(port_usage);
+    }
+    
+    // register port with the remote address
+    if (con->local_port_index >= 0 && !connection_add_to_remote(con)) {
+        client_log(client, BLOG_ERROR, "connection_add_to_remote failed");
+        goto fail3;
     }
     
     // set UDP dgram send address
@@ -1110,29 +1390,36 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     BDatagram_SetSendAddrs(&con->udp_dgram, addr, ipaddr);
     
     // init UDP dgram interfaces
-    BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
-    BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    if (!BDatagram_SendAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch)) {
+        client_log(client, BLOG_ERROR, "BDatagram_SendAsync_InitBatch failed");
+        goto fail4;
+    }
+    if (!BDatagram_RecvAsync_InitBatch(&con->udp_dgram, options.udp_mtu, options.udp_batch)) {
+        client_log(client, BLOG_ERROR, "BDatagram_RecvAsync_InitBatch failed");
+        goto fail5;
+    }
     
     // init UDP writer
-    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&ss));
+    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&client->worker->reactor));
     
     // init UDP buffer
-    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&ss))) {
+    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE * options.udp_batch, BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "PacketBuffer_Init failed");
-        goto fail4;
+        goto fail6;
     }
     
     // init UDP recv interface
-    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&client->worker->reactor));
     
     // init UDP recv buffer
-    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&ss))) {
+    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&client->worker->reactor))) {
         client_log(client, BLOG_ERROR, "SinglePacketBuffer_Init failed");
-        goto fail5;
+        goto fail7;
     }
     
-    // insert to client's connections tree
-    ASSERT_EXECUTE(BAVL_Insert(&client->connections_tree, &con->connections_tree_node, NULL))
+    // insert to client's connections hash
+    ConnectionsHashRef ref = {con, con};
+    ASSERT_EXECUTE(ConnectionsHash_Insert(&client->connections_hash, 0, ref, NULL))
     
     // insert to client's connections list
     LinkedList1_Append(&client->connections_list, &con->connections_list_node);
@@ -1144,13 +1431,17 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     
     return;
     
-fail5:
+fail7:
     PacketPassInterface_Free(&con->udp_recv_if);
     PacketBuffer_Free(&con->udp_send_buffer);
-fail4:
+fail6:
     BufferWriter_Free(&con->udp_send_writer);
     BDatagram_RecvAsync_Free(&con->udp_dgram);
+fail5:
     BDatagram_SendAsync_Free(&con->udp_dgram);
+fail4:
+    connection_remove_from_remote(con);
+fail3:
     BDatagram_Free(&con->udp_dgram);
 fail2:
     PacketProtoFlow_Free(&con->send_ppflow);
@@ -1177,8 +1468,9 @@ void connection_free (struct connection *con)
         // remove from client's connections list
         LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
         
-        // remove from client's connections tree
-        BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
+        // remove from client's connections hash
+        ConnectionsHashRef ref = {con, con};
+        ConnectionsHash_Remove(&client->connections_hash, 0, ref);
         
         // free UDP
         connection_free_udp(con);
@@ -1234,10 +1526,88 @@ void connection_free_udp (struct connection *con)
     BDatagram_RecvAsync_Free(&con->udp_dgram);
     BDatagram_SendAsync_Free(&con->udp_dgram);
     
+    // remove from remote
+    connection_remove_from_remote(con);
+    
     // free UDP dgram
     BDatagram_Free(&con->udp_dgram);
 }
 
+int connection_add_to_remote (struct connection *con)
+{
+    ASSERT(con->local_port_index >= 0)
+    
+    struct worker *w = con->client->worker;
+    
+    struct remote *remote = find_remote(w, con->addr);
+    
+    if (!remote) {
+        // allocate structure
+        remote = (struct remote *)malloc(sizeof(*remote));
+        if (!remote) {
+            return 0;
+        }
+        
+        // init remote
+        remote->addr = get_remote_key(con->addr);
+        BAVL_Init(&remote->connections_tree, OFFSET_DIFF(struct connection, local_port_index, remote_tree_node), (BAVL_comparator)int_comparator, NULL);
+        LinkedList1_Init(&remote->connections_list);
+        
+        // insert to remotes tree
+        ASSERT_EXECUTE(BAVL_Insert(&w->remotes_tree, &remote->remotes_tree_node, NULL))
+    }
+    
+    // insert to remote's connections tree
+    ASSERT_EXECUTE(BAVL_Insert(&remote->connections_tree, &con->remote_tree_node, NULL))
+    
+    // insert to remote's connections list
+    LinkedList1_Append(&remote->connections_list, &con->remote_list_node);
+    
+    con->remote = remote;
+    
+    return 1;
+}
+
+void connection_remove_from_remote (struct connection *con)
+{
+    if (con->local_port_index < 0) {
+        return;
+    }
+    
+    struct remote *remote = con->remote;
+    
+    // remove from remote's connections list
+    LinkedList1_Remove(&remote->connections_list, &con->remote_list_node);
+    
+    // remove from remote's connections tree
+    BAVL_Remove(&remote->connections_tree, &con->remote_tree_node);
+    
+    // free remote if this was its last connection
+    if (BAVL_IsEmpty(&remote->connections_tree)) {
+        BAVL_Remove(&con->client->worker->remotes_tree, &remote->remotes_tree_node);
+        free(remote);
+    }
+}
+
+void connection_touch (struct connection *con)
+{
+    struct client *client = con->client;
+    ASSERT(!con->closing)
+    
+    // set last use time
+    con->last_use_time = btime_gettime();
+    
+    // move connection to front
+    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
+    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    
+    // also in the remote's list
+    if (con->local_port_index >= 0) {
+        LinkedList1_Remove(&con->remote->connections_list, &con->remote_list_node);
+        LinkedList1_Append(&con->remote->connections_list, &con->remote_list_node);
+    }
+}
+
 void connection_first_job_handler (struct connection *con)
 {
     ASSERT(!con->closing)
@@ -1305,19 +1675,14 @@ void connection_send_to_client (struct connection *con, uint8_t flags, const uin
 
 int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len)
 {
-    struct client *client = con->client;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
     
     connection_log(con, BLOG_DEBUG, "from client %d bytes", data_len);
     
-    // set last use time
-    con->last_use_time = btime_gettime();
-    
-    // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    // update last use time and move to front
+    connection_touch(con);
     
     // get buffer location
     uint8_t *out;
@@ -1354,8 +1719,9 @@ void connection_close (struct connection *con)
     // remove from client's connections list
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
     
-    // remove from client's connections tree
-    BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
+    // remove from client's connections hash
+    ConnectionsHashRef ref = {con, con};
+    ConnectionsHash_Remove(&client->connections_hash, 0, ref);
     
     // free UDP
     connection_free_udp(con);
@@ -1396,19 +1762,14 @@ void connection_dgram_handler_event (struct connection *con, int event)
 
 void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len)
 {
-    struct client *client = con->client;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
     
     connection_log(con, BLOG_DEBUG, "from UDP %d bytes", data_len);
     
-    // set last use time
-    con->last_use_time = btime_gettime();
-    
-    // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    // update last use time and move to front
+    connection_touch(con);
     
     // accept packet
     PacketPassInterface_Done(&con->udp_recv_if);
@@ -1419,30 +1780,55 @@ void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data,
 
 struct connection * find_connection (struct client *client, uint16_t conid)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&client->connections_tree, &conid);
-    if (!tree_node) {
+    ConnectionsHashRef ref = ConnectionsHash_Lookup(&client->connections_hash, 0, conid);
+    if (!ref.ptr) {
         return NULL;
     }
-    struct connection *con = UPPER_OBJECT(tree_node, struct connection, connections_tree_node);
+    struct connection *con = ref.ptr;
     ASSERT(con->conid == conid)
     ASSERT(!con->closing)
     
     return con;
 }
 
-int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
+int int_comparator (void *unused, int *v1, int *v2)
 {
     return B_COMPARE(*v1, *v2);
 }
 
-void maybe_update_dns (void)
+int remote_addr_comparator (void *unused, BAddr *v1, BAddr *v2)
+{
+    ASSERT(v1->type == BADDR_TYPE_IPV4 || v1->type == BADDR_TYPE_IPV6)
+    ASSERT(v2->type == BADDR_TYPE_IPV4 || v2->type == BADDR_TYPE_IPV6)
+    
+    int c = B_COMPARE(v1->type, v2->type);
+    if (c) {
+        return c;
+    }
+    
+    if (v1->type == BADDR_TYPE_IPV4) {
+        c = B_COMPARE(v1->ipv4.ip, v2->ipv4.ip);
+        if (c) {
+            return c;
+        }
+        return B_COMPARE(v1->ipv4.port, v2->ipv4.port);
+    }
+    
+    c = B_COMPARE(memcmp(v1->ipv6.ip, v2->ipv6.ip, sizeof(v1->ipv6.ip)), 0);
+    if (c) {
+        return c;
+    }
+    return B_COMPARE(v1->ipv6.port, v2->ipv6.port);
+}
+
+void maybe_update_dns (struct worker *w)
 {
 #ifndef BADVPN_USE_WINAPI
     btime_t now = btime_gettime();
-    if (now < btime_add(last_dns_update_time, DNS_UPDATE_TIME)) {
+    if (now < btime_add(w->last_dns_update_time, DNS_UPDATE_TIME)) {
         return;
     }
-    last_dns_update_time = now;
+    w->last_dns_update_time = now;
     BLog(BLOG_DEBUG, "update dns");
     
     if (res_init() != 0) {
@@ -1458,16 +1844,16 @@ void maybe_update_dns (void)
     BAddr addr;
     BAddr_InitIPv4(&addr, _res.nsaddr_list[0].sin_addr.s_addr, hton16(53));
     
-    if (!BAddr_Compare(&addr, &dns_addr)) {
+    if (!BAddr_Compare(&addr, &w->dns_addr)) {
         char str[BADDR_MAX_PRINT_LEN];
         BAddr_Print(&addr, str);
         BLog(BLOG_INFO, "using DNS server %s", str);
     }
     
-    dns_addr = addr;
+    w->dns_addr = addr;
     return;
     
 fail:
-    BAddr_InitNone(&dns_addr);
+    BAddr_InitNone(&w->dns_addr);
 #endif
 }
@@ -30,9 +30,16 @@
 // maxiumum listen addresses
 #define MAX_LISTEN_ADDRS 16
 
+// maximum number of threads
+#define MAX_THREADS 64
+
 // maximum datagram size
 #define DEFAULT_UDP_MTU 65520
 
+// maximum number of datagrams sent or received with one system call; buffers
+// of each connection grow with it, so batching is off by default
+#define DEFAULT_UDP_BATCH 1
+
 // connection buffer size for sending to client, in packets
 #define CONNECTION_CLIENT_BUFFER_SIZE 1
 
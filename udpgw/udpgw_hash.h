@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME ConnectionsHash
+#define CHASH_PARAM_ENTRY struct connection
+#define CHASH_PARAM_LINK struct connection *
+#define CHASH_PARAM_KEY uint16_t
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct connection *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((size_t)(entry).ptr->conid)
+#define CHASH_PARAM_KEYHASH(arg, key) ((size_t)(key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) ((entry1).ptr->conid == (entry2).ptr->conid)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) ((key1) == (entry2).ptr->conid)
+#define CHASH_PARAM_ENTRY_NEXT connections_hash_next
@@ -31,15 +31,13 @@
 
 #include <misc/offset.h>
 #include <misc/byteorder.h>
-#include <misc/compare.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <udpgw_client/UdpGwClient.h>
 
 #include <generated/blog_channel_UdpGwClient.h>
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
 static void free_server (UdpGwClient *o);
 static void decoder_handler_error (UdpGwClient *o);
 static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data_len);
@@ -47,26 +45,16 @@ static void send_monitor_handler (UdpGwClient *o);
 static void keepalive_if_handler_done (UdpGwClient *o);
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid);
-static uint16_t find_unused_conid (UdpGwClient *o);
+static uint16_t take_free_conid (UdpGwClient *o);
+static void release_conid (UdpGwClient *o, uint16_t conid);
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len);
 static void connection_free (struct UdpGwClient_connection *con);
 static void connection_first_job_handler (struct UdpGwClient_connection *con);
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
-{
-    return B_COMPARE(*v1, *v2);
-}
-
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2)
-{
-    int r = BAddr_CompareOrder(&v1->remote_addr, &v2->remote_addr);
-    if (r) {
-        return r;
-    }
-    return BAddr_CompareOrder(&v1->local_addr, &v2->local_addr);
-}
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_impl.h>
 
 static void free_server (UdpGwClient *o)
 {
@@ -197,39 +185,41 @@ static void keepalive_if_handler_done (UdpGwClient *o)
 
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conaddr, &conaddr);
-    if (!tree_node) {
-        return NULL;
-    }
+    UdpGwClient__ConaddrHashRef ref = UdpGwClient__ConaddrHash_Lookup(&o->connections_hash_by_conaddr, 0, conaddr);
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conaddr_node);
+    return ref.ptr;
 }
 
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conid, &conid);
-    if (!tree_node) {
+    if (conid >= o->max_connections) {
         return NULL;
     }
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conid_node);
+    return o->connections_by_conid[conid];
 }
 
-static uint16_t find_unused_conid (UdpGwClient *o)
+static uint16_t take_free_conid (UdpGwClient *o)
 {
     ASSERT(o->num_connections < o->max_connections)
     
-    while (1) {
-        if (!find_connection_by_conid(o, o->next_conid)) {
-            return o->next_conid;
-        }
-        
-        if (o->next_conid == o->max_connections - 1) {
-            o->next_conid = 0;
-        } else {
-            o->next_conid++;
-        }
-    }
+    // take the conid which has been free the longest, so that late packets
+    // for a closed connection are unlikely to reach a new one
+    uint16_t conid = o->free_conids[o->free_conids_start];
+    o->free_conids_start = (o->free_conids_start + 1) % o->max_connections;
+    ASSERT(!o->connections_by_conid[conid])
+    
+    return conid;
+}
+
+static void release_conid (UdpGwClient *o, uint16_t conid)
+{
+    ASSERT(o->num_connections > 0)
+    
+    // append to the free conids queue; it holds max_connections - num_connections
+    // entries, and num_connections has not been decremented yet
+    int num_free = o->max_connections - o->num_connections;
+    o->free_conids[(o->free_conids_start + num_free) % o->max_connections] = conid;
 }
 
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len)
@@ -252,9 +242,7 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     con->first_flags = flags;
     con->first_data = data;
     con->first_data_len = data_len;
-    
-    // allocate conid
-    con->conid = find_unused_conid(o);
+    con->conaddr_hash = UdpGwClient__conaddr_hash(conaddr);
     
     // init first job
     BPending_Init(&con->first_job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_first_job_handler, con);
@@ -270,11 +258,13 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // allocate conid
+    con->conid = take_free_conid(o);
+    o->connections_by_conid[con->conid] = con;
     
-    // insert to connections tree by conid
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node, NULL))
+    // insert to connections hash by conaddr
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    ASSERT_EXECUTE(UdpGwClient__ConaddrHash_Insert(&o->connections_hash_by_conaddr, 0, ref, NULL))
     
     // insert to connections list
     LinkedList1_Append(&o->connections_list, &con->connections_list_node);
@@ -297,17 +287,19 @@ static void connection_free (struct UdpGwClient_connection *con)
     UdpGwClient *o = con->client;
     PacketPassFairQueueFlow_AssertFree(&con->send_qflow);
     
+    // release conid
+    o->connections_by_conid[con->conid] = NULL;
+    release_conid(o, con->conid);
+    
     // decrement number of connections
     o->num_connections--;
     
     // remove from connections list
     LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
     
-    // remove from connections tree by conid
-    BAVL_Remove(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node);
-    
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // remove from connections hash by conaddr
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    UdpGwClient__ConaddrHash_Remove(&o->connections_hash_by_conaddr, 0, ref);
     
     // free PacketProtoFlow
     PacketProtoFlow_Free(&con->send_ppflow);
@@ -387,14 +379,16 @@ static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct
     // get least recently used connection
     struct UdpGwClient_connection *con = UPPER_OBJECT(LinkedList1_GetFirst(&o->connections_list), struct UdpGwClient_connection, connections_list_node);
     
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // remove from connections hash by conaddr
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    UdpGwClient__ConaddrHash_Remove(&o->connections_hash_by_conaddr, 0, ref);
     
     // set new conaddr
     con->conaddr = conaddr;
+    con->conaddr_hash = UdpGwClient__conaddr_hash(conaddr);
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // insert to connections hash by conaddr
+    ASSERT_EXECUTE(UdpGwClient__ConaddrHash_Insert(&o->connections_hash_by_conaddr, 0, ref, NULL))
     
     return con;
 }
@@ -428,11 +422,30 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     o->udpgw_mtu = udpgw_compute_mtu(o->udp_mtu);
     o->pp_mtu = o->udpgw_mtu + sizeof(struct packetproto_header);
     
-    // init connections tree by conaddr
-    BAVL_Init(&o->connections_tree_by_conaddr, OFFSET_DIFF(struct UdpGwClient_connection, conaddr, connections_tree_by_conaddr_node), (BAVL_comparator)conaddr_comparator, NULL);
+    // init connections hash by conaddr
+    if (!UdpGwClient__ConaddrHash_Init(&o->connections_hash_by_conaddr, o->max_connections)) {
+        BLog(BLOG_ERROR, "UdpGwClient__ConaddrHash_Init failed");
+        goto fail0;
+    }
     
-    // init connections tree by conid
-    BAVL_Init(&o->connections_tree_by_conid, OFFSET_DIFF(struct UdpGwClient_connection, conid, connections_tree_by_conid_node), (BAVL_comparator)uint16_comparator, NULL);
+    // allocate connections array by conid
+    if (!(o->connections_by_conid = (struct UdpGwClient_connection **)BAllocArray(o->max_connections, sizeof(o->connections_by_conid[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    for (int i = 0; i < o->max_connections; i++) {
+        o->connections_by_conid[i] = NULL;
+    }
+    
+    // allocate free conids queue, initially holding all conids in order
+    if (!(o->free_conids = (uint16_t *)BAllocArray(o->max_connections, sizeof(o->free_conids[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    for (int i = 0; i < o->max_connections; i++) {
+        o->free_conids[i] = i;
+    }
+    o->free_conids_start = 0;
     
     // init connections list
     LinkedList1_Init(&o->connections_list);
@@ -440,9 +453,6 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     // set zero connections
     o->num_connections = 0;
     
-    // set next conid
-    o->next_conid = 0;
-    
     // init send connector
     PacketPassConnector_Init(&o->send_connector, o->pp_mtu, BReactor_PendingGroup(o->reactor));
     
@@ -451,7 +461,7 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     
     // init send queue
     if (!PacketPassFairQueue_Init(&o->send_queue, PacketPassInactivityMonitor_GetInput(&o->send_monitor), BReactor_PendingGroup(o->reactor), 0, 1)) {
-        goto fail0;
+        goto fail3;
     }
     
     // construct keepalive packet
@@ -475,9 +485,15 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     DebugObject_Init(&o->d_obj);
     return 1;
     
-fail0:
+fail3:
     PacketPassInactivityMonitor_Free(&o->send_monitor);
     PacketPassConnector_Free(&o->send_connector);
+    BFree(o->free_conids);
+fail2:
+    BFree(o->connections_by_conid);
+fail1:
+    UdpGwClient__ConaddrHash_Free(&o->connections_hash_by_conaddr);
+fail0:
     return 0;
 }
 
@@ -510,6 +526,15 @@ void UdpGwClient_Free (UdpGwClient *o)
     
     // free send connector
     PacketPassConnector_Free(&o->send_connector);
+    
+    // free free conids queue
+    BFree(o->free_conids);
+    
+    // free connections array by conid
+    BFree(o->connections_by_conid);
+    
+    // free connections hash by conaddr
+    UdpGwClient__ConaddrHash_Free(&o->connections_hash_by_conaddr);
 }
 
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len)
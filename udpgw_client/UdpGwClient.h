@@ -34,7 +34,7 @@
 #include <protocol/udpgw_proto.h>
 #include <misc/debug.h>
 #include <misc/packed.h>
-#include <structure/BAVL.h>
+#include <structure/CHash.h>
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <system/BAddr.h>
@@ -49,6 +49,26 @@
 typedef void (*UdpGwClient_handler_servererror) (void *user);
 typedef void (*UdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
+struct UdpGwClient_conaddr {
+    BAddr local_addr;
+    BAddr remote_addr;
+};
+
+static size_t UdpGwClient__conaddr_hash (struct UdpGwClient_conaddr conaddr)
+{
+    return BAddr_Hash(&conaddr.local_addr, BAddr_Hash(&conaddr.remote_addr, 5381));
+}
+
+static int UdpGwClient__conaddr_equal (struct UdpGwClient_conaddr v1, struct UdpGwClient_conaddr v2)
+{
+    return BAddr_Compare(&v1.remote_addr, &v2.remote_addr) && BAddr_Compare(&v1.local_addr, &v2.local_addr);
+}
+
+struct UdpGwClient_connection;
+
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_decl.h>
+
 B_START_PACKED
 struct UdpGwClient__keepalive_packet {
     struct packetproto_header pp;
@@ -67,11 +87,12 @@ typedef struct {
     UdpGwClient_handler_received handler_received;
     int udpgw_mtu;
     int pp_mtu;
-    BAVL connections_tree_by_conaddr;
-    BAVL connections_tree_by_conid;
+    UdpGwClient__ConaddrHash connections_hash_by_conaddr;
+    struct UdpGwClient_connection **connections_by_conid;
     LinkedList1 connections_list;
     int num_connections;
-    int next_conid;
+    uint16_t *free_conids;
+    int free_conids_start;
     PacketPassFairQueue send_queue;
     PacketPassInactivityMonitor send_monitor;
     PacketPassConnector send_connector;
@@ -86,14 +107,10 @@ typedef struct {
     DebugObject d_obj;
 } UdpGwClient;
 
-struct UdpGwClient_conaddr {
-    BAddr local_addr;
-    BAddr remote_addr;
-};
-
 struct UdpGwClient_connection {
     UdpGwClient *client;
     struct UdpGwClient_conaddr conaddr;
+    size_t conaddr_hash;
     uint8_t first_flags;
     const uint8_t *first_data;
     int first_data_len;
@@ -102,8 +119,7 @@ struct UdpGwClient_connection {
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
     PacketPassFairQueueFlow send_qflow;
-    BAVLNode connections_tree_by_conaddr_node;
-    BAVLNode connections_tree_by_conid_node;
+    struct UdpGwClient_connection *conaddr_hash_next;
     LinkedList1Node connections_list_node;
 };
 